@@ -0,0 +1,460 @@
+/*
+ * Stress test for the binder driver
+ *
+ * Starts an echo server registered as the context manager, then
+ * several client processes, each with several threads, that send it
+ * transactions of varying size and check the replies.  Some calls are
+ * one-way, some carry a binder object that the server sends back, and
+ * with -k some clients are killed while their calls are in flight.
+ *
+ * Prints the number of calls and the mean and worst latency of each
+ * client, and exits non-zero if any reply was wrong.
+ *
+ * Warning: this test will cause a very high load while it runs
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(4 * 1024 * 1024)
+#define MAX_DATA	(128 * 1024)
+
+static int nr_clients = 4;
+static int nr_threads = 4;
+static int nr_calls = 10000;
+static int nr_victims;
+
+static const size_t sizes[] = { 0, 4, 16, 100, 256, 1000, 4096, 4100,
+				16384, 65536, MAX_DATA };
+
+static int fd;
+static char binder_obj;		/* its address names the object we pass */
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(2);
+}
+
+static void binder_init(void)
+{
+	struct binder_version vers;
+
+	fd = open("/dev/binder", O_RDWR);
+	if (fd < 0)
+		die("/dev/binder");
+	if (ioctl(fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol %ld, expected %d\n",
+			vers.protocol_version, BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(2);
+	}
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED)
+		die("mmap");
+}
+
+static int binder_write_read(void *wbuf, size_t wlen, void *rbuf,
+			     size_t rlen, size_t *consumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.write_size = wlen;
+	bwr.write_consumed = 0;
+	bwr.read_buffer = (unsigned long)rbuf;
+	bwr.read_size = rlen;
+	bwr.read_consumed = 0;
+	do {
+		ret = ioctl(fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (consumed)
+		*consumed = bwr.read_consumed;
+	return ret;
+}
+
+struct cmdbuf {
+	size_t len;
+	char buf[256];
+};
+
+static void put_cmd(struct cmdbuf *c, uint32_t cmd, const void *arg,
+		    size_t size)
+{
+	memcpy(c->buf + c->len, &cmd, sizeof(cmd));
+	memcpy(c->buf + c->len + sizeof(cmd), arg, size);
+	c->len += sizeof(cmd) + size;
+}
+
+/*
+ * Answer the reference count requests for our own object, which turn
+ * up on whichever thread sent it.
+ */
+static int handle_refs(struct cmdbuf *c, uint32_t cmd, void *arg)
+{
+	switch (cmd) {
+	case BR_INCREFS:
+		put_cmd(c, BC_INCREFS_DONE, arg, sizeof(struct binder_ptr_cookie));
+		return 1;
+	case BR_ACQUIRE:
+		put_cmd(c, BC_ACQUIRE_DONE, arg, sizeof(struct binder_ptr_cookie));
+		return 1;
+	case BR_RELEASE:
+	case BR_DECREFS:
+	case BR_NOOP:
+	case BR_SPAWN_LOOPER:
+		return 1;
+	}
+	return 0;
+}
+
+/* Server */
+
+static void *server_thread(void *unused)
+{
+	struct cmdbuf out;
+	uint32_t rbuf[128];
+	size_t got, pos;
+
+	out.len = 0;
+	put_cmd(&out, BC_ENTER_LOOPER, NULL, 0);
+	for (;;) {
+		if (binder_write_read(out.buf, out.len, rbuf, sizeof(rbuf),
+				      &got) < 0)
+			die("server BINDER_WRITE_READ");
+		out.len = 0;
+		for (pos = 0; pos < got; ) {
+			uint32_t cmd = *(uint32_t *)((char *)rbuf + pos);
+			void *p = (char *)rbuf + pos + sizeof(cmd);
+			struct binder_transaction_data *tr = p;
+			struct binder_transaction_data reply;
+			void *data;
+
+			pos += sizeof(cmd) + _IOC_SIZE(cmd);
+			if (handle_refs(&out, cmd, p))
+				continue;
+			switch (cmd) {
+			case BR_TRANSACTION:
+				data = (void *)tr->data.ptr.buffer;
+				if (!(tr->flags & TF_ONE_WAY)) {
+					/* echo it back, objects and all */
+					reply = *tr;
+					reply.flags = 0;
+					put_cmd(&out, BC_REPLY, &reply,
+						sizeof(reply));
+				}
+				put_cmd(&out, BC_FREE_BUFFER, &data,
+					sizeof(data));
+				break;
+			case BR_TRANSACTION_COMPLETE:
+				break;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				/* the client went away; expected with -k */
+				break;
+			default:
+				fprintf(stderr, "server: unexpected "
+					"command %08x\n", cmd);
+				exit(2);
+			}
+		}
+	}
+	return NULL;
+}
+
+static pid_t start_server(void)
+{
+	int ready[2];
+	pid_t pid;
+	char c = 0;
+
+	if (pipe(ready) < 0)
+		die("pipe");
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0) {
+		pthread_t t;
+		int i;
+		size_t max = 0;		/* a fixed pool; no BR_SPAWN_LOOPER */
+
+		binder_init();
+		if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+			die("BINDER_SET_CONTEXT_MGR");
+		if (ioctl(fd, BINDER_SET_MAX_THREADS, &max) < 0)
+			die("BINDER_SET_MAX_THREADS");
+		for (i = 1; i < nr_threads; i++)
+			if (pthread_create(&t, NULL, server_thread, NULL))
+				die("pthread_create");
+		write(ready[1], &c, 1);
+		server_thread(NULL);
+	}
+	close(ready[1]);
+	if (read(ready[0], &c, 1) != 1) {
+		fprintf(stderr, "server failed to start\n");
+		exit(2);
+	}
+	close(ready[0]);
+	return pid;
+}
+
+/* Clients */
+
+struct call {
+	struct binder_transaction_data tr;
+	uint32_t data[MAX_DATA / 4 + 8];
+	size_t offsets[1];
+};
+
+static uint32_t pattern(uint32_t seed, size_t i)
+{
+	return (seed + i) * 2654435761u;
+}
+
+/*
+ * Send one transaction and wait for it to complete.  Returns 0 when
+ * the reply matches, 1 when the driver failed the call and -1 when
+ * the reply was wrong.
+ */
+static int do_call(struct call *c, int oneway)
+{
+	struct cmdbuf out;
+	uint32_t rbuf[128];
+	size_t got, pos;
+	int done = 0, ret = 0;
+
+	out.len = 0;
+	put_cmd(&out, BC_TRANSACTION, &c->tr, sizeof(c->tr));
+	while (!done) {
+		if (binder_write_read(out.buf, out.len, rbuf, sizeof(rbuf),
+				      &got) < 0)
+			die("client BINDER_WRITE_READ");
+		out.len = 0;
+		for (pos = 0; pos < got; ) {
+			uint32_t cmd = *(uint32_t *)((char *)rbuf + pos);
+			void *p = (char *)rbuf + pos + sizeof(cmd);
+			struct binder_transaction_data *tr = p;
+			const uint32_t *data;
+			void *buf;
+
+			pos += sizeof(cmd) + _IOC_SIZE(cmd);
+			if (handle_refs(&out, cmd, p))
+				continue;
+			switch (cmd) {
+			case BR_TRANSACTION_COMPLETE:
+				if (oneway)
+					done = 1;
+				break;
+			case BR_REPLY:
+				data = tr->data.ptr.buffer;
+				if (tr->data_size != c->tr.data_size ||
+				    tr->offsets_size != c->tr.offsets_size ||
+				    memcmp(data, c->data, tr->data_size))
+					ret = -1;
+				if (tr->offsets_size) {
+					const struct flat_binder_object *obj =
+						(const void *)data;
+					/* our object comes home as itself */
+					if (obj->type != BINDER_TYPE_BINDER ||
+					    obj->binder != &binder_obj)
+						ret = -1;
+				}
+				buf = (void *)data;
+				put_cmd(&out, BC_FREE_BUFFER, &buf,
+					sizeof(buf));
+				done = 1;
+				break;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				ret = 1;
+				done = 1;
+				break;
+			default:
+				fprintf(stderr, "client: unexpected "
+					"command %08x\n", cmd);
+				exit(2);
+			}
+		}
+	}
+	/* hand back the reply buffer */
+	if (out.len && binder_write_read(out.buf, out.len, NULL, 0, NULL) < 0)
+		die("client BC_FREE_BUFFER");
+	return ret;
+}
+
+struct client_stats {
+	long calls, failed, bad;
+	double total, worst;
+};
+
+static void *client_thread(void *arg)
+{
+	struct client_stats *st = arg;
+	struct call *c;
+	int i;
+
+	c = malloc(sizeof(*c));
+	if (c == NULL)
+		die("malloc");
+	for (i = 0; i < nr_calls; i++) {
+		uint32_t seed = getpid() * 31 + i;
+		size_t size = sizes[seed % (sizeof(sizes) / sizeof(sizes[0]))];
+		int oneway = (i % 16) == 15;
+		struct timespec t0, t1;
+		double us;
+		size_t j;
+		int ret;
+
+		memset(&c->tr, 0, sizeof(c->tr));
+		c->tr.target.handle = 0;
+		c->tr.code = i;
+		c->tr.flags = oneway ? TF_ONE_WAY : 0;
+		for (j = 0; j < (size + 3) / 4; j++)
+			c->data[j] = pattern(seed, j);
+		if (!oneway && (i % 8) == 3) {
+			struct flat_binder_object *obj = (void *)c->data;
+
+			memset(obj, 0, sizeof(*obj));
+			obj->type = BINDER_TYPE_BINDER;
+			obj->flags = 0x7f;
+			obj->binder = &binder_obj;
+			obj->cookie = NULL;
+			if (size < sizeof(*obj))
+				size = sizeof(*obj);
+			c->offsets[0] = 0;
+			c->tr.offsets_size = sizeof(size_t);
+		}
+		c->tr.data_size = size;
+		c->tr.data.ptr.buffer = c->data;
+		c->tr.data.ptr.offsets = c->offsets;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		ret = do_call(c, oneway);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		us = (t1.tv_sec - t0.tv_sec) * 1e6 +
+		     (t1.tv_nsec - t0.tv_nsec) / 1e3;
+		st->calls++;
+		st->total += us;
+		if (us > st->worst)
+			st->worst = us;
+		if (ret > 0)
+			st->failed++;
+		else if (ret < 0)
+			st->bad++;
+	}
+	free(c);
+	return NULL;
+}
+
+static void run_client(int n)
+{
+	pthread_t *t = calloc(nr_threads, sizeof(*t));
+	struct client_stats *st = calloc(nr_threads, sizeof(*st));
+	struct client_stats sum;
+	int i;
+
+	if (t == NULL || st == NULL)
+		die("calloc");
+	binder_init();
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&t[i], NULL, client_thread, &st[i]))
+			die("pthread_create");
+	memset(&sum, 0, sizeof(sum));
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(t[i], NULL);
+		sum.calls += st[i].calls;
+		sum.failed += st[i].failed;
+		sum.bad += st[i].bad;
+		sum.total += st[i].total;
+		if (st[i].worst > sum.worst)
+			sum.worst = st[i].worst;
+	}
+	printf("client %d: %ld calls, %ld failed, %ld bad, "
+	       "mean %.1f us, worst %.1f us\n", n, sum.calls, sum.failed,
+	       sum.bad, sum.calls ? sum.total / sum.calls : 0, sum.worst);
+	exit(sum.bad ? 1 : 0);
+}
+
+static pid_t start_client(int n)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		die("fork");
+	if (pid == 0)
+		run_client(n);
+	return pid;
+}
+
+int main(int argc, char **argv)
+{
+	pid_t server, *clients;
+	int i, opt, status, failed = 0;
+
+	while ((opt = getopt(argc, argv, "c:t:n:k:")) != -1) {
+		switch (opt) {
+		case 'c':
+			nr_clients = atoi(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			nr_calls = atoi(optarg);
+			break;
+		case 'k':
+			nr_victims = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c clients] [-t threads] "
+				"[-n calls] [-k victims]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	server = start_server();
+
+	clients = calloc(nr_clients, sizeof(*clients));
+	if (clients == NULL)
+		die("calloc");
+	for (i = 0; i < nr_clients; i++)
+		clients[i] = start_client(i);
+
+	/* extra clients that are killed in the middle of their calls */
+	srand(getpid());
+	for (i = 0; i < nr_victims; i++) {
+		pid_t victim = start_client(nr_clients + i);
+
+		usleep(1000 + rand() % 50000);
+		kill(victim, SIGKILL);
+		waitpid(victim, NULL, 0);
+	}
+
+	for (i = 0; i < nr_clients; i++) {
+		waitpid(clients[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed = 1;
+	}
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+	return failed;
+}
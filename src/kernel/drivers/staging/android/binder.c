@@ -27,6 +27,7 @@
 #include <linux/nsproxy.h>
 #include <linux/poll.h>
 #include <linux/debugfs.h>
+#include <linux/ktime.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
@@ -36,6 +37,25 @@
 
 #include "binder.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/binder.h>
+
+/*
+ * binder_lock protects the object graph: the proc list, threads, nodes,
+ * refs, transaction stacks and work lists.  Each proc's alloc_lock
+ * protects its buffer allocator: the buffer list and trees, the page
+ * array and free_async_space.  Where both are held, binder_lock is
+ * taken first.
+ *
+ * Allocating pages for a transaction buffer, copying the sender's data
+ * into it and unmapping freed pages are done holding only alloc_lock,
+ * so that page reclaim and faults on user memory only hold up other
+ * users of the same process's buffer.  While binder_transaction() has
+ * binder_lock dropped the target proc and node are pinned with tmp_refs;
+ * if the proc is released meanwhile, binder_deferred_release() marks it
+ * dead, moves the pinned node to the dead list even if it has no refs,
+ * and leaves the last unpin of each to free it.
+ */
 static DEFINE_MUTEX(binder_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 
@@ -164,6 +184,51 @@ static inline void binder_stats_created(enum binder_stat_types type)
 	binder_stats.obj_created[type]++;
 }
 
+/*
+ * Latency and size histograms, kept per proc and, for the first three,
+ * per node.  Bucket 0 counts zeroes and bucket i counts values from
+ * 2^(i-1) up to 2^i, except the last, which takes everything above.
+ * Times are in microseconds and sizes in bytes.
+ */
+enum binder_hist_types {
+	BINDER_HIST_ROUND_TRIP,		/* call until reply read (node: sent) */
+	BINDER_HIST_SIZE,		/* data plus offsets */
+	BINDER_HIST_PICKUP,		/* queued to read by a thread */
+	BINDER_NODE_HIST_COUNT,
+	BINDER_HIST_LOCK_WAIT = BINDER_NODE_HIST_COUNT,
+	BINDER_HIST_COUNT
+};
+
+#define BINDER_HIST_BUCKETS 21
+
+struct binder_hist {
+	u32 count;
+	u64 sum;
+	u32 bucket[BINDER_HIST_BUCKETS];
+};
+
+static const char *binder_hist_names[] = {
+	"round trip us",
+	"size bytes",
+	"pickup us",
+	"lock wait us",
+};
+
+static void binder_hist_add(struct binder_hist *hist, s64 value)
+{
+	int i = 0;
+
+	if (value < 0)
+		value = 0;
+	if (value)
+		i = fls64(value);
+	if (i >= BINDER_HIST_BUCKETS)
+		i = BINDER_HIST_BUCKETS - 1;
+	hist->count++;
+	hist->sum += value;
+	hist->bucket[i]++;
+}
+
 struct binder_transaction_log_entry {
 	int debug_id;
 	int call_type;
@@ -222,6 +287,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_refs;
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -232,6 +298,7 @@ struct binder_node {
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
 	struct list_head async_todo;
+	struct binder_hist *hist;	/* BINDER_NODE_HIST_COUNT, or NULL */
 };
 
 struct binder_ref_death {
@@ -294,6 +361,7 @@ struct binder_proc {
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
+	struct mutex alloc_lock;
 	struct list_head buffers;
 	struct rb_root free_buffers;
 	struct rb_root allocated_buffers;
@@ -302,9 +370,12 @@ struct binder_proc {
 	struct page **pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
+	int tmp_refs;
+	int dead;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	struct binder_hist hist[BINDER_HIST_COUNT];
 	struct list_head delivered_death;
 	int max_threads;
 	int requested_threads;
@@ -355,6 +426,10 @@ struct binder_transaction {
 	long	priority;
 	long	saved_priority;
 	uid_t	sender_euid;
+
+	ktime_t	start;		/* of the call, for replies too */
+	ktime_t	queued;
+	void __user *node_ptr;	/* target node, to find it again on reply */
 };
 
 static void
@@ -800,6 +875,9 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
+	buffer->allow_user_free = 0;
+	buffer->transaction = NULL;
+	buffer->target_node = NULL;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
 		binder_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
@@ -1039,7 +1117,7 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 		}
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
+		    !node->local_weak_refs && !node->tmp_refs) {
 			list_del_init(&node->work.entry);
 			if (node->proc) {
 				rb_erase(&node->rb_node, &node->proc->nodes);
@@ -1052,6 +1130,7 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 					     "binder: dead node %d deleted\n",
 					     node->debug_id);
 			}
+			kfree(node->hist);
 			kfree(node);
 			binder_stats_deleted(BINDER_STAT_NODE);
 		}
@@ -1375,6 +1454,115 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+/*
+ * Take binder_lock on behalf of proc, counting the time it had to wait.
+ */
+static void binder_lock_timed(struct binder_proc *proc)
+{
+	ktime_t start;
+	s64 wait;
+
+	if (mutex_trylock(&binder_lock)) {
+		binder_hist_add(&proc->hist[BINDER_HIST_LOCK_WAIT], 0);
+		return;
+	}
+	start = ktime_get();
+	mutex_lock(&binder_lock);
+	wait = ktime_us_delta(ktime_get(), start);
+	binder_hist_add(&proc->hist[BINDER_HIST_LOCK_WAIT], wait);
+	trace_binder_lock_wait(wait);
+}
+
+static void binder_node_hist_add(struct binder_node *node,
+				 enum binder_hist_types type, s64 value)
+{
+	if (node->hist == NULL) {
+		node->hist = kzalloc(sizeof(*node->hist) *
+				     BINDER_NODE_HIST_COUNT, GFP_KERNEL);
+		if (node->hist == NULL)
+			return;
+	}
+	binder_hist_add(&node->hist[type], value);
+}
+
+static void binder_free_proc(struct binder_proc *proc);
+
+static void binder_dec_proc_tmpref(struct binder_proc *proc)
+{
+	proc->tmp_refs--;
+	if (proc->dead && proc->tmp_refs == 0)
+		binder_free_proc(proc);
+}
+
+static void binder_dec_node_tmpref(struct binder_node *node)
+{
+	node->tmp_refs--;
+	if (node->proc || node->tmp_refs || !hlist_empty(&node->refs))
+		return;
+	hlist_del(&node->dead_node);
+	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+		     "binder: dead node %d deleted\n", node->debug_id);
+	kfree(node->hist);
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
+/*
+ * A sync transaction sent while handling another goes to the thread in
+ * target_proc that is already waiting somewhere up the call chain, if
+ * there is one, instead of to any thread of target_proc.
+ */
+static int binder_find_target_thread(struct binder_proc *proc,
+				     struct binder_thread *thread,
+				     struct binder_proc *target_proc,
+				     struct binder_thread **target_thread)
+{
+	struct binder_transaction *tmp = thread->transaction_stack;
+
+	*target_thread = NULL;
+	if (tmp == NULL)
+		return 0;
+	if (tmp->to_thread != thread) {
+		binder_user_error("binder: %d:%d got new "
+			"transaction with bad transaction stack"
+			", transaction %d has target %d:%d\n",
+			proc->pid, thread->pid, tmp->debug_id,
+			tmp->to_proc ? tmp->to_proc->pid : 0,
+			tmp->to_thread ?
+			tmp->to_thread->pid : 0);
+		return -EINVAL;
+	}
+	while (tmp) {
+		if (tmp->from && tmp->from->proc == target_proc)
+			*target_thread = tmp->from;
+		tmp = tmp->from_parent;
+	}
+	return 0;
+}
+
+/*
+ * Another thread's death can deliver a failed reply to this one while
+ * binder_transaction() has binder_lock dropped, so an error may already
+ * be waiting.  Keep both, oldest first, like binder_send_failed_reply().
+ */
+static void binder_set_return_error(struct binder_thread *thread,
+				    uint32_t return_error)
+{
+	if (thread->return_error != BR_OK &&
+	    thread->return_error2 == BR_OK) {
+		thread->return_error2 = thread->return_error;
+		thread->return_error = BR_OK;
+	}
+	if (thread->return_error != BR_OK) {
+		printk(KERN_ERR "binder: %d:%d dropped error %d, "
+		       "has error codes %d and %d already\n",
+		       thread->proc->pid, thread->pid, return_error,
+		       thread->return_error2, thread->return_error);
+		return;
+	}
+	thread->return_error = return_error;
+}
+
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
 			       struct binder_transaction_data *tr, int reply)
@@ -1382,6 +1570,7 @@ static void binder_transaction(struct binder_proc *proc,
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
 	size_t *offp, *off_end;
+	size_t size;
 	struct binder_proc *target_proc;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
@@ -1389,8 +1578,14 @@ static void binder_transaction(struct binder_proc *proc,
 	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
+	struct binder_transaction_log_entry *ring_e;
+	struct binder_transaction_log_entry log_entry;
+	struct binder_buffer *buffer;
+	const char *copy_failed = NULL;
 	uint32_t return_error;
+	ktime_t start;
 
+	start = ktime_get();
 	e = binder_transaction_log_add(&binder_transaction_log);
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
 	e->from_proc = proc->pid;
@@ -1467,35 +1662,15 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
-		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
-			struct binder_transaction *tmp;
-			tmp = thread->transaction_stack;
-			if (tmp->to_thread != thread) {
-				binder_user_error("binder: %d:%d got new "
-					"transaction with bad transaction stack"
-					", transaction %d has target %d:%d\n",
-					proc->pid, thread->pid, tmp->debug_id,
-					tmp->to_proc ? tmp->to_proc->pid : 0,
-					tmp->to_thread ?
-					tmp->to_thread->pid : 0);
-				return_error = BR_FAILED_REPLY;
-				goto err_bad_call_stack;
-			}
-			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
-				tmp = tmp->from_parent;
-			}
+		if (!(tr->flags & TF_ONE_WAY) &&
+		    binder_find_target_thread(proc, thread, target_proc,
+					      &target_thread)) {
+			return_error = BR_FAILED_REPLY;
+			goto err_bad_call_stack;
 		}
 	}
-	if (target_thread) {
+	if (target_thread)
 		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1543,32 +1718,115 @@ static void binder_transaction(struct binder_proc *proc,
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
-	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
+
+	/*
+	 * Pin the target proc and node, and let other transactions run
+	 * while the buffer is allocated and filled in.  The log entry may
+	 * be reused meanwhile, so the failure log gets a copy.  The strong
+	 * ref on the node becomes the buffer's; tmp_refs keeps the node
+	 * itself around if target_proc is released meanwhile.
+	 */
+	if (target_node) {
+		binder_inc_node(target_node, 1, 0, NULL);
+		target_node->tmp_refs++;
+	}
+	target_proc->tmp_refs++;
+	log_entry = *e;
+	ring_e = e;
+	e = &log_entry;
+	mutex_unlock(&binder_lock);
+
+	mutex_lock(&target_proc->alloc_lock);
+	buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
-	if (t->buffer == NULL) {
+	mutex_unlock(&target_proc->alloc_lock);
+	if (buffer) {
+		offp = (size_t *)(buffer->data +
+				  ALIGN(tr->data_size, sizeof(void *)));
+		if (copy_from_user(buffer->data, tr->data.ptr.buffer,
+				   tr->data_size))
+			copy_failed = "data";
+		else if (copy_from_user(offp, tr->data.ptr.offsets,
+					tr->offsets_size))
+			copy_failed = "offsets";
+	}
+
+	binder_lock_timed(proc);
+	if (target_proc->dead) {
+		/*
+		 * Its nodes were torn down along with it, dropping their
+		 * local refs; only our tmp_ref is left to release.
+		 */
+		if (buffer) {
+			mutex_lock(&target_proc->alloc_lock);
+			binder_free_buf(target_proc, buffer);
+			mutex_unlock(&target_proc->alloc_lock);
+		}
+		if (target_node)
+			binder_dec_node_tmpref(target_node);
+		target_node = NULL;
+		return_error = BR_DEAD_REPLY;
+		goto err_dead_target;
+	}
+	if (target_node)
+		target_node->tmp_refs--;
+	if (buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
+	t->buffer = buffer;
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
+	if (copy_failed) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
+			"%s ptr\n", proc->pid, thread->pid, copy_failed);
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
+
+	/* The target thread may have exited while binder_lock was dropped. */
+	if (reply) {
+		if (in_reply_to->from == NULL) {
+			target_thread = NULL;
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_target_thread;
+		}
+		if (target_thread->transaction_stack != in_reply_to) {
+			binder_user_error("binder: %d:%d got reply transaction "
+				"with bad target transaction stack %d, "
+				"expected %d\n",
+				proc->pid, thread->pid,
+				target_thread->transaction_stack ?
+				target_thread->transaction_stack->debug_id : 0,
+				in_reply_to->debug_id);
+			return_error = BR_FAILED_REPLY;
+			in_reply_to = NULL;
+			target_thread = NULL;
+			goto err_dead_target_thread;
+		}
+	} else if (!(t->flags & TF_ONE_WAY) &&
+		   binder_find_target_thread(proc, thread, target_proc,
+					     &target_thread)) {
 		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
+		goto err_dead_target_thread;
+	}
+	t->to_thread = target_thread;
+
+	/* Record the thread chosen now, in the ring too unless it was reused. */
+	e->to_thread = target_thread ? target_thread->pid : 0;
+	if (ring_e->debug_id == t->debug_id)
+		ring_e->to_thread = e->to_thread;
+
+	if (target_thread) {
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
 	}
 	if (!IS_ALIGNED(tr->offsets_size, sizeof(size_t))) {
 		binder_user_error("binder: %d:%d got transaction with "
@@ -1610,6 +1868,7 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
 			ref = binder_get_ref_for_node(target_proc, node);
@@ -1715,8 +1974,17 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	size = tr->data_size + tr->offsets_size;
+	binder_hist_add(&proc->hist[BINDER_HIST_SIZE], size);
 	if (reply) {
+		struct binder_node *node;
+
 		BUG_ON(t->buffer->async_transaction != 0);
+		t->start = in_reply_to->start;
+		node = binder_get_node(proc, in_reply_to->node_ptr);
+		if (node && node->hist)
+			binder_hist_add(&node->hist[BINDER_HIST_ROUND_TRIP],
+				ktime_us_delta(ktime_get(), t->start));
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
@@ -1732,12 +2000,24 @@ static void binder_transaction(struct binder_proc *proc,
 		} else
 			target_node->has_async_transaction = 1;
 	}
+	if (!reply) {
+		t->start = start;
+		t->node_ptr = target_node->ptr;
+		binder_node_hist_add(target_node, BINDER_HIST_SIZE, size);
+	}
+	t->queued = ktime_get();
+	trace_binder_transaction(t->debug_id, reply, t->flags, t->code,
+				 target_proc->pid,
+				 target_thread ? target_thread->pid : 0,
+				 target_node ? target_node->debug_id : 0,
+				 tr->data_size, tr->offsets_size);
 	t->work.type = BINDER_WORK_TRANSACTION;
 	list_add_tail(&t->work.entry, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	binder_dec_proc_tmpref(target_proc);
 	return;
 
 err_get_unused_fd_failed:
@@ -1748,11 +2028,19 @@ err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
+err_dead_target_thread:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	target_node = NULL;	/* released with the buffer */
 	t->buffer->transaction = NULL;
+	mutex_lock(&target_proc->alloc_lock);
 	binder_free_buf(target_proc, t->buffer);
+	mutex_unlock(&target_proc->alloc_lock);
 err_binder_alloc_buf_failed:
+	if (target_node)
+		binder_dec_node(target_node, 1, 0);
+err_dead_target:
+	binder_dec_proc_tmpref(target_proc);
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
@@ -1775,12 +2063,11 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
-	BUG_ON(thread->return_error != BR_OK);
 	if (in_reply_to) {
-		thread->return_error = BR_TRANSACTION_COMPLETE;
+		binder_set_return_error(thread, BR_TRANSACTION_COMPLETE);
 		binder_send_failed_reply(in_reply_to, return_error);
 	} else
-		thread->return_error = return_error;
+		binder_set_return_error(thread, return_error);
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1933,20 +2220,25 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			buffer->allow_user_free = 0;
+			mutex_unlock(&proc->alloc_lock);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1964,7 +2256,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
+
+			/* nothing else can reach the buffer now */
+			mutex_unlock(&binder_lock);
+			mutex_lock(&proc->alloc_lock);
 			binder_free_buf(proc, buffer);
+			mutex_unlock(&proc->alloc_lock);
+			binder_lock_timed(proc);
 			break;
 		}
 
@@ -2256,7 +2554,7 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	binder_lock_timed(proc);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
@@ -2269,6 +2567,8 @@ retry:
 		struct binder_transaction_data tr;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		ktime_t now;
+		s64 pickup;
 
 		if (!list_empty(&thread->todo))
 			w = list_first_entry(&thread->todo, struct binder_work, entry);
@@ -2352,6 +2652,7 @@ retry:
 						     proc->pid, thread->pid, node->debug_id,
 						     node->ptr, node->cookie);
 					rb_erase(&node->rb_node, &proc->nodes);
+					kfree(node->hist);
 					kfree(node);
 					binder_stats_deleted(BINDER_STAT_NODE);
 				} else {
@@ -2458,6 +2759,21 @@ retry:
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
+		now = ktime_get();
+		pickup = ktime_us_delta(now, t->queued);
+		binder_hist_add(&proc->hist[BINDER_HIST_PICKUP], pickup);
+		trace_binder_transaction_received(t->debug_id, pickup);
+		if (cmd == BR_TRANSACTION)
+			binder_node_hist_add(t->buffer->target_node,
+					     BINDER_HIST_PICKUP, pickup);
+		else {
+			s64 round_trip = ktime_us_delta(now, t->start);
+
+			binder_hist_add(&proc->hist[BINDER_HIST_ROUND_TRIP],
+					round_trip);
+			trace_binder_transaction_done(t->debug_id, round_trip);
+		}
+
 		list_del(&t->work.entry);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
@@ -2635,7 +2951,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	binder_lock_timed(proc);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2882,6 +3198,7 @@ static int binder_open(struct inode *nodp, struct file *filp)
 		return -ENOMEM;
 	get_task_struct(current);
 	proc->tsk = current;
+	mutex_init(&proc->alloc_lock);
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
 	proc->default_priority = task_nice(current);
@@ -2943,9 +3260,8 @@ static int binder_release(struct inode *nodp, struct file *filp)
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
-	struct binder_transaction *t;
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
@@ -2973,7 +3289,8 @@ static void binder_deferred_release(struct binder_proc *proc)
 		nodes++;
 		rb_erase(&node->rb_node, &proc->nodes);
 		list_del_init(&node->work.entry);
-		if (hlist_empty(&node->refs)) {
+		if (hlist_empty(&node->refs) && !node->tmp_refs) {
+			kfree(node->hist);
 			kfree(node);
 			binder_stats_deleted(BINDER_STAT_NODE);
 		} else {
@@ -3011,6 +3328,29 @@ static void binder_deferred_release(struct binder_proc *proc)
 		binder_delete_ref(ref);
 	}
 	binder_release_work(&proc->todo);
+	binder_stats_deleted(BINDER_STAT_PROC);
+
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "binder_release: %d threads %d, nodes %d (ref %d), "
+		     "refs %d, active transactions %d\n",
+		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
+		     active_transactions);
+
+	/*
+	 * A sender may still be filling in a buffer of ours with
+	 * binder_lock dropped; the last one to finish frees the proc.
+	 */
+	proc->dead = 1;
+	if (proc->tmp_refs == 0)
+		binder_free_proc(proc);
+}
+
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
+
 	buffers = 0;
 
 	while ((n = rb_first(&proc->allocated_buffers))) {
@@ -3029,8 +3369,6 @@ static void binder_deferred_release(struct binder_proc *proc)
 		buffers++;
 	}
 
-	binder_stats_deleted(BINDER_STAT_PROC);
-
 	page_count = 0;
 	if (proc->pages) {
 		int i;
@@ -3055,11 +3393,8 @@ static void binder_deferred_release(struct binder_proc *proc)
 	put_task_struct(proc->tsk);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
-		     "binder_release: %d threads %d, nodes %d (ref %d), "
-		     "refs %d, active transactions %d, buffers %d, "
-		     "pages %d\n",
-		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
-		     active_transactions, buffers, page_count);
+		     "binder_release: %d buffers %d, pages %d\n",
+		     proc->pid, buffers, page_count);
 
 	kfree(proc);
 }
@@ -3279,9 +3614,13 @@ static void print_binder_proc(struct seq_file *m,
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
 	}
+	if (!binder_debug_no_lock)
+		mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	if (!binder_debug_no_lock)
+		mutex_unlock(&proc->alloc_lock);
 	list_for_each_entry(w, &proc->todo, entry)
 		print_binder_work(m, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
@@ -3411,8 +3750,12 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	if (!binder_debug_no_lock)
+		mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	if (!binder_debug_no_lock)
+		mutex_unlock(&proc->alloc_lock);
 	seq_printf(m, "  buffers: %d\n", count);
 
 	count = 0;
@@ -3475,6 +3818,62 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	return 0;
 }
 
+static void print_binder_hist(struct seq_file *m, const char *prefix,
+			      int type, struct binder_hist *hist)
+{
+	int i;
+
+	if (hist->count == 0)
+		return;
+	seq_printf(m, "%s%s: %u, avg %llu,", prefix, binder_hist_names[type],
+		   hist->count, div_u64(hist->sum, hist->count));
+	for (i = 0; i < BINDER_HIST_BUCKETS; i++) {
+		if (hist->bucket[i])
+			seq_printf(m, " %llu:%u",
+				   i ? 1ULL << (i - 1) : 0ULL,
+				   hist->bucket[i]);
+	}
+	seq_puts(m, "\n");
+}
+
+static void print_binder_proc_latency(struct seq_file *m,
+				      struct binder_proc *proc)
+{
+	struct rb_node *n;
+	int i;
+
+	seq_printf(m, "proc %d\n", proc->pid);
+	for (i = 0; i < BINDER_HIST_COUNT; i++)
+		print_binder_hist(m, "  ", i, &proc->hist[i]);
+	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+		struct binder_node *node = rb_entry(n, struct binder_node,
+						    rb_node);
+		if (node->hist == NULL)
+			continue;
+		seq_printf(m, "  node %d: u%p c%p\n", node->debug_id,
+			   node->ptr, node->cookie);
+		for (i = 0; i < BINDER_NODE_HIST_COUNT; i++)
+			print_binder_hist(m, "    ", i, &node->hist[i]);
+	}
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int do_lock = !binder_debug_no_lock;
+
+	if (do_lock)
+		mutex_lock(&binder_lock);
+
+	seq_puts(m, "binder latency:\n");
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+		print_binder_proc_latency(m, proc);
+	if (do_lock)
+		mutex_unlock(&binder_lock);
+	return 0;
+}
+
 static int binder_transactions_show(struct seq_file *m, void *unused)
 {
 	struct binder_proc *proc;
@@ -3551,6 +3950,7 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(latency);
 
 static int __init binder_init(void)
 {
@@ -3591,6 +3991,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 	}
 	return ret;
 }
@@ -25,6 +25,10 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/lzo.h>
+#include <linux/log2.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -94,35 +98,66 @@ static char klog_buf[256];
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers never wait for each other. Each one claims space for its entry
+ * under the spinlock 'lock', copies the entry in without holding anything,
+ * and then marks it finished. Finished entries become visible to readers
+ * in order, once every entry before them is finished too. Writers never
+ * take 'mutex', which only serializes readers, so a reader copying an
+ * entry out holds 'mutex' but not 'lock'; it checks afterwards that no
+ * writer claimed the space meanwhile, and retries if one did.
+ *
+ * The offsets grow without bound and are reduced with logger_offset() only
+ * to index the buffer, so comparing them needs pos_before(). They are 64
+ * bits wide so that a reader stalled through more than half of the offset
+ * space can't appear to be ahead of the log; functions that only index
+ * the buffer take them truncated to size_t, which logger_offset() ignores.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct mutex		mutex;	/* mutex serializing readers */
+	spinlock_t		lock;	/* spinlock protecting the offsets */
+	u64			w_off;	/* end of the finished entries */
+	u64			reserve;/* end of the claimed entries */
+	u64			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+#ifdef CONFIG_ANDROID_LOGGER_ARCHIVE
+	struct logger_archive	*archive; /* evicted entries, or NULL */
+#endif
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->mutex, and
+ * r_off by log->lock as well.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	u64			r_off;	/* current read head offset */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/* pos_before - is log offset 'a' before 'b'? */
+#define pos_before(a, b)	((s64) ((a) - (b)) < 0)
+
+/*
+ * An entry's __pad field tracks its write: LOGGER_ENTRY_DONE is set once
+ * the writer has finished with it and cleared when it is committed, and
+ * LOGGER_ENTRY_DISCARD marks an entry whose copy failed, which readers
+ * skip. Committed entries have a zero __pad, as they always did.
+ */
+#define LOGGER_ENTRY_DONE	1
+#define LOGGER_ENTRY_DISCARD	2
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -146,36 +181,79 @@ static inline struct logger_log *file_get_log(struct file *file)
 		return file->private_data;
 }
 
+/*
+ * log_peek - copies 'count' bytes starting at offset 'off' out of the log
+ */
+static void log_peek(struct logger_log *log, size_t off, void *buf,
+		     size_t count)
+{
+	size_t len;
+
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(buf, log->buffer + off, len);
+	if (count != len)
+		memcpy(buf + len, log->buffer, count - len);
+}
+
 /*
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
 	__u16 val;
 
-	switch (log->size - off) {
-	case 1:
-		memcpy(&val, log->buffer + off, 1);
-		memcpy(((char *) &val) + 1, log->buffer, 1);
-		break;
-	default:
-		memcpy(&val, log->buffer + off, 2);
-	}
+	log_peek(log, off, &val, sizeof(val));
 
 	return sizeof(struct logger_entry) + val;
 }
 
+static __u16 get_entry_pad(struct logger_log *log, size_t off)
+{
+	__u16 val;
+
+	log_peek(log, off + offsetof(struct logger_entry, __pad),
+		 &val, sizeof(val));
+
+	return val;
+}
+
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count);
+
+static void set_entry_pad(struct logger_log *log, size_t off, __u16 val)
+{
+	do_write_log(log, off + offsetof(struct logger_entry, __pad),
+		     &val, sizeof(val));
+}
+
+/*
+ * fix_up_reader - pull a reader that was lapped by the writers forward to
+ * the oldest entry left in the log, and past any discarded entries.
+ *
+ * The caller needs to hold log->lock.
+ */
+static void fix_up_reader(struct logger_log *log, struct logger_reader *reader)
+{
+	if (pos_before(reader->r_off, log->head))
+		reader->r_off = log->head;
+
+	while (reader->r_off != log->w_off &&
+	       (get_entry_pad(log, reader->r_off) & LOGGER_ENTRY_DISCARD))
+		reader->r_off += get_entry_len(log, reader->r_off);
+}
+
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log_to_user - reads exactly 'count' bytes from offset 'off' in
+ * 'log' into the user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * The bytes may be overwritten while they are copied, so the caller must
+ * check that the log's head hasn't passed 'off' before trusting them.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
+static ssize_t do_read_log_to_user(struct logger_log *log, size_t off,
 				   char __user *buf,
 				   size_t count)
 {
@@ -186,8 +264,9 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -198,8 +277,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
@@ -220,6 +297,7 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	u64 off;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -227,9 +305,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -252,21 +330,40 @@ start:
 
 	mutex_lock(&log->mutex);
 
+	spin_lock(&log->lock);
+	fix_up_reader(log, reader);
+
 	/* is there still something to read or did we race? */
 	if (unlikely(log->w_off == reader->r_off)) {
+		spin_unlock(&log->lock);
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
 
 	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
+	off = reader->r_off;
+	ret = get_entry_len(log, off);
+	spin_unlock(&log->lock);
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, off, buf, ret);
+	if (ret < 0)
+		goto out;
+
+	/* if a writer claimed the entry while we copied it, start over */
+	smp_rmb();
+	spin_lock(&log->lock);
+	if (unlikely(pos_before(off, log->head))) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&log->mutex);
+		goto start;
+	}
+	reader->r_off = off + ret;
+	spin_unlock(&log->lock);
 
 out:
 	mutex_unlock(&log->mutex);
@@ -275,97 +372,98 @@ out:
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * reserve_entry - claim 'len' bytes at the end of the log for a new entry,
+ * first moving the head past the entries they will overwrite. Returns 0
+ * and sets '*off' to the start of the claim, or -EAGAIN if the claim would
+ * overwrite entries that are still being written.
  *
- * Caller must hold log->mutex.
+ * The caller needs to hold log->lock.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static int reserve_entry(struct logger_log *log, size_t len, u64 *off)
 {
-	size_t count = 0;
+	u64 end = log->reserve + len - log->size;
 
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+	if (pos_before(log->w_off, end))
+		return -EAGAIN;
 
-	return off;
-}
+	while (pos_before(log->head, end))
+		log->head += get_entry_len(log, log->head);
 
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
- */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
+	/* readers must see the new head before the old entries change */
+	smp_wmb();
+
+	/* until the writer is done, the old bytes here mustn't look finished */
+	*off = log->reserve;
+	set_entry_pad(log, *off, 0);
+	log->reserve += len;
 
 	return 0;
 }
 
+static int try_reserve_entry(struct logger_log *log, size_t len, u64 *off)
+{
+	int ret;
+
+	spin_lock(&log->lock);
+	ret = reserve_entry(log, len, off);
+	spin_unlock(&log->lock);
+
+	return ret == 0;
+}
+
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * commit_entries - make every finished entry after the last committed one
+ * visible to readers, stopping at the first that is still being written.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void commit_entries(struct logger_log *log)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	while (log->w_off != log->reserve) {
+		__u16 pad = get_entry_pad(log, log->w_off);
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+		if (!(pad & LOGGER_ENTRY_DONE))
+			break;
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+		/* the whole entry must be seen before w_off moves past it */
+		smp_mb();
+		set_entry_pad(log, log->w_off, pad & ~LOGGER_ENTRY_DONE);
+		log->w_off += get_entry_len(log, log->w_off);
+	}
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log - writes 'len' bytes from 'buf' to 'log' at offset 'off'
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
 }
 
 /*
  * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * the log 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller must have claimed the space with reserve_entry().
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
@@ -374,23 +472,227 @@ static ssize_t do_write_log_from_user(struct logger_log *log,
 
 	/* print as kernel log if the log string starts with "!@" */
 	if (count >= 2) {
-		if (log->buffer[log->w_off] == '!'
-		    && log->buffer[logger_offset(log->w_off + 1)] == '@') {
+		if (log->buffer[off] == '!'
+		    && log->buffer[logger_offset(off + 1)] == '@') {
 			char tmp[256];
 			int i;
 			for (i = 0; i < min(count, sizeof(tmp) - 1); i++)
 				tmp[i] =
-				    log->buffer[logger_offset(log->w_off + i)];
+				    log->buffer[logger_offset(off + i)];
 			tmp[i] = '\0';
 			printk("%s\n", tmp);
 		}
 	}
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
+#ifdef CONFIG_ANDROID_LOGGER_ARCHIVE
+
+/* most log bytes compressed into one archive block */
+#define LOGGER_ARCHIVE_CHUNK	(16 * 1024)
+
+/*
+ * struct logger_archive - compressed history of a log's evicted entries
+ *
+ * A worker copies finished entries out of the log before writers wrap
+ * around onto them, and appends them, LZO-compressed in chunks of up to
+ * LOGGER_ARCHIVE_CHUNK bytes, to a ring of blocks of its own, dropping the
+ * oldest blocks to make room. Reading the archive's device returns the
+ * entries, oldest first, in the same format as the log.
+ *
+ * The ring is protected by 'mutex', and 'archived' and 'dropped' by
+ * log->lock. LOGGER_GET_ARCHIVE_DROPPED on the archive's device returns
+ * 'dropped', so readers can tell whether the history has gaps.
+ */
+struct logger_archive {
+	struct logger_log	*log;	/* the log being archived */
+	struct miscdevice	misc;	/* misc device for reading the archive */
+	struct work_struct	work;	/* moves entries into the archive */
+	struct mutex		mutex;	/* mutex protecting the ring */
+	unsigned char		*buffer;/* ring of compressed blocks */
+	size_t			size;	/* size of the ring */
+	u64			head;	/* offset of the oldest block */
+	u64			tail;	/* offset past the newest block */
+	u64			archived; /* log offset archived up to */
+	u64			dropped; /* log bytes lost before archiving */
+};
+
+struct logger_archive_block {
+	__u32	len;		/* compressed length of the entries */
+	__u32	orig_len;	/* their length in the log */
+};
+
+/* buffers for the worker, which archives one chunk at a time */
+static DEFINE_MUTEX(archive_work_mutex);
+static unsigned char *archive_chunk_buf;
+static unsigned char *archive_packed_buf;
+static void *archive_wrkmem;
+
+#define archive_offset(n)	((n) & (archive->size - 1))
+
+static void archive_peek(struct logger_archive *archive, size_t off,
+			 void *buf, size_t count)
+{
+	size_t len;
+
+	off = archive_offset(off);
+	len = min(count, archive->size - off);
+	memcpy(buf, archive->buffer + off, len);
+	if (count != len)
+		memcpy(buf + len, archive->buffer, count - len);
+}
+
+static void archive_poke(struct logger_archive *archive, size_t off,
+			 const void *buf, size_t count)
+{
+	size_t len;
+
+	off = archive_offset(off);
+	len = min(count, archive->size - off);
+	memcpy(archive->buffer + off, buf, len);
+	if (count != len)
+		memcpy(archive->buffer, buf + len, count - len);
+}
+
+/*
+ * archive_append - adds a block holding 'len' compressed bytes from 'buf',
+ * dropping the oldest blocks to make room.
+ *
+ * The caller needs to hold archive->mutex.
+ */
+static void archive_append(struct logger_archive *archive, const void *buf,
+			   size_t len, size_t orig_len)
+{
+	struct logger_archive_block block;
+	size_t total = sizeof(block) + len;
+
+	while (archive->tail + total - archive->head > archive->size) {
+		archive_peek(archive, archive->head, &block, sizeof(block));
+		archive->head += sizeof(block) + block.len;
+	}
+
+	block.len = len;
+	block.orig_len = orig_len;
+	archive_poke(archive, archive->tail, &block, sizeof(block));
+	archive_poke(archive, archive->tail + sizeof(block), buf, len);
+	archive->tail += total;
+}
+
+/*
+ * archive_chunk - compresses the oldest entries that haven't been archived
+ * yet into one block. Returns the number of log bytes dealt with, which is
+ * zero once the archive has caught up with the log.
+ *
+ * The caller needs to hold archive_work_mutex.
+ */
+static size_t archive_chunk(struct logger_archive *archive)
+{
+	struct logger_log *log = archive->log;
+	struct logger_entry hdr;
+	u64 start, end;
+	size_t off, len, packed;
+	size_t kept = 0;
+
+	spin_lock(&log->lock);
+	if (pos_before(archive->archived, log->head)) {
+		archive->dropped += log->head - archive->archived;
+		archive->archived = log->head;
+	}
+	start = end = archive->archived;
+	while (end != log->w_off) {
+		len = get_entry_len(log, end);
+		if (end + len - start > LOGGER_ARCHIVE_CHUNK)
+			break;
+		end += len;
+	}
+	spin_unlock(&log->lock);
+
+	if (start == end)
+		return 0;
+
+	log_peek(log, start, archive_chunk_buf, end - start);
+
+	/* writers may have claimed the entries while we copied them */
+	smp_rmb();
+	spin_lock(&log->lock);
+	if (pos_before(start, log->head)) {
+		spin_unlock(&log->lock);
+		return end - start;
+	}
+	archive->archived = end;
+	spin_unlock(&log->lock);
+
+	/* leave out the entries whose writes failed */
+	for (off = 0; off < end - start; off += len) {
+		memcpy(&hdr, archive_chunk_buf + off, sizeof(hdr));
+		len = sizeof(hdr) + hdr.len;
+		if (hdr.__pad & LOGGER_ENTRY_DISCARD)
+			continue;
+		memmove(archive_chunk_buf + kept, archive_chunk_buf + off, len);
+		kept += len;
+	}
+	if (!kept)
+		return end - start;
+
+	if (lzo1x_1_compress(archive_chunk_buf, kept, archive_packed_buf,
+			     &packed, archive_wrkmem) != LZO_E_OK ||
+	    sizeof(struct logger_archive_block) + packed > archive->size) {
+		spin_lock(&log->lock);
+		archive->dropped += end - start;
+		spin_unlock(&log->lock);
+		return end - start;
+	}
+
+	mutex_lock(&archive->mutex);
+	archive_append(archive, archive_packed_buf, packed, kept);
+	mutex_unlock(&archive->mutex);
+
+	return end - start;
+}
+
+static void archive_work(struct work_struct *work)
+{
+	struct logger_archive *archive =
+		container_of(work, struct logger_archive, work);
+
+	mutex_lock(&archive_work_mutex);
+	while (archive_chunk(archive))
+		;
+	mutex_unlock(&archive_work_mutex);
+}
+
+/*
+ * archive_due - should the archive worker run? It is started once half
+ * the log hasn't been archived, which leaves it the other half of the log
+ * in which to catch up before writers start evicting those entries.
+ *
+ * The caller needs to hold log->lock.
+ */
+static inline int archive_due(struct logger_log *log)
+{
+	return log->archive &&
+	       log->w_off - log->archive->archived >= log->size / 2;
+}
+
+static inline void archive_kick(struct logger_log *log)
+{
+	schedule_work(&log->archive->work);
+}
+
+#else
+
+static inline int archive_due(struct logger_log *log)
+{
+	return 0;
+}
+
+static inline void archive_kick(struct logger_log *log)
+{
+}
+
+#endif /* CONFIG_ANDROID_LOGGER_ARCHIVE */
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -406,9 +708,12 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	u64 off;
+	size_t len;
+	__u16 done = LOGGER_ENTRY_DONE;
+	int archive;
 	ssize_t ret = 0;
 
 #ifdef ADD_SYSTEM_TIMEINFO
@@ -421,6 +726,7 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 
 	now = current_kernel_time();
 
+	header.__pad = 0;
 	header.pid = current->tgid;
 	header.tid = current->pid;
 	header.sec = now.tv_sec;
@@ -444,41 +750,51 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Claim space for the entry. This only waits when the whole log is
+	 * taken up by other writes that haven't finished.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	len = sizeof(struct logger_entry) + header.len;
+	wait_event(log->wq, try_reserve_entry(log, len, &off));
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	do_write_log(log, off, &header, sizeof(struct logger_entry));
+	len = sizeof(struct logger_entry);
 
 	while (nr_segs-- > 0) {
-		size_t len;
+		size_t seg;
 		ssize_t nr;
 
 		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+		seg = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off + len, iov->iov_base, seg);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			/* the space is ours now; fill it with a dud */
+			done |= LOGGER_ENTRY_DISCARD;
+			ret = nr;
+			break;
 		}
 
 		iov++;
+		len += nr;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
+	/* the entry must be complete before it is marked finished */
+	smp_wmb();
+	set_entry_pad(log, off, done);
+
+	spin_lock(&log->lock);
+	commit_entries(log);
+	archive = archive_due(log);
+	spin_unlock(&log->lock);
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	if (archive)
+		archive_kick(log);
+
+	/* wake up any blocked readers, and writers waiting for room */
+	wake_up(&log->wq);
 
 	return ret;
 }
@@ -514,7 +830,9 @@ static int logger_open(struct inode *inode, struct file *file)
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
+		spin_unlock(&log->lock);
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -564,10 +882,10 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 	if (log->w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -579,6 +897,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	long ret = -ENOTTY;
 
 	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -590,10 +909,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		fix_up_reader(log, reader);
+		ret = log->w_off - reader->r_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -601,6 +918,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
+		fix_up_reader(log, reader);
 		if (log->w_off != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
@@ -614,10 +932,17 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		list_for_each_entry(reader, &log->readers, list)
 			reader->r_off = log->w_off;
 		log->head = log->w_off;
+#ifdef CONFIG_ANDROID_LOGGER_ARCHIVE
+		/* flushed entries aren't archived, but weren't lost either */
+		if (log->archive &&
+		    pos_before(log->archive->archived, log->head))
+			log->archive->archived = log->head;
+#endif
 		ret = 0;
 		break;
 	}
 
+	spin_unlock(&log->lock);
 	mutex_unlock(&log->mutex);
 
 	return ret;
@@ -652,7 +977,9 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.reserve = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -681,6 +1008,261 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+#ifdef CONFIG_ANDROID_LOGGER_ARCHIVE
+
+/*
+ * struct logger_archive_reader - an archive device open for reading
+ *
+ * Holds the block being read, decompressed. The structure is protected by
+ * archive->mutex.
+ */
+struct logger_archive_reader {
+	struct logger_archive	*archive; /* associated archive */
+	u64			off;	/* offset of the next block */
+	size_t			pos;	/* read position within 'buf' */
+	size_t			len;	/* bytes in 'buf' */
+	unsigned char		*packed; /* the block, compressed */
+	unsigned char		buf[LOGGER_ARCHIVE_CHUNK];
+};
+
+static struct logger_archive *get_archive_from_minor(int minor);
+
+/*
+ * archive_read - the archive's read() method
+ *
+ * The archive reads like a file: the entries in it, oldest first, end to
+ * end, as many bytes at a time as asked for, and then end-of-file. Blocks
+ * that were dropped while the file was open are skipped.
+ */
+static ssize_t archive_read(struct file *file, char __user *buf,
+			    size_t count, loff_t *pos)
+{
+	struct logger_archive_reader *reader = file->private_data;
+	struct logger_archive *archive = reader->archive;
+	struct logger_archive_block block;
+	size_t len;
+	ssize_t ret;
+
+	mutex_lock(&archive->mutex);
+
+	if (reader->pos == reader->len) {
+		if (pos_before(reader->off, archive->head))
+			reader->off = archive->head;
+		if (reader->off == archive->tail) {
+			ret = 0;
+			goto out;
+		}
+
+		archive_peek(archive, reader->off, &block, sizeof(block));
+		archive_peek(archive, reader->off + sizeof(block),
+			     reader->packed, block.len);
+		reader->off += sizeof(block) + block.len;
+
+		len = sizeof(reader->buf);
+		reader->pos = reader->len = 0;
+		if (lzo1x_decompress_safe(reader->packed, block.len,
+					  reader->buf, &len) != LZO_E_OK ||
+		    len != block.orig_len) {
+			ret = -EIO;
+			goto out;
+		}
+		reader->len = len;
+	}
+
+	len = min(count, reader->len - reader->pos);
+	if (copy_to_user(buf, reader->buf + reader->pos, len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	reader->pos += len;
+	ret = len;
+
+out:
+	mutex_unlock(&archive->mutex);
+
+	return ret;
+}
+
+static int archive_open(struct inode *inode, struct file *file)
+{
+	struct logger_archive *archive;
+	struct logger_archive_reader *reader;
+	int ret;
+
+	ret = nonseekable_open(inode, file);
+	if (ret)
+		return ret;
+
+	if (file->f_mode & FMODE_WRITE)
+		return -EPERM;
+
+	archive = get_archive_from_minor(MINOR(inode->i_rdev));
+	if (!archive)
+		return -ENODEV;
+
+	reader = kmalloc(sizeof(struct logger_archive_reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+	reader->packed = kmalloc(lzo1x_worst_compress(LOGGER_ARCHIVE_CHUNK),
+				 GFP_KERNEL);
+	if (!reader->packed) {
+		kfree(reader);
+		return -ENOMEM;
+	}
+
+	reader->archive = archive;
+	reader->pos = reader->len = 0;
+
+	mutex_lock(&archive->mutex);
+	reader->off = archive->head;
+	mutex_unlock(&archive->mutex);
+
+	file->private_data = reader;
+
+	return 0;
+}
+
+static int archive_release(struct inode *ignored, struct file *file)
+{
+	struct logger_archive_reader *reader = file->private_data;
+
+	kfree(reader->packed);
+	kfree(reader);
+
+	return 0;
+}
+
+static long archive_ioctl(struct file *file, unsigned int cmd,
+			  unsigned long arg)
+{
+	struct logger_archive_reader *reader = file->private_data;
+	struct logger_archive *archive = reader->archive;
+	u64 dropped;
+	long ret = -ENOTTY;
+
+	mutex_lock(&archive->mutex);
+
+	switch (cmd) {
+	case LOGGER_GET_LOG_BUF_SIZE:
+		ret = archive->size;
+		break;
+	case LOGGER_GET_LOG_LEN:
+		ret = archive->tail - archive->head;
+		break;
+	case LOGGER_GET_ARCHIVE_DROPPED:
+		spin_lock(&archive->log->lock);
+		dropped = archive->dropped;
+		spin_unlock(&archive->log->lock);
+		ret = put_user(dropped, (u64 __user *) arg);
+		break;
+	}
+
+	mutex_unlock(&archive->mutex);
+
+	return ret;
+}
+
+static const struct file_operations archive_fops = {
+	.owner = THIS_MODULE,
+	.read = archive_read,
+	.unlocked_ioctl = archive_ioctl,
+	.compat_ioctl = archive_ioctl,
+	.open = archive_open,
+	.release = archive_release,
+};
+
+static struct logger_archive *get_archive_from_minor(int minor)
+{
+	struct logger_log *logs[] = {
+		&log_main, &log_events, &log_radio, &log_system
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(logs); i++)
+		if (logs[i]->archive && logs[i]->archive->misc.minor == minor)
+			return logs[i]->archive;
+	return NULL;
+}
+
+static int __init init_archive_buffers(void)
+{
+	archive_chunk_buf = kmalloc(LOGGER_ARCHIVE_CHUNK, GFP_KERNEL);
+	archive_packed_buf =
+		kmalloc(lzo1x_worst_compress(LOGGER_ARCHIVE_CHUNK), GFP_KERNEL);
+	archive_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	if (!archive_chunk_buf || !archive_packed_buf || !archive_wrkmem) {
+		kfree(archive_chunk_buf);
+		kfree(archive_packed_buf);
+		vfree(archive_wrkmem);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * init_archive - give 'log' an archive and a device to read it by. A log
+ * that can't have one just goes without.
+ */
+static void __init init_archive(struct logger_log *log)
+{
+	struct logger_archive *archive;
+
+	if (!archive_wrkmem)
+		return;
+
+	archive = kzalloc(sizeof(struct logger_archive), GFP_KERNEL);
+	if (!archive)
+		goto fail;
+
+	archive->size = rounddown_pow_of_two(
+			CONFIG_ANDROID_LOGGER_ARCHIVE_SIZE * 1024);
+	archive->buffer = vmalloc(archive->size);
+	archive->misc.name = kasprintf(GFP_KERNEL, "%s_archive",
+				       log->misc.name);
+	if (!archive->buffer || !archive->misc.name)
+		goto fail;
+
+	archive->log = log;
+	archive->misc.minor = MISC_DYNAMIC_MINOR;
+	archive->misc.fops = &archive_fops;
+	INIT_WORK(&archive->work, archive_work);
+	mutex_init(&archive->mutex);
+	archive->archived = log->w_off;
+
+	if (misc_register(&archive->misc))
+		goto fail;
+
+	spin_lock(&log->lock);
+	log->archive = archive;
+	spin_unlock(&log->lock);
+
+	printk(KERN_INFO "logger: created %luK archive '%s'\n",
+			(unsigned long) archive->size >> 10, archive->misc.name);
+	return;
+
+fail:
+	printk(KERN_ERR "logger: failed to create archive for log '%s'\n",
+			log->misc.name);
+	if (archive) {
+		kfree(archive->misc.name);
+		vfree(archive->buffer);
+		kfree(archive);
+	}
+}
+
+#else
+
+static inline int init_archive_buffers(void)
+{
+	return 0;
+}
+
+static inline void init_archive(struct logger_log *log)
+{
+}
+
+#endif /* CONFIG_ANDROID_LOGGER_ARCHIVE */
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
@@ -695,6 +1277,8 @@ static int __init init_log(struct logger_log *log)
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
 			(unsigned long) log->size >> 10, log->misc.name);
 
+	init_archive(log);
+
 	return 0;
 }
 
@@ -710,6 +1294,9 @@ static int __init logger_init(void)
 	plat_log_mark.p_system = _buf_log_system;
 	marks_ver_mark.log_mark_version = 1;
 
+	if (init_archive_buffers())
+		printk(KERN_ERR "logger: no memory to archive logs\n");
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
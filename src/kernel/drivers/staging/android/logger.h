@@ -58,5 +58,6 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_GET_ARCHIVE_DROPPED	_IOR(__LOGGERIO, 5, __u64) /* bytes lost */
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,13 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Candidate processes are kept in one list per oom_adj value, updated when
+ * a process is forked, has its oom_adj written or is freed, so choosing a
+ * victim only looks at the processes in the highest non-empty bucket
+ * instead of walking every process in the system. The cost of those
+ * searches is reported in /sys/module/lowmemorykiller/parameters/scans,
+ * scanned and scan_ns.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +42,8 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
 
 #define SEC_ADJUST_LMK
 
@@ -57,6 +66,19 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * Thread group leaders indexed by oom_adj. OOM_DISABLE is one below
+ * OOM_ADJUST_MIN, so it gets the first bucket.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct list_head lowmem_tasks[LOWMEM_ADJ_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_tasks_lock);
+static unsigned long lowmem_tracked;
+
+static unsigned long lowmem_scans;
+static unsigned long lowmem_scanned;
+static u64 lowmem_scan_ns;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -70,12 +92,68 @@ static struct notifier_block task_nb = {
 	.notifier_call	= task_notify_func,
 };
 
+static int
+adj_notify_func(struct notifier_block *self, unsigned long val, void *data);
+
+static struct notifier_block adj_nb = {
+	.notifier_call	= adj_notify_func,
+};
+
+static int lowmem_bucket(int oom_adj)
+{
+	if (oom_adj < OOM_DISABLE)
+		oom_adj = OOM_DISABLE;
+	if (oom_adj > OOM_ADJUST_MAX)
+		oom_adj = OOM_ADJUST_MAX;
+	return oom_adj - OOM_DISABLE;
+}
+
+/* Called with lowmem_tasks_lock held */
+static void lowmem_index_task(struct task_struct *task)
+{
+	if (list_empty(&task->lowmem_list))
+		lowmem_tracked++;
+	else
+		list_del(&task->lowmem_list);
+	list_add_tail(&task->lowmem_list,
+		      &lowmem_tasks[lowmem_bucket(task->signal->oom_adj)]);
+}
+
+/* Called with lowmem_tasks_lock held */
+static void lowmem_unindex_task(struct task_struct *task)
+{
+	if (list_empty(&task->lowmem_list))
+		return;
+	list_del_init(&task->lowmem_list);
+	lowmem_tracked--;
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	unsigned long flags;
+
 	if (task == lowmem_deathpending)
 		lowmem_deathpending = NULL;
+	if (!list_empty(&task->lowmem_list)) {
+		spin_lock_irqsave(&lowmem_tasks_lock, flags);
+		lowmem_unindex_task(task);
+		spin_unlock_irqrestore(&lowmem_tasks_lock, flags);
+	}
+	return NOTIFY_OK;
+}
+
+static int
+adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	struct task_struct *task = ((struct task_struct *)data)->group_leader;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_tasks_lock, flags);
+	if (!task->exit_state)
+		lowmem_index_task(task);
+	spin_unlock_irqrestore(&lowmem_tasks_lock, flags);
 	return NOTIFY_OK;
 }
 
@@ -89,6 +167,9 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
+	int scanned = 0;
+	unsigned long flags;
+	ktime_t start;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	//int other_file = global_page_state(NR_FILE_PAGES);
@@ -153,57 +234,76 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	}
 	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+	start = ktime_get();
+	spin_lock_irqsave(&lowmem_tasks_lock, flags);
+	/*
+	 * Only the highest bucket holding a live process needs looking at;
+	 * within it the largest one is chosen, as before.
+	 */
+	for (i = LOWMEM_ADJ_BUCKETS - 1;
+	     !selected && i >= lowmem_bucket(min_adj); i--) {
+		struct task_struct *n;
+
+		list_for_each_entry_safe(p, n, &lowmem_tasks[i], lowmem_list) {
+			struct mm_struct *mm;
+			struct signal_struct *sig;
+			int oom_adj;
+
+			scanned++;
+			task_lock(p);
+			mm = p->mm;
+			sig = p->signal;
+			if (!mm || !sig) {
+				task_unlock(p);
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			}
+			oom_adj = sig->oom_adj;
+			if (oom_adj < min_adj) {
+				task_unlock(p);
 				continue;
+			}
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			if (tasksize <= 0)
+				continue;
+			if (selected) {
+				if (oom_adj < selected_oom_adj)
+					continue;
+				if (oom_adj == selected_oom_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+			}
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
+	if (selected)
+		get_task_struct(selected);
+	lowmem_scans++;
+	lowmem_scanned += scanned;
+	lowmem_scan_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	spin_unlock_irqrestore(&lowmem_tasks_lock, flags);
+
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
 		lowmem_deathpending = selected;
 		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
+		/* it may have exited since; send_sig() copes with that */
+		send_sig(SIGKILL, selected, 0);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
 #ifdef SEC_ADJUST_LMK
 	else
 		rem = -1;
 #endif
-	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
-		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
+	lowmem_print(4, "lowmem_shrink %d, %x, return %d, scanned %d\n",
+		     nr_to_scan, gfp_mask, rem, scanned);
 	return rem;
 }
 
@@ -214,15 +314,55 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_tasks[i]);
+
 	task_free_register(&task_nb);
+	register_oom_adj_notifier(&adj_nb);
+
+	/* Pick up whatever was forked before the notifiers were in place */
+	read_lock(&tasklist_lock);
+	spin_lock_irq(&lowmem_tasks_lock);
+	for_each_process(p) {
+		if (!p->exit_state)
+			lowmem_index_task(p);
+	}
+	spin_unlock_irq(&lowmem_tasks_lock);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	struct task_struct *p, *n;
+	int i;
+
 	unregister_shrinker(&lowmem_shrinker);
+	unregister_oom_adj_notifier(&adj_nb);
 	task_free_unregister(&task_nb);
+
+	spin_lock_irq(&lowmem_tasks_lock);
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		list_for_each_entry_safe(p, n, &lowmem_tasks[i], lowmem_list)
+			lowmem_unindex_task(p);
+	spin_unlock_irq(&lowmem_tasks_lock);
+}
+
+/* scan_ns is 64 bits so it doesn't wrap after a few seconds of scanning */
+static int lowmem_get_scan_ns(char *buffer, struct kernel_param *kp)
+{
+	unsigned long flags;
+	u64 ns;
+
+	spin_lock_irqsave(&lowmem_tasks_lock, flags);
+	ns = lowmem_scan_ns;
+	spin_unlock_irqrestore(&lowmem_tasks_lock, flags);
+	return sprintf(buffer, "%llu", (unsigned long long)ns);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -231,6 +371,11 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(tracked, lowmem_tracked, ulong, S_IRUGO);
+module_param_named(scans, lowmem_scans, ulong, S_IRUGO);
+module_param_named(scanned, lowmem_scanned, ulong, S_IRUGO);
+module_param_call(scan_ns, NULL, lowmem_get_scan_ns, &lowmem_scan_ns,
+		  S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
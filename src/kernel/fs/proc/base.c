@@ -1047,6 +1047,7 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 	}
 
 	task->signal->oom_adj = oom_adjust;
+	oom_adj_changed(task);
 
 	unlock_task_sighand(task, &flags);
 	put_task_struct(task);
@@ -1499,6 +1499,10 @@ struct task_struct {
 		unsigned long memsw_bytes; /* uncharged mem+swap usage */
 	} memcg_batch;
 #endif
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* lowmemorykiller candidate list, bucketed by oom_adj */
+	struct list_head lowmem_list;
+#endif
 };
 
 /* Future-safe accessor for struct task_struct's cpus_allowed. */
@@ -0,0 +1,123 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_TRACE_BINDER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_BINDER_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoint for a transaction or reply being queued to its target:
+ */
+TRACE_EVENT(binder_transaction,
+
+	TP_PROTO(int debug_id, int reply, unsigned int flags,
+		 unsigned int code, int to_proc, int to_thread, int to_node,
+		 size_t data_size, size_t offsets_size),
+
+	TP_ARGS(debug_id, reply, flags, code, to_proc, to_thread, to_node,
+		data_size, offsets_size),
+
+	TP_STRUCT__entry(
+		__field(	int,		debug_id	)
+		__field(	int,		reply		)
+		__field(	unsigned int,	flags		)
+		__field(	unsigned int,	code		)
+		__field(	int,		to_proc		)
+		__field(	int,		to_thread	)
+		__field(	int,		to_node		)
+		__field(	size_t,		data_size	)
+		__field(	size_t,		offsets_size	)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= debug_id;
+		__entry->reply		= reply;
+		__entry->flags		= flags;
+		__entry->code		= code;
+		__entry->to_proc	= to_proc;
+		__entry->to_thread	= to_thread;
+		__entry->to_node	= to_node;
+		__entry->data_size	= data_size;
+		__entry->offsets_size	= offsets_size;
+	),
+
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x size=%zd-%zd",
+		  __entry->debug_id, __entry->to_node, __entry->to_proc,
+		  __entry->to_thread, __entry->reply, __entry->flags,
+		  __entry->code, __entry->data_size, __entry->offsets_size)
+);
+
+/*
+ * Tracepoint for a thread picking up a queued transaction or reply,
+ * with the time it spent queued:
+ */
+TRACE_EVENT(binder_transaction_received,
+
+	TP_PROTO(int debug_id, s64 pickup_us),
+
+	TP_ARGS(debug_id, pickup_us),
+
+	TP_STRUCT__entry(
+		__field(	int,		debug_id	)
+		__field(	s64,		pickup_us	)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= debug_id;
+		__entry->pickup_us	= pickup_us;
+	),
+
+	TP_printk("transaction=%d pickup=%lldus",
+		  __entry->debug_id, (long long)__entry->pickup_us)
+);
+
+/*
+ * Tracepoint for the caller of a synchronous transaction receiving the
+ * reply, with the time since the call was made:
+ */
+TRACE_EVENT(binder_transaction_done,
+
+	TP_PROTO(int debug_id, s64 round_trip_us),
+
+	TP_ARGS(debug_id, round_trip_us),
+
+	TP_STRUCT__entry(
+		__field(	int,		debug_id	)
+		__field(	s64,		round_trip_us	)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= debug_id;
+		__entry->round_trip_us	= round_trip_us;
+	),
+
+	TP_printk("reply=%d round_trip=%lldus",
+		  __entry->debug_id, (long long)__entry->round_trip_us)
+);
+
+/*
+ * Tracepoint for a thread that had to wait for the global binder lock:
+ */
+TRACE_EVENT(binder_lock_wait,
+
+	TP_PROTO(s64 wait_us),
+
+	TP_ARGS(wait_us),
+
+	TP_STRUCT__entry(
+		__field(	s64,		wait_us		)
+	),
+
+	TP_fast_assign(
+		__entry->wait_us	= wait_us;
+	),
+
+	TP_printk("wait=%lldus", (long long)__entry->wait_us)
+);
+
+#endif /* _TRACE_BINDER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -22,7 +22,9 @@ LOCAL_SRC_FILES := \
 	menu-tools.c \
 	menu-wipe.c \
 	backup.c \
-	restore.c
+	restore.c \
+	scheduler.c \
+	store.c
 
 LOCAL_MODULE := recovery
 
@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
@@ -31,22 +32,28 @@
 #include "edify/expr.h"
 
 static int SaveFileContents(const char* filename, FileContents file);
-static int LoadPartitionContents(const char* filename, FileContents* file);
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int map);
 int ParseSha1(const char* str, uint8_t* digest);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 
 static int mtd_partitions_scanned = 0;
 
+// Size of the window used to hash a partition that is going to be
+// mapped rather than read into memory.
+#define PARTITION_READ_WINDOW (1024 * 1024)
+
 // Read a file into memory; store it and its associated metadata in
 // *file.  Return 0 on success.
 int LoadFileContents(const char* filename, FileContents* file) {
     file->data = NULL;
+    file->mapped = 0;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
     if (strncmp(filename, "MTD:", 4) == 0 ||
         strncmp(filename, "EMMC:", 5) == 0) {
-        return LoadPartitionContents(filename, file);
+        return LoadPartitionContents(filename, file, 0);
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -79,6 +86,61 @@ int LoadFileContents(const char* filename, FileContents* file) {
     return 0;
 }
 
+// Map a file (or EMMC partition) instead of reading it into memory, so
+// that patch sources larger than RAM can be used.  MTD partitions can't
+// be mapped and are still read into memory.  Return 0 on success.
+int MapFileContents(const char* filename, FileContents* file) {
+    file->data = NULL;
+    file->mapped = 0;
+
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0) {
+        return LoadPartitionContents(filename, file, 1);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &file->st) != 0) {
+        printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    file->size = file->st.st_size;
+
+    if (file->size > 0) {
+        void* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            file->data = data;
+            file->mapped = 1;
+        }
+    }
+    close(fd);
+
+    if (!file->mapped) {
+        return LoadFileContents(filename, file);
+    }
+
+    SHA(file->data, file->size, file->sha1);
+    return 0;
+}
+
+// Release the data of a FileContents filled in by LoadFileContents() or
+// MapFileContents().  The FileContents itself is not freed.
+void ReleaseFileContents(FileContents* file) {
+    if (file->data != NULL) {
+        if (file->mapped) {
+            munmap(file->data, file->size);
+        } else {
+            free(file->data);
+        }
+    }
+    file->data = NULL;
+    file->mapped = 0;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -95,7 +157,7 @@ static int compare_size_indices(const void* a, const void* b) {
 }
 
 void FreeFileContents(FileContents* file) {
-    if (file) free(file->data);
+    if (file) ReleaseFileContents(file);
     free(file);
 }
 
@@ -114,9 +176,14 @@ void FreeFileContents(FileContents* file) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
+//
+// If map is nonzero and this is an EMMC partition, the prefix is hashed
+// through a fixed-size window and then mapped, instead of being read
+// into memory.
 enum PartitionType { MTD, EMMC };
 
-static int LoadPartitionContents(const char* filename, FileContents* file) {
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int map) {
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
 
@@ -204,8 +271,17 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     SHA_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
+    // allocate enough memory to hold the largest size, unless we're going
+    // to map the partition, in which case we only need the window.
+    int windowed = (map && type == EMMC);
+    unsigned char* window = NULL;
+    file->mapped = 0;
+    if (windowed) {
+        file->data = NULL;
+        window = malloc(PARTITION_READ_WINDOW);
+    } else {
+        file->data = malloc(size[index[pairs-1]]);
+    }
     char* p = (char*)file->data;
     file->size = 0;                // # bytes read so far
 
@@ -222,17 +298,33 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                     break;
 
                 case EMMC:
-                    read = fread(p, 1, next, dev);
+                    if (!windowed) {
+                        read = fread(p, 1, next, dev);
+                        break;
+                    }
+                    while (read < next) {
+                        size_t want = next - read;
+                        if (want > PARTITION_READ_WINDOW) {
+                            want = PARTITION_READ_WINDOW;
+                        }
+                        size_t got = fread(window, 1, want, dev);
+                        SHA_update(&sha_ctx, window, got);
+                        read += got;
+                        if (got != want) break;
+                    }
                     break;
             }
             if (next != read) {
                 printf("short read (%d bytes of %d) for partition \"%s\"\n",
                        read, next, partition);
                 free(file->data);
+                free(window);
                 file->data = NULL;
                 return -1;
             }
-            SHA_update(&sha_ctx, p, read);
+            if (!windowed) {
+                SHA_update(&sha_ctx, p, read);
+            }
             file->size += read;
         }
 
@@ -258,7 +350,9 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             break;
         }
 
-        p += read;
+        if (!windowed) {
+            p += read;
+        }
     }
 
     switch (type) {
@@ -267,9 +361,30 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             break;
 
         case EMMC:
+            if (windowed && i < pairs) {
+                void* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE,
+                                  fileno(dev), 0);
+                if (data != MAP_FAILED) {
+                    file->data = data;
+                    file->mapped = 1;
+                } else {
+                    printf("failed to map partition \"%s\": %s\n",
+                           partition, strerror(errno));
+                }
+            }
             fclose(dev);
             break;
     }
+    free(window);
+
+    if (windowed && i < pairs && !file->mapped) {
+        // Fall back to reading the partition into memory.
+        free(copy);
+        free(index);
+        free(size);
+        free(sha1sum);
+        return LoadPartitionContents(filename, file, 0);
+    }
 
 
     if (i == pairs) {
@@ -334,90 +449,164 @@ static int SaveFileContents(const char* filename, FileContents file) {
     return 0;
 }
 
-// Write a memory buffer to 'target' partition, a string of the form
-// "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
-// success.
-int WriteToPartition(unsigned char* data, size_t len,
-                        const char* target) {
-    char* copy = strdup(target);
-    const char* magic = strtok(copy, ":");
-
+// An open MTD or EMMC partition that output can be streamed to with
+// PartitionSink().
+typedef struct {
     enum PartitionType type;
-    if (strcmp(magic, "MTD") == 0) {
-        type = MTD;
-    } else if (strcmp(magic, "EMMC") == 0) {
-        type = EMMC;
+    char* copy;                 // strtok()ed copy of the target string
+    const char* partition;
+    MtdWriteContext* mtd;
+    FILE* f;
+} PartitionWriter;
+
+// Open 'target', a string of the form "MTD:<partition>[:...]" or
+// "EMMC:<partition_device>[:...]", for writing from the start.  Return 0
+// on success.
+static int OpenPartitionWriter(const char* target, PartitionWriter* writer) {
+    memset(writer, 0, sizeof(*writer));
+    writer->copy = strdup(target);
+    const char* magic = strtok(writer->copy, ":");
+
+    if (magic != NULL && strcmp(magic, "MTD") == 0) {
+        writer->type = MTD;
+    } else if (magic != NULL && strcmp(magic, "EMMC") == 0) {
+        writer->type = EMMC;
     } else {
         printf("WriteToPartition called with bad target (%s)\n", target);
+        free(writer->copy);
         return -1;
     }
-    const char* partition = strtok(NULL, ":");
+    writer->partition = strtok(NULL, ":");
 
-    if (partition == NULL) {
+    if (writer->partition == NULL) {
         printf("bad partition target name \"%s\"\n", target);
+        free(writer->copy);
         return -1;
     }
 
-    switch (type) {
+    switch (writer->type) {
         case MTD:
             if (!mtd_partitions_scanned) {
                 mtd_scan_partitions();
                 mtd_partitions_scanned = 1;
             }
 
-            const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+            const MtdPartition* mtd =
+                mtd_find_partition_by_name(writer->partition);
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found for writing\n",
-                       partition);
+                       writer->partition);
+                free(writer->copy);
                 return -1;
             }
 
-            MtdWriteContext* ctx = mtd_write_partition(mtd);
-            if (ctx == NULL) {
+            writer->mtd = mtd_write_partition(mtd);
+            if (writer->mtd == NULL) {
                 printf("failed to init mtd partition \"%s\" for writing\n",
-                       partition);
+                       writer->partition);
+                free(writer->copy);
                 return -1;
             }
+            break;
 
-            size_t written = mtd_write_data(ctx, (char*)data, len);
-            if (written != len) {
-                printf("only wrote %d of %d bytes to MTD %s\n",
-                       written, len, partition);
-                mtd_write_close(ctx);
+        case EMMC:
+            writer->f = fopen(writer->partition, "wb");
+            if (writer->f == NULL) {
+                printf("failed to open %s for writing (%s)\n",
+                       writer->partition, strerror(errno));
+                free(writer->copy);
                 return -1;
             }
+            break;
+    }
+    return 0;
+}
 
-            if (mtd_erase_blocks(ctx, -1) < 0) {
-                printf("error finishing mtd write of %s\n", partition);
-                mtd_write_close(ctx);
-                return -1;
-            }
+// SinkFn that appends to an open PartitionWriter.
+static ssize_t PartitionSink(unsigned char* data, ssize_t len, void* token) {
+    PartitionWriter* writer = (PartitionWriter*)token;
+    ssize_t written;
 
-            if (mtd_write_close(ctx)) {
-                printf("error closing mtd write of %s\n", partition);
-                return -1;
+    if (writer->type == MTD) {
+        written = mtd_write_data(writer->mtd, (char*)data, len);
+    } else {
+        written = fwrite(data, 1, len, writer->f);
+    }
+    if (written != len) {
+        printf("only wrote %ld of %ld bytes to %s\n",
+               (long)written, (long)len, writer->partition);
+    }
+    return written;
+}
+
+// Finish writing a partition: erase the rest of an MTD partition, or
+// flush an EMMC device all the way to storage.  The writer is closed
+// even on failure.  Return 0 on success.
+static int ClosePartitionWriter(PartitionWriter* writer) {
+    int result = 0;
+
+    switch (writer->type) {
+        case MTD:
+            if (mtd_erase_blocks(writer->mtd, -1) < 0) {
+                printf("error finishing mtd write of %s\n", writer->partition);
+                result = -1;
+            }
+            if (mtd_write_close(writer->mtd)) {
+                printf("error closing mtd write of %s\n", writer->partition);
+                result = -1;
             }
             break;
 
         case EMMC:
-            ;
-            FILE* f = fopen(partition, "wb");
-            if (fwrite(data, 1, len, f) != len) {
-                printf("short write writing to %s (%s)\n",
-                       partition, strerror(errno));
-                return -1;
+            if (fflush(writer->f) != 0 || fsync(fileno(writer->f)) != 0) {
+                printf("error flushing %s (%s)\n",
+                       writer->partition, strerror(errno));
+                result = -1;
             }
-            if (fclose(f) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
-                return -1;
+            if (fclose(writer->f) != 0) {
+                printf("error closing %s (%s)\n",
+                       writer->partition, strerror(errno));
+                result = -1;
             }
             break;
     }
 
-    free(copy);
-    return 0;
+    free(writer->copy);
+    writer->copy = NULL;
+    return result;
 }
 
+// Write a memory buffer to 'target' partition, a string of the form
+// "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
+// success.
+int WriteToPartition(unsigned char* data, size_t len,
+                        const char* target) {
+    PartitionWriter writer;
+    if (OpenPartitionWriter(target, &writer) != 0) {
+        return -1;
+    }
+
+    if (PartitionSink(data, len, &writer) != (ssize_t)len) {
+        ClosePartitionWriter(&writer);
+        return -1;
+    }
+
+    return ClosePartitionWriter(&writer);
+}
+
+// Return nonzero if two "MTD:..." or "EMMC:..." names refer to the same
+// partition, ignoring any size/sha1 pairs that follow it.
+static int SamePartition(const char* a, const char* b) {
+    const char* end_a = strchr(a, ':');
+    const char* end_b = strchr(b, ':');
+    if (end_a == NULL || end_b == NULL) return 0;
+
+    end_a = strchr(end_a+1, ':');
+    end_b = strchr(end_b+1, ':');
+    size_t len_a = end_a ? (size_t)(end_a - a) : strlen(a);
+    size_t len_b = end_b ? (size_t)(end_b - b) : strlen(b);
+    return len_a == len_b && strncmp(a, b, len_a) == 0;
+}
 
 // Take a string 'str' of 40 hex digits and parse it into the 20
 // byte array 'digest'.  'str' may contain only the digest or be of
@@ -472,18 +661,19 @@ int applypatch_check(const char* filename,
                      int num_patches, char** const patch_sha1_str) {
     FileContents file;
     file.data = NULL;
+    file.mapped = 0;
 
     // It's okay to specify no sha1s; the check will pass if the
-    // LoadFileContents is successful.  (Useful for reading
+    // MapFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
     // check them twice.)
-    if (LoadFileContents(filename, &file) != 0 ||
+    if (MapFileContents(filename, &file) != 0 ||
         (num_patches > 0 &&
          FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0)) {
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
+        ReleaseFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -491,19 +681,19 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file) != 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            ReleaseFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    ReleaseFileContents(&file);
     return 0;
 }
 
@@ -527,22 +717,6 @@ ssize_t FileSink(unsigned char* data, ssize_t len, void* token) {
     return done;
 }
 
-typedef struct {
-    unsigned char* buffer;
-    ssize_t size;
-    ssize_t pos;
-} MemorySinkInfo;
-
-ssize_t MemorySink(unsigned char* data, ssize_t len, void* token) {
-    MemorySinkInfo* msi = (MemorySinkInfo*)token;
-    if (msi->size - msi->pos < len) {
-        return -1;
-    }
-    memcpy(msi->buffer + msi->pos, data, len);
-    msi->pos += len;
-    return len;
-}
-
 // Return the amount of free space (in bytes) on the filesystem
 // containing filename.  filename must exist.  Return -1 on error.
 size_t FreeSpaceForFile(const char* filename) {
@@ -617,7 +791,7 @@ int applypatch(const char* source_filename,
     int made_copy = 0;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file) == 0) {
+    if (MapFileContents(target_filename, &source_file) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
@@ -632,8 +806,8 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        LoadFileContents(source_filename, &source_file);
+        ReleaseFileContents(&source_file);
+        MapFileContents(source_filename, &source_file);
     }
 
     if (source_file.data != NULL) {
@@ -645,10 +819,10 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
+        ReleaseFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file) < 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &copy_file) < 0) {
             // fail.
             printf("failed to read copy file\n");
             return 1;
@@ -670,7 +844,9 @@ int applypatch(const char* source_filename,
     int retry = 1;
     SHA_CTX ctx;
     int output;
-    MemorySinkInfo msi;
+    PartitionWriter writer;
+    int to_partition = (strncmp(target_filename, "MTD:", 4) == 0 ||
+                        strncmp(target_filename, "EMMC:", 5) == 0);
     FileContents* source_to_use;
     char* outname;
 
@@ -691,25 +867,45 @@ int applypatch(const char* source_filename,
         // Is there enough room in the target filesystem to hold the patched
         // file?
 
-        if (strncmp(target_filename, "MTD:", 4) == 0 ||
-            strncmp(target_filename, "EMMC:", 5) == 0) {
-            // If the target is a partition, we're actually going to
-            // write the output to /tmp and then copy it to the
-            // partition.  statfs() always returns 0 blocks free for
-            // /tmp, so instead we'll just assume that /tmp has enough
-            // space to hold the file.
-
-            // We still write the original source to cache, in case
-            // the partition write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file.size) < 0) {
-                printf("not enough free space on /cache\n");
-                return 1;
-            }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                printf("failed to back up source file\n");
-                return 1;
+        if (to_partition) {
+            // If the target is a partition, the output is streamed
+            // straight to it as it is produced and verified once it's
+            // all written; nothing the size of the target is ever held
+            // in memory or staged in /tmp.
+            //
+            // When the partition is being patched in place, the source
+            // is about to be overwritten, so it has to survive on /cache
+            // in case the write is interrupted; the next attempt finds
+            // it there.  The patch then reads from that copy rather than
+            // from the partition under the writer.  A separate source
+            // partition is never touched and needs no copy.
+            if (source_patch_value != NULL &&
+                SamePartition(source_filename, target_filename)) {
+                if (MakeFreeSpaceOnCache(source_file.size) < 0) {
+                    printf("not enough free space on /cache\n");
+                    return 1;
+                }
+                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                    printf("failed to back up source file\n");
+                    return 1;
+                }
+                made_copy = 1;
+
+                uint8_t source_sha1[SHA_DIGEST_SIZE];
+                memcpy(source_sha1, source_file.sha1, SHA_DIGEST_SIZE);
+                ReleaseFileContents(&source_file);
+                if (MapFileContents(CACHE_TEMP_SOURCE, &source_file) != 0 ||
+                    memcmp(source_file.sha1, source_sha1,
+                           SHA_DIGEST_SIZE) != 0) {
+                    printf("backup of source file doesn't verify\n");
+                    return 1;
+                }
+            } else if (source_patch_value == NULL) {
+                // Resuming from an interrupted write; the copy on /cache
+                // is the only good source, and can go once the target
+                // verifies.
+                made_copy = 1;
             }
-            made_copy = 1;
             retry = 0;
         } else {
             int enough_space = 0;
@@ -776,19 +972,14 @@ int applypatch(const char* source_filename,
         void* token = NULL;
         output = -1;
         outname = NULL;
-        if (strncmp(target_filename, "MTD:", 4) == 0 ||
-            strncmp(target_filename, "EMMC:", 5) == 0) {
-            // We store the decoded output in memory.
-            msi.buffer = malloc(target_size);
-            if (msi.buffer == NULL) {
-                printf("failed to alloc %ld bytes for output\n",
-                       (long)target_size);
+        if (to_partition) {
+            // We stream the decoded output to the partition.
+            if (OpenPartitionWriter(target_filename, &writer) != 0) {
+                printf("failed to open %s for writing\n", target_filename);
                 return 1;
             }
-            msi.pos = 0;
-            msi.size = target_size;
-            sink = MemorySink;
-            token = &msi;
+            sink = PartitionSink;
+            token = &writer;
         } else {
             // We write the decoded output to "<tgt-file>.patch".
             outname = (char*)malloc(strlen(target_filename) + 10);
@@ -822,6 +1013,7 @@ int applypatch(const char* source_filename,
                                      patch, sink, token, &ctx);
         } else {
             printf("Unknown patch file format\n");
+            if (to_partition) ClosePartitionWriter(&writer);
             return 1;
         }
 
@@ -829,6 +1021,9 @@ int applypatch(const char* source_filename,
             fsync(output);
             close(output);
         }
+        if (to_partition && ClosePartitionWriter(&writer) != 0) {
+            result = 1;
+        }
 
         if (result != 0) {
             if (retry == 0) {
@@ -846,20 +1041,16 @@ int applypatch(const char* source_filename,
         }
     } while (retry-- > 0);
 
+    // The SHA-1 was accumulated as the output was written.  If it doesn't
+    // match, a partition target now holds bad data, but any copy of the
+    // source made above is left on /cache for the next attempt.
     const uint8_t* current_target_sha1 = SHA_final(&ctx);
     if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_SIZE) != 0) {
         printf("patch did not produce expected sha1\n");
         return 1;
     }
 
-    if (output < 0) {
-        // Copy the temp file to the partition.
-        if (WriteToPartition(msi.buffer, msi.pos, target_filename) != 0) {
-            printf("write of patched data to %s failed\n", target_filename);
-            return 1;
-        }
-        free(msi.buffer);
-    } else {
+    if (!to_partition) {
         // Give the .patch file the same owner, group, and mode of the
         // original source file.
         if (chmod(outname, source_to_use->st.st_mode) != 0) {
@@ -31,6 +31,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  int mapped;             // data is an mmap()ed view, not a heap buffer
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -64,6 +65,16 @@ int applypatch_check(const char* filename,
 int LoadFileContents(const char* filename, FileContents* file);
 void FreeFileContents(FileContents* file);
 
+// Like LoadFileContents(), but regular files and EMMC partitions are
+// mapped instead of read into the heap.  Release the result with
+// ReleaseFileContents().  Return 0 on success.
+int MapFileContents(const char* filename, FileContents* file);
+void ReleaseFileContents(FileContents* file);
+
+// Write a memory buffer to an "MTD:<partition>" or "EMMC:<device>"
+// target.  Return 0 on success.
+int WriteToPartition(unsigned char* data, size_t len, const char* target);
+
 // bsdiff.c
 void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
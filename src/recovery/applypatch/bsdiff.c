@@ -50,6 +50,7 @@
 #include <bzlib.h>
 #include <err.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -57,103 +58,157 @@
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
-static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
+/*
+ * Suffix array construction by induced sorting (SA-IS; Nong, Zhang and
+ * Chan, "Two Efficient Algorithms for Linear Time Suffix Array
+ * Construction").  This replaces the Larsson-Sadakane qsufsort() from
+ * bsdiff-4.3, which needed two off_t arrays the size of the old file and
+ * O(n log n) time; SA-IS is linear and needs only the 32-bit suffix array
+ * itself plus a type bitmap and a bucket table.
+ *
+ * The old data is treated as if followed by a sentinel that sorts below
+ * every byte, so the result has exactly the layout qsufsort() produced:
+ * I[0] == oldsize (the empty suffix) followed by the sorted suffixes of
+ * old.  A suffix array is unique, so the patches are unchanged.
+ */
+
+#define SA_EMPTY	((uint32_t)-1)
+
+typedef struct {
+	const u_char *bytes;	/* top level: the old data */
+	const uint32_t *names;	/* reduced levels: LMS substring names */
+	uint32_t n;		/* string length, including the sentinel */
+	u_char *t;		/* bit i set if suffix i is S-type */
+} sastr;
+
+static inline uint32_t sa_chr(const sastr *s,uint32_t i)
 {
-	off_t i,j,k,x,tmp,jj,kk;
-
-	if(len<16) {
-		for(k=start;k<start+len;k+=j) {
-			j=1;x=V[I[k]+h];
-			for(i=1;k+i<start+len;i++) {
-				if(V[I[k+i]+h]<x) {
-					x=V[I[k+i]+h];
-					j=0;
-				};
-				if(V[I[k+i]+h]==x) {
-					tmp=I[k+j];I[k+j]=I[k+i];I[k+i]=tmp;
-					j++;
-				};
-			};
-			for(i=0;i<j;i++) V[I[k+i]]=k+j-1;
-			if(j==1) I[k]=-1;
-		};
-		return;
+	if(s->names) return s->names[i];
+	return (i==s->n-1) ? 0 : (uint32_t)s->bytes[i]+1;
+}
+
+#define sa_stype(s,i)	(((s)->t[(i)>>3]>>((i)&7))&1)
+#define sa_islms(s,i)	((i)>0 && sa_stype(s,i) && !sa_stype(s,(i)-1))
+
+static void sa_buckets(const sastr *s,uint32_t *bkt,uint32_t K,int end)
+{
+	uint32_t i,sum=0;
+
+	memset(bkt,0,K*sizeof(uint32_t));
+	for(i=0;i<s->n;i++) bkt[sa_chr(s,i)]++;
+	for(i=0;i<K;i++) {
+		sum+=bkt[i];
+		bkt[i]=end ? sum : sum-bkt[i];
 	};
+}
+
+static void sa_induce(const sastr *s,uint32_t *SA,uint32_t *bkt,uint32_t K)
+{
+	uint32_t i,j;
 
-	x=V[I[start+len/2]+h];
-	jj=0;kk=0;
-	for(i=start;i<start+len;i++) {
-		if(V[I[i]+h]<x) jj++;
-		if(V[I[i]+h]==x) kk++;
+	sa_buckets(s,bkt,K,0);
+	for(i=0;i<s->n;i++) {
+		if(SA[i]==SA_EMPTY || SA[i]==0) continue;
+		j=SA[i]-1;
+		if(!sa_stype(s,j)) SA[bkt[sa_chr(s,j)]++]=j;
 	};
-	jj+=start;kk+=jj;
-
-	i=start;j=0;k=0;
-	while(i<jj) {
-		if(V[I[i]+h]<x) {
-			i++;
-		} else if(V[I[i]+h]==x) {
-			tmp=I[i];I[i]=I[jj+j];I[jj+j]=tmp;
-			j++;
-		} else {
-			tmp=I[i];I[i]=I[kk+k];I[kk+k]=tmp;
-			k++;
-		};
+
+	sa_buckets(s,bkt,K,1);
+	for(i=s->n;i-->0;) {
+		if(SA[i]==SA_EMPTY || SA[i]==0) continue;
+		j=SA[i]-1;
+		if(sa_stype(s,j)) SA[--bkt[sa_chr(s,j)]]=j;
 	};
+}
 
-	while(jj+j<kk) {
-		if(V[I[jj+j]+h]==x) {
-			j++;
-		} else {
-			tmp=I[jj+j];I[jj+j]=I[kk+k];I[kk+k]=tmp;
-			k++;
+/* Sort the suffixes of a string whose last symbol is a unique minimum,
+ * over an alphabet of K symbols, into SA[0..n-1]. */
+static void sais(const u_char *bytes,const uint32_t *names,uint32_t *SA,
+		uint32_t n,uint32_t K)
+{
+	sastr str,*s=&str;
+	uint32_t *bkt,*s1;
+	uint32_t i,j,d,n1,name,prev,pos;
+	int diff;
+
+	if(n==1) { SA[0]=0; return; };
+
+	s->bytes=bytes;s->names=names;s->n=n;
+	if(((s->t=calloc((n+7)/8,1))==NULL) ||
+		((bkt=malloc(K*sizeof(uint32_t)))==NULL)) err(1,NULL);
+
+	/* Classify suffixes: the sentinel is S-type, the one before it L */
+	s->t[(n-1)>>3]|=1<<((n-1)&7);
+	for(i=n-2;i>0;i--) {
+		uint32_t c0=sa_chr(s,i-1),c1=sa_chr(s,i);
+		if((c0<c1) || ((c0==c1) && sa_stype(s,i)))
+			s->t[(i-1)>>3]|=1<<((i-1)&7);
+	};
+
+	/* Stage 1: induce the order of the LMS substrings */
+	sa_buckets(s,bkt,K,1);
+	for(i=0;i<n;i++) SA[i]=SA_EMPTY;
+	for(i=1;i<n;i++) if(sa_islms(s,i)) SA[--bkt[sa_chr(s,i)]]=i;
+	sa_induce(s,SA,bkt,K);
+	free(bkt);
+
+	/* Name the sorted LMS substrings; equal substrings share a name */
+	for(i=0,n1=0;i<n;i++)
+		if((SA[i]!=SA_EMPTY) && sa_islms(s,SA[i])) SA[n1++]=SA[i];
+	for(i=n1;i<n;i++) SA[i]=SA_EMPTY;
+	for(i=0,name=0,prev=SA_EMPTY;i<n1;i++) {
+		pos=SA[i];diff=0;
+		for(d=0;;d++) {
+			if((prev==SA_EMPTY) ||
+				(sa_chr(s,pos+d)!=sa_chr(s,prev+d)) ||
+				(sa_stype(s,pos+d)!=sa_stype(s,prev+d))) {
+				diff=1;
+				break;
+			};
+			if((d>0) && (sa_islms(s,pos+d) || sa_islms(s,prev+d)))
+				break;
 		};
+		if(diff) { name++; prev=pos; };
+		SA[n1+pos/2]=name-1;
 	};
+	for(i=n,j=n;i-->n1;) if(SA[i]!=SA_EMPTY) SA[--j]=SA[i];
 
-	if(jj>start) split(I,V,start,jj-start,h);
+	/* Stage 2: sort the reduced string, recursing if names repeat */
+	s1=SA+n-n1;
+	if(name<n1) {
+		sais(NULL,s1,SA,n1,name);
+	} else {
+		for(i=0;i<n1;i++) SA[s1[i]]=i;
+	};
 
-	for(i=0;i<kk-jj;i++) V[I[jj+i]]=kk-1;
-	if(jj==kk-1) I[jj]=-1;
+	/* Stage 3: induce the full suffix array from the sorted LMS suffixes */
+	if((bkt=malloc(K*sizeof(uint32_t)))==NULL) err(1,NULL);
+	sa_buckets(s,bkt,K,1);
+	for(i=1,j=0;i<n;i++) if(sa_islms(s,i)) s1[j++]=i;
+	for(i=0;i<n1;i++) SA[i]=s1[SA[i]];
+	for(i=n1;i<n;i++) SA[i]=SA_EMPTY;
+	for(i=n1;i-->0;) {
+		j=SA[i];SA[i]=SA_EMPTY;
+		SA[--bkt[sa_chr(s,j)]]=j;
+	};
+	sa_induce(s,SA,bkt,K);
 
-	if(start+len>kk) split(I,V,kk,start+len-kk,h);
+	free(bkt);
+	free(s->t);
 }
 
-static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
+static uint32_t *sufsort(u_char *old,off_t oldsize)
 {
-	off_t buckets[256];
-	off_t i,h,len;
-
-	for(i=0;i<256;i++) buckets[i]=0;
-	for(i=0;i<oldsize;i++) buckets[old[i]]++;
-	for(i=1;i<256;i++) buckets[i]+=buckets[i-1];
-	for(i=255;i>0;i--) buckets[i]=buckets[i-1];
-	buckets[0]=0;
-
-	for(i=0;i<oldsize;i++) I[++buckets[old[i]]]=i;
-	I[0]=oldsize;
-	for(i=0;i<oldsize;i++) V[i]=buckets[old[i]];
-	V[oldsize]=0;
-	for(i=1;i<256;i++) if(buckets[i]==buckets[i-1]+1) I[buckets[i]]=-1;
-	I[0]=-1;
-
-	for(h=1;I[0]!=-(oldsize+1);h+=h) {
-		len=0;
-		for(i=0;i<oldsize+1;) {
-			if(I[i]<0) {
-				len-=I[i];
-				i-=I[i];
-			} else {
-				if(len) I[i-len]=-len;
-				len=V[I[i]]+1-i;
-				split(I,V,i,len,h);
-				i+=len;
-				len=0;
-			};
-		};
-		if(len) I[i-len]=-len;
-	};
+	uint32_t *I;
+
+	/* Indices are 32 bits, and SA_EMPTY must stay out of range */
+	if(oldsize>=(off_t)SA_EMPTY-1)
+		errx(1,"old file too large (%lld bytes)",(long long)oldsize);
+
+	if((I=malloc((oldsize+1)*sizeof(uint32_t)))==NULL) err(1,NULL);
+	sais(old,NULL,I,oldsize+1,257);
 
-	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
+	return I;
 }
 
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
@@ -166,7 +221,7 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static off_t search(uint32_t *I,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
 	off_t x,y;
@@ -219,13 +274,13 @@ static void offtout(off_t x,u_char *buf)
 //    - the "I" block of memory is owned by the caller, who passes a
 //      pointer to *I, which can be NULL.  This way if we call
 //      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//      the sufsort() step the first time.
 //
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
+int bsdiff(u_char* old, off_t oldsize, uint32_t** IP, u_char* new, off_t newsize,
            const char* patch_filename)
 {
 	int fd;
-	off_t *I;
+	uint32_t *I;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
@@ -241,11 +296,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	int bz2err;
 
         if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
+            *IP = sufsort(old, oldsize);
         }
         I = *IP;
 
@@ -21,6 +21,7 @@
 // notice.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
@@ -92,32 +93,157 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
         }
         if (stream->avail_out > 0) {
             printf("need %d more bytes\n", stream->avail_out);
+            if (bzerr == BZ_STREAM_END || stream->avail_in == 0) {
+                // Nothing more is coming; the patch is truncated.
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Size of the window ApplyBSDiffPatch() assembles output in.  The
+// output is handed to the sink (and hashed) one window at a time, so
+// patching never holds more than this much of the new file in memory.
+#define BSDIFF_WINDOW_SIZE (256 * 1024)
+
+// Parse the bsdiff header at patch_offset and start the three bzip2
+// streams.  Returns 0 on success.
+static int OpenBSDiffStreams(const Value* patch, ssize_t patch_offset,
+                             bz_stream* cstream, bz_stream* dstream,
+                             bz_stream* estream, ssize_t* new_size) {
+    unsigned char* header = (unsigned char*) patch->data + patch_offset;
+    if (patch_offset < 0 || patch->size - patch_offset < 32 ||
+        memcmp(header, "BSDIFF40", 8) != 0) {
+        printf("corrupt bsdiff patch file header (magic number)\n");
+        return 1;
+    }
+
+    ssize_t ctrl_len, data_len;
+    ctrl_len = offtin(header+8);
+    data_len = offtin(header+16);
+    *new_size = offtin(header+24);
+
+    if (ctrl_len < 0 || data_len < 0 || *new_size < 0 ||
+        ctrl_len + data_len > patch->size - patch_offset - 32) {
+        printf("corrupt patch file header (data lengths)\n");
+        return 1;
+    }
+
+    bz_stream* streams[3] = { cstream, dstream, estream };
+    char* starts[3] = {
+        patch->data + patch_offset + 32,
+        patch->data + patch_offset + 32 + ctrl_len,
+        patch->data + patch_offset + 32 + ctrl_len + data_len
+    };
+    unsigned int lengths[3] = {
+        ctrl_len,
+        data_len,
+        patch->size - (patch_offset + 32 + ctrl_len + data_len)
+    };
+
+    int i, bzerr;
+    for (i = 0; i < 3; ++i) {
+        memset(streams[i], 0, sizeof(bz_stream));
+        streams[i]->next_in = starts[i];
+        streams[i]->avail_in = lengths[i];
+        if ((bzerr = BZ2_bzDecompressInit(streams[i], 0, 0)) != BZ_OK) {
+            printf("failed to bzinit stream %d (%d)\n", i, bzerr);
+            while (i-- > 0) BZ2_bzDecompressEnd(streams[i]);
+            return 1;
         }
     }
     return 0;
 }
 
+// Apply a bsdiff patch, passing the new file to the sink (and the SHA
+// context, if any) as it is produced rather than building it in memory
+// first.  The new file is assembled in fixed-size windows: diff bytes
+// are added to the matching old bytes a window at a time, and extra
+// bytes are copied straight through.
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
                      const Value* patch, ssize_t patch_offset,
                      SinkFn sink, void* token, SHA_CTX* ctx) {
-
-    unsigned char* new_data;
+    bz_stream cstream, dstream, estream;
     ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
+    if (OpenBSDiffStreams(patch, patch_offset,
+                          &cstream, &dstream, &estream, &new_size) != 0) {
         return -1;
     }
 
-    if (sink(new_data, new_size, token) < new_size) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
+    int result = -1;
+    unsigned char* window = malloc(BSDIFF_WINDOW_SIZE);
+    if (window == NULL) {
+        printf("failed to allocate %d byte patch window\n", BSDIFF_WINDOW_SIZE);
+        goto done;
     }
-    if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+
+    off_t oldpos = 0, newpos = 0;
+    off_t ctrl[3];
+    unsigned char buf[24];
+    while (newpos < new_size) {
+        // Read control data
+        if (FillBuffer(buf, 24, &cstream) != 0) {
+            printf("error while reading control stream\n");
+            goto done;
+        }
+        ctrl[0] = offtin(buf);
+        ctrl[1] = offtin(buf+8);
+        ctrl[2] = offtin(buf+16);
+
+        // Sanity check
+        if (ctrl[0] < 0 || ctrl[1] < 0 ||
+            newpos + ctrl[0] + ctrl[1] > new_size) {
+            printf("corrupt patch (new file overrun)\n");
+            goto done;
+        }
+
+        // Diff string plus old data, then the extra string.
+        int pass;
+        for (pass = 0; pass < 2; ++pass) {
+            off_t left = ctrl[pass];
+            bz_stream* stream = (pass == 0) ? &dstream : &estream;
+            while (left > 0) {
+                int len = (left > BSDIFF_WINDOW_SIZE) ?
+                    BSDIFF_WINDOW_SIZE : (int)left;
+                if (FillBuffer(window, len, stream) != 0) {
+                    printf("error while reading %s stream\n",
+                           (pass == 0) ? "diff" : "extra");
+                    goto done;
+                }
+                if (pass == 0) {
+                    int i;
+                    for (i = 0; i < len; ++i) {
+                        if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
+                            window[i] += old_data[oldpos+i];
+                        }
+                    }
+                    oldpos += len;
+                }
+                if (sink(window, len, token) < len) {
+                    printf("short write of output: %d (%s)\n",
+                           errno, strerror(errno));
+                    goto done;
+                }
+                if (ctx) {
+                    SHA_update(ctx, window, len);
+                }
+                newpos += len;
+                left -= len;
+            }
+        }
+
+        // Adjust pointers
+        oldpos += ctrl[2];
     }
-    free(new_data);
+    result = 0;
 
-    return 0;
+done:
+    free(window);
+    BZ2_bzDecompressEnd(&cstream);
+    BZ2_bzDecompressEnd(&dstream);
+    BZ2_bzDecompressEnd(&estream);
+    return result;
 }
 
 int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
@@ -135,54 +261,12 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     // from oldfile to x bytes from the diff block; copy y bytes from the
     // extra block; seek forwards in oldfile by z bytes".
 
-    unsigned char* header = (unsigned char*) patch->data + patch_offset;
-    if (memcmp(header, "BSDIFF40", 8) != 0) {
-        printf("corrupt bsdiff patch file header (magic number)\n");
+    bz_stream cstream, dstream, estream;
+    if (OpenBSDiffStreams(patch, patch_offset,
+                          &cstream, &dstream, &estream, new_size) != 0) {
         return 1;
     }
 
-    ssize_t ctrl_len, data_len;
-    ctrl_len = offtin(header+8);
-    data_len = offtin(header+16);
-    *new_size = offtin(header+24);
-
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
-        printf("corrupt patch file header (data lengths)\n");
-        return 1;
-    }
-
-    int bzerr;
-
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
-    }
-
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
-    }
-
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
-    }
-
     *new_data = malloc(*new_size);
     if (*new_data == NULL) {
         printf("failed to allocate %ld bytes of memory for output file\n",
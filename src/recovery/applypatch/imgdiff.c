@@ -114,6 +114,8 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -135,7 +137,7 @@ typedef struct {
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  uint32_t* I;          // suffix array, used by bsdiff
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -171,7 +173,7 @@ static int fileentry_compare(const void* a, const void* b) {
 }
 
 // from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
+int bsdiff(u_char* old, off_t oldsize, uint32_t** IP, u_char* new, off_t newsize,
            const char* patch_filename);
 
 unsigned char* ReadZip(const char* filename,
@@ -569,7 +571,6 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
     return -1;
   }
 
-  size_t p = 0;
   unsigned char* out = malloc(BUFFER_SIZE);
 
   // We only check two combinations of encoder parameters:  level 6
@@ -590,6 +591,40 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
   return -1;
 }
 
+/*
+ * Suffix arrays are cached on the source chunk, and in zip mode one
+ * source chunk (the whole source file) can serve many target chunks at
+ * once.  The first thread to need an array claims it by setting the
+ * chunk's I to SA_BUILDING; the others wait until bsdiff() has built it
+ * rather than building their own copies.
+ */
+static pthread_mutex_t sa_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sa_built = PTHREAD_COND_INITIALIZER;
+static uint32_t sa_building;
+#define SA_BUILDING (&sa_building)
+
+static uint32_t* AcquireSuffixArray(ImageChunk* src) {
+  pthread_mutex_lock(&sa_lock);
+  while (src->I == SA_BUILDING) {
+    pthread_cond_wait(&sa_built, &sa_lock);
+  }
+  uint32_t* I = src->I;
+  if (I == NULL) {
+    src->I = SA_BUILDING;
+  }
+  pthread_mutex_unlock(&sa_lock);
+  return I;
+}
+
+static void ReleaseSuffixArray(ImageChunk* src, uint32_t* I) {
+  pthread_mutex_lock(&sa_lock);
+  if (src->I == SA_BUILDING) {
+    src->I = I;
+    pthread_cond_broadcast(&sa_built);
+  }
+  pthread_mutex_unlock(&sa_lock);
+}
+
 /*
  * Given source and target chunks, compute a bsdiff patch between them
  * by running bsdiff in a subprocess.  Return the patch data, placing
@@ -608,7 +643,9 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
   mkstemp(ptemp);
 
-  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
+  uint32_t* I = AcquireSuffixArray(src);
+  int r = bsdiff(src->data, src->len, &I, tgt->data, tgt->len, ptemp);
+  ReleaseSuffixArray(src, I);
   if (r != 0) {
     printf("bsdiff() failed: %d\n", r);
     return NULL;
@@ -771,20 +808,139 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
     }
 }
 
-int main(int argc, char** argv) {
-  if (argc != 4 && argc != 5) {
-    usage:
-    printf("usage: %s [-z] <src-img> <tgt-img> <patch-file>\n",
-            argv[0]);
-    return 2;
+/*
+ * A minimal thread pool:  RunJobs() calls run(job, cookie) once for
+ * every job in [0, count), on up to num_threads threads (including the
+ * calling one), and returns when all of them are done.  Jobs are handed
+ * out heaviest first so a single large chunk doesn't start last and
+ * leave the other threads idle.
+ */
+typedef struct {
+  size_t weight;
+  int job;
+} JobOrder;
+
+typedef struct {
+  JobOrder* order;
+  int count;
+  int next;
+  void (*run)(int job, void* cookie);
+  void* cookie;
+  pthread_mutex_t lock;
+} JobQueue;
+
+static int joborder_compare(const void* a, const void* b) {
+  const JobOrder* ja = (const JobOrder*)a;
+  const JobOrder* jb = (const JobOrder*)b;
+  if (ja->weight != jb->weight) {
+    return (ja->weight > jb->weight) ? -1 : 1;
+  }
+  return ja->job - jb->job;
+}
+
+static void* JobThread(void* cookie) {
+  JobQueue* queue = (JobQueue*)cookie;
+  while (1) {
+    pthread_mutex_lock(&queue->lock);
+    int next = queue->next < queue->count ? queue->next++ : -1;
+    pthread_mutex_unlock(&queue->lock);
+    if (next < 0) break;
+    queue->run(queue->order[next].job, queue->cookie);
   }
+  return NULL;
+}
 
+void RunJobs(int count, const size_t* weight, int num_threads,
+             void (*run)(int job, void* cookie), void* cookie) {
+  JobQueue queue;
+  int i;
+
+  if (num_threads > count) num_threads = count;
+  if (num_threads <= 1) {
+    for (i = 0; i < count; ++i) {
+      run(i, cookie);
+    }
+    return;
+  }
+
+  queue.order = malloc(count * sizeof(JobOrder));
+  for (i = 0; i < count; ++i) {
+    queue.order[i].weight = weight[i];
+    queue.order[i].job = i;
+  }
+  qsort(queue.order, count, sizeof(JobOrder), joborder_compare);
+  queue.count = count;
+  queue.next = 0;
+  queue.run = run;
+  queue.cookie = cookie;
+  pthread_mutex_init(&queue.lock, NULL);
+
+  pthread_t* threads = malloc((num_threads - 1) * sizeof(pthread_t));
+  int started = 0;
+  for (i = 0; i < num_threads - 1; ++i) {
+    if (pthread_create(threads+started, NULL, JobThread, &queue) == 0) {
+      ++started;
+    }
+  }
+  JobThread(&queue);
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  pthread_mutex_destroy(&queue.lock);
+  free(queue.order);
+}
+
+typedef struct {
+  ImageChunk* tgt_chunks;
+  int* result;
+} ReconstructJobs;
+
+static void ReconstructJob(int job, void* cookie) {
+  ReconstructJobs* jobs = (ReconstructJobs*)cookie;
+  ImageChunk* tgt = jobs->tgt_chunks + job;
+  if (tgt->type == CHUNK_DEFLATE) {
+    jobs->result[job] = ReconstructDeflateChunk(tgt);
+  }
+}
+
+typedef struct {
+  ImageChunk** src;
+  ImageChunk* tgt_chunks;
+  unsigned char** patch_data;
+  size_t* patch_size;
+} PatchJobs;
+
+static void PatchJob(int job, void* cookie) {
+  PatchJobs* jobs = (PatchJobs*)cookie;
+  jobs->patch_data[job] = MakePatch(jobs->src[job], jobs->tgt_chunks+job,
+                                    jobs->patch_size+job);
+}
+
+int main(int argc, char** argv) {
   int zip_mode = 0;
+  int num_threads = 1;
+
+  while (argc > 1 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-z") == 0) {
+      zip_mode = 1;
+      --argc;
+      ++argv;
+    } else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+      num_threads = atoi(argv[2]);
+      if (num_threads <= 0) goto usage;
+      argc -= 2;
+      argv += 2;
+    } else {
+      break;
+    }
+  }
 
-  if (strcmp(argv[1], "-z") == 0) {
-    zip_mode = 1;
-    --argc;
-    ++argv;
+  if (argc != 4) {
+    usage:
+    printf("usage: imgdiff [-z] [-j <threads>] <src-img> <tgt-img> <patch-file>\n");
+    return 2;
   }
 
 
@@ -844,13 +1000,25 @@ int main(int argc, char** argv) {
     }
   }
 
+  // Confirm that given the uncompressed chunk data in the target, we
+  // can recompress it and get exactly the same bits as are in the input
+  // target image.  Each chunk's search is independent of the others, so
+  // they run in parallel.
+  ReconstructJobs rjobs;
+  rjobs.tgt_chunks = tgt_chunks;
+  rjobs.result = malloc(num_tgt_chunks * sizeof(int));
+  size_t* weight = malloc(num_tgt_chunks * sizeof(size_t));
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    rjobs.result[i] = 0;
+    weight[i] = tgt_chunks[i].len;
+  }
+  RunJobs(num_tgt_chunks, weight, num_threads, ReconstructJob, &rjobs);
+
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (tgt_chunks[i].type == CHUNK_DEFLATE) {
-      // Confirm that given the uncompressed chunk data in the target, we
-      // can recompress it and get exactly the same bits as are in the
-      // input target image.  If this fails, treat the chunk as a normal
+      // If reconstruction failed, treat the chunk as a normal
       // non-deflated chunk.
-      if (ReconstructDeflateChunk(tgt_chunks+i) < 0) {
+      if (rjobs.result[i] < 0) {
         printf("failed to reconstruct target deflate chunk %d [%s]; "
                "treating as normal\n", i, tgt_chunks[i].filename);
         ChangeDeflateChunkToNormal(tgt_chunks+i);
@@ -907,23 +1075,38 @@ int main(int argc, char** argv) {
   }
 
   // Compute bsdiff patches for each chunk's data (the uncompressed
-  // data, in the case of deflate chunks).
+  // data, in the case of deflate chunks).  Each target chunk is diffed
+  // independently, so the pairs are handed to the thread pool.
 
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
-  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
-  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  PatchJobs pjobs;
+  pjobs.src = malloc(num_tgt_chunks * sizeof(ImageChunk*));
+  pjobs.tgt_chunks = tgt_chunks;
+  pjobs.patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
+  pjobs.patch_size = malloc(num_tgt_chunks * sizeof(size_t));
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        pjobs.src[i] = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        pjobs.src[i] = src_chunks;
       }
     } else {
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      pjobs.src[i] = src_chunks+i;
+    }
+    weight[i] = tgt_chunks[i].len;
+  }
+  RunJobs(num_tgt_chunks, weight, num_threads, PatchJob, &pjobs);
+
+  unsigned char** patch_data = pjobs.patch_data;
+  size_t* patch_size = pjobs.patch_size;
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (tgt_chunks[i].type != CHUNK_RAW && patch_data[i] == NULL) {
+      printf("failed to construct patch for chunk %d\n", i);
+      return 1;
     }
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
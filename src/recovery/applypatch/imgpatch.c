@@ -76,9 +76,17 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
             size_t src_start = Read8(normal_header);
             size_t src_len = Read8(normal_header+8);
             size_t patch_offset = Read8(normal_header+16);
+            if (src_start > (size_t)old_size ||
+                src_len > (size_t)old_size - src_start) {
+                printf("chunk %d source out of range\n", i);
+                return -1;
+            }
 
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
+            if (ApplyBSDiffPatch(old_data + src_start, src_len,
+                                 patch, patch_offset, sink, token, ctx) != 0) {
+                printf("failed to apply chunk %d normal patch\n", i);
+                return -1;
+            }
         } else if (type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
@@ -119,6 +127,11 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
             int windowBits = Read4(deflate_header+48);
             int memLevel = Read4(deflate_header+52);
             int strategy = Read4(deflate_header+56);
+            if (src_start > (size_t)old_size ||
+                src_len > (size_t)old_size - src_start) {
+                printf("chunk %d source out of range\n", i);
+                return -1;
+            }
 
             // Decompress the source data; the chunk header tells us exactly
             // how big we expect it to be when decompressed.
@@ -24,147 +24,1552 @@
 //-----------------------------------------------------------------------------
 
 #include <sys/stat.h>							// Include STAT declarations
+#include <sys/time.h>							// Include TIME declarations
 #include <limits.h>								// Include LIMITS declarations
 #include <fcntl.h>								// Include FCNTL declarations
+#include <malloc.h>								// Include MALLOC declarations
+#include <pthread.h>							// Include PTHREAD declarations
+#include <unistd.h>								// Include UNISTD declarations
 #include <zlib.h> 								// Include ZLIB declarations
 #include "dirent.h"								// Include DIRENT declarations
 #include "ext4_utils/make_ext4fs.h"				// Include MAKE_EXT4FS decls
+#include "ext4_utils/sparse_format.h"			// Include EXT4_UTILS support
+#include "ext4_utils/sparse_crc32.h"			// Include EXT4_UTILS support
+#include "ext4_utils/sha1.h"					// Include EXT4_UTILS support
 #include "yaffs2/yaffs2/utils/mkyaffs2image.h"	// Include MKYAFFS2IMAGE decls
 #include "backup.h"								// Include BACKUP declarations
 
 //-----------------------------------------------------------------------------
-// GLOBAL VARIABLES
+// PRIVATE CONSTANTS / MACROS
 //-----------------------------------------------------------------------------
 
-// used by mkyaffs2_callback - see backup_yaffs2_internal
-static int 					g_yaffs_filecount = 0;
-static int 					g_yaffs_filesprocessed = 0;
-static ui_callbacks* 		g_yaffs_uicallbacks = NULL;
+// Constants for the pipelined raw dump operation
+#define DUMP_CHUNK_SIZE					(1024*1024)		// Size of each read/compress unit
+#define DUMP_CHUNK_ALIGN				4096			// Alignment of the chunk buffers
+#define DUMP_MAX_WORKERS				4				// Maximum compressor threads
+#define DUMP_SLOTS_PER_WORKER			2				// Chunk slots per compressor thread
+
+// Constants for the YAFFS2 backup operation
+#define YAFFS2_READ_THREADS				4				// File reader threads for mkyaffs2image
+
+// Constants for the sparse raw dump operation
+#define SPARSE_DUMP_BUF_SIZE			(1024*1024)		// Size of the device read buffer
+#define SPARSE_DUMP_BLOCK_SIZE			4096			// Preferred sparse block size
+#define SPARSE_DUMP_MIN_BLOCK_SIZE		512				// Fallback sparse block size
+
+// Constants for the incremental raw dump operation
+#define MANIFEST_MAGIC					0x4e414d42		// 'BMAN'
+#define MANIFEST_VERSION				1				// Manifest file version
+#define MANIFEST_CHUNK_SIZE				(64*1024)		// Size of each hashed chunk
+
+// Constants for the backup estimation pass
+#define ESTIMATE_SAMPLE_SIZE			(64*1024)		// Size of each sampled block of file data
+#define ESTIMATE_MAX_SAMPLES			64				// Maximum number of samples per volume
+#define ESTIMATE_YAFFS2_CHUNK			2048			// YAFFS2 image data bytes per page
+#define ESTIMATE_YAFFS2_SPARE			64				// YAFFS2 image spare bytes per page
+#define ESTIMATE_METADATA_RATIO			8				// Assumed compression of YAFFS2 metadata
+#define ESTIMATE_MARGIN_PERCENT			5				// Safety margin added to the output size
+
+//-----------------------------------------------------------------------------
+// PRIVATE TYPE DECLARATIONS
+//-----------------------------------------------------------------------------
+
+// DUMP_SLOT_STATE
+//
+// Lifetime of a single chunk slot in the pipelined raw dump
+typedef enum {
+
+	slot_free		= 0,				// Available to the reader
+	slot_filled,						// Holds raw data, waiting for a compressor
+	slot_busy,							// Being compressed by a worker
+	slot_compressed,					// Holds a gzip member, waiting for the writer
+
+} DUMP_SLOT_STATE;
+
+// DUMP_SLOT
+//
+// A single chunk of the pipelined raw dump.  Each slot carries its own input and
+// output buffers so no data is ever copied between the pipeline stages
+typedef struct {
+
+	DUMP_SLOT_STATE		state;
+	unsigned char*		in;
+	unsigned int		cbin;
+	unsigned char*		out;
+	unsigned int		cbout;
+	unsigned int		cbmaxout;
+
+} DUMP_SLOT;
+
+// DUMP_PIPELINE
+//
+// Shared state of the pipelined raw dump.  The calling thread reads the source
+// device into the slots in order, the worker threads turn each slot into an
+// independent gzip member and the writer thread appends them to the output file
+// in the same order they were read.  Concatenated gzip members are still a valid
+// gzip stream, so the result can be read back with gzread() by restore_dump_ui
+typedef struct {
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		changed;
+	DUMP_SLOT*			slots;
+	int 				numslots;
+	int 				level;
+	int 				dest;
+	unsigned int		nextread;
+	unsigned int		nextwrite;
+	int 				eof;
+	int 				error;
+	unsigned long long	totalwritten;
+
+} DUMP_PIPELINE;
+
+// DUMP_MANIFEST_HEADER
+//
+// Header of a block hash manifest file, which is followed by one SHA-1 digest
+// for each chunk of the volume.  A manifest describes the entire contents of the
+// volume at the time of the backup, regardless of whether that backup was a full
+// or an incremental one, so any backup can serve as the base of the next
+typedef struct {
+
+	u32					magic;
+	u32					version;
+	u32					chunk_size;
+	u32					num_chunks;
+	u64					volume_size;
+
+} DUMP_MANIFEST_HEADER;
+
+// ESTIMATE_STATE
+//
+// State of the backup estimation pass.  The first walk of the directory tree sizes
+// the image; the second one samples file data at evenly spaced byte offsets, so
+// that large files contribute to the measured compression ratio in proportion to
+// their size
+typedef struct {
+
+	int 				gzip;
+	unsigned long long	step;
+	unsigned long long	nextsample;
+	unsigned long long	position;
+	unsigned long long	databytes;
+	unsigned long long	pages;
+	unsigned long long	objects;
+	int 				samples;
+	unsigned long long	sampledin;
+	unsigned long long	sampledout;
+	unsigned long long	read_us;
+	unsigned long long	compress_us;
+	z_stream			zstream;
+	unsigned char*		in;
+	unsigned char*		out;
+	unsigned int		cbmaxout;
+
+} ESTIMATE_STATE;
+
+//-----------------------------------------------------------------------------
+// PRIVATE FUNCTION PROTOTYPES
+//-----------------------------------------------------------------------------
+
+// pipelined implementation of backup_dump_ui
+static int backup_dump_pipelined(const Volume* volume, int source, unsigned long long size, 
+	const char* imgfile, int gzip, ui_callbacks* callbacks);
+
+// compressor thread for backup_dump_pipelined
+static void* backup_dump_compressor(void* arg);
+
+// writer thread for backup_dump_pipelined
+static void* backup_dump_writer(void* arg);
+
+// writes data to a sparse dump output file
+static int backup_dump_sparse_write(int fd, gzFile gz, const void* data, unsigned int len);
+
+// emits a "don't care" chunk into a sparse dump output file
+static int backup_dump_sparse_skip(int fd, gzFile gz, u32 blocks, u32* chunks);
+
+// emits a fill chunk into a sparse dump output file
+static int backup_dump_sparse_fill(int fd, gzFile gz, u32 blocks, u32 fill, u32* chunks);
+
+// emits a raw data chunk into an incremental sparse dump output file
+static int backup_dump_incremental_raw(int fd, gzFile gz, const unsigned char* data, u32 blocks, 
+	u32 blk_sz, u32* chunks);
+
+// loads a block hash manifest file
+static unsigned char* backup_load_manifest(const char* manifest, unsigned long long size, u32* chunks);
+
+// saves a block hash manifest file
+static int backup_save_manifest(const char* manifest, unsigned long long size, 
+	const unsigned char* digests, u32 chunks);
+
+// samples a block of file data for backup_estimate_yaffs2_ui
+static void backup_estimate_sample(ESTIMATE_STATE* state, const char* filename, unsigned long long offset);
+
+// recursively walks a directory tree for backup_estimate_yaffs2_ui
+static void backup_estimate_walk(ESTIMATE_STATE* state, const char* directory);
+
+// common helper that combines all the ext4 backup permutations
+static int backup_ext4_internal(const Volume* volume, const char* imgfile, 
+	ui_callbacks* callbacks, int gzip, int sparse);
+
+// progress callback for mkyaffs2image_parallel
+static void mkyaffs2_progress(unsigned long long done, unsigned long long total, void* context);
+
+//-----------------------------------------------------------------------------
+// backup_dump
+//
+// Creates a dump file from a volume
+//
+// Arguments:
+//
+//	volume			- Volume to be backed up
+//	imgfile			- Destination image file path
+//	gzip			- Flag to compress the output file with GZIP
+
+int backup_dump(const Volume* volume, const char* imgfile, int gzip)
+{
+	// Invoke the UI version with a NULL callback structure
+	return backup_dump_ui(volume, imgfile, gzip, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// backup_dump_ui
+//
+// Creates a dump file from a volume
+//
+// Arguments:
+//
+//	volume			- Volume to be backed up
+//	imgfile			- Destination image file path
+//	gzip			- Flag to compress the output file with GZIP
+//	callbacks		- Optional UI callbacks for progress and messages
+
+int backup_dump_ui(const Volume* volume, const char* imgfile, int gzip, ui_callbacks* callbacks)
+{
+	unsigned char*		buffer;				// Data buffer
+	int 				source;				// Source volume file descriptor
+	unsigned long long	size;				// Size of input volume (for progress)
+	gzFile 				dest;				// Destination file
+	int 				cbread;				// Number of bytes read from source file
+	unsigned long long	totalread = 0;		// Total number of bytes read from source
+	int 				badthings = 0;		// Flag if bad things happened
+	int 				result;				// Result from function call
+	
+	const int BUFFER_SIZE = 4096;			// Size of the read buffer
+	
+	USES_UI_CALLBACKS(callbacks);
+	
+	if(volume == NULL) return EINVAL;			// Invalid [in] argument
+	if(imgfile == NULL) return EINVAL;			// Invalid [in] argument
+
+	// Get the size of the input volume, but it's not the end of the world if we can't
+	result = volume_size(volume, &size);
+	if(result != 0) { size = 0; UI_WARNING("Unable to determine input device size, progress indicator will not work\n"); }
+
+	// Attempt to open the input device first
+	source = open(volume->device, O_RDONLY);
+	if(source < 0) { 
+		
+		UI_ERROR("Cannot open input device %s for read. EC = %d\n", volume->device, errno);
+		return errno;
+	}
+	
+	// Try the pipelined dump first, which overlaps reading the device with compressing
+	// and writing the output file.  ENOMEM indicates that the pipeline could not be set
+	// up at all (nothing has been read or written), so fall back to the serial method
+	result = backup_dump_pipelined(volume, source, size, imgfile, gzip, callbacks);
+	if(result != ENOMEM) { close(source); return result; }
+	
+	UI_WARNING("Unable to start pipelined dump, falling back to serial dump\n");
+	
+	// Allocate the buffer memory
+	buffer = malloc(BUFFER_SIZE);
+	if(!buffer) { 
+		
+		UI_ERROR("Unable to allocate data buffer. EC = %d\n", errno); 
+		close(source);
+		return errno; 
+	}
+	
+	// Now attempt to open the output file with gzip, specifying no compression as applicable
+	dest = gzopen(imgfile, (gzip) ? "wb" : "wb0");
+	if(dest == Z_NULL) {
+		
+		UI_ERROR("Cannot open output file %s for write. EC = %d\n", imgfile, errno);
+		close(source);
+		free(buffer);
+		return errno;
+	}
+	
+	// Move the data ....
+	cbread = read(source, buffer, BUFFER_SIZE);
+	while(cbread > 0) {
+	
+		totalread += cbread;				// Tack on the number of bytes read
+		
+		// Write the buffer to the output file, and break the loop on an error
+		result = gzwrite(dest, buffer, cbread);
+		if(result < cbread) { 
+			
+			UI_ERROR("Unable to write data to output file %s. EC = %d\n", imgfile, errno);
+			badthings = -1;
+			break;
+		}
+		
+		// If we know the size of the output device, we can provide a progress status
+		if(size > 0) UI_SETPROGRESS((float)(totalread * 100) / (float)size);
+		
+		cbread = read(source, buffer, BUFFER_SIZE);		// Read next block of data
+	}
+	
+	if(cbread < 0) { 
+		
+		UI_ERROR("Unable to read data from input volume %s. EC = %d.\n", volume->device, errno); 
+		badthings = -1;
+	}
+	
+	gzclose(dest);								// Close the output file
+	close(source);								// Close the input volume
+	free(buffer);								// Release buffer memory
+	
+	return (badthings) ? -1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// backup_dump_pipelined (private)
+//
+// Pipelined implementation of backup_dump_ui.  The source device is read in large
+// aligned chunks on the calling thread, the chunks are compressed into independent
+// gzip members by a pool of worker threads, and a writer thread appends the members
+// to the output file in their original order.  Returns ENOMEM without touching the
+// output file if the pipeline cannot be set up
+//
+// Arguments:
+//
+//	volume			- Volume being backed up
+//	source			- Open source volume file descriptor
+//	size			- Size of the source volume (for progress), or zero
+//	imgfile			- Destination image file path
+//	gzip			- Flag to compress the output file with GZIP
+//	callbacks		- Optional UI callbacks for progress and messages
+
+static int backup_dump_pipelined(const Volume* volume, int source, unsigned long long size, 
+	const char* imgfile, int gzip, ui_callbacks* callbacks)
+{
+	DUMP_PIPELINE		pipeline;				// Shared pipeline state
+	pthread_t			workers[DUMP_MAX_WORKERS];	// Compressor threads
+	pthread_t			writer;					// Writer thread
+	int 				writerstarted = 0;		// Flag if the writer thread was started
+	int 				numworkers;				// Number of compressor threads
+	int 				startedworkers = 0;		// Number of compressor threads started
+	DUMP_SLOT*			slot;					// Current slot being read into
+	unsigned int		cbslot;					// Bytes read into the current slot
+	ssize_t 			cbread = 0;				// Bytes returned from read()
+	long 				cpus;					// Number of online processors
+	int 				index;					// Loop index variable
+	int 				result = 0;				// Result from function call
+	
+	USES_UI_CALLBACKS(callbacks);
+	
+	// One compressor per processor, but always at least two so that reading and
+	// deflating overlap even on the single-core Hummingbird
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	numworkers = (cpus < 2) ? 2 : ((cpus > DUMP_MAX_WORKERS) ? DUMP_MAX_WORKERS : (int)cpus);
+	
+	memset(&pipeline, 0, sizeof(DUMP_PIPELINE));
+	pipeline.level = (gzip) ? Z_DEFAULT_COMPRESSION : Z_NO_COMPRESSION;
+	pipeline.numslots = numworkers * DUMP_SLOTS_PER_WORKER;
+	
+	// Allocate the chunk slots and their aligned data buffers.  The output buffer is
+	// sized for the worst case expansion of a stored (incompressible) chunk
+	pipeline.slots = (DUMP_SLOT*)calloc(pipeline.numslots, sizeof(DUMP_SLOT));
+	if(!pipeline.slots) return ENOMEM;
+	
+	for(index = 0; index < pipeline.numslots; index++) {
+		
+		pipeline.slots[index].cbmaxout = DUMP_CHUNK_SIZE + (DUMP_CHUNK_SIZE >> 8) + 1024;
+		pipeline.slots[index].in = (unsigned char*)memalign(DUMP_CHUNK_ALIGN, DUMP_CHUNK_SIZE);
+		pipeline.slots[index].out = (unsigned char*)malloc(pipeline.slots[index].cbmaxout);
+		if(!pipeline.slots[index].in || !pipeline.slots[index].out) { result = ENOMEM; break; }
+	}
+	
+	if(result != 0) goto cleanup_slots;
+	
+	pthread_mutex_init(&pipeline.lock, NULL);
+	pthread_cond_init(&pipeline.changed, NULL);
+	
+	// Open the output file.  This is a plain file, the gzip framing is generated
+	// by the compressor threads
+	pipeline.dest = open(imgfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(pipeline.dest < 0) {
+		
+		result = errno;
+		UI_ERROR("Cannot open output file %s for write. EC = %d\n", imgfile, result);
+		goto cleanup_sync;
+	}
+	
+	// Start the writer and the compressor threads.  If none of them can be started
+	// there is no pipeline; let the caller fall back to the serial implementation
+	if(pthread_create(&writer, NULL, backup_dump_writer, &pipeline) == 0) {
+		
+		writerstarted = 1;
+		while(startedworkers < numworkers) {
+			
+			if(pthread_create(&workers[startedworkers], NULL, backup_dump_compressor, &pipeline) != 0) break;
+			startedworkers++;
+		}
+	}
+	
+	if(startedworkers == 0) { result = ENOMEM; pipeline.error = -1; }
+	
+	// Move the data ....
+	while(result == 0) {
+	
+		// Wait for the next slot in sequence to be released by the writer
+		pthread_mutex_lock(&pipeline.lock);
+		slot = &pipeline.slots[pipeline.nextread % pipeline.numslots];
+		while((slot->state != slot_free) && (pipeline.error == 0)) pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+		
+		// Take the opportunity to update the progress while we hold the lock
+		if(size > 0) UI_SETPROGRESS((float)(pipeline.totalwritten * 100) / (float)size);
+		
+		result = pipeline.error;
+		pthread_mutex_unlock(&pipeline.lock);
+		if(result != 0) break;
+		
+		// Fill the slot with a full chunk from the source device
+		cbslot = 0;
+		while(cbslot < DUMP_CHUNK_SIZE) {
+			
+			cbread = read(source, slot->in + cbslot, DUMP_CHUNK_SIZE - cbslot);
+			if(cbread <= 0) break;
+			cbslot += cbread;
+		}
+		
+		if(cbread < 0) { 
+			
+			UI_ERROR("Unable to read data from input volume %s. EC = %d.\n", volume->device, errno); 
+			result = -1;
+		}
+		
+		// Hand the slot over to the compressors, or flag the end of the input
+		pthread_mutex_lock(&pipeline.lock);
+		if(result != 0) pipeline.error = result;
+		else if(cbslot > 0) {
+			
+			slot->cbin = cbslot;
+			slot->state = slot_filled;
+			pipeline.nextread++;
+		}
+		if(cbslot < DUMP_CHUNK_SIZE) pipeline.eof = 1;
+		pthread_cond_broadcast(&pipeline.changed);
+		pthread_mutex_unlock(&pipeline.lock);
+		
+		if(cbslot < DUMP_CHUNK_SIZE) break;
+	}
+	
+	// Wait for the pipeline to drain and the threads to exit
+	pthread_mutex_lock(&pipeline.lock);
+	pipeline.eof = 1;
+	pthread_cond_broadcast(&pipeline.changed);
+	pthread_mutex_unlock(&pipeline.lock);
+	
+	for(index = 0; index < startedworkers; index++) pthread_join(workers[index], NULL);
+	if(writerstarted) pthread_join(writer, NULL);
+	
+	if((result == 0) && (pipeline.error != 0)) {
+		
+		UI_ERROR("Unable to write data to output file %s. EC = %d\n", imgfile, errno);
+		result = -1;
+	}
+	
+	if(close(pipeline.dest) != 0 && (result == 0)) {
+		
+		UI_ERROR("Unable to write data to output file %s. EC = %d\n", imgfile, errno);
+		result = -1;
+	}
+	
+	// Don't leave a truncated image behind that looks like a valid backup
+	if(result != 0) unlink(imgfile);
+	else if(size > 0) UI_SETPROGRESS(100);
+
+cleanup_sync:
+
+	pthread_cond_destroy(&pipeline.changed);
+	pthread_mutex_destroy(&pipeline.lock);
+	
+cleanup_slots:
+	
+	for(index = 0; index < pipeline.numslots; index++) {
+		
+		if(pipeline.slots[index].in) free(pipeline.slots[index].in);
+		if(pipeline.slots[index].out) free(pipeline.slots[index].out);
+	}
+	
+	free(pipeline.slots);
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// backup_dump_compressor (private)
+//
+// Compressor thread for backup_dump_pipelined.  Converts filled slots into
+// complete, independent gzip members in whatever order they become available
+//
+// Arguments:
+//
+//	arg				- Pointer to the shared DUMP_PIPELINE structure
+
+static void* backup_dump_compressor(void* arg)
+{
+	DUMP_PIPELINE*		pipeline = (DUMP_PIPELINE*)arg;
+	DUMP_SLOT*			slot;					// Slot being compressed
+	z_stream			stream;					// ZLIB deflate stream
+	unsigned int		index;					// Loop index variable
+	int 				result;					// Result from function call
+	
+	// Window bits of 15 + 16 instructs zlib to generate a gzip header and trailer
+	memset(&stream, 0, sizeof(z_stream));
+	result = deflateInit2(&stream, pipeline->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+	if(result != Z_OK) {
+		
+		pthread_mutex_lock(&pipeline->lock);
+		pipeline->error = -1;
+		pthread_cond_broadcast(&pipeline->changed);
+		pthread_mutex_unlock(&pipeline->lock);
+		return NULL;
+	}
+	
+	pthread_mutex_lock(&pipeline->lock);
+	
+	for(;;) {
+		
+		// Find the oldest filled slot; the reader fills them in sequence so the 
+		// first one after the writer's position is the best candidate
+		slot = NULL;
+		for(index = pipeline->nextwrite; index < pipeline->nextread; index++) {
+			
+			if(pipeline->slots[index % pipeline->numslots].state == slot_filled) {
+				
+				slot = &pipeline->slots[index % pipeline->numslots];
+				break;
+			}
+		}
+		
+		if(pipeline->error != 0) break;
+		if(slot == NULL) {
+			
+			if(pipeline->eof) break;
+			pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+			continue;
+		}
+		
+		slot->state = slot_busy;
+		pthread_mutex_unlock(&pipeline->lock);
+		
+		// Compress the entire chunk into a single gzip member
+		deflateReset(&stream);
+		stream.next_in = slot->in;
+		stream.avail_in = slot->cbin;
+		stream.next_out = slot->out;
+		stream.avail_out = slot->cbmaxout;
+		result = deflate(&stream, Z_FINISH);
+		
+		pthread_mutex_lock(&pipeline->lock);
+		
+		if(result != Z_STREAM_END) { pipeline->error = -1; }
+		else {
+			
+			slot->cbout = slot->cbmaxout - stream.avail_out;
+			slot->state = slot_compressed;
+		}
+		
+		pthread_cond_broadcast(&pipeline->changed);
+	}
+	
+	pthread_mutex_unlock(&pipeline->lock);
+	
+	deflateEnd(&stream);
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// backup_dump_writer (private)
+//
+// Writer thread for backup_dump_pipelined.  Writes the compressed slots to the
+// output file in the order they were read from the source device
+//
+// Arguments:
+//
+//	arg				- Pointer to the shared DUMP_PIPELINE structure
+
+static void* backup_dump_writer(void* arg)
+{
+	DUMP_PIPELINE*		pipeline = (DUMP_PIPELINE*)arg;
+	DUMP_SLOT*			slot;					// Slot being written
+	unsigned int		cbwritten;				// Bytes written from the slot
+	ssize_t 			cb;						// Bytes returned from write()
+	
+	pthread_mutex_lock(&pipeline->lock);
+	
+	for(;;) {
+		
+		// Wait for the next slot in sequence to finish compressing
+		slot = &pipeline->slots[pipeline->nextwrite % pipeline->numslots];
+		if(pipeline->error != 0) break;
+		if((pipeline->nextwrite == pipeline->nextread) && (pipeline->eof)) break;
+		if((pipeline->nextwrite == pipeline->nextread) || (slot->state != slot_compressed)) {
+			
+			pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+			continue;
+		}
+		
+		pthread_mutex_unlock(&pipeline->lock);
+		
+		// Write the gzip member to the output file
+		cbwritten = 0;
+		while(cbwritten < slot->cbout) {
+			
+			cb = write(pipeline->dest, slot->out + cbwritten, slot->cbout - cbwritten);
+			if(cb <= 0) break;
+			cbwritten += cb;
+		}
+		
+		pthread_mutex_lock(&pipeline->lock);
+		
+		if(cbwritten < slot->cbout) { pipeline->error = -1; }
+		else {
+			
+			pipeline->totalwritten += slot->cbin;
+			slot->state = slot_free;
+			pipeline->nextwrite++;
+		}
+		
+		pthread_cond_broadcast(&pipeline->changed);
+	}
+	
+	pthread_mutex_unlock(&pipeline->lock);
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// backup_dump_sparse
+//
+// Creates a sparse dump file from a volume
+//
+// Arguments:
+//
+//	volume			- Volume to be backed up
+//	imgfile			- Destination image file path
+//	gzip			- Flag to compress the output file with GZIP
+
+int backup_dump_sparse(const Volume* volume, const char* imgfile, int gzip)
+{
+	// Invoke the UI version with a NULL callback structure
+	return backup_dump_sparse_ui(volume, imgfile, gzip, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// backup_dump_sparse_ui
+//
+// Creates a sparse dump file from a volume.  This is a raw dump written in the
+// Android sparse image format, where every run of all-zero blocks is recorded
+// as a zero fill chunk rather than as data.  Like the ext4 sparse images the
+// header is written uncompressed and the remainder of the file can optionally be
+// compressed with GZIP, so the result is restored with restore_ext4_sparse_ui.
+//
+// The zero blocks of a raw dump are real data, so unlike the unused blocks of a
+// sparse ext4 image they can't be "don't care" chunks: restore would skip them
+// and leave whatever the destination volume previously contained
+//
+// Arguments:
+//
+//	volume			- Volume to be backed up
+//	imgfile			- Destination image file path
+//	gzip			- Flag to compress the output file with GZIP
+//	callbacks		- Optional UI callbacks for progress and messages
+
+int backup_dump_sparse_ui(const Volume* volume, const char* imgfile, int gzip, ui_callbacks* callbacks)
+{
+	unsigned char*		buffer;				// Data buffer
+	unsigned char*		block;				// Current block within the data buffer
+	unsigned char*		rawstart;			// Start of the current run of raw blocks
+	int 				source;				// Source volume file descriptor
+	int 				dest;				// Destination file descriptor
+	gzFile 				destgz = Z_NULL;	// Destination GZIP stream
+	unsigned long long	size;				// Size of input volume
+	sparse_header_t 	header;				// Sparse image header
+	chunk_header_t 		chunk;				// Sparse image chunk header
+	u32 				blk_sz;				// Sparse image block size
+	u32 				pendingzero = 0;	// Zero blocks not yet written as a chunk
+	u32 				blocksread = 0;		// Total number of blocks read
+	u32 				rawblocks;			// Blocks in the current run of raw blocks
+	u32 				crc32 = 0;			// Running CRC32 of the image data
+	unsigned int		cbbuffer;			// Bytes read into the data buffer
+	ssize_t 			cbread = 0;			// Bytes returned from read()
+	int 				badthings = 0;		// Flag if bad things happened
+	int 				result;				// Result from function call
+	
+	USES_UI_CALLBACKS(callbacks);
+	
+	if(volume == NULL) return EINVAL;			// Invalid [in] argument
+	if(imgfile == NULL) return EINVAL;			// Invalid [in] argument
+
+	// Unlike a normal dump, the sparse header needs the size of the input volume
+	result = volume_size(volume, &size);
+	if(result != 0) { 
+		
+		UI_ERROR("Cannot determine size of source volume %s. EC = %d\n", volume->name, result); 
+		return result;
+	}
+	
+	// Use 4KB blocks unless the volume isn't a multiple of that, the restore operation
+	// cannot write a padded partial block past the end of the device
+	blk_sz = ((size % SPARSE_DUMP_BLOCK_SIZE) == 0) ? SPARSE_DUMP_BLOCK_SIZE : SPARSE_DUMP_MIN_BLOCK_SIZE;
+	if((size % blk_sz) != 0) {
+		
+		UI_ERROR("Size of source volume %s is not a multiple of %d bytes\n", volume->name, SPARSE_DUMP_MIN_BLOCK_SIZE);
+		return EINVAL;
+	}
+	
+	// Allocate the buffer memory
+	buffer = malloc(SPARSE_DUMP_BUF_SIZE);
+	if(!buffer) { 
+		
+		UI_ERROR("Unable to allocate data buffer. EC = %d\n", errno); 
+		return errno; 
+	}
+	
+	// Attempt to open the input device first
+	source = open(volume->device, O_RDONLY);
+	if(source < 0) { 
+		
+		UI_ERROR("Cannot open input device %s for read. EC = %d\n", volume->device, errno);
+		free(buffer);
+		return errno;
+	}
+	
+	// Open the output file; the sparse header is always written uncompressed
+	dest = open(imgfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(dest < 0) {
+		
+		UI_ERROR("Cannot open output file %s for write. EC = %d\n", imgfile, errno);
+		close(source);
+		free(buffer);
+		return errno;
+	}
+	
+	// Write a preliminary sparse header, the chunk count and checksum are updated at the end
+	memset(&header, 0, sizeof(sparse_header_t));
+	header.magic = SPARSE_HEADER_MAGIC;
+	header.major_version = 1;
+	header.minor_version = 0;
+	header.file_hdr_sz = sizeof(sparse_header_t);
+	header.chunk_hdr_sz = sizeof(chunk_header_t);
+	header.blk_sz = blk_sz;
+	header.total_blks = (u32)(size / blk_sz);
+	
+	if(backup_dump_sparse_write(dest, Z_NULL, &header, sizeof(sparse_header_t)) != 0) badthings = -1;
+	
+	// Associate a duplicate of the file handle with GZIP for the chunk data
+	if((!badthings) && (gzip)) {
+		
+		destgz = gzdopen(dup(dest), "wb");
+		if(destgz == Z_NULL) { UI_ERROR("Cannot associate GZIP file with output file handle. EC = %d\n", errno); badthings = -1; }
+	}
+	
+	if(badthings) UI_ERROR("Unable to write data to output file %s. EC = %d\n", imgfile, errno);
+	
+	// Move the data ....
+	while(!badthings) {
+		
+		// Fill the buffer with as many whole blocks as the device will give us
+		cbbuffer = 0;
+		while(cbbuffer < SPARSE_DUMP_BUF_SIZE) {
+			
+			cbread = read(source, buffer + cbbuffer, SPARSE_DUMP_BUF_SIZE - cbbuffer);
+			if(cbread <= 0) break;
+			cbbuffer += cbread;
+		}
+		
+		if(cbread < 0) { 
+			
+			UI_ERROR("Unable to read data from input volume %s. EC = %d.\n", volume->device, errno); 
+			badthings = -1;
+			break;
+		}
+		
+		if(cbbuffer == 0) break;				// End of the device
+		cbbuffer -= (cbbuffer % blk_sz);		// Ignore anything past the last whole block
+		
+		// Walk the blocks in the buffer, emitting runs of raw blocks as single chunks
+		// and deferring runs of zero blocks so they coalesce across buffers
+		rawstart = NULL;
+		rawblocks = 0;
+		for(block = buffer; block <= buffer + cbbuffer; block += blk_sz) {
+			
+			// A zero block (or the end of the buffer) terminates any run of raw blocks
+			if((block == buffer + cbbuffer) || ((block[0] == 0) && (memcmp(block, block + 1, blk_sz - 1) == 0))) {
+				
+				if(rawblocks > 0) {
+					
+					chunk.chunk_type = CHUNK_TYPE_RAW;
+					chunk.reserved1 = 0;
+					chunk.chunk_sz = rawblocks;
+					chunk.total_sz = sizeof(chunk_header_t) + (rawblocks * blk_sz);
+					
+					if((backup_dump_sparse_write(dest, destgz, &chunk, sizeof(chunk_header_t)) != 0) ||
+						(backup_dump_sparse_write(dest, destgz, rawstart, rawblocks * blk_sz) != 0)) { badthings = -1; break; }
+					
+					crc32 = sparse_crc32(crc32, rawstart, rawblocks * blk_sz);
+					header.total_chunks++;
+					rawblocks = 0;
+				}
+				
+				if(block < buffer + cbbuffer) pendingzero++;
+			}
+			
+			// A raw block terminates any run of zero blocks
+			else {
+				
+				if(pendingzero > 0) {
+					
+					if(backup_dump_sparse_fill(dest, destgz, pendingzero, 0, &header.total_chunks) != 0) { badthings = -1; break; }
+					crc32 = sparse_crc32_zeros(crc32, (u64)pendingzero * blk_sz);
+					pendingzero = 0;
+				}
+				
+				if(rawblocks++ == 0) rawstart = block;
+			}
+		}
+		
+		if(badthings) { UI_ERROR("Unable to write data to output file %s. EC = %d\n", imgfile, errno); break; }
+		
+		blocksread += cbbuffer / blk_sz;
+		UI_SETPROGRESS((float)blocksread * 100 / (float)header.total_blks);
+		
+		if(blocksread >= header.total_blks) break;
+	}
+	
+	// Flush out any trailing run of zero blocks
+	if((!badthings) && (pendingzero > 0)) {
+		
+		if(backup_dump_sparse_fill(dest, destgz, pendingzero, 0, &header.total_chunks) == 0)
+			crc32 = sparse_crc32_zeros(crc32, (u64)pendingzero * blk_sz);
+		else { UI_ERROR("Unable to write data to output file %s. EC = %d\n", imgfile, errno); badthings = -1; }
+	}
+	
+	// The sparse format describes the whole device, a short read is an error
+	if((!badthings) && (blocksread != header.total_blks)) {
+		
+		UI_ERROR("Read %d blocks from input volume %s, expected %d blocks\n", blocksread, volume->device, header.total_blks);
+		badthings = -1;
+	}
+	
+	// Close the GZIP stream (which closes the duplicate handle), then go back and
+	// update the sparse header with the final chunk count and checksum
+	if((destgz != Z_NULL) && (gzclose(destgz) != Z_OK)) badthings = -1;
+	
+	if(!badthings) {
+		
+		header.image_checksum = crc32;
+		if((lseek(dest, 0, SEEK_SET) != 0) || (backup_dump_sparse_write(dest, Z_NULL, &header, sizeof(sparse_header_t)) != 0)) {
+			
+			UI_ERROR("Unable to update sparse header in output file %s. EC = %d\n", imgfile, errno);
+			badthings = -1;
+		}
+	}
+	
+	if(close(dest) != 0) badthings = -1;		// Close the output file
+	close(source);								// Close the input volume
+	free(buffer);								// Release buffer memory
+	
+	return (badthings) ? -1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// backup_dump_incremental
+//
+// Creates an incremental sparse dump file from a volume
+//
+// Arguments:
+//
+//	volume			- Volume to be backed up
+//	imgfile			- Destination image file path
+//	basemanifest	- Optional block hash manifest of the base backup
+//	manifest		- Destination block hash manifest file path
+//	gzip			- Flag to compress the output file with GZIP
+
+int backup_dump_incremental(const Volume* volume, const char* imgfile, const char* basemanifest, 
+	const char* manifest, int gzip)
+{
+	// Invoke the UI version with a NULL callback structure
+	return backup_dump_incremental_ui(volume, imgfile, basemanifest, manifest, gzip, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// backup_dump_incremental_ui
+//
+// Creates an incremental sparse dump file from a volume.  The volume is split
+// into fixed size chunks and the SHA-1 of each one is compared against the
+// manifest of the base backup; chunks that changed are written as raw data and
+// chunks that did not are written as "don't care".  A new manifest describing
+// the current volume is always written, so this backup can be the base of the
+// next one.  Without a (usable) base manifest every chunk is written, which
+// produces a full backup.
+//
+// The result is restored by applying the base backup and then each incremental
+// image on top of it with restore_ext4_sparse_ui.  Since the "don't care" chunks
+// are not zero, the sparse image checksum is not computed (left as zero)
+//
+// Arguments:
+//
+//	volume			- Volume to be backed up
+//	imgfile			- Destination image file path
+//	basemanifest	- Optional block hash manifest of the base backup
+//	manifest		- Destination block hash manifest file path
+//	gzip			- Flag to compress the output file with GZIP
+//	callbacks		- Optional UI callbacks for progress and messages
+
+int backup_dump_incremental_ui(const Volume* volume, const char* imgfile, const char* basemanifest, 
+	const char* manifest, int gzip, ui_callbacks* callbacks)
+{
+	unsigned char*		buffer;				// Data buffer
+	unsigned char*		chunk;				// Current chunk within the data buffer
+	unsigned char*		rawstart = NULL;	// Start of the current run of changed chunks
+	unsigned char*		basedigests = NULL;	// Chunk digests from the base manifest
+	unsigned char*		digests;			// Chunk digests for the new manifest
+	unsigned char*		digest;				// Digest of the current chunk
+	SHA1_CTX 			sha1;				// SHA-1 context
+	int 				source;				// Source volume file descriptor
+	int 				dest;				// Destination file descriptor
+	gzFile 				destgz = Z_NULL;	// Destination GZIP stream
+	unsigned long long	size;				// Size of input volume
+	sparse_header_t 	header;				// Sparse image header
+	u32 				blk_sz;				// Sparse image block size
+	u32 				basechunks = 0;		// Number of chunks in the base manifest
+	u32 				numchunks;			// Number of chunks in the volume
+	u32 				chunkindex = 0;		// Index of the current chunk
+	u32 				chunkblocks;		// Number of blocks in the current chunk
+	u32 				changed = 0;		// Number of changed chunks
+	u32 				pendingskip = 0;	// Unchanged blocks not yet written as a chunk
+	u32 				rawblocks = 0;		// Blocks in the current run of changed chunks
+	u32 				blocksread = 0;		// Total number of blocks read
+	unsigned int		cbbuffer;			// Bytes read into the data buffer
+	unsigned int		cbchunk;			// Bytes in the current chunk
+	ssize_t 			cbread = 0;			// Bytes returned from read()
+	int 				badthings = 0;		// Flag if bad things happened
+	int 				result;				// Result from function call
+	
+	USES_UI_CALLBACKS(callbacks);
+	
+	if(volume == NULL) return EINVAL;			// Invalid [in] argument
+	if(imgfile == NULL) return EINVAL;			// Invalid [in] argument
+	if(manifest == NULL) return EINVAL;			// Invalid [in] argument
+
+	// The sparse header and the manifest both need the size of the input volume
+	result = volume_size(volume, &size);
+	if(result != 0) { 
+		
+		UI_ERROR("Cannot determine size of source volume %s. EC = %d\n", volume->name, result); 
+		return result;
+	}
+	
+	blk_sz = ((size % SPARSE_DUMP_BLOCK_SIZE) == 0) ? SPARSE_DUMP_BLOCK_SIZE : SPARSE_DUMP_MIN_BLOCK_SIZE;
+	if((size % blk_sz) != 0) {
+		
+		UI_ERROR("Size of source volume %s is not a multiple of %d bytes\n", volume->name, SPARSE_DUMP_MIN_BLOCK_SIZE);
+		return EINVAL;
+	}
+	
+	numchunks = (u32)((size + MANIFEST_CHUNK_SIZE - 1) / MANIFEST_CHUNK_SIZE);
+	
+	// Load the base manifest if one was specified.  If it can't be used, this just
+	// turns into a full backup
+	if(basemanifest != NULL) {
+		
+		basedigests = backup_load_manifest(basemanifest, size, &basechunks);
+		if(basedigests == NULL) UI_WARNING("Base manifest %s is missing or does not match volume %s, performing a full backup\n", 
+			basemanifest, volume->name);
+	}
+	
+	// Allocate the buffer memory
+	buffer = malloc(SPARSE_DUMP_BUF_SIZE);
+	digests = malloc(numchunks * SHA1_DIGEST_LENGTH);
+	if(!buffer || !digests) { 
+		
+		UI_ERROR("Unable to allocate data buffer. EC = %d\n", errno); 
+		if(buffer) free(buffer);
+		if(digests) free(digests);
+		if(basedigests) free(basedigests);
+		return ENOMEM; 
+	}
+	
+	// Attempt to open the input device first
+	source = open(volume->device, O_RDONLY);
+	if(source < 0) { 
+		
+		UI_ERROR("Cannot open input device %s for read. EC = %d\n", volume->device, errno);
+		free(buffer);
+		free(digests);
+		if(basedigests) free(basedigests);
+		return errno;
+	}
+	
+	// Open the output file; the sparse header is always written uncompressed
+	dest = open(imgfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(dest < 0) {
+		
+		UI_ERROR("Cannot open output file %s for write. EC = %d\n", imgfile, errno);
+		close(source);
+		free(buffer);
+		free(digests);
+		if(basedigests) free(basedigests);
+		return errno;
+	}
+	
+	// Write a preliminary sparse header, the chunk count is updated at the end
+	memset(&header, 0, sizeof(sparse_header_t));
+	header.magic = SPARSE_HEADER_MAGIC;
+	header.major_version = 1;
+	header.minor_version = 0;
+	header.file_hdr_sz = sizeof(sparse_header_t);
+	header.chunk_hdr_sz = sizeof(chunk_header_t);
+	header.blk_sz = blk_sz;
+	header.total_blks = (u32)(size / blk_sz);
+	
+	if(backup_dump_sparse_write(dest, Z_NULL, &header, sizeof(sparse_header_t)) != 0) badthings = -1;
+	
+	// Associate a duplicate of the file handle with GZIP for the chunk data
+	if((!badthings) && (gzip)) {
+		
+		destgz = gzdopen(dup(dest), "wb");
+		if(destgz == Z_NULL) { UI_ERROR("Cannot associate GZIP file with output file handle. EC = %d\n", errno); badthings = -1; }
+	}
+	
+	if(badthings) UI_ERROR("Unable to write data to output file %s. EC = %d\n", imgfile, errno);
+	
+	// Move the data ....
+	while((!badthings) && (chunkindex < numchunks)) {
+		
+		// Fill the buffer with as many whole blocks as the device will give us
+		cbbuffer = 0;
+		while(cbbuffer < SPARSE_DUMP_BUF_SIZE) {
+			
+			cbread = read(source, buffer + cbbuffer, SPARSE_DUMP_BUF_SIZE - cbbuffer);
+			if(cbread <= 0) break;
+			cbbuffer += cbread;
+		}
+		
+		if(cbread < 0) { 
+			
+			UI_ERROR("Unable to read data from input volume %s. EC = %d.\n", volume->device, errno); 
+			badthings = -1;
+			break;
+		}
+		
+		if(cbbuffer == 0) break;				// End of the device
+		cbbuffer -= (cbbuffer % blk_sz);		// Ignore anything past the last whole block
+		
+		// Hash each chunk in the buffer and compare it against the base manifest.  Runs of
+		// changed chunks are emitted as a single raw chunk, runs of unchanged chunks are
+		// deferred so they coalesce across buffers
+		rawblocks = 0;
+		for(chunk = buffer; (chunk < buffer + cbbuffer) && (chunkindex < numchunks); chunk += cbchunk) {
+			
+			cbchunk = (buffer + cbbuffer - chunk > MANIFEST_CHUNK_SIZE) ? MANIFEST_CHUNK_SIZE : (unsigned int)(buffer + cbbuffer - chunk);
+			chunkblocks = cbchunk / blk_sz;
+			digest = digests + (chunkindex * SHA1_DIGEST_LENGTH);
+			
+			SHA1Init(&sha1);
+			SHA1Update(&sha1, chunk, cbchunk);
+			SHA1Final(digest, &sha1);
+			
+			// Unchanged chunk: terminate any run of changed chunks
+			if((basedigests != NULL) && (chunkindex < basechunks) && 
+				(memcmp(digest, basedigests + (chunkindex * SHA1_DIGEST_LENGTH), SHA1_DIGEST_LENGTH) == 0)) {
+				
+				if((rawblocks > 0) && (backup_dump_incremental_raw(dest, destgz, rawstart, rawblocks, blk_sz, &header.total_chunks) != 0)) { badthings = -1; break; }
+				rawblocks = 0;
+				pendingskip += chunkblocks;
+			}
+			
+			// Changed chunk: terminate any run of unchanged chunks
+			else {
+				
+				if((pendingskip > 0) && (backup_dump_sparse_skip(dest, destgz, pendingskip, &header.total_chunks) != 0)) { badthings = -1; break; }
+				pendingskip = 0;
+				
+				if(rawblocks == 0) rawstart = chunk;
+				rawblocks += chunkblocks;
+				changed++;
+			}
+			
+			chunkindex++;
+		}
+		
+		// Flush the run of changed chunks at the end of the buffer
+		if((!badthings) && (rawblocks > 0) && (backup_dump_incremental_raw(dest, destgz, rawstart, rawblocks, blk_sz, &header.total_chunks) != 0)) badthings = -1;
+		
+		if(badthings) { UI_ERROR("Unable to write data to output file %s. EC = %d\n", imgfile, errno); break; }
+		
+		blocksread += cbbuffer / blk_sz;
+		UI_SETPROGRESS((float)blocksread * 100 / (float)header.total_blks);
+	}
+	
+	// Flush out any trailing run of unchanged chunks
+	if((!badthings) && (pendingskip > 0) && (backup_dump_sparse_skip(dest, destgz, pendingskip, &header.total_chunks) != 0)) {
+		
+		UI_ERROR("Unable to write data to output file %s. EC = %d\n", imgfile, errno);
+		badthings = -1;
+	}
+	
+	// The sparse format describes the whole device, a short read is an error
+	if((!badthings) && (blocksread != header.total_blks)) {
+		
+		UI_ERROR("Read %d blocks from input volume %s, expected %d blocks\n", blocksread, volume->device, header.total_blks);
+		badthings = -1;
+	}
+	
+	// Close the GZIP stream (which closes the duplicate handle), then go back and
+	// update the sparse header with the final chunk count
+	if((destgz != Z_NULL) && (gzclose(destgz) != Z_OK)) badthings = -1;
+	
+	if(!badthings) {
+		
+		if((lseek(dest, 0, SEEK_SET) != 0) || (backup_dump_sparse_write(dest, Z_NULL, &header, sizeof(sparse_header_t)) != 0)) {
+			
+			UI_ERROR("Unable to update sparse header in output file %s. EC = %d\n", imgfile, errno);
+			badthings = -1;
+		}
+	}
+	
+	if(close(dest) != 0) badthings = -1;		// Close the output file
+	close(source);								// Close the input volume
+	
+	// Only write the new manifest if the image is good, otherwise a later backup
+	// could be based on data that was never actually saved
+	if(!badthings) {
+		
+		if(backup_save_manifest(manifest, size, digests, numchunks) == 0) { UI_PRINT("%d of %d chunks changed\n", changed, numchunks); }
+		else { UI_ERROR("Unable to write manifest file %s. EC = %d\n", manifest, errno); badthings = -1; }
+	}
+	
+	free(buffer);								// Release buffer memory
+	free(digests);								// Release digest memory
+	if(basedigests) free(basedigests);			// Release digest memory
+	
+	return (badthings) ? -1 : 0;
+}
 
 //-----------------------------------------------------------------------------
-// PRIVATE FUNCTION PROTOTYPES
+// backup_dump_incremental_raw (private)
+//
+// Emits a raw data chunk into an incremental sparse dump output file
+//
+// Arguments:
+//
+//	fd				- Output file descriptor
+//	gz				- Output GZIP stream, or Z_NULL to write to fd directly
+//	data			- Chunk data
+//	blocks			- Number of blocks of chunk data
+//	blk_sz			- Size of each block
+//	chunks			- Running chunk count to be incremented
+
+static int backup_dump_incremental_raw(int fd, gzFile gz, const unsigned char* data, u32 blocks, 
+	u32 blk_sz, u32* chunks)
+{
+	chunk_header_t 		chunk;				// Sparse image chunk header
+	
+	chunk.chunk_type = CHUNK_TYPE_RAW;
+	chunk.reserved1 = 0;
+	chunk.chunk_sz = blocks;
+	chunk.total_sz = sizeof(chunk_header_t) + (blocks * blk_sz);
+	
+	if(backup_dump_sparse_write(fd, gz, &chunk, sizeof(chunk_header_t)) != 0) return -1;
+	if(backup_dump_sparse_write(fd, gz, data, blocks * blk_sz) != 0) return -1;
+	
+	(*chunks)++;
+	return 0;
+}
+
 //-----------------------------------------------------------------------------
+// backup_load_manifest (private)
+//
+// Loads the chunk digests from a block hash manifest file.  Returns NULL if the
+// file cannot be read or does not describe a volume of the specified size
+//
+// Arguments:
+//
+//	manifest		- Manifest file path
+//	size			- Expected size of the volume
+//	chunks			- On success, receives the number of chunk digests
 
-// common helper that combines all the ext4 backup permutations
-static int backup_ext4_internal(const Volume* volume, const char* imgfile, 
-	ui_callbacks* callbacks, int gzip, int sparse);
+static unsigned char* backup_load_manifest(const char* manifest, unsigned long long size, u32* chunks)
+{
+	DUMP_MANIFEST_HEADER	header;			// Manifest file header
+	unsigned char*		digests = NULL;		// Loaded chunk digests
+	FILE*				file;				// Manifest file
+	
+	file = fopen(manifest, "rb");
+	if(file == NULL) return NULL;
+	
+	// The manifest is only usable if it was generated the same way from a volume of the same size
+	if((fread(&header, sizeof(DUMP_MANIFEST_HEADER), 1, file) == 1) && (header.magic == MANIFEST_MAGIC) && 
+		(header.version == MANIFEST_VERSION) && (header.chunk_size == MANIFEST_CHUNK_SIZE) && (header.volume_size == size) &&
+		(header.num_chunks == (u32)((size + MANIFEST_CHUNK_SIZE - 1) / MANIFEST_CHUNK_SIZE))) {
+		
+		digests = malloc(header.num_chunks * SHA1_DIGEST_LENGTH);
+		if((digests) && (fread(digests, SHA1_DIGEST_LENGTH, header.num_chunks, file) != header.num_chunks)) {
+			
+			free(digests);
+			digests = NULL;
+		}
+	}
+	
+	fclose(file);
+	
+	if(digests) *chunks = header.num_chunks;
+	return digests;
+}
 
-// callback for mkyaffs2image
-static void mkyaffs2_callback(char* filename);
+//-----------------------------------------------------------------------------
+// backup_save_manifest (private)
+//
+// Writes the chunk digests to a block hash manifest file
+//
+// Arguments:
+//
+//	manifest		- Manifest file path
+//	size			- Size of the volume
+//	digests			- Chunk digests
+//	chunks			- Number of chunk digests
 
-// counts the total number of files in a directory for mkyaffs2_callback
-static int mkyaffs2_countfiles(const char* directory, int* count);
+static int backup_save_manifest(const char* manifest, unsigned long long size, 
+	const unsigned char* digests, u32 chunks)
+{
+	DUMP_MANIFEST_HEADER	header;			// Manifest file header
+	FILE*				file;				// Manifest file
+	int 				result = 0;			// Result from function call
+	
+	header.magic = MANIFEST_MAGIC;
+	header.version = MANIFEST_VERSION;
+	header.chunk_size = MANIFEST_CHUNK_SIZE;
+	header.num_chunks = chunks;
+	header.volume_size = size;
+	
+	file = fopen(manifest, "wb");
+	if(file == NULL) return -1;
+	
+	if(fwrite(&header, sizeof(DUMP_MANIFEST_HEADER), 1, file) != 1) result = -1;
+	else if(fwrite(digests, SHA1_DIGEST_LENGTH, chunks, file) != chunks) result = -1;
+	
+	if(fclose(file) != 0) result = -1;
+	if(result != 0) unlink(manifest);
+	
+	return result;
+}
 
 //-----------------------------------------------------------------------------
-// backup_dump
+// backup_dump_sparse_write (private)
 //
-// Creates a dump file from a volume
+// Writes data to a sparse dump output file, either directly or through GZIP
 //
 // Arguments:
 //
-//	volume			- Volume to be backed up
-//	imgfile			- Destination image file path
-//	gzip			- Flag to compress the output file with GZIP
+//	fd				- Output file descriptor
+//	gz				- Output GZIP stream, or Z_NULL to write to fd directly
+//	data			- Data to be written
+//	len				- Length of the data to be written
 
-int backup_dump(const Volume* volume, const char* imgfile, int gzip)
+static int backup_dump_sparse_write(int fd, gzFile gz, const void* data, unsigned int len)
 {
-	// Invoke the UI version with a NULL callback structure
-	return backup_dump_ui(volume, imgfile, gzip, NULL);
+	ssize_t 			cb;					// Bytes returned from write()
+	
+	if(gz != Z_NULL) return (gzwrite(gz, (void*)data, len) == (int)len) ? 0 : -1;
+	
+	while(len > 0) {
+		
+		cb = write(fd, data, len);
+		if(cb <= 0) return -1;
+		
+		data = (const unsigned char*)data + cb;
+		len -= cb;
+	}
+	
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
-// backup_dump_ui
+// backup_dump_sparse_skip (private)
 //
-// Creates a dump file from a volume
+// Emits a "don't care" chunk into a sparse dump output file
 //
 // Arguments:
 //
-//	volume			- Volume to be backed up
-//	imgfile			- Destination image file path
-//	gzip			- Flag to compress the output file with GZIP
-//	callbacks		- Optional UI callbacks for progress and messages
+//	fd				- Output file descriptor
+//	gz				- Output GZIP stream, or Z_NULL to write to fd directly
+//	blocks			- Number of blocks to skip
+//	chunks			- Running chunk count to be incremented
 
-int backup_dump_ui(const Volume* volume, const char* imgfile, int gzip, ui_callbacks* callbacks)
+static int backup_dump_sparse_skip(int fd, gzFile gz, u32 blocks, u32* chunks)
 {
-	unsigned char*		buffer;				// Data buffer
-	int 				source;				// Source volume file descriptor
-	unsigned long long	size;				// Size of input volume (for progress)
-	gzFile 				dest;				// Destination file
-	int 				cbread;				// Number of bytes read from source file
-	unsigned long long	totalread = 0;		// Total number of bytes read from source
-	int 				badthings = 0;		// Flag if bad things happened
-	int 				result;				// Result from function call
+	chunk_header_t 		chunk;				// Sparse image chunk header
 	
-	const int BUFFER_SIZE = 4096;			// Size of the read buffer
+	chunk.chunk_type = CHUNK_TYPE_DONT_CARE;
+	chunk.reserved1 = 0;
+	chunk.chunk_sz = blocks;
+	chunk.total_sz = sizeof(chunk_header_t);
 	
-	USES_UI_CALLBACKS(callbacks);
+	if(backup_dump_sparse_write(fd, gz, &chunk, sizeof(chunk_header_t)) != 0) return -1;
 	
-	if(volume == NULL) return EINVAL;			// Invalid [in] argument
-	if(imgfile == NULL) return EINVAL;			// Invalid [in] argument
+	(*chunks)++;
+	return 0;
+}
 
-	// Get the size of the input volume, but it's not the end of the world if we can't
-	result = volume_size(volume, &size);
-	if(result != 0) { UI_WARNING("Unable to determine input device size, progress indicator will not work\n"); }
+//-----------------------------------------------------------------------------
+// backup_dump_sparse_fill (private)
+//
+// Emits a fill chunk into a sparse dump output file; restore writes the fill
+// value into every 32-bit word of the blocks
+//
+// Arguments:
+//
+//	fd				- Output file descriptor
+//	gz				- Output GZIP stream, or Z_NULL to write to fd directly
+//	blocks			- Number of blocks to fill
+//	fill			- 32-bit fill value
+//	chunks			- Running chunk count to be incremented
 
-	// Allocate the buffer memory
-	buffer = malloc(BUFFER_SIZE);
-	if(!buffer) { 
+static int backup_dump_sparse_fill(int fd, gzFile gz, u32 blocks, u32 fill, u32* chunks)
+{
+	chunk_header_t 		chunk;				// Sparse image chunk header
+	
+	chunk.chunk_type = CHUNK_TYPE_FILL;
+	chunk.reserved1 = 0;
+	chunk.chunk_sz = blocks;
+	chunk.total_sz = sizeof(chunk_header_t) + sizeof(u32);
+	
+	if(backup_dump_sparse_write(fd, gz, &chunk, sizeof(chunk_header_t)) != 0) return -1;
+	if(backup_dump_sparse_write(fd, gz, &fill, sizeof(u32)) != 0) return -1;
+	
+	(*chunks)++;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// backup_estimate_yaffs2
+//
+// Estimates the size of, and time required to create, a YAFFS2 image of a volume
+//
+// Arguments:
+//
+//	directory		- Directory to be backed up
+//	gzip			- Flag if the image file will be compressed with GZIP
+//	estimate		- Receives the backup estimate
+
+int backup_estimate_yaffs2(const char* directory, int gzip, backup_estimate* estimate)
+{
+	// Invoke the private version with a NULL callback structure
+	return backup_estimate_yaffs2_ui(directory, gzip, estimate, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// backup_estimate_yaffs2_ui
+//
+// Estimates the size of, and time required to create, a YAFFS2 image of a volume.
+// The directory tree is walked to determine the exact size of the uncompressed
+// image, and evenly spaced blocks of file data are read and compressed to measure
+// the compression ratio and the read/compress throughput of the volume
+//
+// Arguments:
+//
+//	directory		- Directory to be backed up
+//	gzip			- Flag if the image file will be compressed with GZIP
+//	estimate		- Receives the backup estimate
+//	callbacks		- Optional UI callbacks for progress and messages
+
+int backup_estimate_yaffs2_ui(const char* directory, int gzip, backup_estimate* estimate, 
+	ui_callbacks* callbacks)
+{
+	ESTIMATE_STATE		state;				// Estimation state
+	struct timeval		start, end;			// Directory walk start and end times
+	unsigned long long	walk_us;			// Elapsed directory walk time
+	unsigned long long	metadata;			// Bytes of YAFFS2 metadata in the image
+	int 				result;				// Result from function call
+	
+	USES_UI_CALLBACKS(callbacks);
+	
+	if(directory == NULL) return EINVAL;		// Invalid [in] argument
+	if(estimate == NULL) return EINVAL;			// Invalid [out] argument
+	
+	memset(estimate, 0, sizeof(backup_estimate));
+	memset(&state, 0, sizeof(ESTIMATE_STATE));
+	
+	// Walk the directory tree to size the image, which also measures the per-object
+	// overhead of the backup since the same lstat() calls are made by mkyaffs2image
+	gettimeofday(&start, NULL);
+	backup_estimate_walk(&state, directory);
+	gettimeofday(&end, NULL);
+	
+	walk_us = ((unsigned long long)(end.tv_sec - start.tv_sec) * 1000000) + (end.tv_usec - start.tv_usec);
+	
+	// The amount of file data determines the distance between samples
+	state.gzip = gzip;
+	state.step = state.databytes / ESTIMATE_MAX_SAMPLES;
+	if(state.step < ESTIMATE_SAMPLE_SIZE) state.step = ESTIMATE_SAMPLE_SIZE;
+	state.nextsample = state.step / 2;
+	
+	// Compressed samples use the same compression level as the image file itself
+	result = deflateInit2(&state.zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+	if(result != Z_OK) { UI_ERROR("Cannot initialize zlib deflate stream\n"); return ENOMEM; }
+	
+	state.cbmaxout = deflateBound(&state.zstream, ESTIMATE_SAMPLE_SIZE);
+	state.in = (unsigned char*)malloc(ESTIMATE_SAMPLE_SIZE);
+	state.out = (unsigned char*)malloc(state.cbmaxout);
+	
+	if((state.in == NULL) || (state.out == NULL)) {
 		
-		UI_ERROR("Unable to allocate data buffer. EC = %d\n", errno); 
-		return errno; 
+		UI_ERROR("Cannot allocate estimation buffers\n");
+		free(state.out);
+		free(state.in);
+		deflateEnd(&state.zstream);
+		return ENOMEM;
 	}
 	
-	// Attempt to open the input device first
-	source = open(volume->device, O_RDONLY);
-	if(source < 0) { 
+	// Walk the directory tree again to sample the file data
+	if(state.databytes > 0) backup_estimate_walk(&state, directory);
+	
+	free(state.out);
+	free(state.in);
+	deflateEnd(&state.zstream);
+	
+	// The uncompressed image has one header page per object plus the file data pages
+	estimate->source_bytes = state.databytes;
+	estimate->image_bytes = state.pages * (ESTIMATE_YAFFS2_CHUNK + ESTIMATE_YAFFS2_SPARE);
+	estimate->output_bytes = estimate->image_bytes;
+	
+	// The file data compresses at the sampled ratio; the headers and spare areas are mostly
+	// padding and compress far better than that, but they can't be sampled the same way
+	if((gzip) && (state.sampledin > 0)) {
 		
-		UI_ERROR("Cannot open input device %s for read. EC = %d\n", volume->device, errno);
-		free(buffer);
-		return errno;
+		metadata = estimate->image_bytes - state.databytes;
+		estimate->output_bytes = ((state.databytes * state.sampledout) / state.sampledin) + (metadata / ESTIMATE_METADATA_RATIO);
 	}
 	
-	// Now attempt to open the output file with gzip, specifying no compression as applicable
-	dest = gzopen(imgfile, (gzip) ? "wb" : "wb0");
-	if(dest == Z_NULL) {
+	estimate->output_bytes += (estimate->output_bytes * ESTIMATE_MARGIN_PERCENT) / 100;
+	
+	// The duration is the cost of visiting every object plus reading (and compressing) all of the data
+	estimate->duration_ms = (unsigned long)(walk_us / 1000);
+	if(state.sampledin > 0) estimate->duration_ms += (unsigned long)(((state.read_us + state.compress_us) * 
+		(state.databytes / 1000)) / state.sampledin);
+	
+	estimate->samples = state.samples;
+	
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// backup_estimate_sample (private)
+//
+// Reads and compresses a single block of file data for the estimation pass
+//
+// Arguments:
+//
+//	state			- Estimation state
+//	filename		- File to be sampled
+//	offset			- Offset of the sample within the file
+
+static void backup_estimate_sample(ESTIMATE_STATE* state, const char* filename, unsigned long long offset)
+{
+	int 				fd;					// Sampled file descriptor
+	ssize_t 			cbread;				// Bytes read from the file
+	struct timeval		start, mid, end;	// Sample timestamps
+	
+	fd = open(filename, O_RDONLY);
+	if(fd < 0) return;
+	
+	gettimeofday(&start, NULL);
+	cbread = pread64(fd, state->in, ESTIMATE_SAMPLE_SIZE, (off64_t)offset);
+	gettimeofday(&mid, NULL);
+	close(fd);
+	
+	if(cbread <= 0) return;
+	
+	// Compress the sample into a scratch buffer; only the resultant size is of interest
+	state->zstream.next_in = state->in;
+	state->zstream.avail_in = (uInt)cbread;
+	state->zstream.next_out = state->out;
+	state->zstream.avail_out = state->cbmaxout;
+	
+	if(state->gzip) {
 		
-		UI_ERROR("Cannot open output file %s for write. EC = %d\n", imgfile, errno);
-		close(source);
-		free(buffer);
-		return errno;
+		deflate(&state->zstream, Z_FINISH);
+		state->sampledout += state->zstream.total_out;
+		deflateReset(&state->zstream);
 	}
 	
-	// Move the data ....
-	cbread = read(source, buffer, BUFFER_SIZE);
-	while(cbread > 0) {
+	gettimeofday(&end, NULL);
 	
-		totalread += cbread;				// Tack on the number of bytes read
+	state->samples++;
+	state->sampledin += cbread;
+	state->read_us += ((unsigned long long)(mid.tv_sec - start.tv_sec) * 1000000) + (mid.tv_usec - start.tv_usec);
+	state->compress_us += ((unsigned long long)(end.tv_sec - mid.tv_sec) * 1000000) + (end.tv_usec - mid.tv_usec);
+}
+
+//-----------------------------------------------------------------------------
+// backup_estimate_walk (private)
+//
+// Recursively walks a directory tree for the estimation pass.  Until the sample
+// spacing has been set the image is sized, otherwise any file data that lies on
+// the next sample offset is sampled
+//
+// Arguments:
+//
+//	state			- Estimation state
+//	directory		- Directory to be walked
+
+static void backup_estimate_walk(ESTIMATE_STATE* state, const char* directory)
+{
+	DIR*				dir;				// Directory being walked
+	struct dirent*		entry;				// Directory entry
+	char 				fullname[PATH_MAX];	// Full path to the directory entry
+	struct stat 		stats;				// Directory entry information
+	unsigned long long	size;				// Size of a regular file
+	
+	dir = opendir(directory);
+	if(dir == NULL) return;
+	
+	while((entry = readdir(dir)) != NULL) {
 		
-		// Write the buffer to the output file, and break the loop on an error
-		result = gzwrite(dest, buffer, cbread);
-		if(result < cbread) { 
+		if((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) continue;
+		
+		snprintf(fullname, PATH_MAX, "%s/%s", directory, entry->d_name);
+		if(lstat(fullname, &stats) != 0) continue;
+		
+		if(S_ISDIR(stats.st_mode)) backup_estimate_walk(state, fullname);
+		if(!S_ISREG(stats.st_mode)) size = 0;
+		else size = (unsigned long long)stats.st_size;
+		
+		// Sizing: every object gets a header page in the image, plus the file data pages
+		if(state->step == 0) {
 			
-			UI_ERROR("Unable to write data to output file %s. EC = %d\n", imgfile, errno);
-			badthings = -1;
-			break;
+			state->objects++;
+			state->pages += 1 + ((size + ESTIMATE_YAFFS2_CHUNK - 1) / ESTIMATE_YAFFS2_CHUNK);
+			state->databytes += size;
+			continue;
 		}
 		
-		// If we know the size of the output device, we can provide a progress status
-		if(size > 0) UI_SETPROGRESS((float)(totalread * 100) / (float)size);
-		
-		cbread = read(source, buffer, BUFFER_SIZE);		// Read next block of data
-	}
-	
-	if(cbread < 0) { 
+		// Sampling: take a sample for each sample offset that falls within this file
+		while((state->nextsample < state->position + size) && (state->samples < ESTIMATE_MAX_SAMPLES)) {
+			
+			backup_estimate_sample(state, fullname, (state->nextsample - state->position) & ~((unsigned long long)4095));
+			state->nextsample += state->step;
+		}
 		
-		UI_ERROR("Unable to read data from input volume %s. EC = %d.\n", volume->device, errno); 
-		badthings = -1;
+		state->position += size;
 	}
 	
-	gzclose(dest);								// Close the output file
-	close(source);								// Close the input volume
-	free(buffer);								// Release buffer memory
-	
-	return (badthings) ? -1 : 0;
+	closedir(dir);
 }
 
 //-----------------------------------------------------------------------------
@@ -256,6 +1661,7 @@ static int backup_ext4_internal(const Volume* volume, const char* imgfile,
 	ui_callbacks* callbacks, int gzip, int sparse)
 {
 	unsigned long long	size;				// Size of the source volume
+	long 				cpus;				// Number of online processors
 	int 				result;				// Result from function call
 	
 	USES_UI_CALLBACKS(callbacks);
@@ -279,6 +1685,11 @@ static int backup_ext4_internal(const Volume* volume, const char* imgfile,
 	info.ui_stdout = callbacks->uiprint;
 	info.ui_progress = callbacks->progress;
 	
+	// Sparse images are written by a pool of worker threads; one per processor,
+	// but always at least two so that reading and deflating overlap
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	info.threads = (cpus < 2) ? 2 : (u32)cpus;
+	
 	// Create the EXT4 file system image
 	result = make_ext4fs(imgfile, volume->mount_point, (char*)volume->mount_point, 1, gzip, sparse);
 	
@@ -318,86 +1729,33 @@ int backup_yaffs2(const char* directory, const char* imgfile, int gzip)
 int backup_yaffs2_ui(const char* directory, const char* imgfile, int gzip, 
 	ui_callbacks* callbacks)
 {
-	int 				files = 0;			// Number of files on volume
-	int 				result;				// Result from function call
-	
-	USES_UI_CALLBACKS(callbacks);
-	
 	if(directory == NULL) return EINVAL;		// Invalid [in] argument
 	if(imgfile == NULL) return EINVAL;			// Invalid [in] argument
 
-	// mkyaffs2image has a callback that indicates the file name being processed,
-	// but this recovery uses a percent complete indicator.  Rather than modify
-	// mkyaffs2image like I did with ext4_utils, since I have nothing else to change
-	// in there, I'm opting to just count the files up front and deal with it 
-	// via a simple custom callback here (For now, at least - I may change my mind,
-	// especially since I want to add native gzip functionality to it)
-	
-	result = mkyaffs2_countfiles(directory, &files);
-	if(result != 0) { UI_WARNING("Unable to determine file count for directory %s, progress will not be shown\n", directory); }
-	
-	g_yaffs_filecount = files;						// Set global callback variable
-	g_yaffs_filesprocessed = 0;						// Set global callback variable
-	g_yaffs_uicallbacks = callbacks;				// Set global callback variable
-	
-	// Create the YAFFS2 file system image
-	result = mkyaffs2image((char*)directory, (char*)imgfile, 0, mkyaffs2_callback, gzip);
-	
-	g_yaffs_filecount = 0;							// Reset global callback variable
-	g_yaffs_filesprocessed = 0;						// Reset global callback variable
-	g_yaffs_uicallbacks = NULL;						// Reset global callback variable
-
-	return result;
+	// The parallel version of mkyaffs2image walks the directory tree only once and
+	// reports progress in bytes of the image, so there's no need to count the files
+	// up front anymore.  The file contents are read on a small pool of threads
+	return mkyaffs2image_parallel((char*)directory, (char*)imgfile, 0, YAFFS2_READ_THREADS, 
+		mkyaffs2_progress, callbacks, gzip);
 }
 
-// this might stay; part of the callback solution for mkyaffs2image
-static void mkyaffs2_callback(char* filename)
-{
-	(filename);						// UNREFERENCED VARIABLE
-	
-	USES_UI_CALLBACKS(g_yaffs_uicallbacks);
-
-	if(g_yaffs_filecount <= 0) return;		// Avoid division by zero
-	
-	g_yaffs_filesprocessed++;
-	UI_SETPROGRESS((float)(g_yaffs_filesprocessed * 100) / (float)g_yaffs_filecount);
-}
+//-----------------------------------------------------------------------------
+// mkyaffs2_progress (private)
+//
+// Progress callback for mkyaffs2image_parallel
+//
+// Arguments:
+//
+//	done			- Bytes of the image that have been written
+//	total			- Total size of the image
+//	context			- UI callbacks (ui_callbacks*)
 
-// this might stay; part of the callback solution for mkyaffs2image
-static int mkyaffs2_countfiles(const char* directory, int* count)
+static void mkyaffs2_progress(unsigned long long done, unsigned long long total, void* context)
 {
-	DIR 			*dir;				// Directory to count files from
-	struct dirent 	*entry;				// dirent file information
-	
-	if(!count) return -1;
-
-	dir = opendir(directory);
-	if(dir)
-	{
-		while((entry = readdir(dir)) != NULL)
-		{
-			// Ignore . and ..
-			if(strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
- 			{
- 				char full_name[PATH_MAX];
-				struct stat stats;
-				
-				sprintf(full_name, "%s/%s", directory, entry->d_name);
-				lstat(full_name, &stats);
-				
-				if(S_ISLNK(stats.st_mode) || S_ISREG(stats.st_mode) || S_ISDIR(stats.st_mode) || S_ISFIFO(stats.st_mode) || 
-					S_ISBLK(stats.st_mode) || S_ISCHR(stats.st_mode) || S_ISSOCK(stats.st_mode)) {
-
-					(*count)++;
-					if(S_ISDIR(stats.st_mode)) mkyaffs2_countfiles(full_name, count);
-				}
-			}
-		}
+	USES_UI_CALLBACKS((ui_callbacks*)context);
 
-		closedir(dir);
-	}
-	
-	return 0;
+	if(total == 0) return;					// Avoid division by zero
+	UI_SETPROGRESS((float)(done * 100) / (float)total);
 }
 
 //-----------------------------------------------------------------------------
\ No newline at end of file
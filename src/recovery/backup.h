@@ -29,6 +29,30 @@
 #include "callbacks.h"				// Include CALLBACKS declarations
 #include "volume.h"					// Include VOLUME declarations
 
+//-----------------------------------------------------------------------------
+// DATA TYPES
+//-----------------------------------------------------------------------------
+
+// backup_estimate
+//
+// Predicted cost of a backup operation
+//
+//	source_bytes	- Bytes of data to be read from the source
+//	image_bytes		- Size of the uncompressed image
+//	output_bytes	- Predicted size of the output file
+//	duration_ms		- Predicted duration of the backup, in milliseconds
+//	samples			- Number of data samples the prediction is based on
+//
+typedef struct {
+
+	unsigned long long	source_bytes;
+	unsigned long long	image_bytes;
+	unsigned long long	output_bytes;
+	unsigned long		duration_ms;
+	int 				samples;
+
+} backup_estimate;
+
 //-----------------------------------------------------------------------------
 // FUNCTION PROTOTYPES
 //-----------------------------------------------------------------------------
@@ -39,6 +63,27 @@ int backup_dump(const Volume* volume, const char* imgfile, int gzip);
 // Create a dump file from the specified volume, with a UI status callback
 int backup_dump_ui(const Volume* volume, const char* imgfile, int gzip, ui_callbacks* callbacks);
 
+// Create a sparse dump file from the specified volume
+int backup_dump_sparse(const Volume* volume, const char* imgfile, int gzip);
+
+// Create a sparse dump file from the specified volume, with a UI status callback
+int backup_dump_sparse_ui(const Volume* volume, const char* imgfile, int gzip, ui_callbacks* callbacks);
+
+// Create an incremental sparse dump file from the specified volume
+int backup_dump_incremental(const Volume* volume, const char* imgfile, const char* basemanifest, 
+	const char* manifest, int gzip);
+
+// Create an incremental sparse dump file from the specified volume, with a UI status callback
+int backup_dump_incremental_ui(const Volume* volume, const char* imgfile, const char* basemanifest, 
+	const char* manifest, int gzip, ui_callbacks* callbacks);
+
+// Estimate the size and duration of a YAFFS2 image of the specified directory
+int backup_estimate_yaffs2(const char* directory, int gzip, backup_estimate* estimate);
+
+// Estimate the size and duration of a YAFFS2 image of the specified directory, with a UI status callback
+int backup_estimate_yaffs2_ui(const char* directory, int gzip, backup_estimate* estimate, 
+	ui_callbacks* callbacks);
+
 // Create an EXT4 image file from the specified volume
 int backup_ext4(const Volume* volume, const char* imgfile, int gzip);
 
@@ -32,6 +32,7 @@
 #include <time.h>						// Include TIME declarations
 #include <dirent.h>						// Include DIRENT declarations
 #include <fnmatch.h>					// Include FNMATCH declarations
+#include <pthread.h>					// Include PTHREAD declarations
 #include <diskconfig/diskconfig.h>		// Include DISKCONFIG declarations
 #include <zlib.h>						// Include ZLIB declarations
 #include "common.h"						// Include COMMON declarations
@@ -39,6 +40,8 @@
 #include "ui.h"							// Include UI declarations
 #include "exec.h"						// Include EXEC declarations
 #include "volume.h"						// Include VOLUME declarations
+#include "scheduler.h"					// Include SCHEDULER declarations
+#include "store.h"						// Include STORE declarations
 #include "backup.h"						// Include BACKUP declarations
 #include "restore.h"					// Include RESTORE declarations
 #include "install.h"					// Include INSTALL declarations
@@ -64,6 +67,21 @@ static char CONVERT_TEMP_FILE[]	= "/sdcard/__convert_temp.img";
 // VOLUME_BACKUP_PATH - Path to use when backing up volumes
 static char VOLUME_BACKUP_PATH[] = "/sdcard/backup/volume";
 
+// STORE_PATH - Path to the chunk store used by deduplicated backups
+static char STORE_PATH[] = "/sdcard/backup/store";
+
+// STORE_LIST_ROOT - Path that contains every chunk list referring to the chunk store
+static char STORE_LIST_ROOT[] = "/sdcard/backup";
+
+// INCREMENTAL_BASE_FILE - File in an incremental device backup naming its base backup
+static char INCREMENTAL_BASE_FILE[] = "BASE";
+
+// INCREMENTAL_MANIFEST_EXT - Extension of the incremental device backup manifests
+static char INCREMENTAL_MANIFEST_EXT[] = "manifest";
+
+// INCREMENTAL_MAX_CHAIN - Maximum number of backups in an incremental chain
+#define INCREMENTAL_MAX_CHAIN			32
+
 //-----------------------------------------------------------------------------
 // PRIVATE TYPE DECLARATIONS
 //-----------------------------------------------------------------------------
@@ -91,18 +109,33 @@ static const cmd_backup_method_info g_backup_method_info[] = {
 	{ ext4_sparse,	"ext4 sparse image", 	"simg",		"szimg"		},
 	{ dump,			"raw dump",				"img",		"img.gz"	},
 	{ yaffs2,		"yaffs2 image",			"yimg",		"yimg.gz" 	},
+	{ dump_sparse,	"sparse raw dump",		"sdimg",	"szdimg"	},
+	{ store,		"deduplicated store",	"chunks",	"chunks"	},
 };
 
+// Serializes mount_volume/unmount_volume between the device backup job threads
+static pthread_mutex_t g_backup_device_mount_lock = PTHREAD_MUTEX_INITIALIZER;
+
 //-----------------------------------------------------------------------------
 // PRIVATE FUNCTION PROTOTYPES
 //-----------------------------------------------------------------------------
 
+// Backs up a single volume as part of a device backup
+static int cmd_backup_device_job(const Volume* volume, void* context, ui_callbacks* callbacks);
+
+// Estimates the output size and duration of a device backup
+static int cmd_estimate_device_backup(volume_job* jobs, int numjobs, const Volume* destvol, 
+	unsigned long long* required, unsigned long long* available);
+
 // Generates the paths for backup operations
 static int cmd_gen_volume_backup_path(const char* volname, const char* ext, char* out, size_t cch);
 
 // Generates the paths for backup operations
 static int cmd_gen_device_backup_path(char* out, size_t cch);
 
+// Reads the base backup path of an incremental device backup
+static int cmd_read_incremental_base(const char* backuppath, char* out, size_t cch);
+
 // Attempts to determine the type of an image file
 static int cmd_restore_divine_method(const char* srcpath, cmd_backup_method* method);
 
@@ -121,14 +154,18 @@ static void cmd_restore_volume_yaffs2(const char* srcpath, const Volume* destvol
 void cmd_backup_device(void)
 {
 	char 				destpath[PATH_MAX];	// Backup destination path
+	char 				logfile[PATH_MAX];	// Backup log file path
 	const Volume*		destvol;			// Destination volume
 	int 				destmounted = 0;	// Flag if dest volume was mounted
-	int 				srcmounted = 0;		// Flag if source volume was mounted
-	char 				imgfile[256];		// Image file name
 	const Volume*		iterator;			// Volume iterator
 	ui_callbacks		callbacks;			// UI callbacks for backup operations
 	struct statfs 		volstats;			// Volume statistics
-	unsigned long long	totalbytes = 0;		// Total bytes to be backed up
+	volume_job*			jobs;				// Volume backup jobs
+	int 				numjobs = 0;		// Number of volume backup jobs
+	unsigned long long	required;			// Estimated size of the backup
+	unsigned long long	available;			// Free space on the destination volume
+	FILE*				log;				// Backup log file
+	int 				index;				// Loop index variable
 	int 				result;				// Result from function call
 	
 	// Clear any currently displayed UI text and initialize the callbacks 
@@ -144,20 +181,47 @@ void cmd_backup_device(void)
 	destvol = get_volume_for_path(destpath);
 	if(destvol == NULL) { LOGE("cmd_backup_device: Cannot locate volume for path %s\n", destpath); return; }
 	
-	// Make a first pass over all of the volumes to be backed up to determine what % of the backup each volume
-	// takes up, and also check to make sure that the destination volume isn't one of them
+	// Count the volumes to be backed up so the job array can be allocated
+	iterator = foreach_volume(NULL);
+	while(iterator != NULL) {
+		
+		if(*iterator->dump == '1') numjobs++;
+		iterator = foreach_volume(iterator);				// Move to the next volume
+	}
+	
+	if(numjobs == 0) { LOGE("cmd_backup_device: There are no volumes marked for backup\n"); return; }
+	
+	jobs = (volume_job*)calloc(numjobs, sizeof(volume_job));
+	if(jobs == NULL) { LOGE("cmd_backup_device: Cannot allocate volume job array\n"); return; }
+	
+	// Make a first pass over all of the volumes to be backed up to determine the size of
+	// each job, and also check to make sure that the destination volume isn't one of them
+	numjobs = 0;
 	iterator = foreach_volume(NULL);
 	while(iterator != NULL) {
 		
 		if(*iterator->dump == '1') {
 			
 			// Check that DEST is not one of the SOURCE volumes
-			if(iterator == destvol) { LOGE("cmd_backup_device: Volume %s cannot be both a source and destination volume", destvol->name); return; }
+			if(iterator == destvol) { 
+				
+				LOGE("cmd_backup_device: Volume %s cannot be both a source and destination volume", destvol->name);
+				free(jobs); 
+				return; 
+			}
 			
-			// Get stats for the volume and add it's size to the total byte count
+			// Get stats for the volume and use the used byte count as the job weight
 			result = volume_stats(iterator, &volstats);
-			if(result != 0) { LOGE("cmd_backup_device: Cannot get stats for volume %s", iterator->name); return; }
-			totalbytes += (volstats.f_bsize * (volstats.f_blocks - volstats.f_bfree));
+			if(result != 0) { 
+				
+				LOGE("cmd_backup_device: Cannot get stats for volume %s", iterator->name); 
+				free(jobs); 
+				return; 
+			}
+			
+			jobs[numjobs].volume = iterator;
+			jobs[numjobs].weight = ((unsigned long long)volstats.f_bsize * (volstats.f_blocks - volstats.f_bfree));
+			numjobs++;
 		}
 	
 		iterator = foreach_volume(iterator);				// Move to the next volume
@@ -169,7 +233,27 @@ void cmd_backup_device(void)
 	
 	// Mount the destination volume
 	result = mount_volume(destvol, &destmounted);
-	if(result != 0) { LOGE("cmd_backup_device: Cannot mount destination volume %s. EC = %d\n", destvol->name, result); return; }
+	if(result != 0) { 
+		
+		LOGE("cmd_backup_device: Cannot mount destination volume %s. EC = %d\n", destvol->name, result); 
+		free(jobs); 
+		return; 
+	}
+	
+	// Estimate the size of the backup before anything is written, it's far better to
+	// find out now that it won't fit than after most of the volumes have been backed up
+	ui_print("Estimating backup size...\n\n");
+	result = cmd_estimate_device_backup(jobs, numjobs, destvol, &required, &available);
+	if(result != 0) {
+		
+		if(result == ENOSPC) LOGE("cmd_backup_device: Not enough free space on %s. Backup requires %lluMB, %lluMB available\n",
+			destvol->name, required >> 20, available >> 20);
+		else LOGE("cmd_backup_device: Cannot estimate backup size. EC = %d\n", result);
+		
+		if(destmounted != 0) unmount_volume(destvol, NULL);
+		free(jobs);
+		return;
+	}
 	
 	// Create the destination folder
 	result = dirCreateHierarchy(destpath, 0777, NULL, 0);
@@ -177,10 +261,134 @@ void cmd_backup_device(void)
 		
 		LOGE("cmd_backup_device: Cannot create destination folder %s. EC = %d\n", destpath, errno);
 		if(destmounted != 0) unmount_volume(destvol, NULL);
+		free(jobs);
 		return;
 	}
 	
+	// The backup log receives the throughput of each volume; it's not fatal if it can't be created
+	snprintf(logfile, PATH_MAX, "%s/backup.log", destpath);
+	log = fopen(logfile, "w");
+	if(log == NULL) { LOGW("cmd_backup_device: Cannot create backup log %s. EC = %d\n", logfile, errno); }
+	
 	ui_print("Backing up device...\n\n");
+	ui_show_progress(1.0, 0);
+	
+	// Back up all of the volumes.  Volumes that live on independent physical devices are
+	// backed up concurrently, and their progress is combined into the single progress bar
+	result = schedule_volume_jobs(jobs, numjobs, cmd_backup_device_job, destpath, log, &callbacks);
+	
+	for(index = 0; index < numjobs; index++) {
+		
+		if(jobs[index].result != 0) LOGE("cmd_backup_device: Unable to backup volume %s.  EC = %d\n", 
+			jobs[index].volume->name, jobs[index].result);
+	}
+	
+	//
+	// TODO: /sdcard/Android and /sdcard/.android_secure
+	//
+	
+	if(log != NULL) fclose(log);
+	free(jobs);
+	
+	// If the destination volume was mounted by this function, unmount it
+	if(destmounted != 0) unmount_volume(destvol, NULL);
+	
+	ui_reset_progress();								// Remove the progress bar
+	
+	ui_print("\n");
+	if(result == 0) ui_print("> Device backed up successfully.\n");		// Done
+	else ui_print("> Device backup completed with errors.\n");
+}
+
+//-----------------------------------------------------------------------------
+// cmd_backup_device_incremental
+//
+// Creates an incremental block-level backup of the entire device.  Each volume
+// marked DUMP is written as a sparse dump containing only the chunks that have
+// changed since the base backup, along with a block hash manifest that allows
+// this backup to serve as the base for the next one.  The path of the base
+// backup is recorded in the backup folder so the chain can be restored
+//
+// Arguments:
+//
+//	basepath	- Path to the base device backup, or NULL for a full backup
+
+void cmd_backup_device_incremental(const char* basepath)
+{
+	char 				destpath[PATH_MAX];	// Backup destination path
+	const Volume*		destvol;			// Destination volume
+	int 				destmounted = 0;	// Flag if dest volume was mounted
+	int 				srcunmounted = 0;	// Flag if source volume was unmounted
+	char 				imgfile[PATH_MAX];	// Image file name
+	char 				manifest[PATH_MAX];	// Manifest file name
+	char 				basemanifest[PATH_MAX];	// Base manifest file name
+	const Volume*		iterator;			// Volume iterator
+	ui_callbacks		callbacks;			// UI callbacks for backup operations
+	unsigned long long	volsize;			// Volume size
+	unsigned long long	totalbytes = 0;		// Total bytes to be read
+	FILE*				basefile;			// Base backup path file
+	int 				failed = 0;			// Flag if any volume failed
+	int 				result;				// Result from function call
+	
+	// Clear any currently displayed UI text and initialize the callbacks 
+	ui_clear_text();	
+	init_ui_callbacks(&callbacks, &ui_print, &ui_set_progress);
+
+	// Figure out where the backup is going to go
+	result = cmd_gen_device_backup_path(destpath, PATH_MAX);
+	if(result != 0) { LOGE("cmd_backup_device_incremental: Cannot generate device backup output path"); return; }
+	
+	// Determine what the destination volume will be and make sure it's not the
+	// same as the source volume ...
+	destvol = get_volume_for_path(destpath);
+	if(destvol == NULL) { LOGE("cmd_backup_device_incremental: Cannot locate volume for path %s\n", destpath); return; }
+	
+	// Make a first pass over all of the volumes to be backed up to determine what % of the backup each volume
+	// takes up, and also check to make sure that the destination volume isn't one of them.  Block-level
+	// backups read the entire device, so the raw volume size is used rather than the used space
+	iterator = foreach_volume(NULL);
+	while(iterator != NULL) {
+		
+		if(*iterator->dump == '1') {
+			
+			if(iterator == destvol) { LOGE("cmd_backup_device_incremental: Volume %s cannot be both a source and destination volume", destvol->name); return; }
+			
+			result = volume_size(iterator, &volsize);
+			if(result != 0) { LOGE("cmd_backup_device_incremental: Cannot get size of volume %s", iterator->name); return; }
+			totalbytes += volsize;
+		}
+	
+		iterator = foreach_volume(iterator);				// Move to the next volume
+	}
+	
+	// Mount the destination volume
+	result = mount_volume(destvol, &destmounted);
+	if(result != 0) { LOGE("cmd_backup_device_incremental: Cannot mount destination volume %s. EC = %d\n", destvol->name, result); return; }
+	
+	// Create the destination folder
+	result = dirCreateHierarchy(destpath, 0777, NULL, 0);
+	if(result != 0) { 
+		
+		LOGE("cmd_backup_device_incremental: Cannot create destination folder %s. EC = %d\n", destpath, errno);
+		if(destmounted != 0) unmount_volume(destvol, NULL);
+		return;
+	}
+	
+	// Record the base backup so that the restore can find the rest of the chain
+	if(basepath != NULL) {
+		
+		snprintf(imgfile, PATH_MAX, "%s/%s", destpath, INCREMENTAL_BASE_FILE);
+		basefile = fopen(imgfile, "w");
+		if((basefile == NULL) || (fprintf(basefile, "%s\n", basepath) < 0) || (fclose(basefile) != 0)) {
+			
+			LOGE("cmd_backup_device_incremental: Cannot write base backup file %s. EC = %d\n", imgfile, errno);
+			if(destmounted != 0) unmount_volume(destvol, NULL);
+			return;
+		}
+	}
+	
+	if(basepath != NULL) ui_print("Backing up device (incremental from %s)...\n\n", basepath);
+	else ui_print("Backing up device (full)...\n\n");
 	
 	// Iterate over all of the FSTAB volumes and back up each one marked DUMP
 	iterator = foreach_volume(NULL);
@@ -191,40 +399,83 @@ void cmd_backup_device(void)
 			ui_print("    > Backing up %s\n", iterator->name);
 				
 			// Determine what % of the total operation this volume is and set the progress bar portion
-			result = volume_stats(iterator, &volstats);
-			if(result != 0) { LOGW("cmd_backup_device: Cannot get stats for volume %s; progress will be inaccurate", iterator->name); }
-			else ui_show_progress((float)(volstats.f_bsize * (volstats.f_blocks - volstats.f_bfree)) / (float)totalbytes, 0); 
+			result = volume_size(iterator, &volsize);
+			if((result == 0) && (totalbytes > 0)) ui_show_progress((float)volsize / (float)totalbytes, 0);
 			
-			// Mount the source volume
-			result = mount_volume(iterator, &srcmounted);
+			// The volume is read at the block level, it must not be mounted while that happens
+			result = unmount_volume(iterator, &srcunmounted);
 			if(result == 0) {
 				
-				// Back the volume up
-				sprintf(imgfile, "%s/%s.%s", destpath, iterator->name, g_backup_method_info[yaffs2].compressed_extension);
-				result = backup_yaffs2_ui(iterator->mount_point, imgfile, 1, &callbacks);
-				if(result != 0) { LOGE("cmd_backup_device: Unable to backup volume %s.  EC = %d\n", iterator->name, result); }
+				snprintf(imgfile, PATH_MAX, "%s/%s.%s", destpath, iterator->name, g_backup_method_info[dump_sparse].compressed_extension);
+				snprintf(manifest, PATH_MAX, "%s/%s.%s", destpath, iterator->name, INCREMENTAL_MANIFEST_EXT);
+				if(basepath != NULL) snprintf(basemanifest, PATH_MAX, "%s/%s.%s", basepath, iterator->name, INCREMENTAL_MANIFEST_EXT);
+				
+				result = backup_dump_incremental_ui(iterator, imgfile, (basepath) ? basemanifest : NULL, manifest, 1, &callbacks);
+				if(result != 0) { LOGE("cmd_backup_device_incremental: Unable to backup volume %s.  EC = %d\n", iterator->name, result); failed = 1; }
 					
-				// If the source volume was mounted, unmount it before continuing
-				if(srcmounted != 0) unmount_volume(iterator, NULL);
+				// If the source volume was unmounted, remount it before continuing
+				if(srcunmounted != 0) mount_volume(iterator, NULL);
 			}
 				
-			else { LOGE("cmd_backup_device: Cannot mount volume %s for backup. EC = %d\n", iterator->name, result); }			
+			else { LOGE("cmd_backup_device_incremental: Cannot unmount volume %s for backup. EC = %d\n", iterator->name, result); failed = 1; }
 		}
 		
 		iterator = foreach_volume(iterator);		// Move to next volume
 	}
 	
-	//
-	// TODO: /sdcard/Android and /sdcard/.android_secure
-	//
-	
 	// If the destination volume was mounted by this function, unmount it
 	if(destmounted != 0) unmount_volume(destvol, NULL);
 	
 	ui_reset_progress();								// Remove the progress bar
 	
 	ui_print("\n");
-	ui_print("> Device backed up successfully.\n");		// Done
+	if(failed) ui_print("> Device backup incomplete.\n");
+	else ui_print("> Device backed up successfully to %s.\n", destpath);
+}
+
+//-----------------------------------------------------------------------------
+// cmd_backup_device_job (private)
+//
+// Backs up a single volume as part of a device backup.  This is executed by
+// schedule_volume_jobs on a job thread, so it must only use the callbacks, and
+// the mounted volumes table (not thread-safe) is only touched under a lock
+//
+// Arguments:
+//
+//	volume		- Volume to be backed up
+//	context		- Backup destination path (const char*)
+//	callbacks	- UI callbacks
+
+static int cmd_backup_device_job(const Volume* volume, void* context, ui_callbacks* callbacks)
+{
+	const char*			destpath = (const char*)context;	// Backup destination path
+	char 				imgfile[PATH_MAX];	// Image file name
+	int 				srcmounted = 0;		// Flag if source volume was mounted
+	int 				result;				// Result from function call
+	
+	USES_UI_CALLBACKS(callbacks);
+	
+	UI_PRINT("    > Backing up %s\n", volume->name);
+	
+	// Mount the source volume
+	pthread_mutex_lock(&g_backup_device_mount_lock);
+	result = mount_volume(volume, &srcmounted);
+	pthread_mutex_unlock(&g_backup_device_mount_lock);
+	if(result != 0) { UI_ERROR("Cannot mount volume %s for backup. EC = %d\n", volume->name, result); return result; }
+	
+	// Back the volume up
+	snprintf(imgfile, PATH_MAX, "%s/%s.%s", destpath, volume->name, g_backup_method_info[yaffs2].compressed_extension);
+	result = backup_yaffs2_ui(volume->mount_point, imgfile, 1, callbacks);
+	
+	// If the source volume was mounted, unmount it before continuing
+	if(srcmounted != 0) {
+	
+		pthread_mutex_lock(&g_backup_device_mount_lock);
+		unmount_volume(volume, NULL);
+		pthread_mutex_unlock(&g_backup_device_mount_lock);
+	}
+	
+	return result;
 }
 
 //-----------------------------------------------------------------------------
@@ -404,6 +655,18 @@ void cmd_backup_volume(const Volume* srcvol, cmd_backup_method method, int compr
 					result = backup_yaffs2_ui(srcvol->mount_point, imgfile, compress, &callbacks);
 					break;
 					
+				// SPARSE RAW DUMP
+				case dump_sparse:
+					ui_show_progress(1.0, 0);
+					result = backup_dump_sparse_ui(srcvol, imgfile, compress, &callbacks);
+					break;
+					
+				// DEDUPLICATED STORE (chunks are always compressed)
+				case store:
+					ui_show_progress(1.0, 0);
+					result = store_backup_ui(srcvol, STORE_PATH, imgfile, &callbacks);
+					break;
+					
 				default: { LOGE("cmd_backup_volume: Unknown backup method code\n"); result = -1; }
 			}
 			
@@ -433,6 +696,48 @@ void cmd_backup_volume(const Volume* srcvol, cmd_backup_method method, int compr
 	if(destmounted != 0) unmount_volume(destvol, NULL);
 }
 
+//-----------------------------------------------------------------------------
+// cmd_collect_store_garbage
+//
+// Removes chunks from the backup chunk store that are no longer referenced by
+// any chunk list file.  Chunk list files are deleted like any other backup
+// image, so this is the only way the space used by their chunks is recovered
+//
+// Arguments:
+//
+//	NONE
+
+void cmd_collect_store_garbage(void)
+{
+	const Volume*		storevol;			// Chunk store volume
+	int 				storemounted = 0;	// Flag if store volume was mounted
+	ui_callbacks 		callbacks;			// UI callbacks for store functions
+	int 				result;				// Result from function call
+	
+	ui_clear_text();					// Clear the UI
+	
+	// Locate and mount the volume that contains the chunk store
+	storevol = get_volume_for_path(STORE_PATH);
+	if(storevol == NULL) { LOGE("cmd_collect_store_garbage: Cannot locate volume for path %s\n", STORE_PATH); return; }
+	
+	result = mount_volume(storevol, &storemounted);
+	if(result != 0) { LOGE("cmd_collect_store_garbage: Cannot mount volume %s. EC = %d\n", storevol->name, result); return; }
+	
+	ui_print("Cleaning up backup store...\n\n");
+	init_ui_callbacks(&callbacks, &ui_print, &ui_set_progress);
+	
+	ui_show_progress(1.0, 0);
+	result = store_collect_garbage_ui(STORE_PATH, STORE_LIST_ROOT, &callbacks);
+	ui_reset_progress();
+	
+	// Unmount the store volume if it was mounted by this function
+	if(storemounted != 0) unmount_volume(storevol, NULL);
+	
+	ui_print("\n");
+	if(result == 0) ui_print("> Backup store cleaned up successfully.\n");
+	else ui_print("> Failed to clean up backup store. EC = %d\n", result);
+}
+
 //-----------------------------------------------------------------------------
 // cmd_convert_volume
 //
@@ -524,6 +829,88 @@ void cmd_convert_volume(const Volume* volume, const char* fs)
 	ui_reset_progress();				// Reset/hide the progress bar
 }
 
+//-----------------------------------------------------------------------------
+// cmd_estimate_device_backup (private)
+//
+// Estimates the output size and duration of a device backup by sampling each of
+// the volumes to be backed up, and verifies that the destination volume has room
+// for it.  Volumes on independent physical devices are backed up concurrently,
+// so the predicted duration is that of the busiest physical device
+//
+// Arguments:
+//
+//	jobs		- Volume backup jobs
+//	numjobs		- Number of volume backup jobs
+//	destvol		- Destination volume, must be mounted
+//	required	- Receives the estimated size of the backup
+//	available	- Receives the free space on the destination volume
+
+static int cmd_estimate_device_backup(volume_job* jobs, int numjobs, const Volume* destvol, 
+	unsigned long long* required, unsigned long long* available)
+{
+	backup_estimate		estimate;			// Estimate for a single volume
+	unsigned long*		durations;			// Estimated duration of each job
+	char 				device[PATH_MAX];	// Physical device of a job
+	char 				other[PATH_MAX];	// Physical device of another job
+	unsigned long		devduration;		// Estimated duration of a physical device
+	unsigned long		duration = 0;		// Estimated duration of the backup
+	struct statfs 		volstats;			// Destination volume statistics
+	ui_callbacks		callbacks;			// UI callbacks for estimate operations
+	int 				srcmounted;			// Flag if source volume was mounted
+	int 				index, inner;		// Loop index variables
+	int 				result;				// Result from function call
+	
+	*required = *available = 0;
+	
+	durations = (unsigned long*)calloc(numjobs, sizeof(unsigned long));
+	if(durations == NULL) return ENOMEM;
+	
+	init_ui_callbacks(&callbacks, &ui_print, &ui_set_progress);
+	
+	for(index = 0; index < numjobs; index++) {
+		
+		result = mount_volume(jobs[index].volume, &srcmounted);
+		if(result != 0) { free(durations); return result; }
+		
+		result = backup_estimate_yaffs2_ui(jobs[index].volume->mount_point, 1, &estimate, &callbacks);
+		if(srcmounted != 0) unmount_volume(jobs[index].volume, NULL);
+		if(result != 0) { free(durations); return result; }
+		
+		ui_print("    > %-10s %6lluMB -> %6lluMB  %lu:%02lu\n", jobs[index].volume->name, estimate.source_bytes >> 20,
+			estimate.output_bytes >> 20, (estimate.duration_ms / 60000), (estimate.duration_ms / 1000) % 60);
+		
+		*required += estimate.output_bytes;
+		durations[index] = estimate.duration_ms;
+	}
+	
+	// Sum the durations of the jobs on each physical device, the longest one is the total
+	for(index = 0; index < numjobs; index++) {
+		
+		if(volume_physical_device(jobs[index].volume, device, PATH_MAX) != 0) snprintf(device, PATH_MAX, "%d", index);
+		
+		devduration = 0;
+		for(inner = 0; inner < numjobs; inner++) {
+			
+			if(volume_physical_device(jobs[inner].volume, other, PATH_MAX) != 0) snprintf(other, PATH_MAX, "%d", inner);
+			if(strcmp(device, other) == 0) devduration += durations[inner];
+		}
+		
+		if(devduration > duration) duration = devduration;
+	}
+	
+	free(durations);
+	
+	result = volume_stats(destvol, &volstats);
+	if(result != 0) return result;
+	
+	*available = (unsigned long long)volstats.f_bsize * volstats.f_bavail;
+	
+	ui_print("\nEstimated size : %lluMB (%lluMB free)\n", *required >> 20, *available >> 20);
+	ui_print("Estimated time : %lu:%02lu\n\n", (duration / 60000), (duration / 1000) % 60);
+	
+	return (*required > *available) ? ENOSPC : 0;
+}
+
 //-----------------------------------------------------------------------------
 // cmd_format_volume
 //
@@ -693,6 +1080,41 @@ int cmd_gen_device_backup_path(char* out, size_t cch)
 	return 0;
 }
 
+//-----------------------------------------------------------------------------
+// cmd_read_incremental_base (private)
+//
+// Reads the base backup path recorded in an incremental device backup
+//
+// Arguments:
+//
+//	backuppath	- Path to the device backup
+//	out 		- Output string, receives an empty string for a full backup
+//	cch			- Length of output buffer, in characters
+
+static int cmd_read_incremental_base(const char* backuppath, char* out, size_t cch)
+{
+	char 				basefile[PATH_MAX];	// Base backup path file
+	FILE*				file;				// Open base backup path file
+	size_t 				len;				// Length of the base path
+	
+	if((out == NULL) || (cch <= 0)) return EINVAL;
+	*out = '\0';
+	
+	// A backup without a BASE file is a full backup and ends the chain
+	snprintf(basefile, PATH_MAX, "%s/%s", backuppath, INCREMENTAL_BASE_FILE);
+	file = fopen(basefile, "r");
+	if(file == NULL) return (errno == ENOENT) ? 0 : errno;
+	
+	if(fgets(out, cch, file) == NULL) *out = '\0';
+	fclose(file);
+	
+	// Strip the trailing newline
+	len = strlen(out);
+	while((len > 0) && ((out[len - 1] == '\n') || (out[len - 1] == '\r'))) out[--len] = '\0';
+	
+	return (len > 0) ? 0 : EINVAL;
+}
+
 //-----------------------------------------------------------------------------
 // cmd_install_busybox
 //
@@ -984,6 +1406,9 @@ static int cmd_restore_divine_method(const char* srcpath, cmd_backup_method* met
 
 	*method = dump;							// Assume it's a DUMP
 
+	// Chunk lists aren't images at all, they only describe data in the store
+	if(store_is_list(srcpath)) { *method = store; return 0; }
+
 	// Allocate and initialize a buffer to hold the first 8KB of the file data
 	buffer = (unsigned char*)malloc(8192);
 	if(buffer) memset(buffer, 0, 8192);
@@ -1047,6 +1472,119 @@ static int cmd_restore_divine_method(const char* srcpath, cmd_backup_method* met
 	return result;							// Done!
 }
 
+//-----------------------------------------------------------------------------
+// cmd_restore_device_incremental
+//
+// Restores an incremental block-level device backup.  The chain of base backups
+// is followed back to the full backup, which is applied first; each incremental
+// backup is then applied on top of it in order
+//
+// Arguments:
+//
+//	srcpath		- Path to the device backup to be restored
+
+void cmd_restore_device_incremental(const char* srcpath)
+{
+	char				chain[INCREMENTAL_MAX_CHAIN][PATH_MAX];	// Backup chain, newest first
+	int 				chainlen = 0;		// Number of backups in the chain
+	const Volume*		srcvol;				// Source volume	
+	int 				srcmounted = 0;		// Flag if source volume was mounted
+	int 				destunmounted = 0;	// Flag if dest volume was unmounted
+	const Volume*		iterator;			// Volume iterator
+	ui_callbacks 		callbacks;			// UI callbacks for restore functions
+	char 				imgfile[PATH_MAX];	// Image file name
+	struct stat 		filestat;			// Image file information
+	int 				index;				// Loop index variable
+	int 				failed = 0;			// Flag if any volume failed
+	int 				result;				// Result from function call
+	
+	ui_clear_text();					// Clear the UI
+	
+	// Locate and mount the source volume
+	srcvol = get_volume_for_path(srcpath);
+	if(srcvol == NULL) { LOGE("cmd_restore_device_incremental: Cannot locate volume for path %s\n", srcpath); return; }
+	
+	result = mount_volume(srcvol, &srcmounted);
+	if(result != 0) { LOGE("cmd_restore_device_incremental: Cannot mount source volume %s\n", srcvol->name); return; }
+	
+	// Follow the chain of base backups back to the full backup
+	strncpy(chain[0], srcpath, PATH_MAX);
+	chain[0][PATH_MAX - 1] = '\0';
+	chainlen = 1;
+	
+	for(;;) {
+		
+		result = cmd_read_incremental_base(chain[chainlen - 1], imgfile, PATH_MAX);
+		if((result != 0) || (imgfile[0] == '\0')) break;
+		
+		if(chainlen == INCREMENTAL_MAX_CHAIN) { result = E2BIG; break; }
+		strcpy(chain[chainlen++], imgfile);
+	}
+	
+	if(result != 0) {
+		
+		LOGE("cmd_restore_device_incremental: Cannot determine base backup of %s. EC = %d\n", chain[chainlen - 1], result);
+		if(srcmounted) unmount_volume(srcvol, NULL);
+		return;
+	}
+	
+	ui_print("Restoring device from %s (%d backup%s)...\n\n", srcpath, chainlen, (chainlen == 1) ? "" : "s");
+	init_ui_callbacks(&callbacks, &ui_print, &ui_set_progress);
+	
+	// Restore each volume marked DUMP by applying its chain oldest first
+	iterator = foreach_volume(NULL);
+	while(iterator != NULL) {
+		
+		if(*iterator->dump == '1') {
+			
+			if(iterator == srcvol) { LOGE("cmd_restore_device_incremental: Volume %s cannot be both a source and destination volume\n", srcvol->name); failed = 1; break; }
+			
+			// Every backup in the chain must contain an image for this volume
+			for(index = 0; index < chainlen; index++) {
+				
+				snprintf(imgfile, PATH_MAX, "%s/%s.%s", chain[index], iterator->name, g_backup_method_info[dump_sparse].compressed_extension);
+				if(stat(imgfile, &filestat) != 0) break;
+			}
+			
+			if(index < chainlen) {
+				
+				LOGE("cmd_restore_device_incremental: Missing image file %s\n", imgfile);
+				failed = 1;
+			}
+			
+			else if((result = unmount_volume(iterator, &destunmounted)) == 0) {
+				
+				ui_print("    > Restoring %s\n", iterator->name);
+				
+				for(index = chainlen - 1; index >= 0; index--) {
+					
+					snprintf(imgfile, PATH_MAX, "%s/%s.%s", chain[index], iterator->name, g_backup_method_info[dump_sparse].compressed_extension);
+					
+					ui_show_progress(1.0, 0);
+					result = restore_ext4_sparse_ui(imgfile, iterator, &callbacks);
+					ui_reset_progress();
+					
+					if(result != 0) { LOGE("cmd_restore_device_incremental: Unable to restore %s. EC = %d\n", imgfile, result); failed = 1; break; }
+				}
+				
+				// Mount the destination volume if it was unmounted by this function
+				if(destunmounted != 0) mount_volume(iterator, NULL);
+			}
+			
+			else { LOGE("cmd_restore_device_incremental: Cannot unmount volume %s. EC = %d\n", iterator->name, result); failed = 1; }
+		}
+		
+		iterator = foreach_volume(iterator);		// Move to next volume
+	}
+	
+	// Unmount the source volume if it was mounted by this function
+	if(srcmounted != 0) unmount_volume(srcvol, NULL);
+	
+	ui_print("\n");
+	if(failed) ui_print("> Device restore incomplete.\n");
+	else ui_print("> Device restored successfully.\n");
+}
+
 //-----------------------------------------------------------------------------
 // cmd_restore_volume
 //
@@ -1134,6 +1672,12 @@ void cmd_restore_volume(const char* srcpath, const Volume* destvol)
 				restore_dump_ui(srcpath, destvol, &callbacks);
 				break;
 				
+			// DEDUPLICATED STORE
+			case store:
+				ui_show_progress(1.0, 0);
+				store_restore_ui(STORE_PATH, srcpath, destvol, &callbacks);
+				break;
+				
 			default: LOGE("cmd_restore_volume: Unknown restore method code\n");
 		}
 		
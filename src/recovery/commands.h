@@ -40,6 +40,8 @@ typedef enum {
 	ext4_sparse,
 	dump,
 	yaffs2,
+	dump_sparse,
+	store,
 	
 } cmd_backup_method;
 
@@ -50,12 +52,18 @@ typedef enum {
 // Creates a backup of the entire device
 void cmd_backup_device(void);
 
+// Creates an incremental block-level backup of the entire device
+void cmd_backup_device_incremental(const char* basepath);
+
 // Creates a YAFFS2 image of a single directory
 void cmd_backup_directory(const char* directory, const char* destpath, int compress);
 
 // Creates an image of an entire volume
 void cmd_backup_volume(const Volume* srcvol, cmd_backup_method method, int compress);
 
+// Removes chunks from the backup chunk store that are no longer referenced
+void cmd_collect_store_garbage(void);
+
 // Converts a volume file system
 void cmd_convert_volume(const Volume* volume, const char* fs);
 
@@ -83,6 +91,9 @@ void cmd_remove_busybox(void);
 // Removes su from the system (assumes it was installed by us)
 void cmd_remove_su(void);
 
+// Restores an incremental block-level backup of the entire device
+void cmd_restore_device_incremental(const char* srcpath);
+
 // Restores a YAFFS2 image of a directory
 void cmd_restore_directory(const char* srcpath, const char* directory);
 
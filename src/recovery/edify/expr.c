@@ -33,6 +33,10 @@ int BooleanString(const char* s) {
 }
 
 char* Evaluate(State* state, Expr* expr) {
+    // Constants are the most common arguments; skip the Value for them.
+    if (expr->fn == Literal) {
+        return strdup(expr->name);
+    }
     Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
@@ -264,11 +268,16 @@ Value* InequalityFn(const char* name, State* state, int argc, Expr* argv[]) {
     return StringValue(result);
 }
 
+// The parser builds a sequence from pairs; Compile() flattens a run of
+// them into one node with a statement per argument.
 Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]) {
-    Value* left = EvaluateValue(state, argv[0]);
-    if (left == NULL) return NULL;
-    FreeValue(left);
-    return EvaluateValue(state, argv[1]);
+    int i;
+    for (i = 0; i < argc-1; ++i) {
+        Value* left = EvaluateValue(state, argv[i]);
+        if (left == NULL) return NULL;
+        FreeValue(left);
+    }
+    return EvaluateValue(state, argv[argc-1]);
 }
 
 Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -395,6 +404,262 @@ void RegisterBuiltins() {
 }
 
 
+// -----------------------------------------------------------------
+//   compilation
+// -----------------------------------------------------------------
+
+// The compiled tree is carved out of large blocks; it lives as long as
+// the script does, so nothing in it is freed individually.
+#define ARENA_BLOCK_SIZE 65536
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* blocks;
+
+    // Interned string constants, open-addressed by hash.
+    char** strings;
+    unsigned int num_strings;
+    unsigned int mask;
+} Compiler;
+
+static void* ArenaAlloc(Compiler* c, size_t len) {
+    len = (len + 7) & ~(size_t)7;
+    ArenaBlock* b = c->blocks;
+    if (b == NULL || b->size - b->used < len) {
+        size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(ArenaBlock) + size);
+        if (b == NULL) return NULL;
+        b->next = c->blocks;
+        b->used = 0;
+        b->size = size;
+        c->blocks = b;
+    }
+    void* p = (char*)(b + 1) + b->used;
+    b->used += len;
+    return p;
+}
+
+static unsigned int HashString(const char* str, size_t len) {
+    unsigned int hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Return the single compiled copy of the len-byte string str.
+static char* Intern(Compiler* c, const char* str, size_t len) {
+    if ((c->num_strings + 1) * 4 > (c->mask + 1) * 3) {
+        unsigned int size = (c->mask + 1) * 2;
+        char** strings = calloc(size, sizeof(char*));
+        if (strings == NULL) return NULL;
+        unsigned int i;
+        for (i = 0; i <= c->mask; ++i) {
+            if (c->strings[i] == NULL) continue;
+            unsigned int slot = HashString(c->strings[i],
+                                           strlen(c->strings[i])) & (size-1);
+            while (strings[slot] != NULL) slot = (slot + 1) & (size-1);
+            strings[slot] = c->strings[i];
+        }
+        free(c->strings);
+        c->strings = strings;
+        c->mask = size - 1;
+    }
+
+    unsigned int slot = HashString(str, len) & c->mask;
+    while (c->strings[slot] != NULL) {
+        if (strncmp(c->strings[slot], str, len) == 0 &&
+            c->strings[slot][len] == '\0') {
+            return c->strings[slot];
+        }
+        slot = (slot + 1) & c->mask;
+    }
+
+    char* copy = ArenaAlloc(c, len + 1);
+    if (copy == NULL) return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    c->strings[slot] = copy;
+    ++c->num_strings;
+    return copy;
+}
+
+static Expr* NewExpr(Compiler* c, Function fn, char* name, int argc,
+                     int start, int end) {
+    Expr* e = ArenaAlloc(c, sizeof(Expr) + argc * sizeof(Expr*));
+    if (e == NULL) return NULL;
+    e->fn = fn;
+    e->name = name;
+    e->argc = argc;
+    e->argv = argc ? (Expr**)(e + 1) : NULL;
+    e->start = start;
+    e->end = end;
+    return e;
+}
+
+static Expr* Constant(Compiler* c, const char* str, Expr* where) {
+    char* name = Intern(c, str, strlen(str));
+    if (name == NULL) return NULL;
+    return NewExpr(c, Literal, name, 0, where->start, where->end);
+}
+
+// Stand in for e with one of its operands.  The copy keeps e's span of
+// the script text, which error messages and the journal's step hashes
+// are taken from.
+static Expr* Substitute(Compiler* c, Expr* e, Expr* operand) {
+    Expr* result = NewExpr(c, operand->fn, operand->name, operand->argc,
+                           e->start, e->end);
+    if (result == NULL) return e;
+    if (operand->argc > 0) {
+        memcpy(result->argv, operand->argv, operand->argc * sizeof(Expr*));
+    }
+    return result;
+}
+
+// Replace an operator whose operands are all constants with its result.
+// None of these have side effects, so evaluating them now is the same
+// as evaluating them every time the script runs.
+static Expr* Fold(Compiler* c, Expr* e) {
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        if (e->argv[i]->fn != Literal) break;
+    }
+    int all_constant = (i == e->argc);
+
+    if (e->fn == ConcatFn && all_constant && e->argc > 0) {
+        size_t len = 0;
+        for (i = 0; i < e->argc; ++i) len += strlen(e->argv[i]->name);
+        char* buffer = malloc(len + 1);
+        if (buffer == NULL) return e;
+        buffer[0] = '\0';
+        for (i = 0; i < e->argc; ++i) strcat(buffer, e->argv[i]->name);
+        Expr* result = Constant(c, buffer, e);
+        free(buffer);
+        return result ? result : e;
+    }
+
+    if ((e->fn == EqualityFn || e->fn == InequalityFn) &&
+        e->argc == 2 && all_constant) {
+        int equal = strcmp(e->argv[0]->name, e->argv[1]->name) == 0;
+        Expr* result = Constant(c, (equal == (e->fn == EqualityFn)) ? "t" : "", e);
+        return result ? result : e;
+    }
+
+    if (e->fn == SubstringFn && e->argc == 2 && all_constant) {
+        int found = strstr(e->argv[1]->name, e->argv[0]->name) != NULL;
+        Expr* result = Constant(c, found ? "t" : "", e);
+        return result ? result : e;
+    }
+
+    if (e->fn == LogicalNotFn && e->argc == 1 && all_constant) {
+        Expr* result = Constant(c, BooleanString(e->argv[0]->name) ? "" : "t", e);
+        return result ? result : e;
+    }
+
+    // The rest only need their first operand to be constant.
+    if (e->argc < 2 || e->argv[0]->fn != Literal) return e;
+    int cond = BooleanString(e->argv[0]->name);
+
+    if (e->fn == LogicalAndFn && e->argc == 2) {
+        return Substitute(c, e, cond ? e->argv[1] : e->argv[0]);
+    }
+    if (e->fn == LogicalOrFn && e->argc == 2) {
+        return Substitute(c, e, cond ? e->argv[0] : e->argv[1]);
+    }
+    if (e->fn == IfElseFn && (e->argc == 2 || e->argc == 3)) {
+        if (cond) return Substitute(c, e, e->argv[1]);
+        return Substitute(c, e, (e->argc == 3) ? e->argv[2] : e->argv[0]);
+    }
+    return e;
+}
+
+static int CountStatements(Expr* e) {
+    if (e->fn != SequenceFn) return 1;
+    int count = 0;
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        count += CountStatements(e->argv[i]);
+    }
+    return count;
+}
+
+static Expr* CompileExpr(Compiler* c, Expr* e);
+
+static int CompileStatements(Compiler* c, Expr* e, Expr** out) {
+    if (e->fn != SequenceFn) {
+        *out = CompileExpr(c, e);
+        return (*out == NULL) ? -1 : 1;
+    }
+    int count = 0;
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        int n = CompileStatements(c, e->argv[i], out + count);
+        if (n < 0) return -1;
+        count += n;
+    }
+    return count;
+}
+
+static Expr* CompileExpr(Compiler* c, Expr* e) {
+    Expr* result;
+    int i;
+
+    if (e->fn == Literal) {
+        char* name = Intern(c, e->name, strlen(e->name));
+        if (name == NULL) return NULL;
+        return NewExpr(c, Literal, name, 0, e->start, e->end);
+    }
+
+    // A run of statements becomes one list, rather than a chain of
+    // pairs that nests one level deeper per statement.
+    if (e->fn == SequenceFn) {
+        int count = CountStatements(e);
+        result = NewExpr(c, SequenceFn, e->name, count, e->start, e->end);
+        if (result == NULL) return NULL;
+        if (CompileStatements(c, e, result->argv) != count) return NULL;
+        return result;
+    }
+
+    char* name = Intern(c, e->name, strlen(e->name));
+    if (name == NULL) return NULL;
+    result = NewExpr(c, e->fn, name, e->argc, e->start, e->end);
+    if (result == NULL) return NULL;
+    for (i = 0; i < e->argc; ++i) {
+        result->argv[i] = CompileExpr(c, e->argv[i]);
+        if (result->argv[i] == NULL) return NULL;
+    }
+    return Fold(c, result);
+}
+
+Expr* Compile(Expr* root) {
+    Compiler c;
+    c.blocks = NULL;
+    c.num_strings = 0;
+    c.mask = 255;
+    c.strings = calloc(c.mask + 1, sizeof(char*));
+    if (c.strings == NULL) return NULL;
+
+    Expr* result = CompileExpr(&c, root);
+
+    // The intern table is only needed while compiling; the strings
+    // themselves live in the arena with the tree.
+    free(c.strings);
+    if (result == NULL) {
+        while (c.blocks != NULL) {
+            ArenaBlock* next = c.blocks->next;
+            free(c.blocks);
+            c.blocks = next;
+        }
+    }
+    return result;
+}
+
 // -----------------------------------------------------------------
 //   convenience methods for functions
 // -----------------------------------------------------------------
@@ -403,25 +668,27 @@ void RegisterBuiltins() {
 // zero or more char** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = malloc(count * sizeof(char*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = Evaluate(state, argv[i]);
-        if (args[i] == NULL) {
+        char* arg = Evaluate(state, argv[i]);
+        if (arg == NULL) {
+            // Walk the outputs again to free the ones already filled in.
             va_end(v);
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                free(args[j]);
+                char** out = va_arg(v, char**);
+                free(*out);
+                *out = NULL;
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, char**)) = args[i];
+        *(va_arg(v, char**)) = arg;
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -429,25 +696,26 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
 // zero or more Value** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
-    Value** args = malloc(count * sizeof(Value*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = EvaluateValue(state, argv[i]);
-        if (args[i] == NULL) {
+        Value* arg = EvaluateValue(state, argv[i]);
+        if (arg == NULL) {
             va_end(v);
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                FreeValue(args[j]);
+                Value** out = va_arg(v, Value**);
+                FreeValue(*out);
+                *out = NULL;
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, Value**)) = args[i];
+        *(va_arg(v, Value**)) = arg;
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -61,6 +61,14 @@ struct Expr {
     int start, end;
 };
 
+// Compile a parsed script for evaluation.  Returns a new tree in which
+// runs of ';'-separated statements are a single flat list, operators
+// whose operands are all constants have been folded, and identical
+// string constants share one copy.  The compiled tree is allocated from
+// a few large blocks that live as long as the program; the parsed tree
+// is left untouched.  Returns NULL if out of memory.
+Expr* Compile(Expr* root);
+
 // Take one of the Expr*s passed to the function as an argument,
 // evaluate it, return the resulting Value.  The caller takes
 // ownership of the returned Value.
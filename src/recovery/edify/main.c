@@ -23,23 +23,10 @@
 
 extern int yyparse(Expr** root, int* error_count);
 
-int expect(const char* expr_str, const char* expected, int* errors) {
-    Expr* e;
-    int error;
+static int check(const char* expr_str, Expr* e, const char* form,
+                 const char* expected, int* errors) {
     char* result;
 
-    printf(".");
-
-    yy_scan_string(expr_str);
-    int error_count = 0;
-    error = yyparse(&e, &error_count);
-    if (error > 0 || error_count > 0) {
-        fprintf(stderr, "error parsing \"%s\" (%d errors)\n",
-                expr_str, error_count);
-        ++*errors;
-        return 0;
-    }
-
     State state;
     state.cookie = NULL;
     state.script = strdup(expr_str);
@@ -49,7 +36,7 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     free(state.errmsg);
     free(state.script);
     if (result == NULL && expected != NULL) {
-        fprintf(stderr, "error evaluating \"%s\"\n", expr_str);
+        fprintf(stderr, "error evaluating %s \"%s\"\n", form, expr_str);
         ++*errors;
         return 0;
     }
@@ -59,8 +46,8 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     }
 
     if (strcmp(result, expected) != 0) {
-        fprintf(stderr, "evaluating \"%s\": expected \"%s\", got \"%s\"\n",
-                expr_str, expected, result);
+        fprintf(stderr, "evaluating %s \"%s\": expected \"%s\", got \"%s\"\n",
+                form, expr_str, expected, result);
         ++*errors;
         free(result);
         return 0;
@@ -70,6 +57,43 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     return 1;
 }
 
+int expect(const char* expr_str, const char* expected, int* errors) {
+    Expr* e;
+    int error;
+
+    printf(".");
+
+    yy_scan_string(expr_str);
+    int error_count = 0;
+    error = yyparse(&e, &error_count);
+    if (error > 0 || error_count > 0) {
+        fprintf(stderr, "error parsing \"%s\" (%d errors)\n",
+                expr_str, error_count);
+        ++*errors;
+        return 0;
+    }
+
+    // The compiled form has to give the same answer as the parsed one.
+    Expr* compiled = Compile(e);
+    if (compiled == NULL) {
+        fprintf(stderr, "error compiling \"%s\"\n", expr_str);
+        ++*errors;
+        return 0;
+    }
+
+    // Folding mustn't lose the span of script text the root covers.
+    if (compiled->start != e->start || compiled->end != e->end) {
+        fprintf(stderr, "compiling \"%s\" changed its span from %d-%d "
+                "to %d-%d\n", expr_str, e->start, e->end,
+                compiled->start, compiled->end);
+        ++*errors;
+        return 0;
+    }
+
+    return check(expr_str, e, "parsed", expected, errors) &&
+           check(expr_str, compiled, "compiled", expected, errors);
+}
+
 int test() {
     int errors = 0;
 
@@ -199,6 +223,8 @@ int main(int argc, char** argv) {
     if (error == 0 || error_count > 0) {
 
         ExprDump(0, root, buffer);
+        Expr* compiled = Compile(root);
+        if (compiled != NULL) root = compiled;
 
         State state;
         state.cookie = NULL;
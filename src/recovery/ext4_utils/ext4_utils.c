@@ -79,6 +79,7 @@ void write_ext4_image(const char *filename, int gz, int sparse)
 	int ret = 0;
 	struct output_file *out = open_output_file(filename, gz, sparse);
 	off_t off;
+	u8 buf[4096] = { 0 }; 	/* The larget supported ext4 block size */
 
 	if (!out)
 		return;
@@ -86,10 +87,10 @@ void write_ext4_image(const char *filename, int gz, int sparse)
 	/* The write_data* functions expect only block aligned calls.
 	 * This is not an issue, except when we write out the super
 	 * block on a system with a block size > 1K.  So, we need to
-	 * deal with that here.
+	 * deal with that here.  The buffer has to live until the file
+	 * is closed, the parallel output may not have written it yet.
 	 */
 	if (info.block_size > 1024) {
-		u8 buf[4096] = { 0 }; 	/* The larget supported ext4 block size */
 		memcpy(buf + 1024, (u8*)aux_info.sb, 1024);
 		write_data_block(out, 0, buf, info.block_size);
 
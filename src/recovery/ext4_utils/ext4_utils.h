@@ -105,6 +105,11 @@ struct fs_info {
 	EXT4UTILS_PRINTF 	ui_stdout;
 	EXT4UTILS_PRINTF 	ui_stderr;
 	EXT4UTILS_PROGRESS 	ui_progress;
+	
+	// djp952: number of worker threads used to read, checksum and compress the
+	// data blocks of a sparse image; 0 or 1 writes the image on the calling thread
+	
+	u32 				threads;
 };
 
 struct fs_aux_info {
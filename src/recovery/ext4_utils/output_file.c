@@ -21,6 +21,7 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <zlib.h>
 
@@ -53,6 +54,8 @@ struct output_file {
 	int chunk_cnt;
 	u32 crc32;
 	struct output_file_ops *ops;
+	int gz;
+	struct parallel_output *parallel;
 };
 
 static int file_seek(struct output_file *out, off64_t off)
@@ -149,7 +152,7 @@ static u8 *zero_buf;
 static int emit_skip_chunk(struct output_file *out, u64 skip_len)
 {
 	chunk_header_t chunk_header;
-	int ret, chunk;
+	int ret;
 
 	//DBG printf("skip chunk: 0x%llx bytes\n", skip_len);
 
@@ -171,12 +174,8 @@ static int emit_skip_chunk(struct output_file *out, u64 skip_len)
 	out->cur_out_ptr += skip_len;
 	out->chunk_cnt++;
 
-	/* Compute the CRC for all those zeroes.  Do it block_size bytes at a time. */
-	while (skip_len) {
-		chunk = (skip_len > info.block_size) ? info.block_size : skip_len;
-		out->crc32 = sparse_crc32(out->crc32, zero_buf, chunk);
-		skip_len -= chunk;
-	}
+	/* Compute the CRC for all those zeroes. */
+	out->crc32 = sparse_crc32_zeros(out->crc32, skip_len);
 
 	return 0;
 }
@@ -248,6 +247,447 @@ static int write_chunk_raw(struct output_file *out, u64 off, u8 *data, int len)
 	return 0;
 }
 
+/*
+ * djp952: Parallel sparse image output.  Reading the file data, computing the
+ * CRC and compressing it are done by a pool of worker threads, while the
+ * layout of the image is still decided on the calling thread in the order the
+ * blocks were allocated, so the result doesn't depend on thread timing.
+ *
+ * Each queued region becomes one or more jobs of at most PARALLEL_JOB_SIZE
+ * bytes.  A job holds the complete serialized chunk(s) for its region: an
+ * optional "don't care" chunk for the gap before it and a raw chunk for the
+ * data itself.  When compressing, each job is deflated into an independent
+ * gzip member; concatenated members are still a valid gzip stream, so the
+ * image reads back with gzread() exactly like the serial version.  The writer
+ * thread appends the jobs in order and combines their CRCs.
+ */
+
+#define PARALLEL_MAX_THREADS	4
+#define PARALLEL_SLOTS_PER_THREAD	2
+#define PARALLEL_JOB_SIZE	(1024 * 1024)
+#define PARALLEL_JOB_HDR_LEN	(2 * CHUNK_HEADER_LEN)
+
+enum parallel_slot_state {
+	slot_free = 0,
+	slot_filled,
+	slot_busy,
+	slot_done,
+};
+
+struct parallel_slot {
+	enum parallel_slot_state state;
+	u64 skip_len;		/* "don't care" bytes before the data */
+	u8 *data;		/* memory source, or NULL */
+	char *filename;		/* file source, or NULL */
+	off_t offset;		/* offset of the data in the file */
+	int len;		/* length of the data */
+	u8 *in;			/* serialized chunks */
+	int in_len;
+	u8 *out;		/* serialized chunks as a gzip member */
+	int out_len;
+	int out_max;
+	u32 crc32;		/* CRC of the data and padding only */
+	int crc_len;
+};
+
+struct parallel_output {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pthread_t workers[PARALLEL_MAX_THREADS];
+	pthread_t writer;
+	int num_workers;
+	int writer_started;
+	struct parallel_slot *slots;
+	int num_slots;
+	unsigned int next_submit;
+	unsigned int next_write;
+	int eof;
+	int error;
+};
+
+static int parallel_build_job(struct output_file *out, struct parallel_slot *slot,
+		z_stream *stream)
+{
+	chunk_header_t chunk_header;
+	u8 *ptr = slot->in;
+	int rnd_up_len, zero_len;
+	int file_fd;
+	ssize_t ret;
+	int read_len;
+
+	if (slot->skip_len) {
+		chunk_header.chunk_type = CHUNK_TYPE_DONT_CARE;
+		chunk_header.reserved1 = 0;
+		chunk_header.chunk_sz = slot->skip_len / info.block_size;
+		chunk_header.total_sz = CHUNK_HEADER_LEN;
+		memcpy(ptr, &chunk_header, CHUNK_HEADER_LEN);
+		ptr += CHUNK_HEADER_LEN;
+	}
+
+	slot->crc32 = 0;
+	slot->crc_len = 0;
+
+	if (slot->len) {
+		rnd_up_len = (slot->len + (info.block_size - 1)) & (~(info.block_size -1));
+		zero_len = rnd_up_len - slot->len;
+
+		chunk_header.chunk_type = CHUNK_TYPE_RAW;
+		chunk_header.reserved1 = 0;
+		chunk_header.chunk_sz = rnd_up_len / info.block_size;
+		chunk_header.total_sz = CHUNK_HEADER_LEN + rnd_up_len;
+		memcpy(ptr, &chunk_header, CHUNK_HEADER_LEN);
+		ptr += CHUNK_HEADER_LEN;
+
+		if (slot->filename) {
+			file_fd = open(slot->filename, O_RDONLY);
+			if (file_fd < 0) {
+				warn_errno("open\n");
+				return -1;
+			}
+
+			for (read_len = 0; read_len < slot->len; read_len += ret) {
+				ret = pread64(file_fd, ptr + read_len, slot->len - read_len,
+						slot->offset + read_len);
+				if (ret <= 0) {
+					warn("failed to read %s\n", slot->filename);
+					close(file_fd);
+					return -1;
+				}
+			}
+
+			close(file_fd);
+		} else {
+			memcpy(ptr, slot->data, slot->len);
+		}
+
+		memset(ptr + slot->len, 0, zero_len);
+		slot->crc32 = sparse_crc32(0, ptr, rnd_up_len);
+		slot->crc_len = rnd_up_len;
+		ptr += rnd_up_len;
+	}
+
+	slot->in_len = ptr - slot->in;
+
+	if (out->gz) {
+		deflateReset(stream);
+		stream->next_in = slot->in;
+		stream->avail_in = slot->in_len;
+		stream->next_out = slot->out;
+		stream->avail_out = slot->out_max;
+		if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+			warn("deflate failed\n");
+			return -1;
+		}
+		slot->out_len = slot->out_max - stream->avail_out;
+	}
+
+	return 0;
+}
+
+static void *parallel_worker(void *arg)
+{
+	struct output_file *out = arg;
+	struct parallel_output *par = out->parallel;
+	struct parallel_slot *slot;
+	z_stream stream;
+	unsigned int i;
+	int ret;
+
+	/* Window bits of 15 + 16 makes zlib generate a gzip header and trailer */
+	memset(&stream, 0, sizeof(stream));
+	if (out->gz && deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		pthread_mutex_lock(&par->lock);
+		par->error = -1;
+		pthread_cond_broadcast(&par->changed);
+		pthread_mutex_unlock(&par->lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&par->lock);
+
+	for (;;) {
+		/* Take the oldest job that hasn't been started yet */
+		slot = NULL;
+		for (i = par->next_write; i != par->next_submit; i++) {
+			if (par->slots[i % par->num_slots].state == slot_filled) {
+				slot = &par->slots[i % par->num_slots];
+				break;
+			}
+		}
+
+		if (par->error)
+			break;
+		if (slot == NULL) {
+			if (par->eof)
+				break;
+			pthread_cond_wait(&par->changed, &par->lock);
+			continue;
+		}
+
+		slot->state = slot_busy;
+		pthread_mutex_unlock(&par->lock);
+
+		ret = parallel_build_job(out, slot, &stream);
+
+		pthread_mutex_lock(&par->lock);
+		if (ret < 0)
+			par->error = -1;
+		else
+			slot->state = slot_done;
+		pthread_cond_broadcast(&par->changed);
+	}
+
+	pthread_mutex_unlock(&par->lock);
+
+	if (out->gz)
+		deflateEnd(&stream);
+	return NULL;
+}
+
+static void *parallel_writer(void *arg)
+{
+	struct output_file *out = arg;
+	struct parallel_output *par = out->parallel;
+	struct parallel_slot *slot;
+	int ret;
+
+	pthread_mutex_lock(&par->lock);
+
+	for (;;) {
+		/* Wait for the next job in sequence to be finished */
+		slot = &par->slots[par->next_write % par->num_slots];
+		if (par->error)
+			break;
+		if (par->next_write == par->next_submit && par->eof)
+			break;
+		if (par->next_write == par->next_submit || slot->state != slot_done) {
+			pthread_cond_wait(&par->changed, &par->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&par->lock);
+
+		if (out->gz)
+			ret = file_write(out, slot->out, slot->out_len);
+		else
+			ret = file_write(out, slot->in, slot->in_len);
+
+		/* The job CRCs were computed independently, fold them into the image CRC */
+		if (slot->skip_len)
+			out->crc32 = sparse_crc32_zeros(out->crc32, slot->skip_len);
+		if (slot->crc_len)
+			out->crc32 = crc32_combine(out->crc32, slot->crc32, slot->crc_len);
+
+		pthread_mutex_lock(&par->lock);
+
+		free(slot->filename);
+		slot->filename = NULL;
+
+		if (ret < 0) {
+			par->error = -1;
+		} else {
+			slot->state = slot_free;
+			par->next_write++;
+		}
+		pthread_cond_broadcast(&par->changed);
+	}
+
+	pthread_mutex_unlock(&par->lock);
+	return NULL;
+}
+
+/* Queues a single job; the gap before it must already be accounted for */
+static int parallel_submit_job(struct output_file *out, u64 skip_len, u8 *data,
+		const char *filename, off_t offset, int len)
+{
+	struct parallel_output *par = out->parallel;
+	struct parallel_slot *slot;
+
+	pthread_mutex_lock(&par->lock);
+	slot = &par->slots[par->next_submit % par->num_slots];
+	while (slot->state != slot_free && !par->error)
+		pthread_cond_wait(&par->changed, &par->lock);
+	if (par->error) {
+		pthread_mutex_unlock(&par->lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&par->lock);
+
+	slot->skip_len = skip_len;
+	slot->data = data;
+	slot->filename = NULL;
+	slot->offset = offset;
+	slot->len = len;
+
+	if (filename) {
+		slot->filename = strdup(filename);
+		if (!slot->filename) {
+			error_errno("strdup\n");
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&par->lock);
+	slot->state = slot_filled;
+	par->next_submit++;
+	pthread_cond_broadcast(&par->changed);
+	pthread_mutex_unlock(&par->lock);
+
+	return 0;
+}
+
+/* Splits a region of data into jobs, the same accounting as write_chunk_raw() */
+static void parallel_write_chunk(struct output_file *out, u64 off, u8 *data,
+		const char *filename, off_t offset, int len)
+{
+	u64 skip_len = 0;
+	int job_len;
+
+	if (off < out->cur_out_ptr) {
+		warn("offset %llu is less than the current output offset %llu\n",
+				off, out->cur_out_ptr);
+		return;
+	}
+
+	if (off % info.block_size) {
+		warn("write chunk offset %llu is not a multiple of the block size %u\n",
+				off, info.block_size);
+		return;
+	}
+
+	if (off > out->cur_out_ptr) {
+		skip_len = off - out->cur_out_ptr;
+		out->cur_out_ptr = off;
+		out->chunk_cnt++;
+	}
+
+	/* Job boundaries are multiples of the block size, so only the final job
+	 * of the region can need padding */
+	while (len > 0) {
+		job_len = (len > PARALLEL_JOB_SIZE) ? PARALLEL_JOB_SIZE : len;
+
+		if (parallel_submit_job(out, skip_len, data, filename, offset, job_len) < 0)
+			return;
+
+		out->cur_out_ptr += (job_len + (info.block_size - 1)) & (~(info.block_size -1));
+		out->chunk_cnt++;
+
+		skip_len = 0;
+		len -= job_len;
+		offset += job_len;
+		if (data)
+			data += job_len;
+	}
+}
+
+/* Emits the "don't care" chunk that pads the image out to its full length */
+static void parallel_emit_skip(struct output_file *out, u64 skip_len)
+{
+	if (skip_len % info.block_size) {
+		warn("don't care size %llu is not a multiple of the block size %u\n",
+				skip_len, info.block_size);
+		return;
+	}
+
+	if (parallel_submit_job(out, skip_len, NULL, NULL, 0, 0) < 0)
+		return;
+
+	out->cur_out_ptr += skip_len;
+	out->chunk_cnt++;
+}
+
+/* Drains the jobs and stops the threads; returns non-zero if anything failed */
+static int parallel_close(struct output_file *out)
+{
+	struct parallel_output *par = out->parallel;
+	int error;
+	int i;
+
+	pthread_mutex_lock(&par->lock);
+	par->eof = 1;
+	pthread_cond_broadcast(&par->changed);
+	pthread_mutex_unlock(&par->lock);
+
+	for (i = 0; i < par->num_workers; i++)
+		pthread_join(par->workers[i], NULL);
+	if (par->writer_started)
+		pthread_join(par->writer, NULL);
+
+	error = par->error;
+
+	for (i = 0; i < par->num_slots; i++) {
+		free(par->slots[i].filename);
+		free(par->slots[i].in);
+		free(par->slots[i].out);
+	}
+	free(par->slots);
+
+	pthread_cond_destroy(&par->changed);
+	pthread_mutex_destroy(&par->lock);
+	free(par);
+	out->parallel = NULL;
+
+	return error;
+}
+
+/* Sets up the parallel output; returns non-zero to fall back to serial output */
+static int parallel_open(struct output_file *out)
+{
+	struct parallel_output *par;
+	int threads = (info.threads > PARALLEL_MAX_THREADS) ? PARALLEL_MAX_THREADS : info.threads;
+	int i;
+
+	par = calloc(1, sizeof(struct parallel_output));
+	if (!par)
+		return -1;
+
+	par->num_slots = threads * PARALLEL_SLOTS_PER_THREAD;
+	par->slots = calloc(par->num_slots, sizeof(struct parallel_slot));
+	if (!par->slots) {
+		free(par);
+		return -1;
+	}
+
+	for (i = 0; i < par->num_slots; i++) {
+		par->slots[i].in = malloc(PARALLEL_JOB_HDR_LEN + PARALLEL_JOB_SIZE);
+		par->slots[i].out_max = PARALLEL_JOB_HDR_LEN + PARALLEL_JOB_SIZE +
+			(PARALLEL_JOB_SIZE >> 8) + 1024;
+		if (out->gz)
+			par->slots[i].out = malloc(par->slots[i].out_max);
+		if (!par->slots[i].in || (out->gz && !par->slots[i].out))
+			break;
+	}
+
+	pthread_mutex_init(&par->lock, NULL);
+	pthread_cond_init(&par->changed, NULL);
+	out->parallel = par;
+
+	if (i < par->num_slots) {
+		parallel_close(out);
+		return -1;
+	}
+
+	if (pthread_create(&par->writer, NULL, parallel_writer, out) == 0) {
+		par->writer_started = 1;
+		for (i = 0; i < threads; i++) {
+			if (pthread_create(&par->workers[i], NULL, parallel_worker, out) != 0)
+				break;
+			par->num_workers++;
+		}
+	}
+
+	if (par->num_workers == 0) {
+		pthread_mutex_lock(&par->lock);
+		par->error = -1;
+		pthread_mutex_unlock(&par->lock);
+		parallel_close(out);
+		return -1;
+	}
+
+	return 0;
+}
+
 // djp952: Modified this function to allow sparse images to be gzipped.  The
 // sparse header is written uncompressed to the output file, then a gzFile is
 // associated with it for the remainder of the operations.  The gzip operation
@@ -257,6 +697,13 @@ void close_output_file(struct output_file *out)
 {
 	int ret;
 	
+	// Finish writing the parallel jobs before the header can be updated
+	if(out->parallel != NULL) {
+		
+		if(parallel_close(out) != 0)
+			error("failure writing sparse file data\n");
+	}
+	
 	// If the file was open with GZIP, close out that handle and switch back
 	// to the standard file operation functions for the remainder of the work
 	// (gz_fd is a duplicate handle from fd, so gzclose() won't close it)
@@ -333,6 +780,18 @@ struct output_file *open_output_file(const char *filename, int gz, int sparse)
 		if (ret < 0) return NULL;
 	}
 
+	out->gz = gz;
+	
+	// Sparse images can have their data blocks read, checksummed and compressed
+	// by worker threads.  The workers generate their own gzip members, so the
+	// file stays on the plain file operations.  If the threads can't be set up
+	// just carry on serially
+	if(out->sparse && (info.threads > 1)) {
+		
+		if(parallel_open(out) == 0) return out;
+		warn("unable to start worker threads, writing image serially\n");
+	}
+	
 	// If compression of the sparse file is desired, reassociate the file
 	// handle with a gzFile and switch to the gzip file operations now that 
 	// the sparse header has been written uncompressed
@@ -373,7 +832,10 @@ void pad_output_file(struct output_file *out, u64 len)
 			return;
 		}
 		if (len > out->cur_out_ptr) {
-			emit_skip_chunk(out, len - out->cur_out_ptr);
+			if (out->parallel)
+				parallel_emit_skip(out, len - out->cur_out_ptr);
+			else
+				emit_skip_chunk(out, len - out->cur_out_ptr);
 		}
 	} else {
 		//KEN TODO: Fixme.  If the filesystem image needs no padding,
@@ -401,7 +863,9 @@ void write_data_block(struct output_file *out, u64 off, u8 *data, int len)
 		return;
 	}
 
-	if (out->sparse) {
+	if (out->parallel) {
+		parallel_write_chunk(out, off, data, NULL, 0, len);
+	} else if (out->sparse) {
 		write_chunk_raw(out, off, data, len);
 	} else {
 		ret = out->ops->seek(out, off);
@@ -426,6 +890,12 @@ void write_data_file(struct output_file *out, u64 off, const char *file,
 		return;
 	}
 
+	/* The workers read the file themselves */
+	if (out->parallel) {
+		parallel_write_chunk(out, off, NULL, file, offset, len);
+		return;
+	}
+
 	int file_fd = open(file, O_RDONLY);
 	if (file_fd < 0) {
 		warn_errno("open\n");
@@ -109,3 +109,75 @@ u32 sparse_crc32(u32 crc_in, const void *buf, int size)
         return crc ^ ~0U;
 }
 
+
+/*
+ * Advances a CRC-32 over a run of len zero bytes without touching the data,
+ * in O(log len) time.  This is the same GF(2) matrix technique zlib uses for
+ * crc32_combine(); it lets "don't care" regions of a sparse image be accounted
+ * for without feeding gigabytes of zeroes through the table above.
+ */
+
+#define GF2_DIM 32
+
+static u32 gf2_matrix_times(const u32 *mat, u32 vec)
+{
+        u32 sum = 0;
+
+        while (vec) {
+                if (vec & 1)
+                        sum ^= *mat;
+                vec >>= 1;
+                mat++;
+        }
+        return sum;
+}
+
+static void gf2_matrix_square(u32 *square, const u32 *mat)
+{
+        int n;
+
+        for (n = 0; n < GF2_DIM; n++)
+                square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+u32 sparse_crc32_zeros(u32 crc_in, u64 len)
+{
+        u32 even[GF2_DIM];      /* even-power-of-two zeros operator */
+        u32 odd[GF2_DIM];       /* odd-power-of-two zeros operator */
+        u32 row, crc;
+        int n;
+
+        if (len == 0)
+                return crc_in;
+
+        /* put operator for one zero bit in odd */
+        odd[0] = 0xedb88320;
+        row = 1;
+        for (n = 1; n < GF2_DIM; n++) {
+                odd[n] = row;
+                row <<= 1;
+        }
+
+        /* put operator for two zero bits in even, four zero bits in odd */
+        gf2_matrix_square(even, odd);
+        gf2_matrix_square(odd, even);
+
+        /* apply len zero bytes to the raw (uninverted) crc register */
+        crc = crc_in ^ ~0U;
+        do {
+                /* first square will put the operator for one zero byte in even */
+                gf2_matrix_square(even, odd);
+                if (len & 1)
+                        crc = gf2_matrix_times(even, crc);
+                len >>= 1;
+                if (len == 0)
+                        break;
+
+                gf2_matrix_square(odd, even);
+                if (len & 1)
+                        crc = gf2_matrix_times(odd, crc);
+                len >>= 1;
+        } while (len != 0);
+
+        return crc ^ ~0U;
+}
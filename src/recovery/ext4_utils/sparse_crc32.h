@@ -15,4 +15,5 @@
  */
 
 u32 sparse_crc32(u32 crc, const void *buf, size_t size);
+u32 sparse_crc32_zeros(u32 crc, u64 len);
 
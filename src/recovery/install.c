@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -233,6 +234,78 @@ exit:
     return NULL;
 }
 
+typedef struct {
+    const unsigned char* data;
+    size_t length;
+    const RSAPublicKey* keys;
+    int numKeys;
+    int result;
+} VerifyJob;
+
+static void* verify_thread(void* cookie) {
+    VerifyJob* job = (VerifyJob*) cookie;
+    job->result = verify_mapped(job->data, job->length, job->keys, job->numKeys);
+    return NULL;
+}
+
+// Maps the package once, and uses that one mapping both to verify the
+// whole-file signature (on a helper thread) and to parse the archive's
+// central directory.  If keys is NULL the signature isn't checked.
+// Nothing is written until the signature has been verified, since the
+// caller only gets an open archive back on success.
+static int
+open_package(const char *path, const RSAPublicKey* keys, int numKeys,
+             ZipArchive* zip)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open %s\n(%s)\n", path, strerror(errno));
+        return INSTALL_CORRUPT;
+    }
+
+    MemMapping map;
+    if (sysMapFileInShmem(fd, &map) != 0) {
+        LOGE("Can't map %s\n", path);
+        close(fd);
+        return INSTALL_CORRUPT;
+    }
+
+    VerifyJob job;
+    job.data = (const unsigned char*) map.addr;
+    job.length = map.length;
+    job.keys = keys;
+    job.numKeys = numKeys;
+    job.result = VERIFY_SUCCESS;
+
+    pthread_t thread;
+    int threaded = 0;
+    if (keys != NULL) {
+        ui_print("Verifying update package...\n");
+        threaded = (pthread_create(&thread, NULL, verify_thread, &job) == 0);
+        if (!threaded) verify_thread(&job);
+    }
+
+    int err = mzOpenZipArchiveMapped(fd, &map, zip);
+
+    if (threaded) pthread_join(thread, NULL);
+    LOGI("verify_mapped returned %d\n", job.result);
+
+    if (err != 0) {
+        LOGE("Can't open %s\n(bad)\n", path);
+        close(fd);
+        sysReleaseShmem(&map);
+        return INSTALL_CORRUPT;
+    }
+
+    if (job.result != VERIFY_SUCCESS) {
+        LOGE("signature verification failed\n");
+        mzCloseZipArchive(zip);
+        return INSTALL_CORRUPT;
+    }
+
+    return INSTALL_SUCCESS;
+}
+
 int
 install_package(const char *path)
 {
@@ -248,40 +321,31 @@ install_package(const char *path)
 
     ui_print("Opening update package...\n");
 
-	//TODO: put this back at some point
-	/*
-    int numKeys;
-    RSAPublicKey* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
-    if (loadedKeys == NULL) {
-        LOGE("Failed to load keys\n");
-        return INSTALL_CORRUPT;
-    }
-    LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
-
-    // Give verification half the progress bar...
-    ui_print("Verifying update package...\n");
-    ui_show_progress(
-            VERIFICATION_PROGRESS_FRACTION,
-            VERIFICATION_PROGRESS_TIME);
-	*/
-    int err;
-	/*
-    err = verify_file(path, loadedKeys, numKeys);
-    free(loadedKeys);
-    LOGI("verify_file returned %d\n", err);
-    if (err != VERIFY_SUCCESS) {
-        LOGE("signature verification failed\n");
-        return INSTALL_CORRUPT;
+    // Packages are only verified when the recovery carries a keys file;
+    // without one, any package can be installed.
+    int numKeys = 0;
+    RSAPublicKey* loadedKeys = NULL;
+    if (access(PUBLIC_KEYS_FILE, F_OK) == 0) {
+        loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
+        if (loadedKeys == NULL) {
+            LOGE("Failed to load keys\n");
+            return INSTALL_CORRUPT;
+        }
+        LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
+
+        // Give verification half the progress bar...
+        ui_show_progress(
+                VERIFICATION_PROGRESS_FRACTION,
+                VERIFICATION_PROGRESS_TIME);
     }
-	*/
-	
-    /* Try to open the package.
+
+    /* Verify and open the package from a single mapping.
      */
     ZipArchive zip;
-    err = mzOpenZipArchive(path, &zip);
-    if (err != 0) {
-        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
-        return INSTALL_CORRUPT;
+    int err = open_package(path, loadedKeys, numKeys, &zip);
+    free(loadedKeys);
+    if (err != INSTALL_SUCCESS) {
+        return err;
     }
 
     /* Verify and install the contents of the package.
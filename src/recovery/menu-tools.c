@@ -59,6 +59,7 @@ int menu_tools(void)
 	// Allocate the menu item list
 	items = alloc_menu_list(
 		"- Restart ADBD Service",
+		"- Clean Up Backup Store",
 		//"- Install BusyBox",
 		//"- Install su",
 		//"- Remove BusyBox",
@@ -81,17 +82,20 @@ int menu_tools(void)
 			// RESTART ADBD
 			case 0: cmd_kill_adbd(); break;
 			
+			// CLEAN UP BACKUP STORE
+			case 1: cmd_collect_store_garbage(); break;
+			
 			// INSTALL BUSYBOX
-			//case 1: cmd_install_busybox(); break;
+			//case 2: cmd_install_busybox(); break;
 			
 			// INSTALL SU
-			//case 2: cmd_install_su(); break;
+			//case 3: cmd_install_su(); break;
 			
 			// REMOVE BUSYBOX
-			//case 3: cmd_remove_busybox(); break;
+			//case 4: cmd_remove_busybox(); break;
 			
 			// REMOVE SU
-			//case 4: cmd_remove_su(); break;
+			//case 5: cmd_remove_su(); break;
 		}
 
 		nav = navigate_menu(headers, items, &selection);
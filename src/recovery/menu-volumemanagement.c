@@ -23,6 +23,7 @@
 
 #include <stdio.h>						// Include STDIO declarations
 #include <stdlib.h>						// Include STDLIB declarations
+#include <string.h>						// Include STRING declarations
 #include "common.h"						// Include COMMON declarations
 #include "ui.h"							// Include UI declarations
 #include "menus.h"						// Include MENUS declarations
@@ -44,6 +45,13 @@
 //		> Backup Volumes
 //			> Backup Volume N [METHOD]
 //		> Restore Volumes
+//		> Backup Device (Incremental)
+//			> Full Backup
+//			> Incremental Backup
+//				> Select Base Backup
+//		> Restore Device (Incremental)
+//			> Select Backup
+//				> CONFIRMATION
 //		> Convert Volumes
 //			> Convert Volume N
 //				> Convert Volume N [FILESYSTEM1]
@@ -77,6 +85,8 @@ static char SUBHEADER_FORMATVOLUMES[] 	= "> Format Volumes";
 static char SUBHEADER_BACKUPVOLUMES[]	= "> Backup Volumes";
 static char SUBHEADER_RESTOREVOLUMES[]	= "> Restore Volumes";
 static char SUBHEADER_CONVERTVOLUMES[]	= "> Convert Volumes";
+static char SUBHEADER_BACKUPDEVICE[]	= "> Backup Device (Incremental)";
+static char SUBHEADER_RESTOREDEVICE[]	= "> Restore Device (Incremental)";
 
 // DISABLE_COMPRESSION_ITEM / ENABLE_COMPRESSION_ITEM 
 //
@@ -89,6 +99,13 @@ static char ENABLE_COMPRESSION_ITEM[] = "- Enable Backup File Compression";
 // Used to ignore the SDCARD volume for backup/restore operations
 static char VOLIGNORE_SDCARD[] = "SDCARD";
 
+// DEVICE_BACKUP_PATH / DEVICE_BACKUP_FILTER
+//
+// Used to browse for incremental device backups; every one of them
+// contains a block hash manifest for each volume
+static char DEVICE_BACKUP_PATH[] = "/sdcard/backup/device";
+static char DEVICE_BACKUP_FILTER[] = "*.manifest";
+
 // g_backup_compression
 //
 // Used to enable/disable backup file compression
@@ -105,6 +122,12 @@ static char** create_volume_menuitems(CREATE_VOLMENU_FLAGS* flags);
 // by create_volume_menuitems()
 static const Volume* select_volume_menuitem(int selection, CREATE_VOLMENU_FLAGS* flags);
 
+// Handler for the BACKUP DEVICE (INCREMENTAL) menu
+static int submenu_backupdevice(void);
+
+// Browses for an incremental device backup
+static int submenu_browsedevicebackups(char** headers, char* backuppath, int cch);
+
 // Handler for the BACKUP VOLUMES menu
 static int submenu_backupvolumes(void);
 
@@ -135,6 +158,12 @@ static int submenu_restoreonevolume(const Volume* volume);
 // Displays the Restore Volume confirmation and restores the volume
 static int submenu_restoreonevolume_confirm(const Volume* volume, const char* imgfile);
 
+// Handler for the RESTORE DEVICE (INCREMENTAL) menu
+static int submenu_restoredevice(void);
+
+// Displays the Restore Device confirmation and restores the device
+static int submenu_restoredevice_confirm(const char* backuppath);
+
 // Handler for the RESTORE VOLUMES menu
 static int submenu_restorevolumes(void);
 
@@ -278,6 +307,8 @@ int menu_volumemanagement(void)
 		"- Unmount Volumes",
 		"- Backup Volumes",
 		"- Restore Volumes",
+		"- Backup Device (Incremental)",
+		"- Restore Device (Incremental)",
 		"- Convert Volumes",
 		"- Format Volumes",
 		NULL);
@@ -306,11 +337,17 @@ int menu_volumemanagement(void)
 			// RESTORE VOLUMES
 			case 3: nav = submenu_restorevolumes(); break;
 			
+			// BACKUP DEVICE (INCREMENTAL)
+			case 4: nav = submenu_backupdevice(); break;
+			
+			// RESTORE DEVICE (INCREMENTAL)
+			case 5: nav = submenu_restoredevice(); break;
+			
 			// CONVERT VOLUMES
-			case 4: nav = submenu_convertvolumes(); break;
+			case 6: nav = submenu_convertvolumes(); break;
 
 			// FORMAT VOLUMES
-			case 5: nav = submenu_formatvolumes(); break;
+			case 7: nav = submenu_formatvolumes(); break;
 		}
 		
 		// NAVIGATE_HOME after a command breaks the loop so that
@@ -325,6 +362,68 @@ int menu_volumemanagement(void)
 	return nav;							// Return navigation code
 }
 
+//-----------------------------------------------------------------------------
+// submenu_backupdevice (private)
+//
+// Shows the BACKUP DEVICE (INCREMENTAL) submenu to the user.  A full backup
+// starts a new chain, an incremental backup only stores what has changed
+// since the base backup selected by the user
+//
+// Arguments:
+//
+//	NONE
+
+static int submenu_backupdevice(void)
+{
+	char**				headers = NULL;		// UI menu headers
+	char**	 			items = NULL;		// UI menu items
+	char 				basepath[256];		// Selected base backup
+	int 				selection;			// Selected menu item
+	int 				nav;				// Menu navigation code
+
+	// Allocate a standard header
+	headers = alloc_standard_header(SUBHEADER_BACKUPDEVICE);
+	if(headers == NULL) { LOGE("submenu_backupdevice: Cannot allocate menu headers"); return NAVIGATE_ERROR; }
+	
+	// Allocate the menu item list
+	items = alloc_menu_list(
+		"- Full Backup",
+		"- Incremental Backup",
+		NULL);
+	
+	if(items == NULL) {
+		
+		LOGE("submenu_backupdevice: Cannot allocate menu items");
+		free_menu_list(headers);
+		return NAVIGATE_ERROR;
+	}
+	
+	// Navigate the generated menu
+	nav = navigate_menu(headers, items, &selection);
+	while(nav == NAVIGATE_SELECT) {
+		
+		switch(selection) {
+			
+			// FULL BACKUP
+			case 0: cmd_backup_device_incremental(NULL); break;
+			
+			// INCREMENTAL BACKUP
+			case 1: 
+				nav = submenu_browsedevicebackups(headers, basepath, 256);
+				if(nav == NAVIGATE_SELECT) cmd_backup_device_incremental(basepath);
+				break;
+		}
+		
+		if(nav == NAVIGATE_HOME) break;
+		nav = NAVIGATE_BACK;
+	}
+
+	free_menu_list(items);				// Release the string array
+	free_menu_list(headers);			// Release the string array
+	
+	return nav;							// Return navigation code
+}
+
 //-----------------------------------------------------------------------------
 // submenu_backuponevolume (private)
 //
@@ -370,6 +469,12 @@ static int submenu_backuponevolume(const Volume* volume)
 	
 	sprintf(temp, "- Backup %s [yaffs2 image]", volume->name);
 	items = append_menu_list(items, temp);
+	
+	sprintf(temp, "- Backup %s [sparse raw dump]", volume->name);
+	items = append_menu_list(items, temp);
+	
+	sprintf(temp, "- Backup %s [deduplicated store]", volume->name);
+	items = append_menu_list(items, temp);
 
 	// Navigate the generated menu
 	nav = navigate_menu(headers, items, &selection);
@@ -381,6 +486,8 @@ static int submenu_backuponevolume(const Volume* volume)
 			case 1: cmd_backup_volume(volume, ext4_sparse, g_backup_compression); break;
 			case 2: cmd_backup_volume(volume, dump, g_backup_compression); break;
 			case 3: cmd_backup_volume(volume, yaffs2, g_backup_compression); break;
+			case 4: cmd_backup_volume(volume, dump_sparse, g_backup_compression); break;
+			case 5: cmd_backup_volume(volume, store, g_backup_compression); break;
 		}
 		
 		nav = NAVIGATE_BACK;
@@ -442,6 +549,49 @@ static int submenu_backupvolumes(void)
 	return nav;							// Return navigation code
 }
 
+//-----------------------------------------------------------------------------
+// submenu_browsedevicebackups (private)
+//
+// Browses the SDCARD for an incremental device backup.  The user selects any
+// of the backup's manifest files and the folder containing it is returned
+//
+// Arguments:
+//
+//	headers		- Menu headers
+//	backuppath	- Buffer to receive the selected backup folder
+//	cch			- Length of the backuppath buffer in characters
+
+static int submenu_browsedevicebackups(char** headers, char* backuppath, int cch)
+{
+	const Volume*	sdvolume;			// SDCARD volume
+	int 			sdmounted;			// Flag if SDCARD was mounted
+	char* 			slash;				// Last path separator
+	int 			nav;				// Menu navigation code
+	int 			result;				// Result from function call
+	
+	// Grab a reference to the SDCARD volume
+	sdvolume = get_volume("SDCARD");
+	if(sdvolume == NULL) { LOGE("submenu_browsedevicebackups: Cannot locate SDCARD volume entry in fstab"); return NAVIGATE_ERROR; }
+	
+	// The SDCARD volume has to be mounted before we can browse it (obviously)
+	result = mount_volume(sdvolume, &sdmounted);
+	if(result != 0) { LOGE("submenu_browsedevicebackups: Cannot mount SDCARD volume"); return NAVIGATE_ERROR; }
+	
+	nav = navigate_menu_browse(headers, DEVICE_BACKUP_PATH, DEVICE_BACKUP_FILTER, backuppath, cch);
+	
+	// Strip the manifest file name (and any trailing separators) from the selection
+	if(nav == NAVIGATE_SELECT) {
+		
+		slash = strrchr(backuppath, '/');
+		while((slash != NULL) && (slash > backuppath) && (*slash == '/')) *slash-- = '\0';
+	}
+	
+	// Unmount the SDCARD volume if it was mounted by this function
+	if(sdmounted) unmount_volume(sdvolume, NULL);
+	
+	return nav;							// Return navigation code
+}
+
 //-----------------------------------------------------------------------------
 // submenu_convertonevolume (private)
 //
@@ -775,6 +925,89 @@ static int submenu_mountvolumes(void)
 	return nav;							// Return navigation code
 }
 
+//-----------------------------------------------------------------------------
+// submenu_restoredevice (private)
+//
+// Shows the RESTORE DEVICE (INCREMENTAL) submenu to the user.  The user selects
+// an incremental device backup, which is restored along with its chain of base
+// backups
+//
+// Arguments:
+//
+//	NONE
+
+static int submenu_restoredevice(void)
+{
+	char**			headers = NULL;		// UI menu headers
+	char 			backuppath[256];	// Selected backup folder
+	int 			nav;				// Menu navigation code
+	
+	// Allocate a standard header
+	headers = alloc_standard_header(SUBHEADER_RESTOREDEVICE);
+	if(headers == NULL) { LOGE("submenu_restoredevice: Cannot allocate menu headers"); return NAVIGATE_ERROR; }
+	
+	nav = submenu_browsedevicebackups(headers, backuppath, 256);
+	if(nav == NAVIGATE_SELECT) nav = submenu_restoredevice_confirm(backuppath);
+	
+	free_menu_list(headers);			// Release the string array
+	return nav;							// Return navigation code
+}
+
+//-----------------------------------------------------------------------------
+// submenu_restoredevice_confirm (private)
+//
+// Confirms that the user really wants to restore the device from the selected
+// backup and if so, initiates the restore operation
+//
+// Arguments:
+//
+//	backuppath	- Incremental device backup folder to be restored
+
+static int submenu_restoredevice_confirm(const char* backuppath)
+{
+	char**				headers = NULL;		// UI menu headers
+	char**	 			items = NULL;		// UI menu items
+	int 				selection;			// Selected menu item
+	int 				nav;				// Menu navigation code
+	
+	// Allocate a standard header
+	headers = alloc_standard_header(SUBHEADER_RESTOREDEVICE);
+	if(headers == NULL) { LOGE("submenu_restoredevice_confirm: Cannot allocate menu headers\n"); return NAVIGATE_ERROR; }
+	
+	// Provide a warning message at the end of the header list
+	headers = append_menu_list(headers, "WARNING: All data on the backed up volumes");
+	headers = append_menu_list(headers, "will be replaced by the backup. Continue?");
+	headers = append_menu_list(headers, "");
+	
+	// Allocate the confirmation menu
+	items = alloc_menu_list("- No",
+							"- No",
+							"- No",
+							"- No",
+							"- Yes -- Restore Device",	// <--- 4
+							"- No",
+							"- No",
+							"- No",
+							"- No",
+							NULL);
+	
+	if(items == NULL) {
+		
+		LOGE("submenu_restoredevice_confirm: Cannot allocate menu items");
+		free_menu_list(headers);
+		return NAVIGATE_ERROR;
+	}
+	
+	// If the user selected YES, go ahead and restore the device
+	nav = navigate_menu(headers, items, &selection);
+	if((nav == NAVIGATE_SELECT) && (selection == 4)) cmd_restore_device_incremental(backuppath);
+
+	free_menu_list(items);				// Release the string array
+	free_menu_list(headers);			// Release the string array
+	
+	return nav;							// Return navigation code
+}
+
 //-----------------------------------------------------------------------------
 // submenu_restoreonevolume (private)
 //
@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
 
 #include "DirUtil.h"
@@ -221,30 +222,46 @@ dirUnlinkHierarchy(const char *path)
     return rmdir(path);
 }
 
-int
-dirSetHierarchyPermissions(const char *path,
+/* Set the permissions of <name>, looked up relative to <dirfd>, and of
+ * everything under it.  Directories are walked through file descriptors,
+ * so no path is resolved more than one component deep.
+ */
+static int
+setPermissionsAt(int dirfd, const char *name, unsigned char type,
         int uid, int gid, int dirMode, int fileMode)
 {
-    struct stat st;
-    if (lstat(path, &st)) {
-        return -1;
+    /* readdir() usually tells us the type; only ask when it can't */
+    if (type == DT_UNKNOWN) {
+        struct stat st;
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+            return -1;
+        }
+        type = S_ISDIR(st.st_mode) ? DT_DIR :
+               S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
     }
 
     /* ignore symlinks */
-    if (S_ISLNK(st.st_mode)) {
+    if (type == DT_LNK) {
         return 0;
     }
 
     /* directories and files get different permissions */
-    if (chown(path, uid, gid) ||
-        chmod(path, S_ISDIR(st.st_mode) ? dirMode : fileMode)) {
+    if (fchownat(dirfd, name, uid, gid, 0) ||
+        fchmodat(dirfd, name, type == DT_DIR ? dirMode : fileMode, 0)) {
         return -1;
     }
 
     /* recurse over directory components */
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
+    if (type == DT_DIR) {
+        int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd < 0) {
+            return -1;
+        }
+        DIR *dir = fdopendir(fd);
         if (dir == NULL) {
+            int save = errno;
+            close(fd);
+            errno = save;
             return -1;
         }
 
@@ -255,9 +272,8 @@ dirSetHierarchyPermissions(const char *path,
                 continue;
             }
 
-            char dn[PATH_MAX];
-            snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-            if (!dirSetHierarchyPermissions(dn, uid, gid, dirMode, fileMode)) {
+            if (!setPermissionsAt(fd, de->d_name, de->d_type,
+                                  uid, gid, dirMode, fileMode)) {
                 errno = 0;
             } else if (errno == 0) {
                 errno = -1;
@@ -278,3 +294,11 @@ dirSetHierarchyPermissions(const char *path,
 
     return 0;
 }
+
+int
+dirSetHierarchyPermissions(const char *path,
+        int uid, int gid, int dirMode, int fileMode)
+{
+    return setPermissionsAt(AT_FDCWD, path, DT_UNKNOWN,
+                            uid, gid, dirMode, fileMode);
+}
@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
@@ -23,8 +24,6 @@
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
 
-#define SORT_ENTRIES 1
-
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
@@ -97,64 +96,110 @@ static void dumpEntry(const ZipEntry* pEntry)
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
+ * Compute the hash code for a ZipEntry filename.
  *
- * Compare two ZipEntry structs, by name.
+ * Not expected to be compatible with any other hash function, so we init
+ * to 2 to ensure it doesn't happen to match.
  */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
+static unsigned int computeHash(const char* name, int nameLen)
 {
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    unsigned int hash = 2;
+
+    while (nameLen--)
+        hash = hash * 31 + *name++;
 
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
+    return hash;
 }
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * find a ZipEntry struct by name.
+ * Pick the first slot to probe for a hash.  The multiplicative hash above
+ * leaves its low bits poorly mixed for names that share a long prefix
+ * (which is nearly all of them), so fold the high bits down first.
  */
-static int hashcmpZipName(const void* ventry, const void* vname)
+static inline unsigned int hashSlot(unsigned int hash, unsigned int mask)
 {
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return hash & mask;
+}
 
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+/*
+ * Order two names the way the entry table is sorted: bytewise, with a
+ * name sorting before any longer name it is a prefix of.
+ */
+static int compareNames(const char* name1, unsigned int len1,
+    const char* name2, unsigned int len2)
+{
+    int diff = memcmp(name1, name2, (len1 < len2) ? len1 : len2);
+    if (diff != 0)
+        return diff;
+    return (len1 < len2) ? -1 : (len1 > len2);
 }
 
 /*
- * Compute the hash code for a ZipEntry filename.
+ * (This is a qsort callback.)
  *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
+ * Sort entries by name.  Duplicates keep central directory order, which
+ * is the order of their names within the mapping.
  */
-static unsigned int computeHash(const char* name, int nameLen)
+static int compareZipEntries(const void* ventry1, const void* ventry2)
 {
-    unsigned int hash = 2;
-
-    while (nameLen--)
-        hash = hash * 31 + *name++;
+    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
 
-    return hash;
+    int diff = compareNames(entry1->fileName, entry1->fileNameLen,
+            entry2->fileName, entry2->fileNameLen);
+    if (diff != 0)
+        return diff;
+    return (entry1->fileName < entry2->fileName) ? -1 :
+            (entry1->fileName > entry2->fileName);
 }
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+/*
+ * Build the name index over the (already sorted) entry table.  The table
+ * is a single allocation of at most 3/4 load, so lookups stay short
+ * without storing anything per entry beyond the slot itself.
+ */
+static bool buildEntryIndex(ZipArchive* pArchive)
 {
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
-
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
+    unsigned int numSlots = 16;
+    unsigned int i;
+
+    while (numSlots - (numSlots >> 2) < pArchive->numEntries)
+        numSlots <<= 1;
+
+    pArchive->pIndex = (ZipIndexSlot*) calloc(numSlots, sizeof(ZipIndexSlot));
+    if (pArchive->pIndex == NULL)
+        return false;
+    pArchive->indexMask = numSlots - 1;
+
+    for (i = 0; i < pArchive->numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        unsigned int hash = computeHash(pEntry->fileName, pEntry->fileNameLen);
+        unsigned int slot = hashSlot(hash, pArchive->indexMask);
+
+        while (pArchive->pIndex[slot].entry != 0) {
+            const ZipIndexSlot* pSlot = &pArchive->pIndex[slot];
+            const ZipEntry* found = &pArchive->pEntries[pSlot->entry - 1];
+            if (pSlot->hash == hash &&
+                found->fileNameLen == pEntry->fileNameLen &&
+                memcmp(found->fileName, pEntry->fileName,
+                        pEntry->fileNameLen) == 0)
+            {
+                LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+                    found->fileNameLen, found->fileName);
+                /* keep going; the first one wins lookups */
+                break;
+            }
+            slot = (slot + 1) & pArchive->indexMask;
+        }
+        if (pArchive->pIndex[slot].entry == 0) {
+            pArchive->pIndex[slot].hash = hash;
+            pArchive->pIndex[slot].entry = i + 1;
+        }
     }
+    return true;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -241,8 +286,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL)
         goto bail;
 
     ptr = pMap->addr + cdOffset;
@@ -275,58 +319,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
         //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
@@ -379,36 +372,24 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
-
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
-#if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Sort once all of the entries are in, rather than inserting each one
+     * in place, then index the final positions.  The sorted order is what
+     * lets mzFindZipEntryRange() answer directory queries.
      */
-    for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
-         */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
-    }
-#endif
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry), compareZipEntries);
+    if (!buildEntryIndex(pArchive))
+        goto bail;
 
     result = true;
 
 bail:
     if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
+        free(pArchive->pIndex);
+        pArchive->pIndex = NULL;
     }
     return result;
 }
@@ -430,48 +411,61 @@ bail:
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
 {
     MemMapping map;
+    int fd;
     int err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
 
     map.addr = NULL;
     memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = -1;
 
-    pArchive->fd = open(fileName, O_RDONLY, 0);
-    if (pArchive->fd < 0) {
+    fd = open(fileName, O_RDONLY, 0);
+    if (fd < 0) {
         err = errno ? errno : -1;
         LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
-        goto bail;
+        return err;
     }
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
-        err = -1;
+    if (sysMapFileInShmem(fd, &map) != 0) {
         LOGW("Map of '%s' failed\n", fileName);
-        goto bail;
-    }
-
-    if (map.length < ENDHDR) {
-        err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
-        goto bail;
+        close(fd);
+        return -1;
     }
 
-    if (!parseZipArchive(pArchive, &map)) {
-        err = -1;
+    err = mzOpenZipArchiveMapped(fd, &map, pArchive);
+    if (err != 0) {
         LOGV("Parsing '%s' failed\n", fileName);
-        goto bail;
+        close(fd);
+        sysReleaseShmem(&map);
     }
+    return err;
+}
 
-    err = 0;
-    sysCopyMap(&pArchive->map, &map);
-    map.addr = NULL;
+/*
+ * Open a Zip archive that has already been mapped by the caller.
+ *
+ * On success the archive takes ownership of "fd" and "pMap".  On failure
+ * the caller still owns them, and "pArchive" holds nothing to be closed.
+ */
+int mzOpenZipArchiveMapped(int fd, const MemMapping* pMap, ZipArchive* pArchive)
+{
+    memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = -1;
 
-bail:
-    if (err != 0)
+    if (pMap->length < ENDHDR) {
+        LOGV("File too small to be zip (%zd)\n", pMap->length);
+        return -1;
+    }
+
+    if (!parseZipArchive(pArchive, pMap)) {
         mzCloseZipArchive(pArchive);
-    if (map.addr != NULL)
-        sysReleaseShmem(&map);
-    return err;
+        return -1;
+    }
+
+    pArchive->fd = fd;
+    sysCopyMap(&pArchive->map, pMap);
+    return 0;
 }
 
 /*
@@ -489,11 +483,10 @@ void mzCloseZipArchive(ZipArchive* pArchive)
         sysReleaseShmem(&pArchive->map);
 
     free(pArchive->pEntries);
-
-    mzHashTableFree(pArchive->pHash);
+    free(pArchive->pIndex);
 
     pArchive->fd = -1;
-    pArchive->pHash = NULL;
+    pArchive->pIndex = NULL;
     pArchive->pEntries = NULL;
 }
 
@@ -505,10 +498,71 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    unsigned int nameLen = strlen(entryName);
+    unsigned int hash = computeHash(entryName, nameLen);
+    unsigned int slot = hashSlot(hash, pArchive->indexMask);
+
+    /* Names are only compared when the full hashes match. */
+    while (pArchive->pIndex[slot].entry != 0) {
+        const ZipIndexSlot* pSlot = &pArchive->pIndex[slot];
+        if (pSlot->hash == hash) {
+            const ZipEntry* pEntry = &pArchive->pEntries[pSlot->entry - 1];
+            if (pEntry->fileNameLen == nameLen &&
+                memcmp(pEntry->fileName, entryName, nameLen) == 0)
+                return pEntry;
+        }
+        slot = (slot + 1) & pArchive->indexMask;
+    }
+    return NULL;
+}
+
+/*
+ * Where an entry sorts relative to the block of names beginning with
+ * "prefix": negative before it, zero inside it, positive after it.
+ */
+static int comparePrefix(const ZipEntry* pEntry, const char* prefix,
+    unsigned int prefixLen)
+{
+    unsigned int len = pEntry->fileNameLen;
+    int diff = memcmp(pEntry->fileName, prefix,
+            (len < prefixLen) ? len : prefixLen);
+    if (diff != 0)
+        return diff;
+    return (len < prefixLen) ? -1 : 0;
+}
+
+/*
+ * Find the run of entries whose names begin with "prefix".
+ */
+unsigned int mzFindZipEntryRange(const ZipArchive* pArchive,
+        const char* prefix, unsigned int prefixLen, unsigned int* pCount)
+{
+    unsigned int low, high, first;
+
+    /* first entry at or after the prefix block */
+    low = 0;
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (comparePrefix(&pArchive->pEntries[mid], prefix, prefixLen) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    first = low;
+
+    /* first entry after the prefix block */
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (comparePrefix(&pArchive->pEntries[mid], prefix, prefixLen) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+    *pCount = low - first;
+    return first;
 }
 
 /*
@@ -731,6 +785,20 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
     return true;
 }
 
+/*
+ * Return the entry's data in place, if it is stored uncompressed.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    if (pEntry->compression != STORED ||
+        pEntry->compLen != pEntry->uncompLen ||
+        pEntry->offset + pEntry->compLen > (long)pArchive->map.length) {
+        return NULL;
+    }
+    return (const unsigned char *)pArchive->map.addr + pEntry->offset;
+}
+
 typedef struct {
     char *buf;
     int bufLen;
@@ -976,50 +1044,20 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
-     */
-    unsigned int i;
-    bool seenMatch = false;
-    int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
-        ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
+    /* Extract every entry whose path begins with zpath.  The entries
+     * are sorted, so they form one contiguous run; if zpath is empty,
+     * the run is the whole archive, which is what we want.
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
-         */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
+     */
+    unsigned int i, count;
+    unsigned int first = mzFindZipEntryRange(pArchive, zpath, zipDirLen,
+            &count);
+    int ok = true;
+    for (i = first; i < first + count; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + i;
 
         /* Find the target location of the entry.
          */
@@ -1147,3 +1185,399 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
     return ok;
 }
+
+/*
+ * djp952: parallel extraction for mzExtractRecursiveParallel().
+ *
+ * Directories and symlinks are still created by the calling thread, in
+ * archive order, before any worker starts; only regular file contents are
+ * farmed out.  Workers inflate straight out of the archive mapping (the
+ * shared fd offset can't be used from more than one thread) into a large
+ * private buffer, and claim entries largest-first so that one big file
+ * doesn't end up at the back of the queue.
+ */
+#define PARALLEL_OUTBUF_SIZE (1024 * 1024)
+
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;           // NULL if nothing left to do but the callback
+} MzExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    MzExtractJob **queue;       // regular files, largest compLen first
+    unsigned int queueLen;
+    unsigned int next;
+    bool failed;
+    pthread_mutex_t lock;
+} MzExtractPool;
+
+static int compareJobCompLen(const void *a, const void *b)
+{
+    const MzExtractJob *ja = *(const MzExtractJob * const *)a;
+    const MzExtractJob *jb = *(const MzExtractJob * const *)b;
+
+    if (ja->pEntry->compLen != jb->pEntry->compLen)
+        return (ja->pEntry->compLen > jb->pEntry->compLen) ? -1 : 1;
+    return (ja->pEntry < jb->pEntry) ? -1 : (ja->pEntry > jb->pEntry);
+}
+
+/* Write the contents of a STORED or DEFLATED entry to fd, reading the
+ * compressed data directly from the archive mapping.
+ */
+static bool extractMappedEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd, unsigned char *outBuf, size_t outBufLen)
+{
+    const unsigned char *data =
+            (const unsigned char *)pArchive->map.addr + pEntry->offset;
+
+    if (pEntry->compression == STORED) {
+        long left = pEntry->compLen;
+        if (left != pEntry->uncompLen) {
+            LOGW("Size mismatch on stored file (%ld vs %ld)\n",
+                left, pEntry->uncompLen);
+            return false;
+        }
+        while (left > 0) {
+            int count = (left > (long)outBufLen) ? (int)outBufLen : (int)left;
+            if (!writeProcessFunction(data, count, (void *)fd)) {
+                return false;
+            }
+            data += count;
+            left -= count;
+        }
+        return true;
+    }
+
+    if (pEntry->compression != DEFLATED) {
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+
+    z_stream zstream;
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.next_in = (Bytef *)data;
+    zstream.avail_in = pEntry->compLen;
+
+    int zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        return false;
+    }
+
+    bool ok = true;
+    do {
+        zstream.next_out = outBuf;
+        zstream.avail_out = outBufLen;
+        zerr = inflate(&zstream, Z_NO_FLUSH);
+        if (zerr != Z_OK && zerr != Z_STREAM_END) {
+            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
+            ok = false;
+            break;
+        }
+        /* All of the input is available up front, so a pass that neither
+         * consumes nor produces anything means the stream is truncated.
+         */
+        size_t produced = zstream.next_out - outBuf;
+        if (zerr == Z_OK && produced == 0 && zstream.avail_in == 0) {
+            LOGW("Truncated deflate stream\n");
+            ok = false;
+            break;
+        }
+        if (produced > 0 &&
+            !writeProcessFunction(outBuf, (int)produced, (void *)fd)) {
+            ok = false;
+            break;
+        }
+    } while (zerr == Z_OK);
+
+    if (ok && (long)zstream.total_out != pEntry->uncompLen) {
+        LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
+            (long)zstream.total_out, pEntry->uncompLen);
+        ok = false;
+    }
+    inflateEnd(&zstream);
+    return ok;
+}
+
+static bool extractJob(const MzExtractPool *pool, const MzExtractJob *job,
+    unsigned char *outBuf, size_t outBufLen)
+{
+    const ZipEntry *pEntry = job->pEntry;
+
+    int fd = open(job->targetFile, O_WRONLY | O_CREAT | O_TRUNC,
+            UNZIP_FILEMODE);
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                job->targetFile, strerror(errno));
+        return false;
+    }
+
+    /* Give the file its final size before writing so the filesystem
+     * doesn't have to extend it on every write.
+     */
+    if (pEntry->uncompLen > 0 && ftruncate(fd, pEntry->uncompLen) != 0) {
+        LOGW("Can't presize \"%s\": %s\n", job->targetFile, strerror(errno));
+    }
+
+    bool ok = extractMappedEntry(pool->pArchive, pEntry, fd, outBuf, outBufLen);
+    if (close(fd) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", job->targetFile);
+        return false;
+    }
+
+    if (pool->timestamp != NULL && utime(job->targetFile, pool->timestamp)) {
+        LOGE("Error touching \"%s\"\n", job->targetFile);
+        return false;
+    }
+
+    LOGD("Extracted file \"%s\"\n", job->targetFile);
+    return true;
+}
+
+static void *extractWorker(void *cookie)
+{
+    MzExtractPool *pool = (MzExtractPool *)cookie;
+
+    unsigned char *outBuf = (unsigned char *)malloc(PARALLEL_OUTBUF_SIZE);
+    if (outBuf == NULL) {
+        /* Leave the work to the other threads; the caller always runs
+         * a worker itself, so the queue still drains.
+         */
+        return NULL;
+    }
+
+    while (true) {
+        MzExtractJob *job = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->failed && pool->next < pool->queueLen) {
+            job = pool->queue[pool->next++];
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (job == NULL) break;
+
+        if (!extractJob(pool, job, outBuf, PARALLEL_OUTBUF_SIZE)) {
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = true;
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+    }
+
+    free(outBuf);
+    return NULL;
+}
+
+/*
+ * Like mzExtractRecursive(), but inflates regular files on up to
+ * numThreads threads.  All directories and symlinks exist, and every
+ * file has been completely written and closed, by the time this returns.
+ */
+bool mzExtractRecursiveParallel(const ZipArchive *pArchive,
+                        const char *zipDir, const char *targetDir,
+                        int flags, const struct utimbuf *timestamp,
+                        int numThreads,
+                        void (*callback)(const char *fn, void *), void *cookie)
+{
+    if (numThreads <= 1 || (flags & MZ_EXTRACT_DRY_RUN)) {
+        return mzExtractRecursive(pArchive, zipDir, targetDir, flags,
+                timestamp, callback, cookie);
+    }
+    if (zipDir[0] == '/') {
+        LOGE("mzExtractRecursiveParallel(): zipDir must be a relative path.\n");
+        return false;
+    }
+    if (targetDir[0] != '/') {
+        LOGE("mzExtractRecursiveParallel(): targetDir must be an absolute path.\n");
+        return false;
+    }
+
+    unsigned int zipDirLen = strlen(zipDir);
+    char *zpath = (char *)malloc(zipDirLen + 2);
+    MzExtractJob *jobs = (MzExtractJob *)calloc(pArchive->numEntries + 1,
+            sizeof(MzExtractJob));
+    MzExtractJob **queue = (MzExtractJob **)malloc(
+            (pArchive->numEntries + 1) * sizeof(MzExtractJob *));
+    if (zpath == NULL || jobs == NULL || queue == NULL) {
+        LOGE("Can't allocate extraction state for %u entries\n",
+                pArchive->numEntries);
+        free(zpath);
+        free(jobs);
+        free(queue);
+        return false;
+    }
+    if (zipDirLen > 0) {
+        memcpy(zpath, zipDir, zipDirLen);
+        if (zpath[zipDirLen-1] != '/') {
+            zpath[zipDirLen++] = '/';
+        }
+    }
+    zpath[zipDirLen] = '\0';
+
+    MzPathHelper helper;
+    helper.targetDir = targetDir;
+    helper.targetDirLen = strlen(helper.targetDir);
+    helper.zipDir = zpath;
+    helper.zipDirLen = strlen(helper.zipDir);
+    helper.buf = NULL;
+    helper.bufLen = 0;
+
+    /* Pass one, on this thread and in archive order: create every
+     * directory and symlink, and queue the regular files.  The most
+     * recently created parent directory is remembered so that a run of
+     * files in the same directory only walks the hierarchy once.
+     */
+    unsigned int i, numJobs = 0, queueLen = 0;
+    char *lastParent = NULL;
+    size_t lastParentLen = 0;
+    unsigned int count;
+    unsigned int first = mzFindZipEntryRange(pArchive, zpath, zipDirLen,
+            &count);
+    bool ok = true;
+    for (i = first; i < first + count; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + i;
+
+        const char *targetFile = targetEntryPath(&helper, pEntry);
+        if (targetFile == NULL) {
+            LOGE("Can't assemble target path for \"%.*s\"\n",
+                    pEntry->fileNameLen, pEntry->fileName);
+            ok = false;
+            break;
+        }
+
+        MzExtractJob *job = &jobs[numJobs++];
+        job->pEntry = pEntry;
+
+        if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
+            if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
+                if (dirCreateHierarchy(targetFile, UNZIP_DIRMODE,
+                        timestamp, false) != 0) {
+                    LOGE("Can't create containing directory for \"%s\": %s\n",
+                            targetFile, strerror(errno));
+                    ok = false;
+                    break;
+                }
+                LOGD("Extracted dir \"%s\"\n", targetFile);
+            }
+            job->targetFile = strdup(targetFile);
+            if (job->targetFile == NULL) {
+                ok = false;
+                break;
+            }
+            continue;
+        }
+
+        const char *slash = strrchr(targetFile, '/');
+        size_t parentLen = slash - targetFile;
+        if (lastParent == NULL || parentLen != lastParentLen ||
+            memcmp(lastParent, targetFile, parentLen) != 0) {
+            if (dirCreateHierarchy(targetFile, UNZIP_DIRMODE,
+                    timestamp, true) != 0) {
+                LOGE("Can't create containing directory for \"%s\": %s\n",
+                        targetFile, strerror(errno));
+                ok = false;
+                break;
+            }
+            free(lastParent);
+            lastParent = strndup(targetFile, parentLen);
+            lastParentLen = parentLen;
+        }
+
+        job->targetFile = strdup(targetFile);
+        if (job->targetFile == NULL) {
+            ok = false;
+            break;
+        }
+
+        if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
+            if (pEntry->uncompLen == 0) {
+                LOGE("Symlink entry \"%s\" has no target\n", targetFile);
+                ok = false;
+                break;
+            }
+            char *linkTarget = malloc(pEntry->uncompLen + 1);
+            if (linkTarget == NULL) {
+                ok = false;
+                break;
+            }
+            if (!mzReadZipEntry(pArchive, pEntry, linkTarget,
+                    pEntry->uncompLen)) {
+                LOGE("Can't read symlink target for \"%s\"\n", targetFile);
+                free(linkTarget);
+                ok = false;
+                break;
+            }
+            linkTarget[pEntry->uncompLen] = '\0';
+            if (symlink(linkTarget, targetFile) != 0) {
+                LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
+                        targetFile, linkTarget, strerror(errno));
+                free(linkTarget);
+                ok = false;
+                break;
+            }
+            LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
+                    targetFile, linkTarget);
+            free(linkTarget);
+        } else {
+            queue[queueLen++] = job;
+        }
+    }
+    free(lastParent);
+
+    /* Pass two: drain the file queue on the pool.  This thread works the
+     * queue too, so extraction still completes if no thread can be started.
+     */
+    if (ok && queueLen > 0) {
+        MzExtractPool pool;
+        pthread_t threads[numThreads];
+        int started = 0;
+
+        qsort(queue, queueLen, sizeof(MzExtractJob *), compareJobCompLen);
+
+        pool.pArchive = pArchive;
+        pool.timestamp = timestamp;
+        pool.queue = queue;
+        pool.queueLen = queueLen;
+        pool.next = 0;
+        pool.failed = false;
+        pthread_mutex_init(&pool.lock, NULL);
+
+        while (started < numThreads - 1 && started < (int)queueLen - 1) {
+            if (pthread_create(&threads[started], NULL, extractWorker,
+                    &pool) != 0) {
+                break;
+            }
+            started++;
+        }
+        extractWorker(&pool);
+        while (started > 0) {
+            pthread_join(threads[--started], NULL);
+        }
+
+        /* A worker that couldn't get a buffer leaves its jobs behind. */
+        if (!pool.failed && pool.next < pool.queueLen) {
+            LOGE("Out of memory extracting \"%s\"\n", targetDir);
+            pool.failed = true;
+        }
+        pthread_mutex_destroy(&pool.lock);
+        ok = !pool.failed;
+    }
+
+    for (i = 0; i < numJobs; i++) {
+        if (ok && callback != NULL) callback(jobs[i].targetFile, cookie);
+        free(jobs[i].targetFile);
+    }
+
+    free(queue);
+    free(jobs);
+    free(helper.buf);
+    free(zpath);
+
+    return ok;
+}
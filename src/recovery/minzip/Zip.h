@@ -8,10 +8,10 @@
 
 #include "inline_magic.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <utime.h>
 
-#include "Hash.h"
 #include "SysUtil.h"
 
 /*
@@ -35,14 +35,25 @@ typedef struct ZipEntry {
     long         externalFileAttributes;
 } ZipEntry;
 
+/*
+ * One slot of the name index.  The table is open-addressed and allocated
+ * in one piece; a slot holds the precomputed name hash and the position
+ * of the entry in pEntries (plus one, so that zero means empty).
+ */
+typedef struct ZipIndexSlot {
+    unsigned int hash;
+    unsigned int entry;
+} ZipIndexSlot;
+
 /*
  * One Zip archive.  Treat as opaque.
  */
 typedef struct ZipArchive {
     int         fd;
     unsigned int numEntries;
-    ZipEntry*   pEntries;
-    HashTable*  pHash;          // maps file name to ZipEntry
+    ZipEntry*   pEntries;       // sorted by name
+    ZipIndexSlot* pIndex;       // maps file name to ZipEntry
+    unsigned int indexMask;     // number of slots in pIndex, minus one
     MemMapping  map;
 } ZipArchive;
 
@@ -63,6 +74,15 @@ typedef struct {
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 
+/*
+ * Open a Zip archive from a file the caller has already mapped, so that the
+ * same mapping can be shared with other readers (e.g. signature verification).
+ *
+ * On success, returns 0, populates "pArchive" and takes ownership of "fd"
+ * and "pMap".  Returns nonzero on failure, leaving both with the caller.
+ */
+int mzOpenZipArchiveMapped(int fd, const MemMapping* pMap, ZipArchive* pArchive);
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -78,6 +98,15 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Find the entries whose names begin with the first prefixLen bytes of
+ * "prefix".  Entries are kept sorted by name, so they are contiguous;
+ * returns the index of the first and stores how many there are in
+ * "pCount" (zero if none match).
+ */
+unsigned int mzFindZipEntryRange(const ZipArchive* pArchive,
+        const char* prefix, unsigned int prefixLen, unsigned int* pCount);
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -162,6 +191,14 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
  */
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 
+/*
+ * Return a pointer to the entry's data within the archive mapping, or
+ * NULL if the entry is compressed and has to be inflated first.  The
+ * pointer is valid until the archive is closed.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive* pArchive,
+    const ZipEntry* pEntry);
+
 /*
  * Inflate and write an entry to a file.
  */
@@ -210,4 +247,18 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         int flags, const struct utimbuf *timestamp,
         void (*callback)(const char *fn, void*), void *cookie);
 
+/*
+ * Same as mzExtractRecursive(), but regular files are inflated and written
+ * on up to numThreads threads.  Directories and symlinks are created first,
+ * in archive order, on the calling thread; the callback is invoked for each
+ * entry in archive order once everything has been written.  All writes are
+ * complete when this returns.
+ *
+ * With numThreads <= 1, or MZ_EXTRACT_DRY_RUN, this is mzExtractRecursive().
+ */
+bool mzExtractRecursiveParallel(const ZipArchive *pArchive,
+        const char *zipDir, const char *targetDir,
+        int flags, const struct utimbuf *timestamp, int numThreads,
+        void (*callback)(const char *fn, void*), void *cookie);
+
 #endif /*_MINZIP_ZIP*/
@@ -40,12 +40,15 @@
 #include <sys/stat.h>							// Include STAT declarations
 #include <sys/mman.h>							// Include MMAN declarations
 #include <sys/time.h>							// Include TIME declarations
+#include <sys/uio.h>							// Include UIO declarations
 #include <unistd.h>								// Include UNISTD declarations
 #include <fcntl.h>								// Include FCNTL declarations
 #include <stdio.h>								// Include STDIO declarations
 #include <string.h>								// Include STRING declarations
 #include <stdlib.h>								// Include STDLIB declarations
 #include <limits.h>								// Include LIMITS declarations
+#include <malloc.h>								// Include MALLOC declarations
+#include <pthread.h>							// Include PTHREAD declarations
 #include <zlib.h>								// Include ZLIB declarations
 #include "ext4_utils/ext4_utils.h"				// Include EXT4_UTILS support
 #include "ext4_utils/output_file.h"				// Include EXT4_UTILS support
@@ -68,12 +71,18 @@
 #define SIMG_SPARSE_HEADER_LEN       	(sizeof(sparse_header_t))
 #define SIMG_CHUNK_HEADER_LEN 			(sizeof(chunk_header_t))
 
+// Constants for the streaming sparse EXT4 restore operation
+#define SIMG_RING_SLOTS					8				// Number of ring buffer slots
+#define SIMG_DIRECT_ALIGN				4096			// Alignment of the slot buffers
+
 // Constants for YAFFS2 restore operation
 // (From unyaffs.c)
 #define YAFFS2_CHUNK_SIZE 				2048
 #define YAFFS2_SPARE_SIZE 				64
 #define YAFFS2_MAX_OBJECTS 				50000
 #define YAFFS2_YAFFS_OBJECTID_ROOT		1
+#define YAFFS2_PAGE_SIZE				(YAFFS2_CHUNK_SIZE + YAFFS2_SPARE_SIZE)
+#define YAFFS2_MAX_IOVECS				1024			// Maximum data chunks per writev()
 
 //-----------------------------------------------------------------------------
 // PRIVATE TYPE DECLARATIONS
@@ -97,6 +106,66 @@ typedef struct {
 
 } YAFFS2_STATE;
 
+// YAFFS2_MAPPED_OBJECT
+//
+// Index entry for a single object in a memory-mapped YAFFS2 image; the object
+// header lives at page [header], and its file data (if any) occupies the next
+// [datapages] pages of the image
+typedef struct {
+
+	u32					header;
+	u32					datapages;
+
+} YAFFS2_MAPPED_OBJECT;
+
+// SIMG_SLOT_STATE
+//
+// Lifetime of a single ring buffer slot in the streaming sparse EXT4 restore
+typedef enum {
+
+	simg_slot_free		= 0,			// Available to the decompressor
+	simg_slot_filled,					// Holds data for the writer and checksum threads
+
+} SIMG_SLOT_STATE;
+
+// SIMG_SLOT
+//
+// A single ring buffer slot of the streaming sparse EXT4 restore.  A slot holds
+// up to SIMG_COPY_BUF_SIZE bytes of a raw or fill chunk, or describes an entire
+// "don't care" chunk without any data.  It is released once it has been both
+// written and checksummed
+typedef struct {
+
+	SIMG_SLOT_STATE		state;
+	u8*					data;
+	u64 				offset;
+	u64 				length;
+	int 				skip;
+	int 				written;
+	int 				summed;
+
+} SIMG_SLOT;
+
+// SIMG_PIPELINE
+//
+// Shared state of the streaming sparse EXT4 restore
+typedef struct {
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		changed;
+	SIMG_SLOT*			slots;
+	int 				numslots;
+	int 				out_fd;
+	int 				direct;
+	unsigned int		nextread;
+	unsigned int		nextwrite;
+	unsigned int		nextsum;
+	int 				eof;
+	int 				error;
+	u32 				crc32;
+
+} SIMG_PIPELINE;
+
 //-----------------------------------------------------------------------------
 // PRIVATE GLOBAL VARIABLES
 //-----------------------------------------------------------------------------
@@ -116,9 +185,33 @@ static u8* g_simg_zerobuf = NULL;		// Sparse EXT4 empty chunk buffer
 // SPARSE EXT4 helper function
 static int simg_process_raw_chunk(gzFile *in, FILE *out, u32 blocks, u32 blk_sz, u32 *crc32);
 
+// SPARSE EXT4 helper function
+static int simg_process_fill_chunk(gzFile *in, FILE *out, u32 blocks, u32 blk_sz, u32 *crc32);
+
 // SPARSE EXT4 helper function
 static int simg_process_skip_chunk(FILE *out, u32 blocks, u32 blk_sz, u32 *crc32);
 
+// SPARSE EXT4 helper function
+static void simg_fill_buffer(u8* buffer, u32 len, u32 fill);
+
+// SPARSE EXT4 helper function
+static int simg_read_chunk_header(gzFile* in, const sparse_header_t* sparse_header, unsigned int index,
+	chunk_header_t* chunk_header, ui_callbacks* callbacks);
+
+// SPARSE EXT4 streaming restore checksum thread
+static void* simg_restore_checksum(void* arg);
+
+// SPARSE EXT4 streaming restore
+static int simg_restore_pipelined(gzFile* in, const sparse_header_t* sparse_header, const Volume* volume,
+	u32* total_blocks, u32* crc32, ui_callbacks* callbacks);
+
+// SPARSE EXT4 serial restore
+static int simg_restore_serial(gzFile* in, const sparse_header_t* sparse_header, const Volume* volume,
+	u32* total_blocks, u32* crc32, ui_callbacks* callbacks);
+
+// SPARSE EXT4 streaming restore writer thread
+static void* simg_restore_writer(void* arg);
+
 // SPARSE EXT4 helper function
 static int simg_validate_and_skip_image_header(int in_fd, sparse_header_t* sparse_header, 
 	ui_callbacks* callbacks);
@@ -132,6 +225,9 @@ static void yaffs2_process_chunk(YAFFS2_STATE* state);
 // YAFFS2 helper function
 static int yaffs2_read_chunk(YAFFS2_STATE* state);
 
+// YAFFS2 memory-mapped restore
+static int yaffs2_restore_mapped(YAFFS2_STATE* state, const unsigned char* image, unsigned long long size);
+
 // YAFFS2 helper function
 static void yaffs2_term_state(YAFFS2_STATE* state);
 
@@ -314,13 +410,9 @@ int restore_ext4_sparse_ui(const char* imgfile, const Volume* volume, ui_callbac
 {
 	int 				in_fd;					// Input file handle
 	gzFile*				in_gz;					// Input GZIP file handle
-	FILE*				out;					// Output file handle
-	unsigned int 		index;					// Loop index variable
 	sparse_header_t 	sparse_header;			// EXT4 sparse image header
-	chunk_header_t 		chunk_header;			// EXT4 sparse image chunk header
 	u32					crc32 = 0;				// EXT4 sparse image CRC
 	u32 				total_blocks = 0;		// EXT4 sparse image block count
-	int 				blocks = 0;				// Return from block operation
 	int 				result = 0;				// Result from function call
 	
 	USES_UI_CALLBACKS(callbacks);				// For UI_ERROR et al
@@ -354,90 +446,11 @@ int restore_ext4_sparse_ui(const char* imgfile, const Volume* volume, ui_callbac
 		return errno; 
 	}
 	
-	// Attempt to open the output device
-	out = fopen(volume->device, "wb");
-	if(out == NULL) {
-	
-		result = errno;
-		UI_ERROR("Cannot open output device %s. EC = %d\n", volume->device, result);
-		gzclose(in_gz);
-		return result;
-	}
-	
-	// Attempt to allocate the requisite data buffers
-	g_simg_copybuf = calloc(SIMG_COPY_BUF_SIZE, sizeof(u8));
-	g_simg_zerobuf = calloc(1, sparse_header.blk_sz);
-	if(!g_simg_copybuf || !g_simg_zerobuf) {
-		
-		UI_ERROR("Insufficient memory available to allocate buffers\n");
-		if(g_simg_copybuf) { free(g_simg_copybuf); g_simg_copybuf = NULL; }
-		if(g_simg_zerobuf) { free(g_simg_zerobuf); g_simg_zerobuf = NULL; }
-		fclose(out);
-		gzclose(in_gz);		
-		return ENOMEM;	
-	}
+	// Restore the chunks through the streaming pipeline.  If the pipeline can't be
+	// set up, nothing has been read from the image yet so fall back to doing it serially
+	result = simg_restore_pipelined(in_gz, &sparse_header, volume, &total_blocks, &crc32, callbacks);
+	if(result == ENOMEM) result = simg_restore_serial(in_gz, &sparse_header, volume, &total_blocks, &crc32, callbacks);
 	
-	// All the invariants check out, start processing the image ...
-	for(index = 0; index < sparse_header.total_chunks; index++) {
-		
-		// Update the progress of the restore operation
-		UI_SETPROGRESS((float)index / ((float)sparse_header.total_chunks / 100));
-		
-		if(result != 0) break;				// Something bad happened
-		
-		// Read the next chunk header from the file
-		if(gzread(in_gz, &chunk_header, sizeof(chunk_header)) == sizeof(chunk_header)) {
-
-			// Skip the remaining bytes in a header that is longer than expected
-			if(sparse_header.chunk_hdr_sz > SIMG_CHUNK_HEADER_LEN)
-				gzseek(in_gz, sparse_header.chunk_hdr_sz - SIMG_CHUNK_HEADER_LEN, SEEK_CUR); 
-			
-			// Process the chunk
-			switch(chunk_header.chunk_type) {
-			
-				case CHUNK_TYPE_RAW:
-					if (chunk_header.total_sz != (sparse_header.chunk_hdr_sz + (chunk_header.chunk_sz * sparse_header.blk_sz)) ) {
-						
-						UI_ERROR("Bogus chunk size for chunk %d, type Raw\n", index);
-						result = -1;
-					}
-					else {
-						
-						blocks = simg_process_raw_chunk(in_gz, out, chunk_header.chunk_sz, sparse_header.blk_sz, &crc32);
-						if(blocks >= 0) total_blocks += blocks;
-						else { UI_ERROR("A read/write error occurred copying a raw chunk\n"); result = -1; }
-					}
-					break;
-					
-				case CHUNK_TYPE_DONT_CARE:
-					if (chunk_header.total_sz != sparse_header.chunk_hdr_sz) {
-						
-						UI_ERROR("Bogus chunk size for chunk %d, type=\"Dont Care\"\n", index);
-						result = -1;
-					}
-					else total_blocks += simg_process_skip_chunk(out, chunk_header.chunk_sz, sparse_header.blk_sz, &crc32);
-					break;
-					
-				default:
-					UI_ERROR("Unknown chunk type 0x%4.4x\n", chunk_header.chunk_type);
-					result = -1;
-					break;
-			}			
-		}
-		
-		// Could not read the chunk from the image file
-		else { 
-			
-			UI_ERROR("Error reading chunk header for chunk %d\n", index); 
-			result = -1; 
-			break;
-		}	
-	}
-
-	// Clean up the memory buffers and file handles
-	if(g_simg_zerobuf) { free(g_simg_zerobuf); g_simg_zerobuf = NULL; }	// Release buffer
-	if(g_simg_copybuf) { free(g_simg_copybuf); g_simg_copybuf = NULL; }	// Release buffer
-	fclose(out);														// Close output device
 	gzclose(in_gz);														// Close input file
 
 	// Execute some final invariant checks if everything went OK.  Nothing can be done
@@ -448,8 +461,11 @@ int restore_ext4_sparse_ui(const char* imgfile, const Volume* volume, ui_callbac
 		if(sparse_header.total_blks != total_blocks)
 			UI_WARNING("Wrote %d blocks, expected to write %d blocks\n", total_blocks, sparse_header.total_blks);
 		
-		// Ensure the the resultant checksum for the image file was correct
-		if(sparse_header.image_checksum != crc32)
+		// Ensure the the resultant checksum for the image file was correct.  Incremental
+		// images don't carry a checksum since their "don't care" chunks aren't zeroes.
+		// The sparse header has no flag for that, so a zero checksum means "none" and
+		// the rare image whose data really does have a CRC32 of zero isn't verified
+		if((sparse_header.image_checksum != 0) && (sparse_header.image_checksum != crc32))
 			UI_WARNING("Computed CRC32 of 0x%8.8x, expected 0x%8.8x\n", crc32, sparse_header.image_checksum);
 	}
 	
@@ -488,6 +504,7 @@ int restore_yaffs2_ui(const char* imgfile, const char* directory, ui_callbacks*
 {
 	YAFFS2_STATE 		state;				// Shared restore operation state
 	struct stat 		filestats;			// Image file statistics
+	void*				image;				// Memory-mapped image file
 	int 				result;				// Result from function call
 	
 	USES_UI_CALLBACKS(callbacks);
@@ -509,6 +526,24 @@ int restore_yaffs2_ui(const char* imgfile, const char* directory, ui_callbacks*
 		// Try to get the length of the image file for providing progress feedback
 		result = fstat(state.img_fd, &filestats);
 		if(result == 0) state.img_size = filestats.st_size;	
+		
+		// Uncompressed images are restored directly from a memory mapping of the image file,
+		// which avoids copying every chunk through the state buffer.  If the image is
+		// compressed or can't be mapped, fall back to reading it through zlib
+		if((state.img_size > 0) && (state.img_size == (size_t)state.img_size) && 
+			(pread(state.img_fd, state.data, 2, 0) == 2) && ((state.data[0] != 0x1F) || (state.data[1] != 0x8B))) {
+			
+			image = mmap(NULL, (size_t)state.img_size, PROT_READ, MAP_PRIVATE, state.img_fd, 0);
+			if(image != MAP_FAILED) {
+				
+				result = yaffs2_restore_mapped(&state, (const unsigned char*)image, state.img_size);
+				munmap(image, (size_t)state.img_size);
+				close(state.img_fd);
+				
+				yaffs2_term_state(&state);
+				return result;
+			}
+		}
 
 		// Now associate the file descriptor with a gzFile
 		state.img_gzfile = gzdopen(state.img_fd, "rb");
@@ -572,6 +607,41 @@ static int simg_process_raw_chunk(gzFile *in, FILE *out, u32 blocks, u32 blk_sz,
 	return blocks;
 }
 
+//-----------------------------------------------------------------------------
+// simg_process_fill_chunk (private)
+//
+// Processes a sparse EXT4 file chunk that repeats a 32-bit value
+//
+// Arguments:
+//
+//	in			- INPUT file pointer
+//	out			- OUTPUT file pointer
+//	blocks		- Number of blocks to process
+//	blk_sz		- Size of each block
+//	crc32		- Running CRC32 checksum
+
+static int simg_process_fill_chunk(gzFile *in, FILE *out, u32 blocks, u32 blk_sz, u32 *crc32)
+{
+	u64 	len = (u64)blocks * blk_sz;			// Calculated data length
+	u32 	fill;								// Fill value
+	int 	chunk;								// Calculated chunk size
+
+	if(gzread(in, &fill, sizeof(u32)) != sizeof(u32)) return -1;
+	simg_fill_buffer(g_simg_copybuf, SIMG_COPY_BUF_SIZE, fill);
+	
+	while (len) {
+		
+		chunk = (len > SIMG_COPY_BUF_SIZE) ? SIMG_COPY_BUF_SIZE : len;
+		
+		*crc32 = sparse_crc32(*crc32, g_simg_copybuf, chunk);
+		if (fwrite(g_simg_copybuf, chunk, 1, out) != 1) return -1;
+
+		len -= chunk; 
+	}
+
+	return blocks;
+}
+
 //-----------------------------------------------------------------------------
 // simg_process_skip_chunk (private)
 //
@@ -591,30 +661,499 @@ static int simg_process_skip_chunk(FILE *out, u32 blocks, u32 blk_sz, u32 *crc32
 	 * as a 32 bit value of blocks.
 	 */
 	u64 len = (u64)blocks * blk_sz;
-	u64 len_save;
 	u32 skip_chunk = 0;
 
+	// Account for the skipped region in the CRC without actually feeding that many
+	// zeroes through it; sparse dumps of mostly empty volumes consist largely of
+	// "don't care" chunks and this used to dominate the restore time
+	*crc32 = sparse_crc32_zeros(*crc32, len);
+
 	/* Fseek takes the offset as a long, which may be 32 bits on some systems.
 	 * So, lets do a sequence of fseeks() with SEEK_CUR to get the file pointer
 	 * where we want it.
 	 */
-	len_save = len;
-	while (len) {
-		skip_chunk = (len > 0x80000000) ? 0x80000000 : len;
-		fseek(out, skip_chunk, SEEK_CUR);
-		len -= skip_chunk;
-	}
-	/* And compute the CRC of the skipped region a chunk at a time */
-	len = len_save;
 	while (len) {
-		skip_chunk = (skip_chunk > blk_sz) ? blk_sz : skip_chunk;
-		*crc32 = sparse_crc32(*crc32, g_simg_zerobuf, skip_chunk);
+		skip_chunk = (len > 0x40000000) ? 0x40000000 : len;
+		if(fseek(out, skip_chunk, SEEK_CUR) != 0) return -1;
 		len -= skip_chunk;
 	}
 
 	return blocks;
 }
 
+//-----------------------------------------------------------------------------
+// simg_fill_buffer (private)
+//
+// Fills a buffer with repeated copies of a fill chunk's 32-bit value
+//
+// Arguments:
+//
+//	buffer		- Buffer to be filled
+//	len			- Length of the buffer, a multiple of 4 bytes
+//	fill		- Fill value
+
+static void simg_fill_buffer(u8* buffer, u32 len, u32 fill)
+{
+	u32 	index;								// Loop index variable
+	
+	if(fill == 0) { memset(buffer, 0, len); return; }
+	for(index = 0; index < len; index += sizeof(u32)) memcpy(buffer + index, &fill, sizeof(u32));
+}
+
+//-----------------------------------------------------------------------------
+// simg_read_chunk_header (private)
+//
+// Reads and validates the next chunk header from a sparse EXT4 image
+//
+// Arguments:
+//
+//	in				- INPUT file pointer
+//	sparse_header	- Sparse image header
+//	index			- Index of the chunk being read (for messages)
+//	chunk_header	- Receives the chunk header
+//	callbacks		- Optional UI callbacks
+
+static int simg_read_chunk_header(gzFile* in, const sparse_header_t* sparse_header, unsigned int index,
+	chunk_header_t* chunk_header, ui_callbacks* callbacks)
+{
+	USES_UI_CALLBACKS(callbacks);				// For UI_ERROR et al
+	
+	// Read the next chunk header from the file
+	if(gzread(in, chunk_header, sizeof(chunk_header_t)) != sizeof(chunk_header_t)) {
+		
+		UI_ERROR("Error reading chunk header for chunk %d\n", index); 
+		return -1;
+	}
+
+	// Skip the remaining bytes in a header that is longer than expected
+	if(sparse_header->chunk_hdr_sz > SIMG_CHUNK_HEADER_LEN)
+		gzseek(in, sparse_header->chunk_hdr_sz - SIMG_CHUNK_HEADER_LEN, SEEK_CUR); 
+	
+	switch(chunk_header->chunk_type) {
+	
+		case CHUNK_TYPE_RAW:
+			if (chunk_header->total_sz != (sparse_header->chunk_hdr_sz + (chunk_header->chunk_sz * sparse_header->blk_sz)) ) {
+				
+				UI_ERROR("Bogus chunk size for chunk %d, type Raw\n", index);
+				return -1;
+			}
+			break;
+			
+		case CHUNK_TYPE_FILL:
+			if (chunk_header->total_sz != (sparse_header->chunk_hdr_sz + sizeof(u32))) {
+				
+				UI_ERROR("Bogus chunk size for chunk %d, type Fill\n", index);
+				return -1;
+			}
+			break;
+			
+		case CHUNK_TYPE_DONT_CARE:
+			if (chunk_header->total_sz != sparse_header->chunk_hdr_sz) {
+				
+				UI_ERROR("Bogus chunk size for chunk %d, type=\"Dont Care\"\n", index);
+				return -1;
+			}
+			break;
+			
+		default:
+			UI_ERROR("Unknown chunk type 0x%4.4x\n", chunk_header->chunk_type);
+			return -1;
+	}
+	
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// simg_restore_checksum (private)
+//
+// Checksum thread for simg_restore_pipelined.  Calculates the running CRC32 of
+// the slots in the order they were read from the image
+//
+// Arguments:
+//
+//	arg				- Pointer to the shared SIMG_PIPELINE structure
+
+static void* simg_restore_checksum(void* arg)
+{
+	SIMG_PIPELINE*		pipeline = (SIMG_PIPELINE*)arg;
+	SIMG_SLOT*			slot;					// Slot being checksummed
+	u32 				crc32;					// Running CRC32
+	
+	pthread_mutex_lock(&pipeline->lock);
+	crc32 = pipeline->crc32;
+	
+	for(;;) {
+		
+		// Wait for the next slot in sequence to be filled
+		slot = &pipeline->slots[pipeline->nextsum % pipeline->numslots];
+		if(pipeline->error != 0) break;
+		if((pipeline->nextsum == pipeline->nextread) && (pipeline->eof)) break;
+		if((pipeline->nextsum == pipeline->nextread) || (slot->state != simg_slot_filled) || (slot->summed)) {
+			
+			pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+			continue;
+		}
+		
+		pthread_mutex_unlock(&pipeline->lock);
+		
+		// The writer only reads from the slot as well, so this can happen concurrently
+		if(slot->skip) crc32 = sparse_crc32_zeros(crc32, slot->length);
+		else crc32 = sparse_crc32(crc32, slot->data, (u32)slot->length);
+		
+		pthread_mutex_lock(&pipeline->lock);
+		
+		slot->summed = 1;
+		if(slot->written) slot->state = simg_slot_free;
+		pipeline->nextsum++;
+		pipeline->crc32 = crc32;
+		
+		pthread_cond_broadcast(&pipeline->changed);
+	}
+	
+	pthread_mutex_unlock(&pipeline->lock);
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// simg_restore_pipelined (private)
+//
+// Pipelined implementation of the sparse EXT4 chunk processing.  The calling
+// thread inflates the image into a ring of aligned slots, a writer thread issues
+// large O_DIRECT writes of each slot to the device at its absolute offset and a
+// checksum thread calculates the image CRC32 from the same slots.  The restore
+// then runs at the speed of the slower of inflate and flash write rather than
+// their sum.  Returns ENOMEM without reading from the image if the pipeline
+// cannot be set up
+//
+// Arguments:
+//
+//	in				- INPUT file pointer, positioned at the first chunk
+//	sparse_header	- Sparse image header
+//	volume			- Destination volume
+//	total_blocks	- Receives the total number of blocks processed
+//	crc32			- Receives the CRC32 of the image data
+//	callbacks		- Optional UI callbacks for progress and messages
+
+static int simg_restore_pipelined(gzFile* in, const sparse_header_t* sparse_header, const Volume* volume,
+	u32* total_blocks, u32* crc32, ui_callbacks* callbacks)
+{
+	SIMG_PIPELINE		pipeline;				// Shared pipeline state
+	pthread_t			writer;					// Writer thread
+	pthread_t			checksum;				// Checksum thread
+	int 				writerstarted = 0;		// Flag if the writer thread was started
+	int 				checksumstarted = 0;	// Flag if the checksum thread was started
+	SIMG_SLOT*			slot;					// Current slot being filled
+	chunk_header_t 		chunk_header;			// EXT4 sparse image chunk header
+	unsigned int		index;					// Loop index variable
+	u64 				offset = 0;				// Current output device offset
+	u64 				remain;					// Bytes remaining in the current chunk
+	u32 				fill = 0;				// Fill value of the current chunk
+	u32 				blocks = 0;				// Total number of blocks processed
+	int 				result = 0;				// Result from function call
+	
+	USES_UI_CALLBACKS(callbacks);				// For UI_ERROR et al
+	
+	memset(&pipeline, 0, sizeof(SIMG_PIPELINE));
+	pipeline.numslots = SIMG_RING_SLOTS;
+	
+	// Allocate the ring slots.  The data buffers are aligned for O_DIRECT
+	pipeline.slots = (SIMG_SLOT*)calloc(pipeline.numslots, sizeof(SIMG_SLOT));
+	if(!pipeline.slots) return ENOMEM;
+	
+	for(index = 0; index < (unsigned int)pipeline.numslots; index++) {
+		
+		pipeline.slots[index].data = (u8*)memalign(SIMG_DIRECT_ALIGN, SIMG_COPY_BUF_SIZE);
+		if(!pipeline.slots[index].data) { result = ENOMEM; break; }
+	}
+	
+	if(result != 0) goto cleanup_slots;
+	
+	pthread_mutex_init(&pipeline.lock, NULL);
+	pthread_cond_init(&pipeline.changed, NULL);
+	
+	// Open the output device for direct I/O so the writes don't churn the page cache.
+	// Not every device supports it, and only whole 512-byte sectors can be written
+	// that way; the writer drops back to buffered I/O if it gets refused
+	pipeline.direct = ((sparse_header->blk_sz % 512) == 0);
+	pipeline.out_fd = open(volume->device, O_WRONLY | ((pipeline.direct) ? O_DIRECT : 0));
+	if((pipeline.out_fd < 0) && (pipeline.direct)) {
+		
+		pipeline.direct = 0;
+		pipeline.out_fd = open(volume->device, O_WRONLY);
+	}
+	
+	if(pipeline.out_fd < 0) {
+		
+		result = errno;
+		UI_ERROR("Cannot open output device %s. EC = %d\n", volume->device, result);
+		goto cleanup_sync;
+	}
+	
+	// Start the writer and checksum threads.  Without both there is no pipeline
+	if(pthread_create(&writer, NULL, simg_restore_writer, &pipeline) == 0) writerstarted = 1;
+	if(pthread_create(&checksum, NULL, simg_restore_checksum, &pipeline) == 0) checksumstarted = 1;
+	if(!writerstarted || !checksumstarted) { result = ENOMEM; pipeline.error = -1; }
+	
+	// Inflate the image into the slots, one chunk at a time ...
+	for(index = 0; (result == 0) && (index < sparse_header->total_chunks); index++) {
+		
+		// Update the progress of the restore operation
+		UI_SETPROGRESS((float)index / ((float)sparse_header->total_chunks / 100));
+		
+		result = simg_read_chunk_header(in, sparse_header, index, &chunk_header, callbacks);
+		if(result != 0) break;
+		
+		remain = (u64)chunk_header.chunk_sz * sparse_header->blk_sz;
+		
+		if((chunk_header.chunk_type == CHUNK_TYPE_FILL) && (gzread(in, &fill, sizeof(u32)) != sizeof(u32))) {
+			
+			UI_ERROR("A read error occurred reading a fill chunk\n");
+			result = -1;
+			break;
+		}
+		
+		// A "don't care" chunk is a single slot without any data, it still needs to
+		// pass through the checksum thread in order.  Raw and fill chunks are split
+		// across as many slots as necessary
+		do {
+			
+			// Wait for the next slot in sequence to be released
+			pthread_mutex_lock(&pipeline.lock);
+			slot = &pipeline.slots[pipeline.nextread % pipeline.numslots];
+			while((slot->state != simg_slot_free) && (pipeline.error == 0)) pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+			result = pipeline.error;
+			pthread_mutex_unlock(&pipeline.lock);
+			if(result != 0) break;
+			
+			slot->skip = (chunk_header.chunk_type == CHUNK_TYPE_DONT_CARE);
+			slot->offset = offset;
+			slot->length = (slot->skip || (remain < SIMG_COPY_BUF_SIZE)) ? remain : SIMG_COPY_BUF_SIZE;
+			slot->written = slot->summed = 0;
+			
+			if(chunk_header.chunk_type == CHUNK_TYPE_FILL) simg_fill_buffer(slot->data, (u32)slot->length, fill);
+			else if(!slot->skip && (gzread(in, slot->data, (unsigned int)slot->length) != (int)slot->length)) {
+				
+				UI_ERROR("A read error occurred copying a raw chunk\n");
+				result = -1;
+				break;
+			}
+			
+			offset += slot->length;
+			remain -= slot->length;
+			
+			// Hand the slot over to the writer and checksum threads
+			pthread_mutex_lock(&pipeline.lock);
+			slot->state = simg_slot_filled;
+			pipeline.nextread++;
+			pthread_cond_broadcast(&pipeline.changed);
+			pthread_mutex_unlock(&pipeline.lock);
+		
+		} while(remain > 0);
+		
+		if(result == 0) blocks += chunk_header.chunk_sz;
+	}
+	
+	// Wait for the pipeline to drain and the threads to exit
+	pthread_mutex_lock(&pipeline.lock);
+	if((result != 0) && (result != ENOMEM)) pipeline.error = result;
+	pipeline.eof = 1;
+	pthread_cond_broadcast(&pipeline.changed);
+	pthread_mutex_unlock(&pipeline.lock);
+	
+	if(writerstarted) pthread_join(writer, NULL);
+	if(checksumstarted) pthread_join(checksum, NULL);
+	
+	if((result == 0) && (pipeline.error != 0)) {
+		
+		UI_ERROR("A write error occurred writing to output device %s. EC = %d\n", volume->device, pipeline.error);
+		result = -1;
+	}
+	
+	// Nothing is buffered with O_DIRECT, but the fallback path may be
+	if((fsync(pipeline.out_fd) != 0) && (result == 0) && (errno != EINVAL)) {
+		
+		UI_ERROR("A write error occurred writing to output device %s. EC = %d\n", volume->device, errno);
+		result = -1;
+	}
+	
+	close(pipeline.out_fd);
+	
+	*total_blocks = blocks;
+	*crc32 = pipeline.crc32;
+	
+cleanup_sync:
+
+	pthread_cond_destroy(&pipeline.changed);
+	pthread_mutex_destroy(&pipeline.lock);
+	
+cleanup_slots:
+	
+	for(index = 0; index < (unsigned int)pipeline.numslots; index++)
+		if(pipeline.slots[index].data) free(pipeline.slots[index].data);
+	
+	free(pipeline.slots);
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// simg_restore_serial (private)
+//
+// Serial implementation of the sparse EXT4 chunk processing, used when the
+// streaming pipeline cannot be set up
+//
+// Arguments:
+//
+//	in				- INPUT file pointer, positioned at the first chunk
+//	sparse_header	- Sparse image header
+//	volume			- Destination volume
+//	total_blocks	- Receives the total number of blocks processed
+//	crc32			- Receives the CRC32 of the image data
+//	callbacks		- Optional UI callbacks for progress and messages
+
+static int simg_restore_serial(gzFile* in, const sparse_header_t* sparse_header, const Volume* volume,
+	u32* total_blocks, u32* crc32, ui_callbacks* callbacks)
+{
+	FILE*				out;					// Output file handle
+	unsigned int 		index;					// Loop index variable
+	chunk_header_t 		chunk_header;			// EXT4 sparse image chunk header
+	int 				blocks = 0;				// Return from block operation
+	int 				result = 0;				// Result from function call
+	
+	USES_UI_CALLBACKS(callbacks);				// For UI_ERROR et al
+	
+	// Attempt to open the output device
+	out = fopen(volume->device, "wb");
+	if(out == NULL) {
+	
+		result = errno;
+		UI_ERROR("Cannot open output device %s. EC = %d\n", volume->device, result);
+		return result;
+	}
+	
+	// Attempt to allocate the requisite data buffers
+	g_simg_copybuf = calloc(SIMG_COPY_BUF_SIZE, sizeof(u8));
+	g_simg_zerobuf = calloc(1, sparse_header->blk_sz);
+	if(!g_simg_copybuf || !g_simg_zerobuf) {
+		
+		UI_ERROR("Insufficient memory available to allocate buffers\n");
+		if(g_simg_copybuf) { free(g_simg_copybuf); g_simg_copybuf = NULL; }
+		if(g_simg_zerobuf) { free(g_simg_zerobuf); g_simg_zerobuf = NULL; }
+		fclose(out);
+		return ENOMEM;	
+	}
+	
+	// All the invariants check out, start processing the image ...
+	for(index = 0; index < sparse_header->total_chunks; index++) {
+		
+		// Update the progress of the restore operation
+		UI_SETPROGRESS((float)index / ((float)sparse_header->total_chunks / 100));
+		
+		// Read the next chunk header from the file
+		result = simg_read_chunk_header(in, sparse_header, index, &chunk_header, callbacks);
+		if(result != 0) break;
+		
+		// Process the chunk
+		if(chunk_header.chunk_type == CHUNK_TYPE_RAW) {
+			
+			blocks = simg_process_raw_chunk(in, out, chunk_header.chunk_sz, sparse_header->blk_sz, crc32);
+			if(blocks >= 0) *total_blocks += blocks;
+			else { UI_ERROR("A read/write error occurred copying a raw chunk\n"); result = -1; break; }
+		}
+		
+		else if(chunk_header.chunk_type == CHUNK_TYPE_FILL) {
+			
+			blocks = simg_process_fill_chunk(in, out, chunk_header.chunk_sz, sparse_header->blk_sz, crc32);
+			if(blocks >= 0) *total_blocks += blocks;
+			else { UI_ERROR("A read/write error occurred writing a fill chunk\n"); result = -1; break; }
+		}
+		
+		else {
+			
+			blocks = simg_process_skip_chunk(out, chunk_header.chunk_sz, sparse_header->blk_sz, crc32);
+			if(blocks >= 0) *total_blocks += blocks;
+			else { UI_ERROR("A seek error occurred skipping a \"Dont Care\" chunk\n"); result = -1; break; }
+		}
+	}
+
+	// Clean up the memory buffers and file handles
+	if(g_simg_zerobuf) { free(g_simg_zerobuf); g_simg_zerobuf = NULL; }	// Release buffer
+	if(g_simg_copybuf) { free(g_simg_copybuf); g_simg_copybuf = NULL; }	// Release buffer
+	fclose(out);														// Close output device
+	
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// simg_restore_writer (private)
+//
+// Writer thread for simg_restore_pipelined.  Writes the filled slots to the
+// output device at their absolute offsets, in the order they were read
+//
+// Arguments:
+//
+//	arg				- Pointer to the shared SIMG_PIPELINE structure
+
+static void* simg_restore_writer(void* arg)
+{
+	SIMG_PIPELINE*		pipeline = (SIMG_PIPELINE*)arg;
+	SIMG_SLOT*			slot;					// Slot being written
+	u32 				cbwritten;				// Bytes written from the slot
+	ssize_t 			cb;						// Bytes returned from pwrite()
+	int 				error;					// Error code from pwrite()
+	
+	pthread_mutex_lock(&pipeline->lock);
+	
+	for(;;) {
+		
+		// Wait for the next slot in sequence to be filled
+		slot = &pipeline->slots[pipeline->nextwrite % pipeline->numslots];
+		if(pipeline->error != 0) break;
+		if((pipeline->nextwrite == pipeline->nextread) && (pipeline->eof)) break;
+		if((pipeline->nextwrite == pipeline->nextread) || (slot->state != simg_slot_filled) || (slot->written)) {
+			
+			pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+			continue;
+		}
+		
+		pthread_mutex_unlock(&pipeline->lock);
+		
+		// "Don't care" slots just leave the device contents alone
+		error = 0;
+		cbwritten = 0;
+		while((!slot->skip) && (cbwritten < slot->length)) {
+			
+			cb = pwrite64(pipeline->out_fd, slot->data + cbwritten, slot->length - cbwritten, slot->offset + cbwritten);
+			if(cb > 0) { cbwritten += cb; continue; }
+			
+			// The device doesn't like this direct write (size or alignment), switch
+			// the descriptor over to buffered I/O and try it again
+			if((cb < 0) && (errno == EINVAL) && (pipeline->direct)) {
+				
+				pipeline->direct = 0;
+				if(fcntl(pipeline->out_fd, F_SETFL, fcntl(pipeline->out_fd, F_GETFL) & ~O_DIRECT) == 0) continue;
+			}
+			
+			error = (cb < 0) ? errno : EIO;
+			break;
+		}
+		
+		pthread_mutex_lock(&pipeline->lock);
+		
+		if(error != 0) { pipeline->error = error; }
+		else {
+			
+			slot->written = 1;
+			if(slot->summed) slot->state = simg_slot_free;
+			pipeline->nextwrite++;
+		}
+		
+		pthread_cond_broadcast(&pipeline->changed);
+	}
+	
+	pthread_mutex_unlock(&pipeline->lock);
+	return NULL;
+}
+
 //-----------------------------------------------------------------------------
 // simg_validate_image_header (private)
 //
@@ -827,6 +1366,199 @@ static int yaffs2_read_chunk(YAFFS2_STATE* state)
 	return result;
 }
 
+//-----------------------------------------------------------------------------
+// yaffs2_restore_mapped (private)
+//
+// Restores a memory-mapped uncompressed YAFFS2 image.  The object headers are
+// parsed in a single pass to build an index of the image, then the directories
+// are created, the file data is written straight out of the mapping with one
+// writev() per file (per YAFFS2_MAX_IOVECS chunks) and finally the ownership,
+// permissions and times are applied to every object.  Applying the attributes
+// last also keeps the directory times from being changed by their contents
+//
+// Arguments:
+//
+//	state		- YAFFS2_STATE structure for this restore operation
+//	image		- Memory-mapped image file
+//	size		- Length of the image file
+
+static int yaffs2_restore_mapped(YAFFS2_STATE* state, const unsigned char* image, unsigned long long size)
+{
+	YAFFS2_MAPPED_OBJECT*		objects = NULL;		// Object index
+	YAFFS2_MAPPED_OBJECT*		newobjects;			// Reallocated object index
+	unsigned int				numobjects = 0;		// Number of indexed objects
+	unsigned int				maxobjects = 0;		// Allocated length of the object index
+	const yaffs_ObjectHeader*	oh;					// Object header
+	const yaffs_PackedTags2*	pt;					// Packed tags of a page
+	const yaffs_PackedTags2*	datapt;				// Packed tags of a data page
+	struct iovec				iov[YAFFS2_MAX_IOVECS];	// Data chunks of a file
+	struct timeval 				times[2];			// Object access/modification times
+	char*						path;				// Full path of an object
+	unsigned long long			remain;				// Remaining file data
+	u32							numpages;			// Number of pages in the image
+	u32							page;				// Current image page
+	u32							index;				// Loop index variable
+	u32							chunk;				// Data chunk index
+	int 						numiov;				// Number of iovecs to be written
+	ssize_t						cbexpected;			// Expected bytes written by writev()
+	int 						fd;					// Output file descriptor
+	int 						result = 0;			// Result from this function
+	
+	USES_UI_CALLBACKS(state->callbacks);
+	
+	numpages = (u32)(size / YAFFS2_PAGE_SIZE);
+	if((size % YAFFS2_PAGE_SIZE) != 0) { UI_ERROR("yaffs2_restore_mapped: Source image file is corrupt.\n"); }
+	
+	madvise((void*)image, (size_t)size, MADV_SEQUENTIAL);
+	
+	// INDEX: Walk the object headers, building the full path of each object and noting
+	// how many of the following pages hold its data
+	for(page = 0; page < numpages; page++) {
+		
+		oh = (const yaffs_ObjectHeader*)(image + ((unsigned long long)page * YAFFS2_PAGE_SIZE));
+		pt = (const yaffs_PackedTags2*)((const unsigned char*)oh + YAFFS2_CHUNK_SIZE);
+		if(pt->t.byteCount != 0xffff) continue;
+		
+		// The image starts with a header for the root directory itself, which already exists
+		// and keeps the path of the destination directory
+		if((pt->t.objectId >= YAFFS2_MAX_OBJECTS) || (oh->parentObjectId >= YAFFS2_MAX_OBJECTS) || (state->obj_list[oh->parentObjectId] == NULL) || 
+			((pt->t.objectId != YAFFS2_YAFFS_OBJECTID_ROOT) && (state->obj_list[pt->t.objectId] != NULL))) {
+			
+			UI_ERROR("yaffs2_restore_mapped: Invalid object header at page %u\n", page);
+			result = EINVAL;
+			continue;
+		}
+		
+		if(numobjects == maxobjects) {
+			
+			maxobjects = (maxobjects) ? maxobjects * 2 : 1024;
+			newobjects = (YAFFS2_MAPPED_OBJECT*)realloc(objects, maxobjects * sizeof(YAFFS2_MAPPED_OBJECT));
+			if(newobjects == NULL) { free(objects); return ENOMEM; }
+			objects = newobjects;
+		}
+		
+		if(pt->t.objectId != YAFFS2_YAFFS_OBJECTID_ROOT) {
+			
+			path = (char*)malloc(strnlen(oh->name, YAFFS_MAX_NAME_LENGTH + 1) + strlen(state->obj_list[oh->parentObjectId]) + 2);
+			if(path == NULL) { free(objects); return ENOMEM; }
+			
+			sprintf(path, "%s/%.*s", state->obj_list[oh->parentObjectId], YAFFS_MAX_NAME_LENGTH, oh->name);
+			state->obj_list[pt->t.objectId] = path;
+		}
+		
+		objects[numobjects].header = page;
+		objects[numobjects].datapages = 0;
+		
+		// The file data follows the header as a run of data pages tagged with the same object
+		while(page + 1 < numpages) {
+			
+			datapt = (const yaffs_PackedTags2*)(image + ((unsigned long long)(page + 1) * YAFFS2_PAGE_SIZE) + YAFFS2_CHUNK_SIZE);
+			if((datapt->t.byteCount == 0xffff) || (datapt->t.objectId != pt->t.objectId)) break;
+			
+			objects[numobjects].datapages++;
+			page++;
+		}
+		
+		numobjects++;
+	}
+	
+	// DIRECTORIES: Create the entire directory tree up front; the image lists parents before children
+	for(index = 0; index < numobjects; index++) {
+		
+		oh = (const yaffs_ObjectHeader*)(image + ((unsigned long long)objects[index].header * YAFFS2_PAGE_SIZE));
+		pt = (const yaffs_PackedTags2*)((const unsigned char*)oh + YAFFS2_CHUNK_SIZE);
+		if(oh->type == YAFFS_OBJECT_TYPE_DIRECTORY) mkdir(state->obj_list[pt->t.objectId], 0777);
+	}
+	
+	// CONTENTS: Write the files straight out of the mapping, and create the links
+	for(index = 0; index < numobjects; index++) {
+		
+		oh = (const yaffs_ObjectHeader*)(image + ((unsigned long long)objects[index].header * YAFFS2_PAGE_SIZE));
+		pt = (const yaffs_PackedTags2*)((const unsigned char*)oh + YAFFS2_CHUNK_SIZE);
+		path = state->obj_list[pt->t.objectId];
+		
+		switch(oh->type) {
+			
+			case YAFFS_OBJECT_TYPE_FILE:
+				
+				fd = creat(path, oh->yst_mode);
+				if(fd < 0) { UI_ERROR("yaffs2_restore_mapped: Cannot create file %s. EC = %d\n", path, errno); result = errno; break; }
+				
+				remain = oh->fileSize;
+				chunk = 0;
+				
+				while((remain > 0) && (chunk < objects[index].datapages)) {
+					
+					// Gather as many of the data chunks as possible into a single writev()
+					numiov = 0;
+					cbexpected = 0;
+					
+					while((remain > 0) && (chunk < objects[index].datapages) && (numiov < YAFFS2_MAX_IOVECS)) {
+						
+						iov[numiov].iov_base = (void*)(image + ((unsigned long long)(objects[index].header + 1 + chunk) * YAFFS2_PAGE_SIZE));
+						datapt = (const yaffs_PackedTags2*)((const unsigned char*)iov[numiov].iov_base + YAFFS2_CHUNK_SIZE);
+						iov[numiov].iov_len = (remain < datapt->t.byteCount) ? (size_t)remain : datapt->t.byteCount;
+						
+						remain -= iov[numiov].iov_len;
+						cbexpected += iov[numiov].iov_len;
+						numiov++;
+						chunk++;
+					}
+					
+					if(writev(fd, iov, numiov) != cbexpected) {
+						
+						UI_ERROR("yaffs2_restore_mapped: Cannot write file %s. EC = %d\n", path, errno);
+						result = (errno) ? errno : EIO;
+						remain = 0;						// Already reported
+						break;
+					}
+				}
+				
+				if(remain > 0) { UI_ERROR("yaffs2_restore_mapped: File %s is truncated\n", path); result = EINVAL; }
+				close(fd);
+				break;
+				
+			case YAFFS_OBJECT_TYPE_SYMLINK:
+				symlink(oh->alias, path);
+				break;
+				
+			case YAFFS_OBJECT_TYPE_HARDLINK:
+				if((oh->equivalentObjectId < YAFFS2_MAX_OBJECTS) && (state->obj_list[oh->equivalentObjectId] != NULL))
+					link(state->obj_list[oh->equivalentObjectId], path);
+				break;
+				
+			default: break;
+		}
+		
+		// Only update the progress every so often, the object headers are cheap to process
+		if((++state->progress_modulo % 20) == 0) UI_SETPROGRESS((float)((unsigned long long)objects[index].header * 100) / (float)numpages);
+	}
+	
+	// ATTRIBUTES: Apply ownership, permissions and times to everything that was created
+	for(index = 0; index < numobjects; index++) {
+		
+		oh = (const yaffs_ObjectHeader*)(image + ((unsigned long long)objects[index].header * YAFFS2_PAGE_SIZE));
+		pt = (const yaffs_PackedTags2*)((const unsigned char*)oh + YAFFS2_CHUNK_SIZE);
+		path = state->obj_list[pt->t.objectId];
+		
+		// Hard links share the inode of their equivalent object, and carry no attributes of their own
+		if(oh->type == YAFFS_OBJECT_TYPE_HARDLINK) continue;
+		
+		lchown(path, oh->yst_uid, oh->yst_gid);
+		if(oh->type != YAFFS_OBJECT_TYPE_SYMLINK) chmod(path, oh->yst_mode);
+		
+		memset(times, 0, sizeof(times));
+		times[0].tv_sec = oh->yst_atime;
+		times[1].tv_sec = oh->yst_mtime;
+		utimes(path, times);
+	}
+	
+	UI_SETPROGRESS(100);
+	
+	free(objects);
+	return result;
+}
+
 //-----------------------------------------------------------------------------
 // yaffs2_term_state (private)
 //
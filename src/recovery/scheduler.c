@@ -0,0 +1,646 @@
+//-----------------------------------------------------------------------------
+// scheduler.c
+//
+// Samsung Galaxy S CDMA SCH-I500 Recovery
+// Volume Job Scheduler
+//
+// Copyright (C) 2007 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Modifications: Copyright (C) 2011 Michael Brehm
+//-----------------------------------------------------------------------------
+
+#include <stdlib.h>						// Include STDLIB declarations
+#include <stdarg.h>						// Include STDARG declarations
+#include <string.h>						// Include STRING declarations
+#include <errno.h>						// Include ERRNO declarations
+#include <unistd.h>						// Include UNISTD declarations
+#include <poll.h>						// Include POLL declarations
+#include <pthread.h>					// Include PTHREAD declarations
+#include <sys/types.h>					// Include TYPES declarations
+#include <sys/time.h>					// Include TIME declarations
+#include "scheduler.h"					// Include SCHEDULER declarations
+
+//-----------------------------------------------------------------------------
+// PRIVATE CONSTANTS / MACROS
+//-----------------------------------------------------------------------------
+
+// Maximum length of a physical device name
+#define SCHED_MAX_DEVICE_NAME			32
+
+// Maximum length of a message forwarded from a job thread
+#define SCHED_MAX_MESSAGE				256
+
+//-----------------------------------------------------------------------------
+// PRIVATE TYPE DECLARATIONS
+//-----------------------------------------------------------------------------
+
+// SCHED_MESSAGE_TYPE
+//
+// Types of messages sent from a job thread back to the scheduler
+typedef enum {
+
+	sched_print		= 0,				// UI text, followed by length bytes of text
+	sched_progress,						// Job progress update
+	sched_result,						// Job has completed
+
+} SCHED_MESSAGE_TYPE;
+
+// SCHED_MESSAGE
+//
+// Fixed-size message header sent from a job thread back to the scheduler.  All
+// messages are smaller than PIPE_BUF, so they are written to the pipe atomically
+typedef struct {
+
+	SCHED_MESSAGE_TYPE	type;
+	int 				job;
+	int 				result;
+	float 				progress;
+	unsigned long		elapsed_ms;
+	int 				length;
+
+} SCHED_MESSAGE;
+
+// SCHED_GROUP
+//
+// A set of jobs that target the same physical device and are run serially
+typedef struct {
+
+	char 				device[SCHED_MAX_DEVICE_NAME];
+	pthread_t 			thread;
+	int 				started;
+	int 				fd;
+
+} SCHED_GROUP;
+
+// SCHED_THREAD
+//
+// Everything a job thread needs to run the jobs of one group.  The pipe, current
+// job and last reported progress are also reached from the UI callbacks, which
+// have no context argument, through g_sched_key
+typedef struct {
+
+	volume_job*			jobs;
+	int 				count;
+	const int*			jobgroup;
+	int 				group;
+	VOLUME_JOB_CALLBACK	job;
+	void*				context;
+	int 				fd;
+	int 				current;
+	float 				lastprogress;
+
+} SCHED_THREAD;
+
+//-----------------------------------------------------------------------------
+// PRIVATE GLOBAL VARIABLES
+//-----------------------------------------------------------------------------
+
+// UI_PRINT/PROGRESS callbacks have no context argument, so each job thread
+// keeps its SCHED_THREAD in thread-specific data
+static pthread_key_t 			g_sched_key;
+static pthread_once_t 			g_sched_key_once = PTHREAD_ONCE_INIT;
+
+// Inline fallback state, used to aggregate progress when a thread can't be started
+static int 						g_sched_job = -1;
+static volume_job*				g_sched_jobs = NULL;
+static float* 					g_sched_progress = NULL;
+static int 						g_sched_count = 0;
+static ui_callbacks*			g_sched_callbacks = NULL;
+
+//-----------------------------------------------------------------------------
+// PRIVATE FUNCTION PROTOTYPES
+//-----------------------------------------------------------------------------
+
+// Executes a single job and records its result and elapsed time
+static void sched_execute_job(volume_job* jobs, int index, VOLUME_JOB_CALLBACK job, void* context,
+	ui_callbacks* callbacks);
+
+// Calculates the aggregate progress of all jobs
+static float sched_aggregate_progress(const volume_job* jobs, const float* progress, int count);
+
+// Creates the thread-specific data key for job threads
+static void sched_create_key(void);
+
+// Entry point for a job thread
+static void* sched_thread_proc(void* arg);
+
+// UIPRINT_CALLBACK for job threads
+static void sched_thread_print(const char* fmt, ...);
+
+// PROGRESS_CALLBACK for job threads
+static void sched_thread_progress(float percent);
+
+// PROGRESS_CALLBACK for jobs run inline
+static void sched_inline_progress(float percent);
+
+// Writes a job result to the backup log
+static void sched_log_result(FILE* log, const volume_job* job, const char* device);
+
+// Reads an entire message from a job thread pipe
+static int sched_read_message(int fd, SCHED_MESSAGE* message, char* text);
+
+// Writes an entire message to the scheduler pipe
+static void sched_write_message(int fd, SCHED_MESSAGE* message, const char* text);
+
+//-----------------------------------------------------------------------------
+// schedule_volume_jobs
+//
+// Executes a job against each of the specified volumes.  Volumes are grouped
+// by the physical device that contains them; the groups are run concurrently,
+// each on its own thread, and the jobs within a group are run serially.
+// Messages and progress from the jobs are forwarded to the caller's UI callbacks,
+// with progress aggregated by job weight into a single value.  A throughput line
+// for each job is written to the optional log file
+//
+// Arguments:
+//
+//	jobs			- Array of jobs to be executed
+//	count			- Number of jobs in the array
+//	job				- Job callback function
+//	context			- Context pointer passed to the job callback function
+//	log				- Optional log file to receive per-volume results
+//	callbacks		- Optional UI callbacks for progress and messages
+
+int schedule_volume_jobs(volume_job* jobs, int count, VOLUME_JOB_CALLBACK job, void* context,
+	FILE* log, ui_callbacks* callbacks)
+{
+	SCHED_GROUP*		groups;				// Physical device job groups
+	SCHED_THREAD*		threads;			// Job thread state for each group
+	int*				jobgroup;			// Group index of each job
+	float*				progress;			// Progress of each job
+	struct pollfd*		fds;				// Group pipes being polled
+	int 				numgroups = 0;		// Number of job groups
+	int 				running = 0;		// Number of groups still running
+	SCHED_MESSAGE 		message;			// Message from a job thread
+	char 				text[SCHED_MAX_MESSAGE];	// Message text from a job thread
+	char 				device[SCHED_MAX_DEVICE_NAME];	// Physical device name
+	int 				pipefds[2];			// New pipe file descriptors
+	int 				index, group;		// Loop index variables
+	int 				failed = 0;			// Number of failed jobs
+	ssize_t 			cb;					// Bytes returned from read()
+	int 				result;				// Result from function call
+
+	USES_UI_CALLBACKS(callbacks);
+
+	if((jobs == NULL) || (count <= 0)) return EINVAL;
+	if(job == NULL) return EINVAL;
+
+	groups = (SCHED_GROUP*)calloc(count, sizeof(SCHED_GROUP));
+	threads = (SCHED_THREAD*)calloc(count, sizeof(SCHED_THREAD));
+	jobgroup = (int*)calloc(count, sizeof(int));
+	progress = (float*)calloc(count, sizeof(float));
+	fds = (struct pollfd*)calloc(count, sizeof(struct pollfd));
+	if(!groups || !threads || !jobgroup || !progress || !fds) {
+
+		if(groups) free(groups);
+		if(threads) free(threads);
+		if(jobgroup) free(jobgroup);
+		if(progress) free(progress);
+		if(fds) free(fds);
+		return ENOMEM;
+	}
+
+	// Assign each job to the group for its physical device.  If the device can't be
+	// determined the job gets a group to itself, named after the volume
+	for(index = 0; index < count; index++) {
+
+		jobs[index].result = -1;
+		jobs[index].elapsed_ms = 0;
+
+		result = volume_physical_device(jobs[index].volume, device, SCHED_MAX_DEVICE_NAME);
+		if(result != 0) snprintf(device, SCHED_MAX_DEVICE_NAME, "%s", jobs[index].volume->name);
+
+		for(group = 0; group < numgroups; group++) if(strcmp(groups[group].device, device) == 0) break;
+		if(group == numgroups) {
+
+			strcpy(groups[numgroups].device, device);
+			groups[numgroups].started = 0;
+			groups[numgroups].fd = -1;
+			numgroups++;
+		}
+
+		jobgroup[index] = group;
+	}
+
+	// Start a thread for each group.  recovery is multithreaded, so forked children
+	// could deadlock on locks held by the UI threads; the job threads talk back through
+	// a pipe instead, and only this thread touches the caller's UI callbacks
+	pthread_once(&g_sched_key_once, sched_create_key);
+
+	for(group = 0; group < numgroups; group++) {
+
+		if(pipe(pipefds) != 0) continue;
+
+		threads[group].jobs = jobs;
+		threads[group].count = count;
+		threads[group].jobgroup = jobgroup;
+		threads[group].group = group;
+		threads[group].job = job;
+		threads[group].context = context;
+		threads[group].fd = pipefds[1];
+		threads[group].current = -1;
+
+		if(pthread_create(&groups[group].thread, NULL, sched_thread_proc, &threads[group]) != 0) {
+
+			close(pipefds[0]);
+			close(pipefds[1]);
+			continue;
+		}
+
+		groups[group].started = 1;
+		groups[group].fd = pipefds[0];
+		fds[running].fd = pipefds[0];
+		fds[running].events = POLLIN;
+		running++;
+
+		UI_PRINT("    > Started %s jobs\n", groups[group].device);
+	}
+
+	// Forward messages from the threads until all of their pipes have closed
+	while(running > 0) {
+
+		result = poll(fds, running, -1);
+		if((result < 0) && (errno == EINTR)) continue;
+		if(result < 0) break;
+
+		for(index = 0; index < running; index++) {
+
+			if(fds[index].revents == 0) continue;
+
+			// End of the pipe (or a broken message); the thread is done.  Anything left is
+			// drained first, the write end must not outlive the read end in this process
+			if(sched_read_message(fds[index].fd, &message, text) != 0) {
+
+				do { cb = read(fds[index].fd, text, SCHED_MAX_MESSAGE); } while((cb > 0) || ((cb < 0) && (errno == EINTR)));
+
+				close(fds[index].fd);
+				for(group = 0; group < numgroups; group++) {
+
+					if(groups[group].fd != fds[index].fd) continue;
+
+					pthread_join(groups[group].thread, NULL);
+					groups[group].fd = -1;
+					UI_PRINT("    > Finished %s jobs\n", groups[group].device);
+				}
+
+				fds[index] = fds[--running];
+				index--;
+				continue;
+			}
+
+			if((message.job < 0) || (message.job >= count)) continue;
+
+			switch(message.type) {
+
+				case sched_print:
+					UI_PRINT("%s", text);
+					break;
+
+				case sched_progress:
+					progress[message.job] = message.progress;
+					UI_SETPROGRESS(sched_aggregate_progress(jobs, progress, count) * 100);
+					break;
+
+				case sched_result:
+					jobs[message.job].result = message.result;
+					jobs[message.job].elapsed_ms = message.elapsed_ms;
+					progress[message.job] = 1.0;
+					UI_SETPROGRESS(sched_aggregate_progress(jobs, progress, count) * 100);
+					sched_log_result(log, &jobs[message.job], groups[jobgroup[message.job]].device);
+					break;
+			}
+		}
+	}
+
+	// Any groups that could not be started on a thread are run here, serially
+	for(group = 0; group < numgroups; group++) {
+
+		if(groups[group].started) continue;
+
+		UI_WARNING("Unable to start a thread for %s jobs, running them serially\n", groups[group].device);
+
+		g_sched_jobs = jobs;
+		g_sched_progress = progress;
+		g_sched_count = count;
+		g_sched_callbacks = callbacks;
+
+		for(index = 0; index < count; index++) {
+
+			if(jobgroup[index] != group) continue;
+
+			ui_callbacks inlinecallbacks;
+			init_ui_callbacks(&inlinecallbacks, (callbacks) ? callbacks->uiprint : NULL, sched_inline_progress);
+
+			g_sched_job = index;
+			sched_execute_job(jobs, index, job, context, &inlinecallbacks);
+			progress[index] = 1.0;
+			sched_log_result(log, &jobs[index], groups[group].device);
+		}
+
+		g_sched_jobs = NULL;
+		g_sched_progress = NULL;
+		g_sched_callbacks = NULL;
+		g_sched_job = -1;
+	}
+
+	for(index = 0; index < count; index++) if(jobs[index].result != 0) failed++;
+
+	free(fds);
+	free(progress);
+	free(jobgroup);
+	free(threads);
+	free(groups);
+
+	return (failed) ? -1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// sched_aggregate_progress (private)
+//
+// Calculates the aggregate progress of all jobs, weighted by job size
+//
+// Arguments:
+//
+//	jobs			- Array of jobs
+//	progress		- Progress of each job (0.0 - 1.0)
+//	count			- Number of jobs
+
+static float sched_aggregate_progress(const volume_job* jobs, const float* progress, int count)
+{
+	double 				total = 0;			// Total weight of all jobs
+	double 				done = 0;			// Weighted progress of all jobs
+	int 				index;				// Loop index variable
+
+	for(index = 0; index < count; index++) {
+
+		total += (double)jobs[index].weight;
+		done += (double)jobs[index].weight * progress[index];
+	}
+
+	return (total > 0) ? (float)(done / total) : 0;
+}
+
+//-----------------------------------------------------------------------------
+// sched_create_key (private)
+//
+// Creates the thread-specific data key that job threads keep their state in
+
+static void sched_create_key(void)
+{
+	pthread_key_create(&g_sched_key, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// sched_thread_proc (private)
+//
+// Entry point for a job thread; runs each of the jobs in a group and reports
+// the result of each back to the scheduler
+//
+// Arguments:
+//
+//	arg				- SCHED_THREAD for the group (SCHED_THREAD*)
+
+static void* sched_thread_proc(void* arg)
+{
+	SCHED_THREAD*		thread = (SCHED_THREAD*)arg;	// Job thread state
+	ui_callbacks 		threadcallbacks;	// UI callbacks for the jobs
+	SCHED_MESSAGE 		message;			// Result message
+	int 				index;				// Loop index variable
+
+	pthread_setspecific(g_sched_key, thread);
+	init_ui_callbacks(&threadcallbacks, sched_thread_print, sched_thread_progress);
+
+	for(index = 0; index < thread->count; index++) {
+
+		if(thread->jobgroup[index] != thread->group) continue;
+
+		thread->current = index;
+		thread->lastprogress = 0;
+		sched_execute_job(thread->jobs, index, thread->job, thread->context, &threadcallbacks);
+
+		memset(&message, 0, sizeof(SCHED_MESSAGE));
+		message.type = sched_result;
+		message.job = index;
+		message.result = thread->jobs[index].result;
+		message.elapsed_ms = thread->jobs[index].elapsed_ms;
+		sched_write_message(thread->fd, &message, NULL);
+	}
+
+	// Closing the pipe tells the scheduler that this group is finished
+	pthread_setspecific(g_sched_key, NULL);
+	close(thread->fd);
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// sched_thread_print (private)
+//
+// UIPRINT_CALLBACK used by jobs running on a job thread
+//
+// Arguments:
+//
+//	fmt			- printf-style format string
+//	...			- variable argument list for fmt
+
+static void sched_thread_print(const char* fmt, ...)
+{
+	SCHED_THREAD*		thread;				// Job thread state
+	SCHED_MESSAGE 		message;			// Message to be sent
+	char 				text[SCHED_MAX_MESSAGE];	// Formatted message text
+	va_list 			args;				// Variable argument list
+
+	thread = (SCHED_THREAD*)pthread_getspecific(g_sched_key);
+	if(thread == NULL) return;
+
+	va_start(args, fmt);
+	vsnprintf(text, SCHED_MAX_MESSAGE, fmt, args);
+	va_end(args);
+
+	memset(&message, 0, sizeof(SCHED_MESSAGE));
+	message.type = sched_print;
+	message.job = thread->current;
+	message.length = strlen(text) + 1;
+
+	sched_write_message(thread->fd, &message, text);
+}
+
+//-----------------------------------------------------------------------------
+// sched_thread_progress (private)
+//
+// PROGRESS_CALLBACK used by jobs running on a job thread
+//
+// Arguments:
+//
+//	percent		- Progress of the current job (0.0 - 1.0)
+
+static void sched_thread_progress(float percent)
+{
+	SCHED_THREAD*		thread;				// Job thread state
+	SCHED_MESSAGE 		message;			// Message to be sent
+
+	thread = (SCHED_THREAD*)pthread_getspecific(g_sched_key);
+	if(thread == NULL) return;
+
+	// Don't flood the pipe; the progress bar can't show differences this small anyway
+	if((percent - thread->lastprogress < 0.005) && (percent < 1.0)) return;
+	thread->lastprogress = percent;
+
+	memset(&message, 0, sizeof(SCHED_MESSAGE));
+	message.type = sched_progress;
+	message.job = thread->current;
+	message.progress = percent;
+
+	sched_write_message(thread->fd, &message, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// sched_execute_job (private)
+//
+// Executes a single job and records its result and elapsed time
+//
+// Arguments:
+//
+//	jobs			- Array of jobs
+//	index			- Index of the job to execute
+//	job				- Job callback function
+//	context			- Context pointer passed to the job callback function
+//	callbacks		- UI callbacks to pass to the job
+
+static void sched_execute_job(volume_job* jobs, int index, VOLUME_JOB_CALLBACK job, void* context,
+	ui_callbacks* callbacks)
+{
+	struct timeval		start, end;			// Job start and end times
+
+	gettimeofday(&start, NULL);
+	jobs[index].result = job(jobs[index].volume, context, callbacks);
+	gettimeofday(&end, NULL);
+
+	jobs[index].elapsed_ms = ((end.tv_sec - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec) / 1000);
+}
+
+//-----------------------------------------------------------------------------
+// sched_inline_progress (private)
+//
+// PROGRESS_CALLBACK used by jobs that are run inline by the scheduler
+//
+// Arguments:
+//
+//	percent		- Progress of the current job (0.0 - 1.0)
+
+static void sched_inline_progress(float percent)
+{
+	USES_UI_CALLBACKS(g_sched_callbacks);
+
+	if((g_sched_progress == NULL) || (g_sched_job < 0)) return;
+
+	g_sched_progress[g_sched_job] = percent;
+	UI_SETPROGRESS(sched_aggregate_progress(g_sched_jobs, g_sched_progress, g_sched_count) * 100);
+}
+
+//-----------------------------------------------------------------------------
+// sched_log_result (private)
+//
+// Writes the result and throughput of a job to the log
+//
+// Arguments:
+//
+//	log				- Log file, or NULL
+//	job				- Completed job
+//	device			- Physical device the job ran against
+
+static void sched_log_result(FILE* log, const volume_job* job, const char* device)
+{
+	unsigned long long	kbps = 0;			// Throughput in KB/s
+
+	if(log == NULL) return;
+
+	if(job->elapsed_ms > 0) kbps = ((job->weight / 1024) * 1000) / job->elapsed_ms;
+
+	fprintf(log, "%-12s %-20s %-10s %10llu KB %6lu.%03lu s %8llu KB/s  ", job->volume->name, job->volume->device,
+		device, job->weight / 1024, job->elapsed_ms / 1000, job->elapsed_ms % 1000, kbps);
+
+	if(job->result == 0) fprintf(log, "OK\n");
+	else fprintf(log, "FAILED (EC = %d)\n", job->result);
+
+	fflush(log);
+}
+
+//-----------------------------------------------------------------------------
+// sched_read_message (private)
+//
+// Reads an entire message from a job thread pipe
+//
+// Arguments:
+//
+//	fd				- Pipe file descriptor
+//	message			- Receives the message header
+//	text			- Receives the message text, if any (SCHED_MAX_MESSAGE)
+
+static int sched_read_message(int fd, SCHED_MESSAGE* message, char* text)
+{
+	char*				buffer = (char*)message;	// Current read position
+	size_t 				remain;				// Bytes remaining to be read
+	ssize_t 			cb;					// Bytes returned from read()
+
+	// Messages are written atomically, so once any of it is available all of it is
+	for(remain = sizeof(SCHED_MESSAGE); remain > 0; remain -= cb, buffer += cb) {
+
+		cb = read(fd, buffer, remain);
+		if((cb < 0) && (errno == EINTR)) { cb = 0; continue; }
+		if(cb <= 0) return -1;
+	}
+
+	text[0] = '\0';
+	if((message->length <= 0) || (message->length > SCHED_MAX_MESSAGE)) return 0;
+
+	for(buffer = text, remain = message->length; remain > 0; remain -= cb, buffer += cb) {
+
+		cb = read(fd, buffer, remain);
+		if((cb < 0) && (errno == EINTR)) { cb = 0; continue; }
+		if(cb <= 0) return -1;
+	}
+
+	text[SCHED_MAX_MESSAGE - 1] = '\0';
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// sched_write_message (private)
+//
+// Writes an entire message to the scheduler pipe in a single write
+//
+// Arguments:
+//
+//	fd				- Pipe file descriptor
+//	message			- Message header
+//	text			- Message text, or NULL
+
+static void sched_write_message(int fd, SCHED_MESSAGE* message, const char* text)
+{
+	char 				buffer[sizeof(SCHED_MESSAGE) + SCHED_MAX_MESSAGE];	// Complete message
+
+	if(fd < 0) return;
+
+	if(text == NULL) message->length = 0;
+
+	memcpy(buffer, message, sizeof(SCHED_MESSAGE));
+	if(message->length > 0) memcpy(buffer + sizeof(SCHED_MESSAGE), text, message->length);
+
+	// A failed write means the scheduler is gone; there's nobody left to tell
+	while((write(fd, buffer, sizeof(SCHED_MESSAGE) + message->length) < 0) && (errno == EINTR));
+}
+
+//-----------------------------------------------------------------------------
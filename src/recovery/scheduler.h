@@ -0,0 +1,72 @@
+//-----------------------------------------------------------------------------
+// scheduler.h
+//
+// Samsung Galaxy S CDMA SCH-I500 Recovery
+// Volume Job Scheduler
+//
+// Copyright (C) 2007 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Modifications: Copyright (C) 2011 Michael Brehm
+//-----------------------------------------------------------------------------
+
+#ifndef __SCHEDULER_H_
+#define __SCHEDULER_H_
+
+#include <stdio.h>					// Include STDIO declarations
+#include "callbacks.h"				// Include CALLBACKS declarations
+#include "volume.h"					// Include VOLUME declarations
+
+//-----------------------------------------------------------------------------
+// CALLBACKS
+//-----------------------------------------------------------------------------
+
+// VOLUME_JOB_CALLBACK - Defines a job that is executed against a single volume.
+// Jobs are run on their own thread, concurrently with other jobs, and must only
+// communicate through the provided ui_callbacks (not ui_print() and friends)
+typedef int(*VOLUME_JOB_CALLBACK)(const Volume* volume, void* context, ui_callbacks* callbacks);
+
+//-----------------------------------------------------------------------------
+// DATA TYPES
+//-----------------------------------------------------------------------------
+
+// volume_job
+//
+// Defines a single job to be executed by schedule_volume_jobs
+//
+//	volume			- Target volume
+//	weight			- Relative size of the job (bytes), for progress and throughput
+//	result			- Receives the result code returned from the job
+//	elapsed_ms		- Receives the elapsed time of the job, in milliseconds
+//
+typedef struct {
+
+	const Volume*		volume;
+	unsigned long long	weight;
+	int 				result;
+	unsigned long		elapsed_ms;
+
+} volume_job;
+
+//-----------------------------------------------------------------------------
+// FUNCTION PROTOTYPES
+//-----------------------------------------------------------------------------
+
+// Executes jobs against volumes on independent physical devices concurrently
+int schedule_volume_jobs(volume_job* jobs, int count, VOLUME_JOB_CALLBACK job, void* context,
+	FILE* log, ui_callbacks* callbacks);
+
+//-----------------------------------------------------------------------------
+
+#endif	// __SCHEDULER_H_
@@ -0,0 +1,883 @@
+//-----------------------------------------------------------------------------
+// store.c
+//
+// Samsung Galaxy S CDMA SCH-I500 Recovery
+// Deduplicating Chunk Store
+//
+// Copyright (C) 2007 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Modifications: Copyright (C) 2011 Michael Brehm
+//-----------------------------------------------------------------------------
+
+// A chunk store keeps every unique piece of data from any number of volume
+// backups exactly once.  A volume is read at the block level and split into
+// variable length chunks at boundaries chosen by a rolling hash of the data
+// itself, so an insertion or deletion only disturbs the chunks around it rather
+// than shifting every fixed-size block that follows.  Each chunk is compressed
+// and stored under the SHA-1 digest of its contents:
+//
+//		<storepath>/<first 2 digest characters>/<40 character digest>
+//
+// A backup is then just a chunk list file; a header followed by the digest and
+// length of each chunk in volume order.  Chunks are never modified once they
+// are written, and the only thing that ever removes one is the garbage collector
+// when no chunk list refers to it anymore
+
+#include <stdlib.h>									// Include STDLIB declarations
+#include <stdio.h>									// Include STDIO declarations
+#include <string.h>									// Include STRING declarations
+#include <ctype.h>									// Include CTYPE declarations
+#include <errno.h>									// Include ERRNO declarations
+#include <sys/types.h>								// Include TYPES declarations
+#include <sys/stat.h>								// Include STAT declarations
+#include <limits.h>									// Include LIMITS declarations
+#include <fcntl.h>									// Include FCNTL declarations
+#include <unistd.h>									// Include UNISTD declarations
+#include <dirent.h>									// Include DIRENT declarations
+#include <zlib.h>									// Include ZLIB declarations
+#include "ext4_utils/ext4_utils.h"					// Include EXT4_UTILS support
+#include "ext4_utils/sha1.h"						// Include EXT4_UTILS support
+#include "store.h"									// Include STORE declarations
+
+//-----------------------------------------------------------------------------
+// PRIVATE CONSTANTS / MACROS
+//-----------------------------------------------------------------------------
+
+// Chunk list file header constants
+#define STORE_LIST_MAGIC				0x4b484342		// 'BCHK'
+#define STORE_LIST_VERSION				1				// Chunk list file version
+
+// Content-defined chunking parameters.  Once a chunk is at least the minimum
+// size, a boundary is declared wherever the low 16 bits of the rolling hash are
+// zero, giving an average of about 64KB past the minimum.  Changing any of these
+// values (or the gear table seed) changes where the boundaries fall and would
+// stop new backups from sharing chunks with the existing ones
+#define STORE_MIN_CHUNK					(16*1024)		// Minimum chunk size
+#define STORE_MAX_CHUNK					(256*1024)		// Maximum chunk size
+#define STORE_BOUNDARY_MASK				0x0000FFFF		// Rolling hash boundary mask
+#define STORE_GEAR_SEED					0x2545F491		// Gear table generator seed
+
+// Size of the volume read buffer
+#define STORE_READ_SIZE					(1024*1024)
+
+// Length of a chunk digest string, and of the directory prefix
+#define STORE_DIGEST_CHARS				(SHA1_DIGEST_LENGTH * 2)
+#define STORE_PREFIX_CHARS				2
+
+//-----------------------------------------------------------------------------
+// PRIVATE TYPE DECLARATIONS
+//-----------------------------------------------------------------------------
+
+// STORE_LIST_HEADER
+//
+// Header of a chunk list file, which is followed by num_chunks STORE_LIST_ENTRY
+// structures.  The sum of the entry lengths is the size of the volume data
+typedef struct {
+
+	u32					magic;
+	u32					version;
+	u32					num_chunks;
+	u32					max_chunk;
+	u64					volume_size;
+
+} STORE_LIST_HEADER;
+
+// STORE_LIST_ENTRY
+//
+// A single chunk of a chunk list file
+typedef struct {
+
+	u8					digest[SHA1_DIGEST_LENGTH];
+	u32					length;
+
+} STORE_LIST_ENTRY;
+
+// STORE_DIGEST_SET
+//
+// Sorted set of the chunk digests referenced by the chunk list files, used by
+// the garbage collector
+typedef struct {
+
+	u8*					digests;
+	u32					count;
+	u32					capacity;
+
+} STORE_DIGEST_SET;
+
+//-----------------------------------------------------------------------------
+// PRIVATE GLOBAL VARIABLES
+//-----------------------------------------------------------------------------
+
+static u32 g_store_gear[256];				// Rolling hash gear table
+static int g_store_gear_init = 0;			// Flag if gear table has been generated
+
+//-----------------------------------------------------------------------------
+// PRIVATE FUNCTION PROTOTYPES
+//-----------------------------------------------------------------------------
+
+// Generates the path of a chunk file in the store
+static void store_chunk_path(const char* storepath, const u8* digest, char* out, size_t cch);
+
+// Compares two chunk digests for qsort() and bsearch()
+static int store_compare_digests(const void* lhs, const void* rhs);
+
+// Adds the chunks from every chunk list file under a directory to a digest set
+static int store_gather_digests(const char* path, const char* storepath, STORE_DIGEST_SET* set,
+	ui_callbacks* callbacks);
+
+// Generates the rolling hash gear table
+static void store_init_gear(void);
+
+// Parses a chunk digest string
+static int store_parse_digest(const char* str, u8* digest);
+
+// Reads and validates the header of a chunk list file
+static int store_read_list_header(FILE* file, STORE_LIST_HEADER* header);
+
+// Writes a chunk into the store if it isn't already there
+static int store_write_chunk(const char* storepath, const u8* data, u32 length, u8* digest, int* added);
+
+//-----------------------------------------------------------------------------
+// store_backup
+//
+// Backs up a volume into a chunk store
+//
+// Arguments:
+//
+//	volume			- Volume to be backed up
+//	storepath		- Path to the root of the chunk store
+//	listfile		- Chunk list file to be created
+
+int store_backup(const Volume* volume, const char* storepath, const char* listfile)
+{
+	// Invoke the UI version with a NULL callback structure
+	return store_backup_ui(volume, storepath, listfile, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// store_backup_ui
+//
+// Backs up a volume into a chunk store.  The volume is read at the block level
+// and split into content-defined chunks, any chunks that aren't already in the
+// store are added to it, and the list of chunks is written to the list file
+//
+// Arguments:
+//
+//	volume			- Volume to be backed up
+//	storepath		- Path to the root of the chunk store
+//	listfile		- Chunk list file to be created
+//	callbacks		- Optional UI callbacks for progress and messages
+
+int store_backup_ui(const Volume* volume, const char* storepath, const char* listfile,
+	ui_callbacks* callbacks)
+{
+	u8*					buffer = NULL;		// Volume read buffer
+	u8*					chunk = NULL;		// Current chunk buffer
+	u32 				cbchunk = 0;		// Bytes in the current chunk
+	u32 				hash = 0;			// Rolling hash of the current chunk
+	int 				source;				// Source volume file descriptor
+	FILE*				list;				// Chunk list file (temporary)
+	char 				templist[PATH_MAX];	// Temporary chunk list file path
+	STORE_LIST_HEADER	header;				// Chunk list file header
+	STORE_LIST_ENTRY	entry;				// Chunk list file entry
+	unsigned long long	size;				// Size of the source volume
+	unsigned long long	totalread = 0;		// Total bytes read from the volume
+	unsigned long long	totaladded = 0;		// Total bytes of new chunks
+	u32 				addedchunks = 0;	// Number of chunks added to the store
+	ssize_t 			cbread;				// Bytes returned from read()
+	ssize_t 			start;				// Start of the span being copied
+	ssize_t 			index;				// Loop index variable
+	int 				added;				// Flag if a chunk was added to the store
+	int 				result = 0;			// Result from function call
+
+	USES_UI_CALLBACKS(callbacks);
+
+	if(volume == NULL) return EINVAL;			// Invalid [in] argument
+	if(storepath == NULL) return EINVAL;		// Invalid [in] argument
+	if(listfile == NULL) return EINVAL;			// Invalid [in] argument
+
+	store_init_gear();
+
+	result = volume_size(volume, &size);
+	if(result != 0) { UI_WARNING("Cannot determine size of volume %s, progress will not be shown\n", volume->name); size = 0; }
+
+	// Allocate the buffers
+	buffer = (u8*)malloc(STORE_READ_SIZE);
+	chunk = (u8*)malloc(STORE_MAX_CHUNK);
+	if(!buffer || !chunk) {
+
+		UI_ERROR("Insufficient memory available to allocate buffers\n");
+		if(buffer) free(buffer);
+		if(chunk) free(chunk);
+		return ENOMEM;
+	}
+
+	// Open the source volume
+	source = open(volume->device, O_RDONLY);
+	if(source < 0) {
+
+		result = errno;
+		UI_ERROR("Cannot open source volume %s. EC = %d\n", volume->device, result);
+		free(chunk);
+		free(buffer);
+		return result;
+	}
+
+	// Create the store if this is the first backup going into it
+	if((mkdir(storepath, 0777) != 0) && (errno != EEXIST)) {
+
+		result = errno;
+		UI_ERROR("Cannot create chunk store %s. EC = %d\n", storepath, result);
+		close(source);
+		free(chunk);
+		free(buffer);
+		return result;
+	}
+
+	// The chunk list is written to a temporary file and renamed when it's complete,
+	// a partial list must never be mistaken for a backup (or trusted by the collector)
+	snprintf(templist, PATH_MAX, "%s.tmp", listfile);
+	list = fopen(templist, "wb");
+	if(list == NULL) {
+
+		result = errno;
+		UI_ERROR("Cannot create chunk list file %s. EC = %d\n", templist, result);
+		close(source);
+		free(chunk);
+		free(buffer);
+		return result;
+	}
+
+	memset(&header, 0, sizeof(STORE_LIST_HEADER));
+	header.magic = STORE_LIST_MAGIC;
+	header.version = STORE_LIST_VERSION;
+	header.max_chunk = STORE_MAX_CHUNK;
+	if(fwrite(&header, sizeof(STORE_LIST_HEADER), 1, list) != 1) result = -1;
+
+	// Move the data ....
+	while(result == 0) {
+
+		cbread = read(source, buffer, STORE_READ_SIZE);
+		if(cbread < 0) { UI_ERROR("Unable to read data from input volume %s. EC = %d.\n", volume->device, errno); result = -1; }
+		if(cbread <= 0) break;
+
+		// Split the buffer into chunks.  Spans of the buffer are copied into the
+		// chunk buffer between boundaries, rather than one byte at a time
+		for(start = index = 0; (index < cbread) && (result == 0); index++) {
+
+			hash = (hash << 1) + g_store_gear[buffer[index]];
+			cbchunk++;
+
+			if(((cbchunk >= STORE_MIN_CHUNK) && ((hash & STORE_BOUNDARY_MASK) == 0)) || (cbchunk == STORE_MAX_CHUNK)) {
+
+				memcpy(chunk + cbchunk - (index + 1 - start), buffer + start, index + 1 - start);
+				start = index + 1;
+
+				result = store_write_chunk(storepath, chunk, cbchunk, entry.digest, &added);
+				if(result != 0) { UI_ERROR("Unable to write chunk to store %s. EC = %d\n", storepath, result); break; }
+
+				entry.length = cbchunk;
+				if(fwrite(&entry, sizeof(STORE_LIST_ENTRY), 1, list) != 1) { result = -1; break; }
+
+				header.num_chunks++;
+				header.volume_size += cbchunk;
+				if(added) { addedchunks++; totaladded += cbchunk; }
+
+				cbchunk = 0;
+				hash = 0;
+			}
+		}
+
+		// Carry whatever is left of the buffer into the next one
+		if((result == 0) && (start < cbread)) memcpy(chunk + cbchunk - (cbread - start), buffer + start, cbread - start);
+
+		totalread += cbread;
+		if(size > 0) UI_SETPROGRESS((float)(totalread * 100) / (float)size);
+	}
+
+	// Whatever remains at the end of the volume is the final chunk
+	if((result == 0) && (cbchunk > 0)) {
+
+		result = store_write_chunk(storepath, chunk, cbchunk, entry.digest, &added);
+		if(result != 0) { UI_ERROR("Unable to write chunk to store %s. EC = %d\n", storepath, result); }
+		else {
+
+			entry.length = cbchunk;
+			if(fwrite(&entry, sizeof(STORE_LIST_ENTRY), 1, list) != 1) result = -1;
+
+			header.num_chunks++;
+			header.volume_size += cbchunk;
+			if(added) { addedchunks++; totaladded += cbchunk; }
+		}
+	}
+
+	// Update the header now that the chunk count is known
+	if(result == 0) {
+
+		if((fseek(list, 0, SEEK_SET) != 0) || (fwrite(&header, sizeof(STORE_LIST_HEADER), 1, list) != 1)) result = -1;
+	}
+
+	if((fclose(list) != 0) && (result == 0)) result = -1;
+
+	if(result == 0) {
+
+		if(rename(templist, listfile) != 0) {
+
+			result = errno;
+			UI_ERROR("Cannot create chunk list file %s. EC = %d\n", listfile, result);
+			unlink(templist);
+		}
+
+		else UI_PRINT("%u of %u chunks were new (%llu KB added to the store)\n", addedchunks, header.num_chunks, totaladded / 1024);
+	}
+
+	else {
+
+		UI_ERROR("Unable to write chunk list file %s\n", templist);
+		unlink(templist);
+	}
+
+	close(source);
+	free(chunk);
+	free(buffer);
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// store_collect_garbage
+//
+// Removes chunks from a chunk store that are no longer referenced
+//
+// Arguments:
+//
+//	storepath		- Path to the root of the chunk store
+//	listroot		- Directory tree containing all of the chunk list files
+
+int store_collect_garbage(const char* storepath, const char* listroot)
+{
+	// Invoke the UI version with a NULL callback structure
+	return store_collect_garbage_ui(storepath, listroot, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// store_collect_garbage_ui
+//
+// Removes chunks from a chunk store that are no longer referenced.  Every file
+// under the list root is checked for the chunk list header, so deleting a backup
+// folder (or a single list file) is all it takes to release its chunks.  If any
+// chunk list cannot be read, nothing is removed
+//
+// Arguments:
+//
+//	storepath		- Path to the root of the chunk store
+//	listroot		- Directory tree containing all of the chunk list files
+//	callbacks		- Optional UI callbacks for progress and messages
+
+int store_collect_garbage_ui(const char* storepath, const char* listroot, ui_callbacks* callbacks)
+{
+	STORE_DIGEST_SET	set;				// Referenced chunk digests
+	DIR*				store;				// Chunk store directory
+	DIR*				prefix;				// Chunk store prefix directory
+	struct dirent*		storeentry;			// Chunk store directory entry
+	struct dirent*		prefixentry;		// Chunk store prefix directory entry
+	char 				prefixpath[PATH_MAX];	// Chunk store prefix directory path
+	char 				chunkpath[PATH_MAX];	// Chunk file path
+	struct stat 		chunkstat;			// Chunk file information
+	u8 					digest[SHA1_DIGEST_LENGTH];	// Chunk file digest
+	u32 				kept = 0;			// Number of chunks kept
+	u32 				removed = 0;		// Number of chunks removed
+	unsigned long long	freed = 0;			// Total bytes of chunks removed
+	int 				prefixes = 0;		// Number of prefix directories processed
+	int 				result;				// Result from function call
+
+	USES_UI_CALLBACKS(callbacks);
+
+	if(storepath == NULL) return EINVAL;		// Invalid [in] argument
+	if(listroot == NULL) return EINVAL;			// Invalid [in] argument
+
+	memset(&set, 0, sizeof(STORE_DIGEST_SET));
+
+	// Gather up every chunk that's referenced by a chunk list
+	result = store_gather_digests(listroot, storepath, &set, callbacks);
+	if(result != 0) {
+
+		UI_ERROR("Unable to read all chunk list files under %s, no chunks will be removed\n", listroot);
+		if(set.digests) free(set.digests);
+		return result;
+	}
+
+	if(set.count > 0) qsort(set.digests, set.count, SHA1_DIGEST_LENGTH, store_compare_digests);
+
+	store = opendir(storepath);
+	if(store == NULL) {
+
+		result = errno;
+		UI_ERROR("Cannot open chunk store %s. EC = %d\n", storepath, result);
+		if(set.digests) free(set.digests);
+		return result;
+	}
+
+	// Check every chunk file in every prefix directory of the store
+	while((storeentry = readdir(store)) != NULL) {
+
+		// Only the hexadecimal prefix directories belong to the store
+		if(strlen(storeentry->d_name) != STORE_PREFIX_CHARS) continue;
+		if(!isxdigit(storeentry->d_name[0]) || !isxdigit(storeentry->d_name[1])) continue;
+
+		snprintf(prefixpath, PATH_MAX, "%s/%s", storepath, storeentry->d_name);
+		prefix = opendir(prefixpath);
+		if(prefix == NULL) continue;
+
+		while((prefixentry = readdir(prefix)) != NULL) {
+
+			if(prefixentry->d_name[0] == '.') continue;
+			snprintf(chunkpath, PATH_MAX, "%s/%s", prefixpath, prefixentry->d_name);
+			if((stat(chunkpath, &chunkstat) != 0) || !S_ISREG(chunkstat.st_mode)) continue;
+
+			// Leftovers from an interrupted backup are never referenced
+			if(store_parse_digest(prefixentry->d_name, digest) == 0) {
+
+				if(bsearch(digest, set.digests, set.count, SHA1_DIGEST_LENGTH, store_compare_digests) != NULL) { kept++; continue; }
+			}
+
+			if(unlink(chunkpath) == 0) { removed++; freed += chunkstat.st_size; }
+			else { UI_WARNING("Unable to remove chunk %s. EC = %d\n", chunkpath, errno); }
+		}
+
+		closedir(prefix);
+		rmdir(prefixpath);						// Only succeeds if it's now empty
+
+		// There are 256 possible prefix directories
+		UI_SETPROGRESS((float)(++prefixes * 100) / 256.0);
+	}
+
+	closedir(store);
+	if(set.digests) free(set.digests);
+
+	UI_PRINT("Kept %u chunks, removed %u chunks (%llu KB freed)\n", kept, removed, freed / 1024);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// store_is_list
+//
+// Determines if a file is a chunk list file
+//
+// Arguments:
+//
+//	listfile		- File to be checked
+
+int store_is_list(const char* listfile)
+{
+	STORE_LIST_HEADER	header;				// Chunk list file header
+	FILE*				file;				// Chunk list file
+	int 				result;				// Result from function call
+
+	if(listfile == NULL) return 0;
+
+	file = fopen(listfile, "rb");
+	if(file == NULL) return 0;
+
+	result = store_read_list_header(file, &header);
+	fclose(file);
+
+	return (result == 0) ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// store_restore
+//
+// Restores a chunk list file from a chunk store to a volume
+//
+// Arguments:
+//
+//	storepath		- Path to the root of the chunk store
+//	listfile		- Chunk list file to be restored
+//	volume			- Destination volume
+
+int store_restore(const char* storepath, const char* listfile, const Volume* volume)
+{
+	// Invoke the UI version with a NULL callback structure
+	return store_restore_ui(storepath, listfile, volume, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// store_restore_ui
+//
+// Restores a chunk list file from a chunk store to a volume.  Every chunk is
+// checked against its digest before it's written
+//
+// Arguments:
+//
+//	storepath		- Path to the root of the chunk store
+//	listfile		- Chunk list file to be restored
+//	volume			- Destination volume
+//	callbacks		- Optional UI callbacks for progress and messages
+
+int store_restore_ui(const char* storepath, const char* listfile, const Volume* volume,
+	ui_callbacks* callbacks)
+{
+	FILE*				list;				// Chunk list file
+	STORE_LIST_HEADER	header;				// Chunk list file header
+	STORE_LIST_ENTRY	entry;				// Chunk list file entry
+	u8*					chunk;				// Chunk data buffer
+	char 				chunkpath[PATH_MAX];	// Chunk file path
+	gzFile 				chunkfile;			// Chunk file
+	SHA1_CTX 			sha1;				// SHA-1 context
+	u8 					digest[SHA1_DIGEST_LENGTH];	// Calculated chunk digest
+	unsigned long long	size;				// Size of the destination volume
+	unsigned long long	totalwritten = 0;	// Total bytes written to the volume
+	int 				dest;				// Destination volume file descriptor
+	int 				cbread;				// Bytes returned from gzread()
+	u32 				cbwritten;			// Bytes written from the chunk
+	ssize_t 			cb;					// Bytes returned from write()
+	u32 				index;				// Loop index variable
+	int 				result = 0;			// Result from function call
+
+	USES_UI_CALLBACKS(callbacks);
+
+	if(storepath == NULL) return EINVAL;		// Invalid [in] argument
+	if(listfile == NULL) return EINVAL;			// Invalid [in] argument
+	if(volume == NULL) return EINVAL;			// Invalid [in] argument
+
+	list = fopen(listfile, "rb");
+	if(list == NULL) {
+
+		result = errno;
+		UI_ERROR("Cannot open chunk list file %s. EC = %d\n", listfile, result);
+		return result;
+	}
+
+	result = store_read_list_header(list, &header);
+	if(result != 0) {
+
+		UI_ERROR("File %s is not a valid chunk list file\n", listfile);
+		fclose(list);
+		return result;
+	}
+
+	// Don't start writing anything if the data can't possibly fit on the volume
+	if((volume_size(volume, &size) == 0) && (header.volume_size > size)) {
+
+		UI_ERROR("Backup is %llu bytes, but volume %s is only %llu bytes\n", header.volume_size, volume->name, size);
+		fclose(list);
+		return EFBIG;
+	}
+
+	// Allocate one extra byte so that a chunk file that's longer than expected is detected
+	chunk = (u8*)malloc(header.max_chunk + 1);
+	if(chunk == NULL) {
+
+		UI_ERROR("Insufficient memory available to allocate buffers\n");
+		fclose(list);
+		return ENOMEM;
+	}
+
+	dest = open(volume->device, O_WRONLY);
+	if(dest < 0) {
+
+		result = errno;
+		UI_ERROR("Cannot open output device %s. EC = %d\n", volume->device, result);
+		free(chunk);
+		fclose(list);
+		return result;
+	}
+
+	// Restore the chunks in order
+	for(index = 0; index < header.num_chunks; index++) {
+
+		if(fread(&entry, sizeof(STORE_LIST_ENTRY), 1, list) != 1) { UI_ERROR("Unable to read chunk list file %s\n", listfile); result = -1; break; }
+		if(entry.length > header.max_chunk) { UI_ERROR("Chunk %u in chunk list file %s is too large\n", index, listfile); result = -1; break; }
+
+		store_chunk_path(storepath, entry.digest, chunkpath, PATH_MAX);
+
+		chunkfile = gzopen(chunkpath, "rb");
+		if(chunkfile == Z_NULL) { UI_ERROR("Missing chunk %s\n", chunkpath); result = ENOENT; break; }
+
+		cbread = gzread(chunkfile, chunk, entry.length + 1);
+		gzclose(chunkfile);
+
+		// Verify the chunk before it goes anywhere near the volume
+		SHA1Init(&sha1);
+		if(cbread > 0) SHA1Update(&sha1, chunk, cbread);
+		SHA1Final(digest, &sha1);
+
+		if((cbread != (int)entry.length) || (memcmp(digest, entry.digest, SHA1_DIGEST_LENGTH) != 0)) {
+
+			UI_ERROR("Chunk %s is corrupt\n", chunkpath);
+			result = EIO;
+			break;
+		}
+
+		for(cbwritten = 0; cbwritten < entry.length; cbwritten += cb) {
+
+			cb = write(dest, chunk + cbwritten, entry.length - cbwritten);
+			if(cb <= 0) break;
+		}
+
+		if(cbwritten < entry.length) { UI_ERROR("Unable to write data to output device %s. EC = %d\n", volume->device, errno); result = -1; break; }
+
+		totalwritten += entry.length;
+		if(header.volume_size > 0) UI_SETPROGRESS((float)(totalwritten * 100) / (float)header.volume_size);
+	}
+
+	if((close(dest) != 0) && (result == 0)) {
+
+		UI_ERROR("Unable to write data to output device %s. EC = %d\n", volume->device, errno);
+		result = -1;
+	}
+
+	free(chunk);
+	fclose(list);
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// store_chunk_path (private)
+//
+// Generates the path of a chunk file in the store
+//
+// Arguments:
+//
+//	storepath		- Path to the root of the chunk store
+//	digest			- Chunk digest
+//	out				- Receives the chunk file path
+//	cch				- Length of the output buffer
+
+static void store_chunk_path(const char* storepath, const u8* digest, char* out, size_t cch)
+{
+	char 				str[STORE_DIGEST_CHARS + 1];	// Chunk digest string
+	int 				index;				// Loop index variable
+
+	for(index = 0; index < SHA1_DIGEST_LENGTH; index++) sprintf(str + (index * 2), "%02x", digest[index]);
+	snprintf(out, cch, "%s/%.*s/%s", storepath, STORE_PREFIX_CHARS, str, str);
+}
+
+//-----------------------------------------------------------------------------
+// store_compare_digests (private)
+//
+// Compares two chunk digests for qsort() and bsearch()
+//
+// Arguments:
+//
+//	lhs				- Left-hand digest
+//	rhs				- Right-hand digest
+
+static int store_compare_digests(const void* lhs, const void* rhs)
+{
+	return memcmp(lhs, rhs, SHA1_DIGEST_LENGTH);
+}
+
+//-----------------------------------------------------------------------------
+// store_gather_digests (private)
+//
+// Adds the chunks from every chunk list file found under a directory to a set
+// of digests.  The chunk store itself is skipped
+//
+// Arguments:
+//
+//	path			- Directory to search
+//	storepath		- Path to the root of the chunk store
+//	set				- Digest set to be added to
+//	callbacks		- Optional UI callbacks for messages
+
+static int store_gather_digests(const char* path, const char* storepath, STORE_DIGEST_SET* set,
+	ui_callbacks* callbacks)
+{
+	DIR*				dir;				// Directory being searched
+	struct dirent*		dirent;				// Directory entry
+	char 				child[PATH_MAX];	// Child path
+	struct stat 		childstat;			// Child information
+	FILE*				list;				// Chunk list file
+	STORE_LIST_HEADER	header;				// Chunk list file header
+	STORE_LIST_ENTRY	entry;				// Chunk list file entry
+	u8*					digests;			// Reallocated digest array
+	u32 				index;				// Loop index variable
+	int 				result = 0;			// Result from function call
+
+	USES_UI_CALLBACKS(callbacks);
+
+	dir = opendir(path);
+	if(dir == NULL) { UI_ERROR("Cannot open directory %s. EC = %d\n", path, errno); return errno; }
+
+	while((result == 0) && ((dirent = readdir(dir)) != NULL)) {
+
+		if((strcmp(dirent->d_name, ".") == 0) || (strcmp(dirent->d_name, "..") == 0)) continue;
+
+		snprintf(child, PATH_MAX, "%s/%s", path, dirent->d_name);
+		if(strcmp(child, storepath) == 0) continue;
+		if(stat(child, &childstat) != 0) continue;
+
+		if(S_ISDIR(childstat.st_mode)) { result = store_gather_digests(child, storepath, set, callbacks); continue; }
+		if(!S_ISREG(childstat.st_mode) || (childstat.st_size < (off_t)sizeof(STORE_LIST_HEADER))) continue;
+
+		list = fopen(child, "rb");
+		if(list == NULL) continue;
+
+		// Anything that isn't a chunk list is just ignored
+		if(store_read_list_header(list, &header) != 0) { fclose(list); continue; }
+
+		// Make room for all of the chunks in this list up front
+		if(set->count + header.num_chunks > set->capacity) {
+
+			set->capacity = (set->count + header.num_chunks) * 2;
+			digests = (u8*)realloc(set->digests, set->capacity * SHA1_DIGEST_LENGTH);
+			if(digests == NULL) { UI_ERROR("Insufficient memory available to allocate buffers\n"); fclose(list); result = ENOMEM; break; }
+			set->digests = digests;
+		}
+
+		for(index = 0; index < header.num_chunks; index++) {
+
+			if(fread(&entry, sizeof(STORE_LIST_ENTRY), 1, list) != 1) { UI_ERROR("Chunk list file %s is truncated\n", child); result = EIO; break; }
+			memcpy(set->digests + (set->count++ * SHA1_DIGEST_LENGTH), entry.digest, SHA1_DIGEST_LENGTH);
+		}
+
+		fclose(list);
+	}
+
+	closedir(dir);
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// store_init_gear (private)
+//
+// Generates the rolling hash gear table from a fixed seed.  The table has to be
+// identical for every backup, or the chunk boundaries would move
+
+static void store_init_gear(void)
+{
+	u32 				state = STORE_GEAR_SEED;	// xorshift32 generator state
+	int 				index;				// Loop index variable
+
+	if(g_store_gear_init) return;
+
+	for(index = 0; index < 256; index++) {
+
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		g_store_gear[index] = state;
+	}
+
+	g_store_gear_init = 1;
+}
+
+//-----------------------------------------------------------------------------
+// store_parse_digest (private)
+//
+// Parses a 40 character chunk digest string
+//
+// Arguments:
+//
+//	str				- Digest string
+//	digest			- Receives the digest
+
+static int store_parse_digest(const char* str, u8* digest)
+{
+	unsigned int		byte;				// Parsed byte
+	int 				index;				// Loop index variable
+
+	if(strlen(str) != STORE_DIGEST_CHARS) return -1;
+
+	for(index = 0; index < SHA1_DIGEST_LENGTH; index++) {
+
+		if(!isxdigit(str[index * 2]) || !isxdigit(str[(index * 2) + 1])) return -1;
+		if(sscanf(str + (index * 2), "%2x", &byte) != 1) return -1;
+		digest[index] = (u8)byte;
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// store_read_list_header (private)
+//
+// Reads and validates the header of a chunk list file
+//
+// Arguments:
+//
+//	file			- Chunk list file, positioned at the beginning
+//	header			- Receives the chunk list file header
+
+static int store_read_list_header(FILE* file, STORE_LIST_HEADER* header)
+{
+	if(fread(header, sizeof(STORE_LIST_HEADER), 1, file) != 1) return -1;
+
+	if(header->magic != STORE_LIST_MAGIC) return -1;
+	if(header->version != STORE_LIST_VERSION) return -1;
+	if((header->max_chunk == 0) || (header->max_chunk > STORE_MAX_CHUNK)) return -1;
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// store_write_chunk (private)
+//
+// Calculates the digest of a chunk and writes it into the store if it isn't
+// already there.  New chunks are written to a temporary file first and renamed
+// into place, so a chunk file that exists is always complete
+//
+// Arguments:
+//
+//	storepath		- Path to the root of the chunk store
+//	data			- Chunk data
+//	length			- Length of the chunk data
+//	digest			- Receives the chunk digest
+//	added			- Receives a flag indicating if the chunk was added
+
+static int store_write_chunk(const char* storepath, const u8* data, u32 length, u8* digest, int* added)
+{
+	SHA1_CTX 			sha1;				// SHA-1 context
+	char 				chunkpath[PATH_MAX];	// Chunk file path
+	char 				temppath[PATH_MAX];	// Temporary chunk file path
+	char*				slash;				// Last slash in the chunk path
+	struct stat 		chunkstat;			// Chunk file information
+	gzFile 				chunkfile;			// Chunk file
+	int 				result = 0;			// Result from function call
+
+	*added = 0;
+
+	SHA1Init(&sha1);
+	SHA1Update(&sha1, data, length);
+	SHA1Final(digest, &sha1);
+
+	store_chunk_path(storepath, digest, chunkpath, PATH_MAX);
+	if(stat(chunkpath, &chunkstat) == 0) return 0;		// Already in the store
+
+	// Create the prefix directory if needed
+	slash = strrchr(chunkpath, '/');
+	*slash = '\0';
+	if((mkdir(chunkpath, 0777) != 0) && (errno != EEXIST)) return errno;
+	*slash = '/';
+
+	snprintf(temppath, PATH_MAX, "%s.tmp", chunkpath);
+
+	chunkfile = gzopen(temppath, "wb");
+	if(chunkfile == Z_NULL) return (errno) ? errno : ENOMEM;
+
+	if(gzwrite(chunkfile, (voidp)data, length) != (int)length) result = EIO;
+	if((gzclose(chunkfile) != Z_OK) && (result == 0)) result = EIO;
+
+	if((result == 0) && (rename(temppath, chunkpath) != 0)) result = errno;
+	if(result != 0) { unlink(temppath); return result; }
+
+	*added = 1;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
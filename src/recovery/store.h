@@ -0,0 +1,59 @@
+//-----------------------------------------------------------------------------
+// store.h
+//
+// Samsung Galaxy S CDMA SCH-I500 Recovery
+// Deduplicating Chunk Store
+//
+// Copyright (C) 2007 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Modifications: Copyright (C) 2011 Michael Brehm
+//-----------------------------------------------------------------------------
+
+#ifndef __STORE_H_
+#define __STORE_H_
+
+#include "callbacks.h"				// Include CALLBACKS declarations
+#include "volume.h"					// Include VOLUME declarations
+
+//-----------------------------------------------------------------------------
+// FUNCTION PROTOTYPES
+//-----------------------------------------------------------------------------
+
+// Backs up a volume into a chunk store, creating a chunk list file
+int store_backup(const Volume* volume, const char* storepath, const char* listfile);
+
+// Backs up a volume into a chunk store, creating a chunk list file, with a UI status callback
+int store_backup_ui(const Volume* volume, const char* storepath, const char* listfile, 
+	ui_callbacks* callbacks);
+
+// Removes chunks from a chunk store that are not referenced by any chunk list file
+int store_collect_garbage(const char* storepath, const char* listroot);
+
+// Removes chunks from a chunk store that are not referenced by any chunk list file, with a UI status callback
+int store_collect_garbage_ui(const char* storepath, const char* listroot, ui_callbacks* callbacks);
+
+// Determines if a file is a chunk list file
+int store_is_list(const char* listfile);
+
+// Restores a chunk list file from a chunk store to a volume
+int store_restore(const char* storepath, const char* listfile, const Volume* volume);
+
+// Restores a chunk list file from a chunk store to a volume, with a UI status callback
+int store_restore_ui(const char* storepath, const char* listfile, const Volume* volume,
+	ui_callbacks* callbacks);
+
+//-----------------------------------------------------------------------------
+
+#endif	// __STORE_H_
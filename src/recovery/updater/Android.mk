@@ -3,7 +3,9 @@
 LOCAL_PATH := $(call my-dir)
 
 updater_src_files := \
+	blockimg.c \
 	install.c \
+	journal.c \
 	updater.c
 
 #
@@ -70,3 +72,21 @@ LOCAL_MODULE := updater
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 include $(BUILD_EXECUTABLE)
+
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := blockimg_test.c
+
+LOCAL_MODULE := blockimg_test
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES += libapplypatch libedify libmtdutils libminzip libz
+LOCAL_STATIC_LIBRARIES += libmincrypt libbz
+LOCAL_STATIC_LIBRARIES += libcutils libstdc++ libc
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,993 @@
+//-----------------------------------------------------------------------------
+// blockimg.c
+//
+// Samsung Galaxy S CDMA SCH-I500 Recovery
+// Block Image Update
+//
+// Copyright (C) 2009 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Modifications: Copyright (C) 2011 Michael Brehm
+//-----------------------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "edify/expr.h"
+#include "mincrypt/sha.h"
+#include "minzip/Zip.h"
+#include "updater.h"
+#include "blockimg.h"
+#include "applypatch/applypatch.h"
+
+// block_image_update() updates a whole partition at the block level from a
+// transfer list, instead of patching the mounted filesystem one file at a
+// time.  The transfer list is a text file:
+//
+//    1                     format version
+//    <blocks>              total number of blocks written, for progress
+//    <command>             one per line
+//
+// Block ranges are written "<n>,<b0>,<e0>,...", n numbers describing n/2
+// half-open ranges of BLOCKSIZE-byte blocks.  The commands are:
+//
+//    copy <src> <tgt> <sha1>
+//        copy the blocks in src to tgt; sha1 is that of the data
+//    diff <offset> <len> <src> <tgt> <src-sha1> <tgt-sha1>
+//        apply the bsdiff or imgdiff patch at <offset> in the patch data
+//        to the blocks in src, writing the result to tgt
+//    new <offset> <tgt> <sha1>
+//        write the data at <offset> in the patch data to tgt
+//    zero <tgt>
+//        fill tgt with zeros
+//
+// Every source range names blocks as they were before the update started,
+// and no block may be written by more than one command, so the list says
+// what the new image is made of rather than how to get there.  The
+// commands are run in list order except where that would overwrite a
+// block some later command still has to read; those are held back until
+// their readers have run.  Cycles of such dependencies are broken by
+// reading one command's source ahead of time and stashing it.
+//
+// Sources are verified against their SHA-1 before use and every target
+// is verified before it's written.  So that an interrupted update can be
+// started over from the beginning:
+//
+//  - a command whose source doesn't match but whose target already does
+//    is skipped;
+//  - a source that has to be read ahead of time, and the source of a
+//    command whose target overlaps it, is stashed in STASH_DIR, named by
+//    the command's index and the source's SHA-1, and synced before any
+//    of its blocks are overwritten; a command whose source and target
+//    both don't match uses the stash;
+//  - the device is synced before a command overwrites blocks that other
+//    commands read, so those commands' targets are on flash first.
+
+#define BLOCKSIZE 4096
+
+// Upper bound on the blocks zero commands write per call.
+#define ZERO_BLOCKS 256
+
+// Where sources are stashed; /tmp wouldn't survive the interruption.
+#define STASH_DIR "/cache/recovery/blockimg"
+#define STASH_PATH_MAX (sizeof(STASH_DIR) + SHA_DIGEST_SIZE * 2 + 16)
+
+typedef struct {
+    int count;                  // number of ranges
+    size_t size;                // total number of blocks
+    unsigned int* pos;          // begin/end block of each range
+} RangeSet;
+
+enum {
+    CMD_COPY,
+    CMD_DIFF,
+    CMD_NEW,
+    CMD_ZERO,
+};
+
+typedef struct {
+    int type;
+    RangeSet src;               // copy and diff only
+    RangeSet tgt;
+    uint8_t src_sha1[SHA_DIGEST_SIZE];
+    uint8_t tgt_sha1[SHA_DIGEST_SIZE];
+    size_t offset;              // in the patch data; diff and new only
+    size_t length;              // of the patch; diff only
+
+    unsigned char* stash;       // source read early to break a cycle
+    int stashed;                // source is in a stash file
+    int skip;                   // target already verified as written
+
+    int readers;                // commands that read our target
+    int indegree;               // readers of our target not yet run
+    int first_edge;             // commands that overwrite our source...
+    int num_edges;              // ...in BlockImage.edges
+    int released;               // our source no longer has to be kept
+    int done;
+} Command;
+
+typedef struct {
+    int fd;
+    const char* device;
+    Command* cmds;
+    int num_cmds;
+    int* edges;
+
+    const unsigned char* patch_data;
+    size_t patch_size;
+
+    FILE* cmd_pipe;
+    size_t total_blocks;
+    size_t written_blocks;
+    int last_progress;
+    int unsynced;               // blocks written since the last fsync
+} BlockImage;
+
+static int ParseRanges(const char* str, RangeSet* rs) {
+    char* end;
+    long num = strtol(str, &end, 10);
+    if (end == str || num <= 0 || (num % 2) != 0) {
+        return -1;
+    }
+
+    rs->count = num / 2;
+    rs->size = 0;
+    rs->pos = malloc(num * sizeof(unsigned int));
+    if (rs->pos == NULL) {
+        return -1;
+    }
+
+    long i;
+    for (i = 0; i < num; ++i) {
+        if (*end != ',') {
+            return -1;
+        }
+        str = end + 1;
+        rs->pos[i] = strtoul(str, &end, 10);
+        if (end == str) {
+            return -1;
+        }
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+
+    for (i = 0; i < rs->count; ++i) {
+        if (rs->pos[i*2] >= rs->pos[i*2+1]) {
+            return -1;
+        }
+        rs->size += rs->pos[i*2+1] - rs->pos[i*2];
+    }
+    return 0;
+}
+
+// Parse one line of the transfer list into *cmd.  The line is modified.
+static int ParseCommand(char* line, Command* cmd) {
+    char* word[7];
+    int words = 0;
+    char* save;
+    char* tok;
+    for (tok = strtok_r(line, " ", &save); tok != NULL;
+         tok = strtok_r(NULL, " ", &save)) {
+        if (words == 7) return -1;
+        word[words++] = tok;
+    }
+    if (words == 0) return -1;
+
+    if (strcmp(word[0], "copy") == 0 && words == 4) {
+        cmd->type = CMD_COPY;
+        if (ParseRanges(word[1], &cmd->src) != 0 ||
+            ParseRanges(word[2], &cmd->tgt) != 0 ||
+            ParseSha1(word[3], cmd->src_sha1) != 0 ||
+            cmd->src.size != cmd->tgt.size) {
+            return -1;
+        }
+        memcpy(cmd->tgt_sha1, cmd->src_sha1, SHA_DIGEST_SIZE);
+    } else if (strcmp(word[0], "diff") == 0 && words == 7) {
+        cmd->type = CMD_DIFF;
+        cmd->offset = strtoul(word[1], NULL, 10);
+        cmd->length = strtoul(word[2], NULL, 10);
+        if (ParseRanges(word[3], &cmd->src) != 0 ||
+            ParseRanges(word[4], &cmd->tgt) != 0 ||
+            ParseSha1(word[5], cmd->src_sha1) != 0 ||
+            ParseSha1(word[6], cmd->tgt_sha1) != 0) {
+            return -1;
+        }
+    } else if (strcmp(word[0], "new") == 0 && words == 4) {
+        cmd->type = CMD_NEW;
+        cmd->offset = strtoul(word[1], NULL, 10);
+        if (ParseRanges(word[2], &cmd->tgt) != 0 ||
+            ParseSha1(word[3], cmd->tgt_sha1) != 0) {
+            return -1;
+        }
+    } else if (strcmp(word[0], "zero") == 0 && words == 2) {
+        cmd->type = CMD_ZERO;
+        if (ParseRanges(word[1], &cmd->tgt) != 0) {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int ReadBlocks(BlockImage* bi, const RangeSet* rs,
+                      unsigned char* data) {
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        off_t pos = (off_t)rs->pos[i*2] * BLOCKSIZE;
+        size_t len = (size_t)(rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        if (lseek(bi->fd, pos, SEEK_SET) != pos) {
+            fprintf(stderr, "failed to seek %s: %s\n",
+                    bi->device, strerror(errno));
+            return -1;
+        }
+        while (len > 0) {
+            ssize_t r = read(bi->fd, data, len);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                fprintf(stderr, "failed to read %s: %s\n", bi->device,
+                        r == 0 ? "unexpected end of device" : strerror(errno));
+                return -1;
+            }
+            data += r;
+            len -= r;
+        }
+    }
+    return 0;
+}
+
+static int WriteBlocks(BlockImage* bi, const RangeSet* rs,
+                       const unsigned char* data, size_t stride) {
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        off_t pos = (off_t)rs->pos[i*2] * BLOCKSIZE;
+        size_t len = (size_t)(rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        if (lseek(bi->fd, pos, SEEK_SET) != pos) {
+            fprintf(stderr, "failed to seek %s: %s\n",
+                    bi->device, strerror(errno));
+            return -1;
+        }
+        while (len > 0) {
+            // A zero stride writes the same buffer over and over.
+            size_t chunk = len;
+            if (stride == 0 && chunk > ZERO_BLOCKS * BLOCKSIZE) {
+                chunk = ZERO_BLOCKS * BLOCKSIZE;
+            }
+            ssize_t w = write(bi->fd, data, chunk);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                fprintf(stderr, "failed to write %s: %s\n",
+                        bi->device, strerror(errno));
+                return -1;
+            }
+            if (stride != 0) data += w;
+            len -= w;
+        }
+    }
+    return 0;
+}
+
+static int Sha1Matches(const unsigned char* data, size_t len,
+                       const uint8_t* sha1) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    SHA(data, len, digest);
+    return memcmp(digest, sha1, SHA_DIGEST_SIZE) == 0;
+}
+
+static int RangesOverlap(const RangeSet* a, const RangeSet* b) {
+    int i, j;
+    for (i = 0; i < a->count; ++i) {
+        for (j = 0; j < b->count; ++j) {
+            if (a->pos[i*2] < b->pos[j*2+1] && b->pos[j*2] < a->pos[i*2+1]) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int SyncDevice(BlockImage* bi) {
+    if (fsync(bi->fd) != 0) {
+        fprintf(stderr, "failed to sync %s: %s\n",
+                bi->device, strerror(errno));
+        return -1;
+    }
+    bi->unsynced = 0;
+    return 0;
+}
+
+// Commands with the same source data each get a stash of their own:  the
+// first of them to finish would otherwise remove one the others still
+// need.
+static void StashPath(const BlockImage* bi, const Command* cmd, char* path) {
+    static const char alphabet[] = "0123456789abcdef";
+    char* p = path + sprintf(path, "%s/%d-", STASH_DIR,
+                             (int)(cmd - bi->cmds));
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        *p++ = alphabet[cmd->src_sha1[i] >> 4];
+        *p++ = alphabet[cmd->src_sha1[i] & 0xf];
+    }
+    *p = '\0';
+}
+
+// Save a command's (verified) source where a restarted update will find
+// it.  The file is complete and on flash before this returns 0.
+static int WriteStash(BlockImage* bi, Command* cmd,
+                      const unsigned char* data) {
+    char path[STASH_PATH_MAX];
+    char tmp[STASH_PATH_MAX + 4];
+    size_t len = cmd->src.size * BLOCKSIZE;
+
+    mkdir("/cache/recovery", 0700);
+    mkdir(STASH_DIR, 0700);
+    StashPath(bi, cmd, path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        data += w;
+        len -= w;
+    }
+    if (len > 0 || fsync(fd) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp, path) != 0) {
+        fprintf(stderr, "failed to rename %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    fd = open(STASH_DIR, O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        fprintf(stderr, "failed to sync %s: %s\n", STASH_DIR, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+
+    cmd->stashed = 1;
+    return 0;
+}
+
+// Read a command's source back from its stash file into buffer.
+// Returns 0 if the stash is there and matches the source's sha1.
+static int ReadStash(BlockImage* bi, Command* cmd, unsigned char* buffer) {
+    char path[STASH_PATH_MAX];
+    size_t len = cmd->src.size * BLOCKSIZE;
+    unsigned char* data = buffer;
+    size_t left = len;
+
+    StashPath(bi, cmd, path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    while (left > 0) {
+        ssize_t r = read(fd, data, left);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        data += r;
+        left -= r;
+    }
+    close(fd);
+
+    if (left > 0 || !Sha1Matches(buffer, len, cmd->src_sha1)) {
+        fprintf(stderr, "stash %s is damaged\n", path);
+        return -1;
+    }
+    cmd->stashed = 1;
+    return 0;
+}
+
+// Once the command's target is on flash its stash isn't needed.
+static void RemoveStash(BlockImage* bi, Command* cmd) {
+    char path[STASH_PATH_MAX];
+
+    if (!cmd->stashed || SyncDevice(bi) != 0) return;
+    StashPath(bi, cmd, path);
+    if (unlink(path) != 0 && errno != ENOENT) {
+        fprintf(stderr, "failed to remove %s: %s\n", path, strerror(errno));
+    }
+    cmd->stashed = 0;
+}
+
+// Read and verify a command's source blocks into a newly allocated
+// buffer, falling back on its stash if the blocks have been overwritten.
+// Returns 0 on success, 1 (with *data NULL) if the source is gone but
+// the target is already in place, and -1 on error.
+static int LoadSource(BlockImage* bi, Command* cmd, unsigned char** data) {
+    size_t len = cmd->src.size * BLOCKSIZE;
+    size_t tgt_len = cmd->tgt.size * BLOCKSIZE;
+    unsigned char* buffer = malloc(len > tgt_len ? len : tgt_len);
+    if (buffer == NULL) {
+        fprintf(stderr, "failed to allocate %lu bytes for source\n",
+                (unsigned long)len);
+        return -1;
+    }
+
+    *data = NULL;
+    if (ReadBlocks(bi, &cmd->src, buffer) != 0) {
+        free(buffer);
+        return -1;
+    }
+    if (Sha1Matches(buffer, len, cmd->src_sha1)) {
+        *data = buffer;
+        return 0;
+    }
+
+    if (ReadBlocks(bi, &cmd->tgt, buffer) == 0 &&
+        Sha1Matches(buffer, tgt_len, cmd->tgt_sha1)) {
+        // An interrupted run may have left the stash behind.
+        char path[STASH_PATH_MAX];
+        StashPath(bi, cmd, path);
+        cmd->stashed = (access(path, F_OK) == 0);
+        free(buffer);
+        return 1;
+    }
+
+    if (ReadStash(bi, cmd, buffer) == 0) {
+        fprintf(stderr, "using stashed source for command %d\n",
+                (int)(cmd - bi->cmds));
+        *data = buffer;
+        return 0;
+    }
+
+    fprintf(stderr, "source blocks of command %d don't match the expected "
+            "sha1\n", (int)(cmd - bi->cmds));
+    free(buffer);
+    return -1;
+}
+
+typedef struct {
+    unsigned char* buffer;
+    size_t size;
+    size_t pos;
+} BlockSink;
+
+static ssize_t BlockSinkFn(unsigned char* data, ssize_t len, void* token) {
+    BlockSink* bs = (BlockSink*)token;
+    if (len > (ssize_t)(bs->size - bs->pos)) {
+        fprintf(stderr, "patch output exceeds target blocks\n");
+        return -1;
+    }
+    memcpy(bs->buffer + bs->pos, data, len);
+    bs->pos += len;
+    return len;
+}
+
+static int ApplyDiff(BlockImage* bi, Command* cmd, const unsigned char* src,
+                     unsigned char* tgt) {
+    if (cmd->offset > bi->patch_size ||
+        cmd->length > bi->patch_size - cmd->offset) {
+        fprintf(stderr, "patch of command %d is outside the patch data\n",
+                (int)(cmd - bi->cmds));
+        return -1;
+    }
+
+    Value patch;
+    patch.type = VAL_BLOB;
+    patch.size = cmd->length;
+    patch.data = (char*)(bi->patch_data + cmd->offset);
+
+    BlockSink bs;
+    bs.buffer = tgt;
+    bs.size = cmd->tgt.size * BLOCKSIZE;
+    bs.pos = 0;
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+
+    int result;
+    if (patch.size >= 8 && memcmp(patch.data, "BSDIFF40", 8) == 0) {
+        result = ApplyBSDiffPatch(src, cmd->src.size * BLOCKSIZE, &patch, 0,
+                                  BlockSinkFn, &bs, &ctx);
+    } else if (patch.size >= 8 && memcmp(patch.data, "IMGDIFF2", 8) == 0) {
+        result = ApplyImagePatch(src, cmd->src.size * BLOCKSIZE, &patch,
+                                 BlockSinkFn, &bs, &ctx);
+    } else {
+        fprintf(stderr, "unknown patch type for command %d\n",
+                (int)(cmd - bi->cmds));
+        return -1;
+    }
+
+    if (result != 0 || bs.pos != bs.size) {
+        fprintf(stderr, "failed to apply patch for command %d\n",
+                (int)(cmd - bi->cmds));
+        return -1;
+    }
+    if (memcmp(SHA_final(&ctx), cmd->tgt_sha1, SHA_DIGEST_SIZE) != 0) {
+        fprintf(stderr, "patched blocks of command %d don't match the "
+                "expected sha1\n", (int)(cmd - bi->cmds));
+        return -1;
+    }
+    return 0;
+}
+
+static void UpdateProgress(BlockImage* bi, size_t blocks) {
+    bi->written_blocks += blocks;
+    if (bi->cmd_pipe == NULL || bi->total_blocks == 0) return;
+
+    // Report in steps of 0.5% so a long list doesn't flood the pipe.
+    int progress = (int)((double)bi->written_blocks * 200 / bi->total_blocks);
+    if (progress != bi->last_progress) {
+        bi->last_progress = progress;
+        fprintf(bi->cmd_pipe, "set_progress %.4f\n",
+                (double)bi->written_blocks / bi->total_blocks);
+    }
+}
+
+static int RunCommand(BlockImage* bi, Command* cmd) {
+    unsigned char* src = cmd->stash;
+    int result = -1;
+
+    if (cmd->skip) {
+        RemoveStash(bi, cmd);
+        UpdateProgress(bi, cmd->tgt.size);
+        return 0;
+    }
+
+    switch (cmd->type) {
+        case CMD_ZERO: {
+            unsigned char* zero = calloc(ZERO_BLOCKS, BLOCKSIZE);
+            if (zero != NULL) {
+                result = WriteBlocks(bi, &cmd->tgt, zero, 0);
+                free(zero);
+            }
+            break;
+        }
+
+        case CMD_NEW: {
+            size_t len = cmd->tgt.size * BLOCKSIZE;
+            if (cmd->offset > bi->patch_size ||
+                len > bi->patch_size - cmd->offset) {
+                fprintf(stderr, "data of command %d is outside the patch "
+                        "data\n", (int)(cmd - bi->cmds));
+                break;
+            }
+            const unsigned char* data = bi->patch_data + cmd->offset;
+            if (!Sha1Matches(data, len, cmd->tgt_sha1)) {
+                fprintf(stderr, "data of command %d doesn't match the "
+                        "expected sha1\n", (int)(cmd - bi->cmds));
+                break;
+            }
+            result = WriteBlocks(bi, &cmd->tgt, data, BLOCKSIZE);
+            break;
+        }
+
+        case CMD_COPY:
+        case CMD_DIFF: {
+            if (src == NULL) {
+                int r = LoadSource(bi, cmd, &src);
+                if (r != 0) {
+                    result = (r > 0) ? 0 : -1;
+                    break;
+                }
+            }
+
+            // Writing the target destroys the source, so an interrupted
+            // write would leave neither to start over from.
+            if (!cmd->stashed && RangesOverlap(&cmd->src, &cmd->tgt) &&
+                WriteStash(bi, cmd, src) != 0) {
+                break;
+            }
+
+            if (cmd->type == CMD_COPY) {
+                result = WriteBlocks(bi, &cmd->tgt, src, BLOCKSIZE);
+                break;
+            }
+
+            unsigned char* tgt = malloc(cmd->tgt.size * BLOCKSIZE);
+            if (tgt == NULL) {
+                fprintf(stderr, "failed to allocate target for command %d\n",
+                        (int)(cmd - bi->cmds));
+                break;
+            }
+            if (ApplyDiff(bi, cmd, src, tgt) == 0) {
+                result = WriteBlocks(bi, &cmd->tgt, tgt, BLOCKSIZE);
+            }
+            free(tgt);
+            break;
+        }
+    }
+
+    free(src);
+    cmd->stash = NULL;
+    if (result == 0) {
+        bi->unsynced = 1;
+        RemoveStash(bi, cmd);
+        UpdateProgress(bi, cmd->tgt.size);
+    }
+    return result;
+}
+
+// Work out which commands overwrite blocks that other commands read.  An
+// edge from A to B means A has to run (or have its source stashed)
+// before B.  Returns 0 on success.
+static int BuildDependencies(BlockImage* bi) {
+    unsigned int max_block = 0;
+    int i, j;
+    unsigned int b;
+
+    for (i = 0; i < bi->num_cmds; ++i) {
+        Command* cmd = bi->cmds + i;
+        for (j = 0; j < cmd->tgt.count; ++j) {
+            if (cmd->tgt.pos[j*2+1] > max_block) {
+                max_block = cmd->tgt.pos[j*2+1];
+            }
+        }
+    }
+
+    int* writer = malloc(max_block * sizeof(int));
+    int* mark = malloc(bi->num_cmds * sizeof(int));
+    if ((max_block > 0 && writer == NULL) || mark == NULL) {
+        free(writer);
+        free(mark);
+        return -1;
+    }
+    for (b = 0; b < max_block; ++b) writer[b] = -1;
+
+    for (i = 0; i < bi->num_cmds; ++i) {
+        Command* cmd = bi->cmds + i;
+        for (j = 0; j < cmd->tgt.count; ++j) {
+            for (b = cmd->tgt.pos[j*2]; b < cmd->tgt.pos[j*2+1]; ++b) {
+                if (writer[b] != -1) {
+                    fprintf(stderr, "block %u is written by commands %d "
+                            "and %d\n", b, writer[b], i);
+                    free(writer);
+                    free(mark);
+                    return -1;
+                }
+                writer[b] = i;
+            }
+        }
+    }
+
+    // Two passes over the sources:  count the edges, then fill them in.
+    int pass, num_edges = 0;
+    for (pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            bi->edges = malloc((num_edges ? num_edges : 1) * sizeof(int));
+            if (bi->edges == NULL) break;
+            num_edges = 0;
+        }
+        for (i = 0; i < bi->num_cmds; ++i) mark[i] = -1;
+
+        for (i = 0; i < bi->num_cmds; ++i) {
+            Command* cmd = bi->cmds + i;
+            cmd->first_edge = num_edges;
+            for (j = 0; j < cmd->src.count; ++j) {
+                unsigned int end = cmd->src.pos[j*2+1];
+                if (end > max_block) end = max_block;
+                for (b = cmd->src.pos[j*2]; b < end; ++b) {
+                    int w = writer[b];
+                    if (w < 0 || w == i || mark[w] == i) continue;
+                    mark[w] = i;
+                    if (pass == 1) {
+                        bi->edges[num_edges] = w;
+                        ++bi->cmds[w].indegree;
+                    }
+                    ++num_edges;
+                }
+            }
+            cmd->num_edges = num_edges - cmd->first_edge;
+        }
+    }
+
+    for (i = 0; i < bi->num_cmds; ++i) {
+        bi->cmds[i].readers = bi->cmds[i].indegree;
+    }
+
+    free(writer);
+    free(mark);
+    return bi->edges == NULL ? -1 : 0;
+}
+
+//
+// A small binary heap of command indices, so that of the commands that
+// are free to run the earliest in the list always goes next.
+//
+
+static void HeapPush(int* heap, int* count, int value) {
+    int i = (*count)++;
+    while (i > 0 && heap[(i-1)/2] > value) {
+        heap[i] = heap[(i-1)/2];
+        i = (i-1)/2;
+    }
+    heap[i] = value;
+}
+
+static int HeapPop(int* heap, int* count) {
+    int top = heap[0];
+    int value = heap[--(*count)];
+    int i = 0;
+    while (i*2+1 < *count) {
+        int child = i*2+1;
+        if (child+1 < *count && heap[child+1] < heap[child]) ++child;
+        if (heap[child] >= value) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = value;
+    return top;
+}
+
+// The command's source has been read (or is no longer needed), so the
+// commands that overwrite it are one step closer to being able to run.
+static void ReleaseSource(BlockImage* bi, Command* cmd,
+                          int* ready, int* num_ready) {
+    int i;
+    if (cmd->released) return;
+    cmd->released = 1;
+    for (i = 0; i < cmd->num_edges; ++i) {
+        int w = bi->edges[cmd->first_edge + i];
+        if (--bi->cmds[w].indegree == 0) {
+            HeapPush(ready, num_ready, w);
+        }
+    }
+}
+
+static int RunTransferList(BlockImage* bi) {
+    int* ready = malloc(bi->num_cmds * sizeof(int));
+    int num_ready = 0;
+    int remaining = bi->num_cmds;
+    int stashed = 0;
+    int i;
+
+    if (ready == NULL) return -1;
+
+    for (i = 0; i < bi->num_cmds; ++i) {
+        if (bi->cmds[i].indegree == 0) {
+            HeapPush(ready, &num_ready, i);
+        }
+    }
+
+    while (remaining > 0) {
+        if (num_ready == 0) {
+            // Every command left is waiting on another one to read its
+            // target first.  Read the smallest source that is holding
+            // something up into memory and stash it, which lets its
+            // writers go.
+            Command* victim = NULL;
+            for (i = 0; i < bi->num_cmds; ++i) {
+                Command* cmd = bi->cmds + i;
+                if (cmd->done || cmd->released || cmd->num_edges == 0) {
+                    continue;
+                }
+                if (victim == NULL || cmd->src.size < victim->src.size) {
+                    victim = cmd;
+                }
+            }
+            if (victim == NULL) {
+                fprintf(stderr, "transfer list can't be ordered\n");
+                free(ready);
+                return -1;
+            }
+
+            int r = LoadSource(bi, victim, &victim->stash);
+            if (r == 0 && !victim->stashed &&
+                WriteStash(bi, victim, victim->stash) != 0) {
+                r = -1;
+            }
+            if (r < 0) {
+                free(ready);
+                return -1;
+            }
+            if (r > 0) victim->skip = 1;
+            ++stashed;
+            ReleaseSource(bi, victim, ready, &num_ready);
+            continue;
+        }
+
+        Command* cmd = bi->cmds + HeapPop(ready, &num_ready);
+
+        // The commands that read our target have to be on flash before
+        // we overwrite what they read.
+        if (cmd->readers > 0 && !cmd->skip && bi->unsynced &&
+            SyncDevice(bi) != 0) {
+            free(ready);
+            return -1;
+        }
+        if (RunCommand(bi, cmd) != 0) {
+            free(ready);
+            return -1;
+        }
+        cmd->done = 1;
+        --remaining;
+        ReleaseSource(bi, cmd, ready, &num_ready);
+    }
+
+    if (stashed > 0) {
+        fprintf(stderr, "stashed %d sources to break dependency cycles\n",
+                stashed);
+    }
+    free(ready);
+    return 0;
+}
+
+static int ApplyBlockImage(BlockImage* bi, char* transfer_list) {
+    char* save;
+    char* line;
+    int result = -1;
+    int i;
+
+    // Version and block count come first; count the command lines.
+    line = strtok_r(transfer_list, "\n", &save);
+    if (line == NULL || strcmp(line, "1") != 0) {
+        fprintf(stderr, "unsupported transfer list version \"%s\"\n",
+                line ? line : "");
+        return -1;
+    }
+    line = strtok_r(NULL, "\n", &save);
+    if (line == NULL) {
+        fprintf(stderr, "transfer list is missing the block count\n");
+        return -1;
+    }
+    bi->total_blocks = strtoul(line, NULL, 10);
+
+    char* commands = save ? save : "";
+    int max_cmds = 1;
+    for (line = commands; line && *line; ++line) {
+        if (*line == '\n') ++max_cmds;
+    }
+
+    bi->cmds = calloc(max_cmds, sizeof(Command));
+    if (bi->cmds == NULL) return -1;
+
+    bi->num_cmds = 0;
+    for (line = strtok_r(commands, "\n", &save); line != NULL;
+         line = strtok_r(NULL, "\n", &save)) {
+        if (ParseCommand(line, bi->cmds + bi->num_cmds) != 0) {
+            fprintf(stderr, "failed to parse transfer list command %d\n",
+                    bi->num_cmds);
+            goto done;
+        }
+        ++bi->num_cmds;
+    }
+
+    if (BuildDependencies(bi) != 0) {
+        fprintf(stderr, "failed to order transfer list\n");
+        goto done;
+    }
+
+    result = RunTransferList(bi);
+    if (result == 0 && fsync(bi->fd) != 0) {
+        fprintf(stderr, "failed to sync %s: %s\n",
+                bi->device, strerror(errno));
+        result = -1;
+    }
+
+done:
+    for (i = 0; i < max_cmds; ++i) {
+        free(bi->cmds[i].src.pos);
+        free(bi->cmds[i].tgt.pos);
+        free(bi->cmds[i].stash);
+    }
+    free(bi->cmds);
+    free(bi->edges);
+    return result;
+}
+
+// block_image_update(block_device, transfer_list, patch_data)
+//
+//    Applies transfer_list (its contents, as returned by
+//    package_extract_file()) to block_device.  patch_data names the
+//    package entry holding the patches and new data the list refers to;
+//    it is used in place if stored uncompressed.  Returns "t" on
+//    success, "" on failure.
+Value* BlockImageUpdateFn(const char* name, State* state,
+                          int argc, Expr* argv[]) {
+    if (argc != 3) {
+        return ErrorAbort(state, "%s() expects 3 args, got %d", name, argc);
+    }
+
+    Value* device;
+    Value* transfer_list;
+    Value* patch_entry;
+    if (ReadValueArgs(state, argv, 3, &device, &transfer_list,
+                      &patch_entry) < 0) {
+        return NULL;
+    }
+
+    int success = 0;
+    unsigned char* patch_buffer = NULL;
+    char* list = NULL;
+    BlockImage bi;
+    memset(&bi, 0, sizeof(bi));
+    bi.fd = -1;
+    bi.last_progress = -1;
+
+    if (device->type != VAL_STRING || patch_entry->type != VAL_STRING) {
+        ErrorAbort(state, "%s(): block_device and patch_data must be "
+                   "strings", name);
+        goto done;
+    }
+    if (transfer_list->type != VAL_BLOB || transfer_list->size < 0) {
+        ErrorAbort(state, "%s(): transfer_list must be a blob", name);
+        goto done;
+    }
+
+    // The list is parsed in place, so give it a terminator.
+    list = malloc(transfer_list->size + 1);
+    if (list == NULL) {
+        fprintf(stderr, "%s: failed to allocate transfer list\n", name);
+        goto done;
+    }
+    memcpy(list, transfer_list->data, transfer_list->size);
+    list[transfer_list->size] = '\0';
+
+    if (strlen(patch_entry->data) > 0) {
+        ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+        const ZipEntry* entry = mzFindZipEntry(za, patch_entry->data);
+        if (entry == NULL) {
+            fprintf(stderr, "%s: no %s in package\n", name, patch_entry->data);
+            goto done;
+        }
+
+        bi.patch_size = mzGetZipEntryUncompLen(entry);
+        bi.patch_data = mzGetStoredZipEntryData(za, entry);
+        if (bi.patch_data == NULL) {
+            patch_buffer = malloc(bi.patch_size);
+            if (patch_buffer == NULL ||
+                !mzExtractZipEntryToBuffer(za, entry, patch_buffer)) {
+                fprintf(stderr, "%s: failed to extract %s\n",
+                        name, patch_entry->data);
+                goto done;
+            }
+            bi.patch_data = patch_buffer;
+        }
+    }
+
+    bi.device = device->data;
+    bi.fd = open(device->data, O_RDWR);
+    if (bi.fd < 0) {
+        fprintf(stderr, "%s: failed to open %s: %s\n",
+                name, device->data, strerror(errno));
+        goto done;
+    }
+
+    bi.cmd_pipe = ((UpdaterInfo*)(state->cookie))->cmd_pipe;
+    success = (ApplyBlockImage(&bi, list) == 0);
+    printf("%s %s from transfer list\n",
+           success ? "updated" : "failed to update", device->data);
+
+done:
+    if (bi.fd >= 0) close(bi.fd);
+    free(patch_buffer);
+    free(list);
+    FreeValue(device);
+    FreeValue(transfer_list);
+    FreeValue(patch_entry);
+    return StringValue(strdup(success ? "t" : ""));
+}
+
+void RegisterBlockImageFunctions() {
+    RegisterFunction("block_image_update", BlockImageUpdateFn);
+}
@@ -0,0 +1,202 @@
+//-----------------------------------------------------------------------------
+// blockimg_test.c
+//
+// Samsung Galaxy S CDMA SCH-I500 Recovery
+// Block Image Update Tests
+//
+// Copyright (C) 2009 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Modifications: Copyright (C) 2011 Michael Brehm
+//-----------------------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The test needs blockimg.c's internals, and a way to stop it dead at a
+// chosen point the way a power cut would:  the first stash removed is
+// removed for real, and then the process exits on the spot.
+static int interrupt_after_unlink = 0;
+static int TestUnlink(const char* path);
+#define unlink TestUnlink
+#include "blockimg.c"
+#undef unlink
+
+static int TestUnlink(const char* path) {
+    int result = unlink(path);
+    if (interrupt_after_unlink) _exit(3);
+    return result;
+}
+
+// Three commands, over four blocks that start out as A A C D:
+//
+//    0:  copy block 0 to block 2       both sources are A, so the two
+//    1:  copy block 1 to block 3       commands' stashes share a sha1
+//    2:  copy blocks 2-3 to blocks 0-1
+//
+// Command 2 overwrites what 0 and 1 read and they overwrite what it
+// reads, so both of their sources are stashed before it runs.  Then
+// command 0 runs and removes its stash, and the update is interrupted
+// before command 1, whose source is gone by then.  The restarted update
+// has to find command 1's stash still there.
+#define NUM_BLOCKS 4
+
+static const char kImagePath[] = "/data/local/tmp/blockimg_test.img";
+
+static void FillBlock(unsigned char* block, char c) {
+    memset(block, c, BLOCKSIZE);
+}
+
+static void Sha1Hex(const unsigned char* data, size_t len, char* hex) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    int i;
+    SHA(data, len, digest);
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        sprintf(hex + i*2, "%02x", digest[i]);
+    }
+}
+
+static int WriteImage(const char* blocks) {
+    unsigned char data[NUM_BLOCKS * BLOCKSIZE];
+    int i;
+    for (i = 0; i < NUM_BLOCKS; ++i) {
+        FillBlock(data + i*BLOCKSIZE, blocks[i]);
+    }
+    FILE* f = fopen(kImagePath, "wb");
+    if (f == NULL) return -1;
+    size_t w = fwrite(data, 1, sizeof(data), f);
+    return (fclose(f) == 0 && w == sizeof(data)) ? 0 : -1;
+}
+
+// Returns 0 if the image holds the blocks given, one letter per block.
+static int CheckImage(const char* blocks) {
+    unsigned char data[NUM_BLOCKS * BLOCKSIZE];
+    unsigned char expected[BLOCKSIZE];
+    int i;
+    FILE* f = fopen(kImagePath, "rb");
+    if (f == NULL) return -1;
+    size_t r = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    if (r != sizeof(data)) return -1;
+    for (i = 0; i < NUM_BLOCKS; ++i) {
+        FillBlock(expected, blocks[i]);
+        if (memcmp(data + i*BLOCKSIZE, expected, BLOCKSIZE) != 0) {
+            fprintf(stderr, "block %d isn't %c\n", i, blocks[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int RunUpdate(const char* transfer_list) {
+    BlockImage bi;
+    memset(&bi, 0, sizeof(bi));
+    bi.last_progress = -1;
+    bi.device = kImagePath;
+    bi.fd = open(kImagePath, O_RDWR);
+    if (bi.fd < 0) return -1;
+
+    char* list = strdup(transfer_list);
+    int result = (list != NULL) ? ApplyBlockImage(&bi, list) : -1;
+    free(list);
+    close(bi.fd);
+    return result;
+}
+
+// Runs the update in a child that is interrupted right after the first
+// stash is removed.  Returns 0 if it was.
+static int RunInterruptedUpdate(const char* transfer_list) {
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        interrupt_after_unlink = 1;
+        RunUpdate(transfer_list);
+        _exit(0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid) return -1;
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 3) ? 0 : -1;
+}
+
+// Returns how many of commands 0 and 1 have a stash, first removing
+// them if remove is set.
+static int CountStashes(int remove) {
+    BlockImage bi;
+    Command cmds[2];
+    char path[STASH_PATH_MAX];
+    unsigned char block[BLOCKSIZE];
+    int i, count = 0;
+
+    FillBlock(block, 'A');
+    memset(cmds, 0, sizeof(cmds));
+    bi.cmds = cmds;
+    for (i = 0; i < 2; ++i) {
+        SHA(block, BLOCKSIZE, cmds[i].src_sha1);
+        StashPath(&bi, cmds + i, path);
+        if (remove) unlink(path);
+        if (access(path, F_OK) == 0) ++count;
+    }
+    return count;
+}
+
+int main() {
+    unsigned char data[2 * BLOCKSIZE];
+    char sha1_a[SHA_DIGEST_SIZE * 2 + 1];
+    char sha1_cd[SHA_DIGEST_SIZE * 2 + 1];
+    char transfer_list[256];
+
+    FillBlock(data, 'A');
+    Sha1Hex(data, BLOCKSIZE, sha1_a);
+    FillBlock(data, 'C');
+    FillBlock(data + BLOCKSIZE, 'D');
+    Sha1Hex(data, 2 * BLOCKSIZE, sha1_cd);
+    snprintf(transfer_list, sizeof(transfer_list),
+             "1\n%d\n"
+             "copy 2,0,1 2,2,3 %s\n"
+             "copy 2,1,2 2,3,4 %s\n"
+             "copy 2,2,4 2,0,2 %s\n",
+             NUM_BLOCKS, sha1_a, sha1_a, sha1_cd);
+
+    CountStashes(1);
+
+    printf("uninterrupted update... ");
+    if (WriteImage("AACD") != 0 || RunUpdate(transfer_list) != 0 ||
+        CheckImage("CDAA") != 0 || CountStashes(0) != 0) {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("ok\n");
+
+    printf("update interrupted between commands 0 and 1... ");
+    if (WriteImage("AACD") != 0 ||
+        RunInterruptedUpdate(transfer_list) != 0 ||
+        CheckImage("CDAD") != 0) {
+        printf("FAIL (interruption)\n");
+        return 1;
+    }
+    if (RunUpdate(transfer_list) != 0 || CheckImage("CDAA") != 0 ||
+        CountStashes(0) != 0) {
+        printf("FAIL (resume)\n");
+        return 1;
+    }
+    printf("ok\n");
+
+    unlink(kImagePath);
+    return 0;
+}
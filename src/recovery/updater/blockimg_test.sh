@@ -0,0 +1,66 @@
+#!/bin/bash
+#
+# A test for block_image_update's stashes.  Run in a client where you
+# have done envsetup, choosecombo, etc.
+#
+# The test writes to /cache/recovery, so it needs a device (or emulator)
+# where adb runs as root.
+#
+#
+# TODO: find some way to get this run regularly along with the rest of
+# the tests.
+
+EMULATOR_PORT=5580
+
+WORK_DIR=/data/local/tmp
+
+# set to 0 to use a device instead
+USE_EMULATOR=0
+
+# ------------------------
+
+if [ "$USE_EMULATOR" == 1 ]; then
+  emulator -wipe-data -noaudio -no-window -port $EMULATOR_PORT &
+  pid_emulator=$!
+  ADB="adb -s emulator-$EMULATOR_PORT "
+else
+  ADB="adb -d "
+fi
+
+echo "waiting to connect to device"
+$ADB wait-for-device
+
+# run a command on the device; exit with the exit status of the device
+# command.
+run_command() {
+  $ADB shell "$@" \; echo \$? | awk '{if (b) {print a}; a=$0; b=1} END {exit a}'
+}
+
+fail() {
+  echo
+  echo FAIL
+  echo
+  [ "$pid_emulator" == "" ] || kill $pid_emulator
+  exit 1
+}
+
+cleanup() {
+  # not necessary if we're about to kill the emulator, but nice for
+  # running on real devices or already-running emulators.
+  run_command rm $WORK_DIR/blockimg_test
+
+  [ "$pid_emulator" == "" ] || kill $pid_emulator
+}
+
+$ADB push $ANDROID_PRODUCT_OUT/system/bin/blockimg_test \
+          $WORK_DIR/blockimg_test
+
+run_command $WORK_DIR/blockimg_test || fail
+
+# --------------- cleanup ----------------------
+
+cleanup
+
+echo
+echo PASS
+echo
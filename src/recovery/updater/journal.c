@@ -0,0 +1,422 @@
+//-----------------------------------------------------------------------------
+// journal.c
+//
+// Samsung Galaxy S CDMA SCH-I500 Recovery
+// Updater Checkpoint Journal
+//
+// Copyright (C) 2009 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Modifications: Copyright (C) 2011 Michael Brehm
+//-----------------------------------------------------------------------------
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "edify/expr.h"
+#include "mincrypt/sha.h"
+#include "minzip/Zip.h"
+#include "journal.h"
+
+// The journal records which steps of an update script have completed, so
+// that if the device loses power part way through, the next attempt at
+// the same package can skip them instead of starting from scratch.  Only
+// an interruption leaves the journal behind:  it is removed whenever the
+// script ends, whether it succeeded or aborted, because a later attempt
+// may be on a device that has been restored or wiped since.
+//
+// A step is one call to a function in kJournalFunctions:  those whose
+// effects are on flash and that are safe to skip once done.  Everything
+// else (mount, getprop, ui_print, ...) still runs every time, which
+// rebuilds the in-memory state the skipped steps leave behind.  Skipped
+// steps aren't evaluated at all, so neither are their arguments.
+// apply_patch() and apply_patch_check() aren't steps:  the former already
+// skips a target that is in place, and the latter has to check every time.
+//
+// /tmp is a ramdisk, so a call that names a path under it is not a step:
+// the files it left there are gone after a reboot, and whatever runs
+// them later (run_program, ...) needs them back.  A step that fails is
+// not recorded either, so the next attempt runs it again instead of
+// replaying the failure.
+//
+// The file is text:
+//
+//    package <sha1>                the script and every entry's crc
+//    <sha1> <result>               one line per completed step
+//
+// A step's sha1 covers its function name and the script text of its
+// arguments, and its result is the hex-encoded value it returned, or
+// "-" for the empty string.  On resume, steps are matched against the
+// records in order; at the first mismatch the rest of the journal is
+// thrown away and everything from there on runs normally.
+//
+// Records are written in batches.  Before a batch is appended everything
+// is sync()ed, so a record never reaches flash before the changes made
+// by its step; losing an unwritten batch only means redoing its steps.
+
+// Functions whose calls are recorded.  Some of them return "" when they
+// fail; the rest abort the script instead, and return "" when they work.
+typedef struct {
+    const char* name;
+    int empty_fails;
+} JournalFunction;
+
+static const JournalFunction kJournalFunctions[] = {
+    { "block_image_update",   1 },
+    { "delete",               0 },
+    { "delete_recursive",     0 },
+    { "format",               1 },
+    { "package_extract_dir",  1 },
+    { "package_extract_file", 1 },
+    { "set_perm",             0 },
+    { "set_perm_batch",       0 },
+    { "set_perm_recursive",   0 },
+    { "symlink",              0 },
+    { "symlink_batch",        0 },
+    { "write_raw_image",      1 },
+    { NULL,                   0 }
+};
+
+// Append pending records after this many steps or seconds.
+#define JOURNAL_BATCH_STEPS 64
+#define JOURNAL_BATCH_SECONDS 5
+
+typedef struct {
+    uint8_t step[SHA_DIGEST_SIZE];
+    char* result;
+    long end;                   // file offset just past this record
+} JournalRecord;
+
+static FILE* journal = NULL;
+static const char* journal_path = NULL;
+static char* script_text = NULL;
+
+static JournalRecord* records = NULL;   // loaded from an earlier attempt
+static int num_records = 0;
+static int next_record = 0;
+static int replaying = 0;
+static long replay_end = 0;             // offset after the last match
+
+static char* pending = NULL;            // records not yet written
+static size_t pending_len = 0;
+static size_t pending_size = 0;
+static int pending_steps = 0;
+static time_t last_flush = 0;
+
+static void ToHex(const unsigned char* data, size_t len, char* out) {
+    static const char alphabet[] = "0123456789abcdef";
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        out[i*2] = alphabet[data[i] >> 4];
+        out[i*2+1] = alphabet[data[i] & 0xf];
+    }
+    out[len*2] = '\0';
+}
+
+static int FromHex(const char* hex, size_t len, unsigned char* out) {
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        unsigned int byte;
+        if (sscanf(hex + i*2, "%2x", &byte) != 1) return -1;
+        out[i] = byte;
+    }
+    return 0;
+}
+
+// Identify the package by its script and the crc and size of every
+// entry, which is enough to tell two builds apart without reading them.
+static void HashPackage(ZipArchive* za, const char* script,
+                        uint8_t* digest) {
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    SHA_update(&ctx, script, strlen(script));
+
+    unsigned int i;
+    for (i = 0; i < mzZipEntryCount(za); ++i) {
+        const ZipEntry* entry = mzGetZipEntryAt(za, i);
+        long info[2];
+        info[0] = mzGetZipEntryCrc32(entry);
+        info[1] = mzGetZipEntryUncompLen(entry);
+        SHA_update(&ctx, entry->fileName, entry->fileNameLen);
+        SHA_update(&ctx, info, sizeof(info));
+    }
+    memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+}
+
+static void HashStep(const char* name, int argc, Expr* argv[],
+                     uint8_t* digest) {
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    SHA_update(&ctx, name, strlen(name) + 1);
+    if (argc > 0) {
+        int start = argv[0]->start;
+        int end = argv[argc-1]->end;
+        if (end > start) {
+            SHA_update(&ctx, script_text + start, end - start);
+        }
+    }
+    memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+}
+
+static void LoadRecords(FILE* f, const char* package) {
+    char line[MAX_STRING_LEN * 2 + 64];
+
+    if (fgets(line, sizeof(line), f) == NULL ||
+        strncmp(line, "package ", 8) != 0 ||
+        strncmp(line + 8, package, SHA_DIGEST_SIZE * 2) != 0) {
+        fprintf(stderr, "journal is for a different package; ignoring it\n");
+        return;
+    }
+    replay_end = ftell(f);
+
+    int size = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char* nl = strchr(line, '\n');
+        if (nl == NULL) break;          // torn write at the end
+        *nl = '\0';
+
+        char* space = strchr(line, ' ');
+        if (space == NULL || space - line != SHA_DIGEST_SIZE * 2) break;
+
+        if (num_records == size) {
+            size = size * 2 + 64;
+            records = realloc(records, size * sizeof(JournalRecord));
+        }
+        JournalRecord* rec = records + num_records;
+        if (FromHex(line, SHA_DIGEST_SIZE, rec->step) != 0) break;
+
+        const char* hex = space + 1;
+        size_t len = (strcmp(hex, "-") == 0) ? 0 : strlen(hex) / 2;
+        rec->result = malloc(len + 1);
+        if (len > 0 && FromHex(hex, len, (unsigned char*)rec->result) != 0) {
+            free(rec->result);
+            break;
+        }
+        rec->result[len] = '\0';
+        rec->end = ftell(f);
+        ++num_records;
+    }
+
+    if (num_records > 0) {
+        fprintf(stderr, "journal has %d completed steps; resuming\n",
+                num_records);
+        replaying = 1;
+    }
+}
+
+static void DropRecords() {
+    int i;
+    for (i = 0; i < num_records; ++i) {
+        free(records[i].result);
+    }
+    free(records);
+    records = NULL;
+    num_records = 0;
+}
+
+// Stop replaying:  cut the journal back to the last record that matched,
+// so the steps run from here on are appended in its place.
+static void EndReplay() {
+    replaying = 0;
+    if (next_record < num_records) {
+        fprintf(stderr, "journal diverges at step %d; discarding %d "
+                "records\n", next_record, num_records - next_record);
+    }
+    if (journal != NULL) {
+        fflush(journal);
+        if (ftruncate(fileno(journal), replay_end) != 0) {
+            fprintf(stderr, "failed to truncate %s: %s\n",
+                    journal_path, strerror(errno));
+        }
+        fseek(journal, 0, SEEK_END);
+    }
+    DropRecords();
+}
+
+static void FlushJournal() {
+    if (journal == NULL || pending_len == 0) return;
+
+    // Everything the pending steps did has to be on flash before they
+    // are recorded as done.
+    sync();
+
+    if (fwrite(pending, 1, pending_len, journal) != pending_len ||
+        fflush(journal) != 0 || fsync(fileno(journal)) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n",
+                journal_path, strerror(errno));
+    }
+    pending_len = 0;
+    pending_steps = 0;
+    last_flush = time(NULL);
+}
+
+static void RecordStep(const uint8_t* step, const char* result) {
+    size_t len = strlen(result);
+    size_t need = SHA_DIGEST_SIZE * 2 + 1 + (len ? len * 2 : 1) + 2;
+
+    if (journal == NULL) return;
+
+    if (pending_len + need > pending_size) {
+        pending_size = (pending_len + need) * 2;
+        pending = realloc(pending, pending_size);
+    }
+    char* p = pending + pending_len;
+    ToHex(step, SHA_DIGEST_SIZE, p);
+    p += SHA_DIGEST_SIZE * 2;
+    *p++ = ' ';
+    if (len > 0) {
+        ToHex((const unsigned char*)result, len, p);
+        p += len * 2;
+    } else {
+        *p++ = '-';
+    }
+    *p++ = '\n';
+    pending_len = p - pending;
+
+    if (++pending_steps >= JOURNAL_BATCH_STEPS ||
+        time(NULL) - last_flush >= JOURNAL_BATCH_SECONDS) {
+        FlushJournal();
+    }
+}
+
+static const JournalFunction* FindJournalFunction(const char* name) {
+    int i;
+    for (i = 0; kJournalFunctions[i].name != NULL; ++i) {
+        if (strcmp(name, kJournalFunctions[i].name) == 0) {
+            return kJournalFunctions + i;
+        }
+    }
+    return NULL;
+}
+
+// Does any string literal in the arguments name /tmp or a path under it?
+static int MentionsTmp(int argc, Expr* argv[]) {
+    int i;
+    for (i = 0; i < argc; ++i) {
+        if (argv[i]->fn == Literal &&
+            (strcmp(argv[i]->name, "/tmp") == 0 ||
+             strncmp(argv[i]->name, "/tmp/", 5) == 0)) {
+            return 1;
+        }
+        if (MentionsTmp(argv[i]->argc, argv[i]->argv)) return 1;
+    }
+    return 0;
+}
+
+// Stands in for every journaled function in the parsed script.
+static Value* JournalStepFn(const char* name, State* state,
+                            int argc, Expr* argv[]) {
+    Function fn = FindFunction(name);
+
+    // Only the two-argument package_extract_file() writes a file; the
+    // other form returns the contents, which have to be read every time.
+    if (strcmp(name, "package_extract_file") == 0 && argc != 2) {
+        return fn(name, state, argc, argv);
+    }
+
+    // Whatever this leaves in /tmp won't survive a reboot.
+    if (MentionsTmp(argc, argv)) {
+        return fn(name, state, argc, argv);
+    }
+
+    uint8_t step[SHA_DIGEST_SIZE];
+    HashStep(name, argc, argv, step);
+
+    if (replaying) {
+        if (next_record < num_records &&
+            memcmp(records[next_record].step, step, SHA_DIGEST_SIZE) == 0) {
+            JournalRecord* rec = records + next_record++;
+            replay_end = rec->end;
+            fprintf(stderr, "skipping completed step %d (%s)\n",
+                    next_record, name);
+            return StringValue(strdup(rec->result));
+        }
+        EndReplay();
+    }
+
+    Value* v = fn(name, state, argc, argv);
+    if (v != NULL && v->type == VAL_STRING &&
+        (v->data[0] != '\0' || !FindJournalFunction(name)->empty_fails)) {
+        RecordStep(step, v->data);
+    }
+    return v;
+}
+
+static void AttachExpr(Expr* expr) {
+    int i;
+    if (expr->fn != NULL && FindJournalFunction(expr->name) != NULL &&
+        expr->fn == FindFunction(expr->name)) {
+        expr->fn = JournalStepFn;
+    }
+    for (i = 0; i < expr->argc; ++i) {
+        AttachExpr(expr->argv[i]);
+    }
+}
+
+void JournalOpen(const char* path, ZipArchive* za, char* script,
+                 Expr* root) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    char package[SHA_DIGEST_SIZE * 2 + 1];
+
+    HashPackage(za, script, digest);
+    ToHex(digest, SHA_DIGEST_SIZE, package);
+
+    FILE* f = fopen(path, "r+");
+    if (f != NULL) {
+        LoadRecords(f, package);
+        if (!replaying) {
+            fclose(f);
+            f = NULL;
+        }
+    }
+    if (f == NULL) {
+        f = fopen(path, "w");
+        if (f == NULL) {
+            fprintf(stderr, "can't open journal %s (%s); progress won't be "
+                    "saved\n", path, strerror(errno));
+            return;
+        }
+        fprintf(f, "package %s\n", package);
+        fflush(f);
+        fsync(fileno(f));
+    }
+
+    journal = f;
+    journal_path = path;
+    script_text = script;
+    last_flush = time(NULL);
+    AttachExpr(root);
+}
+
+void JournalClose() {
+    if (journal == NULL) return;
+
+    fclose(journal);
+    journal = NULL;
+    replaying = 0;
+    DropRecords();
+
+    // Whether it finished or aborted, the script leaves nothing to resume.
+    if (unlink(journal_path) != 0) {
+        fprintf(stderr, "failed to remove %s: %s\n",
+                journal_path, strerror(errno));
+    }
+    free(pending);
+    pending = NULL;
+    pending_len = pending_size = 0;
+}
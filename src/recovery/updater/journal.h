@@ -0,0 +1,39 @@
+//-----------------------------------------------------------------------------
+// journal.h
+//
+// Samsung Galaxy S CDMA SCH-I500 Recovery
+// Updater Checkpoint Journal
+//
+// Copyright (C) 2009 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Modifications: Copyright (C) 2011 Michael Brehm
+//-----------------------------------------------------------------------------
+
+#ifndef _UPDATER_JOURNAL_H_
+#define _UPDATER_JOURNAL_H_
+
+#include "edify/expr.h"
+#include "minzip/Zip.h"
+
+// Open (or resume from) the checkpoint journal at path for the package
+// za running script, and route the journaled function calls in the
+// parsed script through it.  script must stay valid until JournalClose().
+void JournalOpen(const char* path, ZipArchive* za, char* script, Expr* root);
+
+// Remove the journal; called whenever the script ends, successfully or
+// not.  Only an interrupted update leaves a journal to resume from.
+void JournalClose();
+
+#endif
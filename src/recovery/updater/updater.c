@@ -21,6 +21,8 @@
 #include "edify/expr.h"
 #include "updater.h"
 #include "install.h"
+#include "blockimg.h"
+#include "journal.h"
 #include "minzip/Zip.h"
 
 // Generated by the makefile, this function defines the
@@ -32,6 +34,10 @@
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// Where completed steps are recorded, so an interrupted install of the
+// same package can pick up where it left off.
+#define JOURNAL_FILE "/cache/recovery/updater.journal"
+
 int main(int argc, char** argv) {
     // Various things log information to stdout or stderr more or less
     // at random.  The log file makes more sense if buffering is
@@ -89,6 +95,7 @@ int main(int argc, char** argv) {
 
     RegisterBuiltins();
     RegisterInstallFunctions();
+    RegisterBlockImageFunctions();
     RegisterDeviceExtensions();
     FinishRegistration();
 
@@ -103,7 +110,15 @@ int main(int argc, char** argv) {
         return 6;
     }
 
-    // Evaluate the parsed script.
+    // Flatten and fold the parsed script before running it.
+
+    root = Compile(root);
+    if (root == NULL) {
+        fprintf(stderr, "failed to compile script\n");
+        return 6;
+    }
+
+    // Evaluate the compiled script.
 
     UpdaterInfo updater_info;
     updater_info.cmd_pipe = cmd_pipe;
@@ -115,7 +130,10 @@ int main(int argc, char** argv) {
     state.script = script;
     state.errmsg = NULL;
 
+    JournalOpen(JOURNAL_FILE, &za, script, root);
+
     char* result = Evaluate(&state, root);
+    JournalClose();
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
@@ -23,6 +23,10 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ui.h"
 
@@ -36,12 +40,45 @@
 int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys) {
     ui_set_progress(0.0);
 
-    FILE* f = fopen(path, "rb");
-    if (f == NULL) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
         LOGE("failed to open %s (%s)\n", path, strerror(errno));
         return VERIFY_FAILURE;
     }
 
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOGE("failed to stat %s (%s)\n", path, strerror(errno));
+        close(fd);
+        return VERIFY_FAILURE;
+    }
+
+    // Hash the package straight out of a read-only mapping, rather
+    // than copying it through a buffer with fread().
+    void* data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == NULL || data == MAP_FAILED) {
+        LOGE("failed to map %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+
+    int result = verify_mapped(data, st.st_size, pKeys, numKeys);
+    munmap(data, st.st_size);
+    return result;
+}
+
+// Same as verify_file(), but for a package that has already been
+// mapped into memory (so that the installer can hash and parse the
+// package from a single mapping).
+//
+// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
+// or no key matches the signature).
+
+int verify_mapped(const unsigned char* data, size_t length,
+                  const RSAPublicKey *pKeys, unsigned int numKeys) {
     // An archive with a whole-file signature will end in six bytes:
     //
     //   (2-byte signature start) $ff $ff (2-byte comment size)
@@ -53,21 +90,14 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
 
 #define FOOTER_SIZE 6
 
-    if (fseek(f, -FOOTER_SIZE, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
+    if (length < FOOTER_SIZE) {
+        LOGE("package is too small to be signed\n");
         return VERIFY_FAILURE;
     }
 
-    unsigned char footer[FOOTER_SIZE];
-    if (fread(footer, 1, FOOTER_SIZE, f) != FOOTER_SIZE) {
-        LOGE("failed to read footer from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    const unsigned char* footer = data + length - FOOTER_SIZE;
 
     if (footer[2] != 0xff || footer[3] != 0xff) {
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -79,7 +109,6 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     if (signature_start - FOOTER_SIZE < RSANUMBYTES) {
         // "signature" block isn't big enough to contain an RSA block.
         LOGE("signature is too short\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -89,9 +118,8 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     // comment length.
     size_t eocd_size = comment_size + EOCD_HEADER_SIZE;
 
-    if (fseek(f, -eocd_size, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
+    if (eocd_size > length) {
+        LOGE("EOCD record is larger than the package\n");
         return VERIFY_FAILURE;
     }
 
@@ -99,30 +127,19 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     // This is everything except the signature data and length, which
     // includes all of the EOCD except for the comment length field (2
     // bytes) and the comment data.
-    size_t signed_len = ftell(f) + EOCD_HEADER_SIZE - 2;
+    size_t signed_len = length - eocd_size + EOCD_HEADER_SIZE - 2;
 
-    unsigned char* eocd = malloc(eocd_size);
-    if (eocd == NULL) {
-        LOGE("malloc for EOCD record failed\n");
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
-    if (fread(eocd, 1, eocd_size, f) != eocd_size) {
-        LOGE("failed to read eocd from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    const unsigned char* eocd = data + length - eocd_size;
 
     // If this is really is the EOCD record, it will begin with the
     // magic number $50 $4b $05 $06.
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
         LOGE("signature length doesn't match EOCD marker\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
-    int i;
+    size_t i;
     for (i = 4; i < eocd_size-3; ++i) {
         if (eocd[i  ] == 0x50 && eocd[i+1] == 0x4b &&
             eocd[i+2] == 0x05 && eocd[i+3] == 0x06) {
@@ -131,34 +148,25 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
             LOGE("EOCD marker occurs after start of EOCD\n");
-            fclose(f);
             return VERIFY_FAILURE;
         }
     }
 
-#define BUFFER_SIZE 4096
+    // The mapping is hashed in blocks only so that progress can be
+    // reported along the way.
+#define BLOCK_SIZE (1024*1024)
+
+    madvise((void*)data, length, MADV_SEQUENTIAL);
 
     SHA_CTX ctx;
     SHA_init(&ctx);
-    unsigned char* buffer = malloc(BUFFER_SIZE);
-    if (buffer == NULL) {
-        LOGE("failed to alloc memory for sha1 buffer\n");
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
 
     double frac = -1.0;
     size_t so_far = 0;
-    fseek(f, 0, SEEK_SET);
     while (so_far < signed_len) {
-        int size = BUFFER_SIZE;
+        size_t size = BLOCK_SIZE;
         if (signed_len - so_far < size) size = signed_len - so_far;
-        if (fread(buffer, 1, size, f) != size) {
-            LOGE("failed to read data from %s (%s)\n", path, strerror(errno));
-            fclose(f);
-            return VERIFY_FAILURE;
-        }
-        SHA_update(&ctx, buffer, size);
+        SHA_update(&ctx, data + so_far, size);
         so_far += size;
         double f = so_far / (double)signed_len;
         if (f > frac + 0.02 || size == so_far) {
@@ -166,8 +174,6 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
             frac = f;
         }
     }
-    fclose(f);
-    free(buffer);
 
     const uint8_t* sha1 = SHA_final(&ctx);
     for (i = 0; i < numKeys; ++i) {
@@ -176,11 +182,9 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
         if (RSA_verify(pKeys+i, eocd + eocd_size - 6 - RSANUMBYTES,
                        RSANUMBYTES, sha1)) {
             LOGI("whole-file signature verified\n");
-            free(eocd);
             return VERIFY_SUCCESS;
         }
     }
-    free(eocd);
     LOGE("failed to verify whole-file signature\n");
     return VERIFY_FAILURE;
 }
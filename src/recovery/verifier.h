@@ -17,6 +17,8 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include <stddef.h>
+
 #include "mincrypt/rsa.h"
 
 /* Look in the file for a signature footer, and verify that it
@@ -24,6 +26,11 @@
  */
 int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys);
 
+/* Same as verify_file(), for a package that is already mapped into memory.
+ */
+int verify_mapped(const unsigned char* data, size_t length,
+                  const RSAPublicKey *pKeys, unsigned int numKeys);
+
 #define VERIFY_SUCCESS        0
 #define VERIFY_FAILURE        1
 
@@ -598,6 +598,55 @@ int unmount_volume(const Volume* volume, int* unmounted)
 	return result;							// Return result
 }
 
+//-----------------------------------------------------------------------------
+// volume_physical_device
+//
+// Gets a name for the physical device that contains a volume, which can be used
+// to determine if I/O against two volumes would compete for the same bus.  The
+// partition suffix is removed from the device name (mmcblk0p1 -> mmcblk0), and
+// all of the STL/BML partitions are reported as the single OneNAND chip
+//
+// Arguments:
+//
+//	volume		- Target volume
+//	out			- On success, contains the physical device name
+//	cch			- Length of the output buffer, in characters
+
+int volume_physical_device(const Volume* volume, char* out, size_t cch)
+{
+	const char*		name;				// Device node name
+	size_t 			len;				// Length of the physical device name
+	
+	if(!volume) return EINVAL;			// NULL pointer
+	if((!out) || (cch == 0)) return EINVAL;		// Invalid output buffer
+	
+	// Strip the path from the device node
+	name = strrchr(volume->device, '/');
+	name = (name) ? name + 1 : volume->device;
+	
+	// OneNAND partitions are exposed through both the STL and BML layers
+	if((strncmp(name, "stl", 3) == 0) || (strncmp(name, "bml", 3) == 0)) name = "onenand";
+	
+	len = strlen(name);
+	
+	// MMC partitions are named mmcblkNpM, remove the pM; anything else is assumed
+	// to just have the partition number appended to the device name (sda1)
+	if(strncmp(name, "mmcblk", 6) == 0) {
+		
+		const char* partition = strchr(name + 6, 'p');
+		if(partition) len = partition - name;
+	}
+	
+	else while((len > 1) && (isdigit(name[len - 1]))) len--;
+	
+	if(len >= cch) return ENAMETOOLONG;
+	
+	strncpy(out, name, len);
+	out[len] = '\0';
+	
+	return 0;
+}
+
 //-----------------------------------------------------------------------------
 // volume_size
 //
@@ -24,6 +24,7 @@
 #ifndef __VOLUME_H_
 #define __VOLUME_H_
 
+#include <stddef.h>						// Include STDDEF declarations
 #include <sys/statfs.h>					// Include STATFS declarations
 
 //-----------------------------------------------------------------------------
@@ -85,6 +86,9 @@ int restore_volume(const Volume* volume, const char* backup_file);
 // Unmounts a volume
 int unmount_volume(const Volume* volume, int* unmounted);
 
+// Gets the name of the physical device that contains a volume
+int volume_physical_device(const Volume* volume, char* out, size_t cch);
+
 // Gets the raw size of a volume device
 int volume_size(const Volume* volume, unsigned long long* size);
 
@@ -16,6 +16,7 @@ LOCAL_CFLAGS+=   -Wmissing-prototypes -Wredundant-decls -Wnested-externs -Winlin
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/yaffs2
 LOCAL_C_INCLUDES += external/zlib
 LOCAL_STATIC_LIBRARIES := libz
+LOCAL_LDLIBS += -lpthread
 LOCAL_MODULE := mkyaffs2image
 
 include $(BUILD_HOST_EXECUTABLE)
@@ -35,6 +35,7 @@
 #include <unistd.h>
 
 #include <limits.h>
+#include <pthread.h>
 #include <zlib.h>
 
 #include <private/android_filesystem_config.h>
@@ -47,7 +48,6 @@
 
 #include "mkyaffs2image.h"
 
-unsigned source_path_len = 0;
 unsigned yaffs_traceMask=0;
 
 #define MAX_OBJECTS 50000
@@ -66,16 +66,30 @@ typedef struct
 } objItem;
 
 
-static objItem obj_list[MAX_OBJECTS];
-static int n_obj = 0;
-static int obj_id = YAFFS_NOBJECT_BUCKETS + 1;
+/* djp952: the state of one image being built, so that more than one image
+ * can be built at the same time by different threads */
+typedef struct
+{
+	objItem *obj_list;
+	int n_obj;
+	int obj_id;
+	int outFile;
+	gzFile outgzFile;
+	unsigned source_path_len;
+} mk_image;
 
 //static int nObjects, nDirectories, nPages;
 
-static int outFile = -1;
-static gzFile outgzFile = Z_NULL;
+static int mk_init_image(mk_image *img)
+{
+	memset(img, 0, sizeof(mk_image));
+	img->obj_id = YAFFS_NOBJECT_BUCKETS + 1;
+	img->outFile = -1;
+	img->outgzFile = Z_NULL;
 
-static int error;
+	img->obj_list = calloc(MAX_OBJECTS, sizeof(objItem));
+	return (img->obj_list == NULL) ? -1 : 0;
+}
 
 #ifdef HAVE_BIG_ENDIAN
 static int convert_endian = 1;
@@ -99,16 +113,29 @@ static int obj_compare(const void *a, const void * b)
 }
 
 
-static void add_obj_to_list(dev_t dev, ino_t ino, int obj)
+static void add_obj_to_list(mk_image *img, dev_t dev, ino_t ino, int obj)
 {
-	if(n_obj < MAX_OBJECTS)
+	if(img->n_obj < MAX_OBJECTS)
 	{
-		obj_list[n_obj].dev = dev;
-		obj_list[n_obj].ino = ino;
-		obj_list[n_obj].obj = obj;
-		n_obj++;
-		qsort(obj_list,n_obj,sizeof(objItem),obj_compare);
-		
+		/* djp952: the list is already sorted, so binary search for the insertion
+		 * point rather than re-sorting the entire list for every object */
+		objItem item;
+		int lo = 0, hi = img->n_obj;
+
+		item.dev = dev;
+		item.ino = ino;
+		item.obj = obj;
+
+		while(lo < hi)
+		{
+			int mid = (lo + hi) / 2;
+			if(obj_compare(&img->obj_list[mid], &item) <= 0) lo = mid + 1;
+			else hi = mid;
+		}
+
+		memmove(&img->obj_list[lo + 1], &img->obj_list[lo], (img->n_obj - lo) * sizeof(objItem));
+		img->obj_list[lo] = item;
+		img->n_obj++;
 	}
 	else
 	{
@@ -118,7 +145,7 @@ static void add_obj_to_list(dev_t dev, ino_t ino, int obj)
 }
 
 
-static int find_obj_in_list(dev_t dev, ino_t ino)
+static int find_obj_in_list(mk_image *img, dev_t dev, ino_t ino)
 {
 	objItem *i = NULL;
 	objItem test;
@@ -126,9 +153,9 @@ static int find_obj_in_list(dev_t dev, ino_t ino)
 	test.dev = dev;
 	test.ino = ino;
 	
-	if(n_obj > 0)
+	if(img->n_obj > 0)
 	{
-		i = bsearch(&test,obj_list,n_obj,sizeof(objItem),obj_compare);
+		i = bsearch(&test,img->obj_list,img->n_obj,sizeof(objItem),obj_compare);
 	}
 
 	if(i)
@@ -212,16 +239,17 @@ static void little_to_big_endian(yaffs_PackedTags2 *pt)
 	pt->t.byteCount = SWAP32(pt->t.byteCount);
 }
 
-static int write_chunk(__u8 *data, __u32 objId, __u32 chunkId, __u32 nBytes)
+static int write_chunk(mk_image *img, __u8 *data, __u32 objId, __u32 chunkId, __u32 nBytes)
 {
 	char spare[spareSize];
 	yaffs_ExtendedTags t;
 	yaffs_PackedTags2 *pt = (yaffs_PackedTags2 *)spare;
+	int error;
 
 	memset(spare, 0xff, spareSize);
 
-	if(outgzFile == Z_NULL) error = write(outFile,data,chunkSize);
-	else error = gzwrite(outgzFile, data, chunkSize);
+	if(img->outgzFile == Z_NULL) error = write(img->outFile,data,chunkSize);
+	else error = gzwrite(img->outgzFile, data, chunkSize);
 	
 	if(error < 0) return error;
 
@@ -247,15 +275,15 @@ static int write_chunk(__u8 *data, __u32 objId, __u32 chunkId, __u32 nBytes)
 		little_to_big_endian(pt);
 	}
 	
-//	return write(outFile,&pt,sizeof(yaffs_PackedTags2));
+//	return write(img->outFile,&pt,sizeof(yaffs_PackedTags2));
 	ssize_t result;
-	if(outgzFile == Z_NULL) result = write(outFile,spare, spareSize);
-	else result = gzwrite(outgzFile, spare, spareSize);
+	if(img->outgzFile == Z_NULL) result = write(img->outFile,spare, spareSize);
+	else result = gzwrite(img->outgzFile, spare, spareSize);
 	
 	return result;
 }
 
-static int write_object_header(int objId, yaffs_ObjectType t, struct stat *s, int parent, const char *name, int equivalentObj, const char * alias)
+static int write_object_header(mk_image *img, int objId, yaffs_ObjectType t, struct stat *s, int parent, const char *name, int equivalentObj, const char * alias)
 {
 	__u8 bytes[chunkSize];
 	
@@ -303,21 +331,22 @@ static int write_object_header(int objId, yaffs_ObjectType t, struct stat *s, in
     		object_header_little_to_big_endian(oh);
 	}
 	
-	return write_chunk(bytes,objId,0,0xffff);
+	return write_chunk(img, bytes,objId,0,0xffff);
 	
 }
 
-static void fix_stat(const char *path, struct stat *s)
+static void fix_stat(mk_image *img, const char *path, struct stat *s)
 {
-    path += source_path_len;
+    path += img->source_path_len;
     fs_config(path, S_ISDIR(s->st_mode), &s->st_uid, &s->st_gid, &s->st_mode);
 }
 
-static int process_directory(int parent, const char *path, int fixstats, mkyaffs2image_callback callback)
+static int process_directory(mk_image *img, int parent, const char *path, int fixstats, mkyaffs2image_callback callback)
 {
 
 	DIR *dir;
 	struct dirent *entry;
+	int error;
 
 	//nDirectories++;
 	
@@ -350,28 +379,28 @@ static int process_directory(int parent, const char *path, int fixstats, mkyaffs
 				    S_ISSOCK(stats.st_mode))
 				{
 				
-					newObj = obj_id++;
+					newObj = img->obj_id++;
 					if (callback != NULL)
                         callback(full_name);
 					//nObjects++;
 
                     if (fixstats) {
-                        fix_stat(full_name, &stats);
+                        fix_stat(img, full_name, &stats);
                     }
 
 					//printf("Object %d, %s is a ",newObj,full_name);
 					
 					/* We're going to create an object for it */
-					if((equivalentObj = find_obj_in_list(stats.st_dev, stats.st_ino)) > 0)
+					if((equivalentObj = find_obj_in_list(img, stats.st_dev, stats.st_ino)) > 0)
 					{
 					 	/* we need to make a hard link */
 					 	//printf("hard link to object %d\n",equivalentObj);
-						error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_HARDLINK, &stats, parent, entry->d_name, equivalentObj, NULL);
+						error =  write_object_header(img, newObj, YAFFS_OBJECT_TYPE_HARDLINK, &stats, parent, entry->d_name, equivalentObj, NULL);
 					}
 					else 
 					{
 						
-						add_obj_to_list(stats.st_dev,stats.st_ino,newObj);
+						add_obj_to_list(img, stats.st_dev,stats.st_ino,newObj);
 						
 						if(S_ISLNK(stats.st_mode))
 						{
@@ -383,13 +412,13 @@ static int process_directory(int parent, const char *path, int fixstats, mkyaffs
 							readlink(full_name,symname,sizeof(symname) -1);
 						
 							//printf("symlink to \"%s\"\n",symname);
-							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_SYMLINK, &stats, parent, entry->d_name, -1, symname);
+							error =  write_object_header(img, newObj, YAFFS_OBJECT_TYPE_SYMLINK, &stats, parent, entry->d_name, -1, symname);
 
 						}
 						else if(S_ISREG(stats.st_mode))
 						{
 							//printf("file, ");
-							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_FILE, &stats, parent, entry->d_name, -1, NULL);
+							error =  write_object_header(img, newObj, YAFFS_OBJECT_TYPE_FILE, &stats, parent, entry->d_name, -1, NULL);
 
 							if(error >= 0)
 							{
@@ -405,7 +434,7 @@ static int process_directory(int parent, const char *path, int fixstats, mkyaffs
 									while((nBytes = read(h,bytes,sizeof(bytes))) > 0)
 									{
 										chunk++;
-										write_chunk(bytes,newObj,chunk,nBytes);
+										write_chunk(img, bytes,newObj,chunk,nBytes);
 										memset(bytes,0xff,sizeof(bytes));
 									}
 									if(nBytes < 0) 
@@ -425,29 +454,29 @@ static int process_directory(int parent, const char *path, int fixstats, mkyaffs
 						else if(S_ISSOCK(stats.st_mode))
 						{
 							//printf("socket\n");
-							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL);
+							error =  write_object_header(img, newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL);
 						}
 						else if(S_ISFIFO(stats.st_mode))
 						{
 							//printf("fifo\n");
-							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL);
+							error =  write_object_header(img, newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL);
 						}
 						else if(S_ISCHR(stats.st_mode))
 						{
 							//printf("character device\n");
-							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL);
+							error =  write_object_header(img, newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL);
 						}
 						else if(S_ISBLK(stats.st_mode))
 						{
 							//printf("block device\n");
-							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL);
+							error =  write_object_header(img, newObj, YAFFS_OBJECT_TYPE_SPECIAL, &stats, parent, entry->d_name, -1, NULL);
 						}
 						else if(S_ISDIR(stats.st_mode))
 						{
 							//printf("directory\n");
-							error =  write_object_header(newObj, YAFFS_OBJECT_TYPE_DIRECTORY, &stats, parent, entry->d_name, -1, NULL);
-// NCB modified 10/9/2001				process_directory(1,full_name);
-							process_directory(newObj,full_name,fixstats,callback);
+							error =  write_object_header(img, newObj, YAFFS_OBJECT_TYPE_DIRECTORY, &stats, parent, entry->d_name, -1, NULL);
+// NCB modified 10/9/2001				process_directory(img, 1,full_name);
+							process_directory(img, newObj,full_name,fixstats,callback);
 						}
 					}
 				}
@@ -468,50 +497,505 @@ static int process_directory(int parent, const char *path, int fixstats, mkyaffs
 int mkyaffs2image(char* target_directory, char* filename, int fixstats, mkyaffs2image_callback callback, int gzip)
 {
 	struct stat stats;
-	memset(obj_list, 0, sizeof(objItem) * MAX_OBJECTS);
-	n_obj = 0;
-	obj_id = YAFFS_NOBJECT_BUCKETS + 1;
+	mk_image image;
+	mk_image *img = &image;
+	int error;
 
 	if (stat(target_directory,&stats) < 0)
 		return -1;
 	
-	outFile = -1;
-	outgzFile = Z_NULL;
+	if(mk_init_image(img) != 0) return -1;
 
-	outFile = open(filename, O_CREAT | O_TRUNC | O_WRONLY, S_IREAD | S_IWRITE);
+	img->outFile = open(filename, O_CREAT | O_TRUNC | O_WRONLY, S_IREAD | S_IWRITE);
 	
-	if(outFile < 0) {
+	if(img->outFile < 0) {
 		fprintf(stderr,"Could not open output file %s\n",filename);
+		free(img->obj_list);
 		return -1;
 	}
 
-	if(gzip) outgzFile = gzdopen(outFile, "wb");
+	if(gzip) img->outgzFile = gzdopen(img->outFile, "wb");
 
 	if (fixstats) {
 		int len = strlen(target_directory);
 
 		if((len >= 4) && (!strcmp(target_directory + len - 4, "data"))) {
-			source_path_len = len - 4;
+			img->source_path_len = len - 4;
 		} else if((len >= 6) && (!strcmp(target_directory + len - 6, "system"))) {
-			source_path_len = len - 6;
+			img->source_path_len = len - 6;
 		} else {            
 			fprintf(stderr,"Fixstats (-f) option requested but filesystem is not data or android!\n");
+			if(img->outgzFile == Z_NULL) close(img->outFile);
+			else gzclose(img->outgzFile);
+			free(img->obj_list);
 			return -1;
 		}
-		fix_stat(target_directory, &stats);
+		fix_stat(img, target_directory, &stats);
 	}
 
 	//printf("Processing directory %s into image file %s\n",argv[1],argv[2]);
-	error =  write_object_header(1, YAFFS_OBJECT_TYPE_DIRECTORY, &stats, 1,"", -1, NULL);
+	error =  write_object_header(img, 1, YAFFS_OBJECT_TYPE_DIRECTORY, &stats, 1,"", -1, NULL);
 	if(error)
-		error = process_directory(YAFFS_OBJECTID_ROOT,target_directory,fixstats,callback);
+		error = process_directory(img, YAFFS_OBJECTID_ROOT,target_directory,fixstats,callback);
 	
-	if(outgzFile == Z_NULL) close(outFile);
-	else gzclose(outgzFile);
+	if(img->outgzFile == Z_NULL) close(img->outFile);
+	else gzclose(img->outgzFile);
+	free(img->obj_list);
 	
 	return error < 0 ? error : 0;
 }
 
+/* djp952: parallel version of mkyaffs2image().  The directory tree is walked
+ * once to build the list of objects (assigning object ids in exactly the same
+ * order process_directory() does), then the file contents are read in segments
+ * by a pool of threads into a ring of slots.  Segments are claimed in image
+ * order, so the calling thread can pack them into chunks and write them out in
+ * order as well, producing an image identical to the serial version */
+
+#define MK_SEGMENT_CHUNKS	256		/* chunks per file read segment */
+#define MK_SLOTS_PER_THREAD	4		/* ring slots per reader thread */
+#define MK_MAX_THREADS		8		/* maximum reader threads */
+
+enum { mk_slot_free = 0, mk_slot_busy, mk_slot_filled };
+
+typedef struct
+{
+	int obj;
+	int parent;
+	yaffs_ObjectType type;
+	int equivalentObj;
+	struct stat stats;
+	char *name;
+	char *path;
+	char *alias;
+} mk_entry;
+
+typedef struct
+{
+	int state;
+	int entry;
+	off_t offset;
+	size_t length;
+	ssize_t nread;
+	__u8 *data;
+} mk_slot;
+
+typedef struct
+{
+	mk_image *img;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	mk_entry *entries;
+	int n_entries;
+	int max_entries;
+	mk_slot *slots;
+	int n_slots;
+	unsigned next_claim;
+	unsigned next_write;
+	int cursor_entry;
+	off_t cursor_offset;
+	int abort;
+	unsigned long long pages;
+} mk_pipeline;
+
+static int mk_is_data_entry(const mk_entry *e)
+{
+	return (e->type == YAFFS_OBJECT_TYPE_FILE) && (e->stats.st_size > 0);
+}
+
+static int mk_add_entry(mk_pipeline *p, int obj, int parent, yaffs_ObjectType type, int equivalentObj,
+	struct stat *stats, const char *name, const char *path, const char *alias)
+{
+	mk_entry *e;
+
+	if(p->n_entries == p->max_entries)
+	{
+		int max = (p->max_entries) ? p->max_entries * 2 : 1024;
+		mk_entry *entries = realloc(p->entries, max * sizeof(mk_entry));
+		if(entries == NULL) return -1;
+		p->entries = entries;
+		p->max_entries = max;
+	}
+
+	e = &p->entries[p->n_entries];
+	memset(e, 0, sizeof(mk_entry));
+
+	e->obj = obj;
+	e->parent = parent;
+	e->type = type;
+	e->equivalentObj = equivalentObj;
+	e->stats = *stats;
+	e->name = strdup(name);
+	if(path) e->path = strdup(path);
+	if(alias) e->alias = strdup(alias);
+
+	if((e->name == NULL) || (path && !e->path) || (alias && !e->alias)) return -1;
+
+	/* one header page, plus the data pages of a file */
+	p->pages++;
+	if(mk_is_data_entry(e)) p->pages += (e->stats.st_size + chunkSize - 1) / chunkSize;
+
+	p->n_entries++;
+	return 0;
+}
+
+static int mk_collect_directory(mk_pipeline *p, int parent, const char *path, int fixstats)
+{
+	mk_image *img = p->img;
+	DIR *dir;
+	struct dirent *entry;
+	int result = 0;
+
+	dir = opendir(path);
+	if(!dir) return 0;
+
+	while((result == 0) && ((entry = readdir(dir)) != NULL))
+	{
+		char full_name[PATH_MAX];
+		struct stat stats;
+		int equivalentObj;
+		int newObj;
+
+		/* Ignore . and .. */
+		if(!strcmp(entry->d_name,".") || !strcmp(entry->d_name,"..")) continue;
+
+		sprintf(full_name,"%s/%s",path,entry->d_name);
+
+		if(lstat(full_name,&stats) < 0) continue;
+
+		if(!(S_ISLNK(stats.st_mode) || S_ISREG(stats.st_mode) || S_ISDIR(stats.st_mode) ||
+		     S_ISFIFO(stats.st_mode) || S_ISBLK(stats.st_mode) || S_ISCHR(stats.st_mode) ||
+		     S_ISSOCK(stats.st_mode))) continue;
+
+		newObj = img->obj_id++;
+
+		if (fixstats) {
+			fix_stat(img, full_name, &stats);
+		}
+
+		if((equivalentObj = find_obj_in_list(img, stats.st_dev, stats.st_ino)) > 0)
+		{
+			result = mk_add_entry(p, newObj, parent, YAFFS_OBJECT_TYPE_HARDLINK, equivalentObj, &stats, entry->d_name, NULL, NULL);
+			continue;
+		}
+
+		add_obj_to_list(img, stats.st_dev,stats.st_ino,newObj);
+
+		if(S_ISLNK(stats.st_mode))
+		{
+			char symname[PATH_MAX];
+
+			memset(symname,0, sizeof(symname));
+			readlink(full_name,symname,sizeof(symname) -1);
+			result = mk_add_entry(p, newObj, parent, YAFFS_OBJECT_TYPE_SYMLINK, -1, &stats, entry->d_name, NULL, symname);
+		}
+		else if(S_ISREG(stats.st_mode))
+		{
+			result = mk_add_entry(p, newObj, parent, YAFFS_OBJECT_TYPE_FILE, -1, &stats, entry->d_name, full_name, NULL);
+		}
+		else if(S_ISDIR(stats.st_mode))
+		{
+			result = mk_add_entry(p, newObj, parent, YAFFS_OBJECT_TYPE_DIRECTORY, -1, &stats, entry->d_name, NULL, NULL);
+			if(result == 0) result = mk_collect_directory(p, newObj, full_name, fixstats);
+		}
+		else
+		{
+			/* sockets, fifos and devices */
+			result = mk_add_entry(p, newObj, parent, YAFFS_OBJECT_TYPE_SPECIAL, -1, &stats, entry->d_name, NULL, NULL);
+		}
+	}
+
+	closedir(dir);
+	return result;
+}
+
+/* Claims the next file segment into the next slot of the ring, with the lock held.
+ * Returns 1 if a slot was claimed, 0 if the slot isn't free yet, -1 when done */
+static int mk_claim_segment(mk_pipeline *p, mk_slot **claimed)
+{
+	mk_slot *slot = &p->slots[p->next_claim % p->n_slots];
+	mk_entry *e;
+	off_t remain;
+
+	while((p->cursor_entry < p->n_entries) && !mk_is_data_entry(&p->entries[p->cursor_entry]))
+		p->cursor_entry++;
+
+	if(p->cursor_entry >= p->n_entries) return -1;
+	if(slot->state != mk_slot_free) return 0;
+
+	e = &p->entries[p->cursor_entry];
+	remain = e->stats.st_size - p->cursor_offset;
+
+	slot->state = mk_slot_busy;
+	slot->entry = p->cursor_entry;
+	slot->offset = p->cursor_offset;
+	slot->length = (remain < (off_t)(MK_SEGMENT_CHUNKS * chunkSize)) ? (size_t)remain : MK_SEGMENT_CHUNKS * chunkSize;
+	slot->nread = 0;
+
+	p->cursor_offset += slot->length;
+	if(p->cursor_offset >= e->stats.st_size)
+	{
+		p->cursor_entry++;
+		p->cursor_offset = 0;
+	}
+
+	p->next_claim++;
+	*claimed = slot;
+	return 1;
+}
+
+/* Reads a claimed segment, without the lock held */
+static void mk_read_segment(mk_pipeline *p, mk_slot *slot)
+{
+	int h;
+	size_t total = 0;
+	ssize_t nBytes = 0;
+
+	h = open(p->entries[slot->entry].path, O_RDONLY);
+	if(h < 0)
+	{
+		if(slot->offset == 0) perror("Error opening file");
+		slot->nread = -1;
+		return;
+	}
+
+	while(total < slot->length)
+	{
+		nBytes = pread(h, slot->data + total, slot->length - total, slot->offset + total);
+		if(nBytes <= 0) break;
+		total += nBytes;
+	}
+
+	close(h);
+	slot->nread = (nBytes < 0) ? -1 : (ssize_t)total;
+}
+
+static void *mk_reader_thread(void *arg)
+{
+	mk_pipeline *p = (mk_pipeline *)arg;
+	mk_slot *slot;
+	int result;
+
+	pthread_mutex_lock(&p->lock);
+
+	while(!p->abort)
+	{
+		result = mk_claim_segment(p, &slot);
+		if(result < 0) break;
+		if(result == 0)
+		{
+			pthread_cond_wait(&p->changed, &p->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&p->lock);
+		mk_read_segment(p, slot);
+		pthread_mutex_lock(&p->lock);
+
+		slot->state = mk_slot_filled;
+		pthread_cond_broadcast(&p->changed);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* Writes out all of the data chunks of a file, in order, as the readers fill the slots */
+static int mk_write_file_data(mk_pipeline *p, int index, int nthreads, unsigned long long *done,
+	mkyaffs2image_progress_callback callback, void *context)
+{
+	mk_image *img = p->img;
+	mk_entry *e = &p->entries[index];
+	__u8 bytes[chunkSize];
+	off_t offset = 0;
+	int chunk = 0;
+	int shortread = 0;
+	int result = 0;
+
+	while(offset < e->stats.st_size)
+	{
+		mk_slot *slot = &p->slots[p->next_write % p->n_slots];
+		mk_slot *claimed;
+		ssize_t pos;
+
+		pthread_mutex_lock(&p->lock);
+		while(slot->state != mk_slot_filled)
+		{
+			/* without any reader threads, the segments are read right here */
+			if((nthreads == 0) && (mk_claim_segment(p, &claimed) > 0))
+			{
+				pthread_mutex_unlock(&p->lock);
+				mk_read_segment(p, claimed);
+				pthread_mutex_lock(&p->lock);
+				claimed->state = mk_slot_filled;
+			}
+			else pthread_cond_wait(&p->changed, &p->lock);
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		/* a file that shrank or failed to read keeps the data that was read */
+		for(pos = 0; (!shortread) && (result >= 0) && (pos < slot->nread); pos += chunkSize)
+		{
+			size_t nBytes = ((size_t)(slot->nread - pos) < chunkSize) ? (size_t)(slot->nread - pos) : chunkSize;
+			__u8 *data = slot->data + pos;
+
+			if(nBytes < chunkSize)
+			{
+				memset(bytes, 0xff, sizeof(bytes));
+				memcpy(bytes, data, nBytes);
+				data = bytes;
+			}
+
+			chunk++;
+			result = write_chunk(img, data, e->obj, chunk, nBytes);
+			*done += chunkSize + spareSize;
+		}
+
+		if(slot->nread < (ssize_t)slot->length) shortread = 1;
+		offset += slot->length;
+
+		pthread_mutex_lock(&p->lock);
+		slot->state = mk_slot_free;
+		p->next_write++;
+		pthread_cond_broadcast(&p->changed);
+		pthread_mutex_unlock(&p->lock);
+
+		if(callback != NULL) callback(*done, p->pages * (chunkSize + spareSize), context);
+		if(result < 0) return result;
+	}
+
+	return result;
+}
+
+int mkyaffs2image_parallel(char* target_directory, char* filename, int fixstats, int threads,
+	mkyaffs2image_progress_callback callback, void* context, int gzip)
+{
+	mk_pipeline p;
+	mk_image image;
+	mk_image *img = &image;
+	pthread_t workers[MK_MAX_THREADS];
+	int nthreads = 0;
+	struct stat stats;
+	unsigned long long done = 0;
+	unsigned long long total;
+	int result = 0;
+	int index;
+
+	if (stat(target_directory,&stats) < 0)
+		return -1;
+
+	if(mk_init_image(img) != 0) return -1;
+
+	memset(&p, 0, sizeof(mk_pipeline));
+	p.img = img;
+	p.pages = 1;		/* root directory header */
+
+	if (fixstats) {
+		int len = strlen(target_directory);
+
+		if((len >= 4) && (!strcmp(target_directory + len - 4, "data"))) {
+			img->source_path_len = len - 4;
+		} else if((len >= 6) && (!strcmp(target_directory + len - 6, "system"))) {
+			img->source_path_len = len - 6;
+		} else {
+			fprintf(stderr,"Fixstats (-f) option requested but filesystem is not data or android!\n");
+			result = -1;
+			goto cleanup;
+		}
+		fix_stat(img, target_directory, &stats);
+	}
+
+	/* the one and only walk of the directory tree */
+	if(mk_collect_directory(&p, YAFFS_OBJECTID_ROOT, target_directory, fixstats) != 0)
+	{
+		fprintf(stderr,"Not enough memory for the object list\n");
+		result = -1;
+		goto cleanup;
+	}
+
+	total = p.pages * (chunkSize + spareSize);
+
+	if(threads < 0) threads = 0;
+	if(threads > MK_MAX_THREADS) threads = MK_MAX_THREADS;
+
+	p.n_slots = (threads) ? threads * MK_SLOTS_PER_THREAD : 1;
+	p.slots = calloc(p.n_slots, sizeof(mk_slot));
+	if(p.slots == NULL) { result = -1; goto cleanup; }
+
+	for(index = 0; index < p.n_slots; index++)
+	{
+		p.slots[index].data = malloc(MK_SEGMENT_CHUNKS * chunkSize);
+		if(p.slots[index].data == NULL) { result = -1; goto cleanup; }
+	}
+
+	img->outFile = open(filename, O_CREAT | O_TRUNC | O_WRONLY, S_IREAD | S_IWRITE);
+	if(img->outFile < 0) {
+		fprintf(stderr,"Could not open output file %s\n",filename);
+		result = -1;
+		goto cleanup;
+	}
+
+	img->outgzFile = (gzip) ? gzdopen(img->outFile, "wb") : Z_NULL;
+
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.changed, NULL);
+
+	/* if none of the readers can be started, the file data is read inline */
+	for(index = 0; index < threads; index++)
+	{
+		if(pthread_create(&workers[nthreads], NULL, mk_reader_thread, &p) == 0) nthreads++;
+	}
+
+	result = write_object_header(img, 1, YAFFS_OBJECT_TYPE_DIRECTORY, &stats, 1,"", -1, NULL);
+	done += chunkSize + spareSize;
+
+	for(index = 0; (result >= 0) && (index < p.n_entries); index++)
+	{
+		mk_entry *e = &p.entries[index];
+
+		result = write_object_header(img, e->obj, e->type, &e->stats, e->parent, e->name, e->equivalentObj, e->alias);
+		done += chunkSize + spareSize;
+
+		if((result >= 0) && mk_is_data_entry(e))
+			result = mk_write_file_data(&p, index, nthreads, &done, callback, context);
+		else if(callback != NULL)
+			callback(done, total, context);
+	}
+
+	if(callback != NULL) callback(total, total, context);
+
+	pthread_mutex_lock(&p.lock);
+	p.abort = 1;
+	pthread_cond_broadcast(&p.changed);
+	pthread_mutex_unlock(&p.lock);
+
+	for(index = 0; index < nthreads; index++) pthread_join(workers[index], NULL);
+
+	pthread_cond_destroy(&p.changed);
+	pthread_mutex_destroy(&p.lock);
+
+	if(img->outgzFile == Z_NULL) close(img->outFile);
+	else if(gzclose(img->outgzFile) != Z_OK) result = -1;
+
+	img->outFile = -1;
+	img->outgzFile = Z_NULL;
+
+cleanup:
+	for(index = 0; index < p.n_entries; index++)
+	{
+		free(p.entries[index].name);
+		free(p.entries[index].path);
+		free(p.entries[index].alias);
+	}
+	free(p.entries);
+
+	for(index = 0; (p.slots != NULL) && (index < p.n_slots); index++) free(p.slots[index].data);
+	free(p.slots);
+	free(img->obj_list);
+
+	return result < 0 ? result : 0;
+}
+
 static void usage(void)
 {
 	fprintf(stderr,"mkyaffs2image: image building tool for YAFFS2 built "__DATE__"\n");
@@ -527,6 +1011,7 @@ static void usage(void)
 int main(int argc, char *argv[])
 {
 	int fixstats = 0;
+	int error;
 	struct stat stats;
 	int opt;
 	char *image;
@@ -599,8 +1084,6 @@ int main(int argc, char *argv[])
         */
 	}
 	
-	close(outFile);
-	
 	exit(0);
 }	
 
@@ -2,7 +2,14 @@
 #define MKYAFFS2IMAGE_H
 
 typedef void (*mkyaffs2image_callback) (char* filename);
+typedef void (*mkyaffs2image_progress_callback) (unsigned long long done, unsigned long long total, void* context);
 
 int mkyaffs2image(char* target_directory, char* filename, int fixstats, mkyaffs2image_callback callback, int gzip);
 
+/* djp952: single directory walk, file contents read by a pool of threads.  The
+ * image is identical to the one produced by mkyaffs2image(), and progress is
+ * reported in image bytes rather than files */
+int mkyaffs2image_parallel(char* target_directory, char* filename, int fixstats, int threads,
+	mkyaffs2image_progress_callback callback, void* context, int gzip);
+
 #endif